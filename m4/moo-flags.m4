@@ -239,6 +239,10 @@ AC_DEFUN_ONCE([MOO_AC_FLAGS],[
   fi
 
   if $MOO_OS_UNIX; then
+    PKG_CHECK_MODULES(GIO_UNIX, gio-unix-2.0)
+    MOO_CFLAGS="$MOO_CFLAGS $GIO_UNIX_CFLAGS"
+    MOO_CXXFLAGS="$MOO_CXXFLAGS $GIO_UNIX_CFLAGS"
+    MOO_LIBS="$MOO_LIBS $GIO_UNIX_LIBS"
     MOO_CPPFLAGS="$MOO_CPPFLAGS -DMOO_DATA_DIR=\\\"${MOO_DATA_DIR}\\\" -DMOO_LIB_DIR=\\\"${MOO_LIB_DIR}\\\""
     MOO_CPPFLAGS="$MOO_CPPFLAGS -DMOO_LOCALE_DIR=\\\"${localedir}\\\" -DMOO_HELP_DIR=\\\"${MOO_HELP_DIR}\\\""
   fi
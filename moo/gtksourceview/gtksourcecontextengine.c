@@ -69,13 +69,36 @@
  * to analyze quickly. Perhaps we want to reinstall first_update in case
  * of expose events or something. */
 #define INCREMENTAL_UPDATE_PRIORITY	G_PRIORITY_LOW
-/* Maximal amount of time allowed to spent in one cycle of background idle. */
+/* Maximal amount of time allowed to spent in one cycle of background idle.
+ * The idle is shared by all engines; an engine whose views don't wait for
+ * highlighting gets at most BACKGROUND_UPDATE_TIME_SLICE of it. */
 #define INCREMENTAL_UPDATE_TIME_SLICE	30
+#define BACKGROUND_UPDATE_TIME_SLICE	10
+
+/* Text requested by a view this many lines after the first invalid line
+ * is highlighted provisionally, see highlight_provisionally(). */
+#define PROVISIONAL_MIN_LINES		500
 
 /* Maximal amount of time allowed to spent highlihting a single line. If it
  * is not enough, then highlighting is disabled. */
 #define MAX_TIME_FOR_ONE_LINE		2000
 
+/* A checkpoint segment is remembered every CHECKPOINT_LINES lines, see
+ * checkpoint_add(). */
+#define CHECKPOINT_LINES		256
+
+/* Number of lines fetched from the buffer at once, see LineReader. */
+#define LINE_READER_CHUNK_LINES		128
+
+/* Buffers with at least this many lines left to analyze are also analyzed
+ * in worker threads, ANALYSIS_JOB_LINES lines per job (see analysis_job_run). */
+#define BACKGROUND_ANALYSIS_MIN_LINES	10000
+#define ANALYSIS_JOB_LINES		2000
+/* Maximal number of worker threads, and number of jobs queued per thread
+ * for one engine. */
+#define MAX_ANALYSIS_THREADS		8
+#define ANALYSIS_JOBS_PER_THREAD	2
+
 #define GTK_SOURCE_CONTEXT_ENGINE_ERROR (gtk_source_context_engine_error_quark ())
 
 /* Returns the definition corrsponding to the specified id. */
@@ -129,7 +152,10 @@ typedef struct _ContextDefinition ContextDefinition;
 typedef struct _DefinitionChild DefinitionChild;
 typedef struct _DefinitionsIter DefinitionsIter;
 typedef struct _LineInfo LineInfo;
+typedef struct _LineReader LineReader;
 typedef struct _InvalidRegion InvalidRegion;
+typedef struct _AnalysisJob AnalysisJob;
+typedef struct _ContextDataCopy ContextDataCopy;
 
 typedef enum {
 	GTK_SOURCE_CONTEXT_ENGINE_ERROR_DUPLICATED_ID = 0,
@@ -174,6 +200,11 @@ struct _Regex
 		RegexAndMatch	 regex;
 		RegexInfo	 info;
 	} u;
+	/* Only in reg_all: numbers of capturing groups around child
+	 * patterns in definition_iter_next() order, 0 for children without
+	 * a regex. %NULL if it's not known which alternative matched. */
+	gint			*child_groups;
+	guint			 n_child_groups;
 	guint			 ref_count;
 	guint			 resolved : 1;
 };
@@ -332,6 +363,8 @@ struct _Segment
 	/* Whether this segment is a whole good segment, or it's an
 	 * an end of bigger one left after erase_segments() call. */
 	guint			 is_start : 1;
+	/* Whether it's in the checkpoints array. */
+	guint			 is_checkpoint : 1;
 };
 
 struct _SubPattern
@@ -374,6 +407,18 @@ struct _LineInfo
 	gint			 byte_length;
 };
 
+/* Reads consecutive lines from the buffer, see line_reader_read(). */
+struct _LineReader
+{
+	GtkTextBuffer		*buffer;
+	GtkTextIter		 limit;
+	gchar			*chunk;
+	const gchar		*chunk_end;
+	/* Next line in the chunk and its offset in the buffer */
+	const gchar		*pos;
+	gint			 pos_offset;
+};
+
 struct _InvalidRegion
 {
 	gboolean		 empty;
@@ -384,6 +429,36 @@ struct _InvalidRegion
 	gint			 delta;
 };
 
+/* A chunk of text analyzed in a worker thread. Worker threads can't touch
+ * the engine, so the job gets a snapshot of the text and a private copy of
+ * the context definitions, and builds a detached segment tree, starting in
+ * the root context. The main thread splices the tree into the engine's one
+ * if the text before the chunk ends in the root context too. */
+struct _AnalysisJob
+{
+	/* The engine, %NULL if the job was cancelled. Only the
+	 * main thread touches it. */
+	GtkSourceContextEngine	*ce;
+	GtkSourceContextData	*ctx_data;
+	GtkSourceLanguage	*lang;
+
+	/* Set in the worker thread: the copy of definitions, the engine
+	 * which owns the detached tree, and the map from copied definitions
+	 * and sub pattern definitions to the original ones, which belongs
+	 * to the copy. */
+	ContextDataCopy		*copy;
+	GtkSourceContextEngine	*detached;
+	GHashTable		*origin;
+
+	gchar			*text;
+	gint			 start_at;
+	gint			 end_at;
+
+	volatile gint		 cancelled;
+	guint			 done : 1;
+	guint			 failed : 1;
+};
+
 struct _GtkSourceContextData
 {
 	guint			 ref_count;
@@ -392,6 +467,10 @@ struct _GtkSourceContextData
 
 	/* Contains every ContextDefinition indexed by its id. */
 	GHashTable		*definitions;
+
+	/* Copies of definitions which no job is using, protected
+	 * by the context_data_copies lock. See get_context_data_copy(). */
+	GSList			*copies;
 };
 
 struct _GtkSourceContextEnginePrivate
@@ -421,15 +500,31 @@ struct _GtkSourceContextEnginePrivate
 	Segment			*root_segment;
         Segment                 *hint;
         Segment                 *hint2;
+	/* Segments at the starts of every CHECKPOINT_LINES-th line, sorted
+	 * by offset. Segment* is kept here until the segment is destroyed. */
+	GPtrArray		*checkpoints;
 	/* list of Segment* */
 	GSList			*invalid;
 	InvalidRegion		 invalid_region;
 
 	guint			 first_update;
+	/* Whether it's queued for the shared idle worker. */
 	guint			 incremental_update;
 
-	/* Views highlight requests. */
+	/* Views highlight requests, text which views want to be highlighted
+	 * but which hasn't been analyzed yet. */
 	GtkTextRegion		*highlight_requests;
+	/* Requested text which has been highlighted provisionally. */
+	GtkTextRegion		*provisional_region;
+	/* Only analyze text views ask for, see _gtk_source_engine_set_lazy(). */
+	gboolean		 lazy;
+
+	/* Jobs analyzing text in worker threads (AnalysisJob*), sorted
+	 * by offset. */
+	GSList			*jobs;
+	/* Set by update_syntax() if it stopped at a chunk of text which
+	 * is being analyzed by a worker thread. */
+	gboolean		 waiting_for_job;
 
 #ifdef ENABLE_MEMORY_DEBUG
 	guint			 mem_usage_timeout;
@@ -492,6 +587,8 @@ static void		find_insertion_place	(Segment		*segment,
 						 Segment		*hint);
 static void		segment_destroy		(GtkSourceContextEngine	*ce,
 						 Segment		*segment);
+static void		checkpoint_remove	(GtkSourceContextEngine	*ce,
+						 Segment		*segment);
 static ContextDefinition *context_definition_ref(ContextDefinition	*definition);
 static void		context_definition_unref(ContextDefinition	*definition);
 
@@ -509,7 +606,22 @@ static void		update_syntax		(GtkSourceContextEngine	*ce,
 						 const GtkTextIter	*end,
 						 gint			 time);
 static void		install_idle_worker	(GtkSourceContextEngine	*ce);
+static void		remove_idle_worker	(GtkSourceContextEngine	*ce);
 static void		install_first_update	(GtkSourceContextEngine	*ce);
+static void		highlight_provisionally	(GtkSourceContextEngine	*ce,
+						 const GtkTextIter	*start,
+						 const GtkTextIter	*end);
+
+static AnalysisJob     *get_analysis_job	(GtkSourceContextEngine	*ce,
+						 gint			 offset);
+static gint		splice_analysis_job	(GtkSourceContextEngine	*ce,
+						 AnalysisJob		*job,
+						 gint			 offset);
+static void		queue_analysis_jobs	(GtkSourceContextEngine	*ce,
+						 gint			 offset);
+static void		cancel_analysis_jobs	(GtkSourceContextEngine	*ce,
+						 gint			 offset);
+static void		context_data_copy_free	(ContextDataCopy	*copy);
 
 #ifdef ENABLE_MEMORY_DEBUG
 static gboolean		mem_usage_timeout	(GtkSourceContextEngine *ce);
@@ -753,15 +865,93 @@ get_context_tag (GtkSourceContextEngine *ce,
 	return context->tag;
 }
 
+struct TagRun {
+	gint start;
+	gint end;
+};
+
+static void
+add_tag_run (GHashTable *runs,
+	     GtkTextTag *tag,
+	     gint        start,
+	     gint        end)
+{
+	GArray *array;
+	struct TagRun run;
+
+	if (start >= end)
+		return;
+
+	array = g_hash_table_lookup (runs, tag);
+
+	if (array == NULL)
+	{
+		array = g_array_new (FALSE, FALSE, sizeof (struct TagRun));
+		g_hash_table_insert (runs, tag, array);
+	}
+
+	run.start = start;
+	run.end = end;
+	g_array_append_val (array, run);
+}
+
+static void
+tag_runs_free (GArray *array)
+{
+	g_array_free (array, TRUE);
+}
+
+static int
+compare_tag_runs (const struct TagRun *a,
+		  const struct TagRun *b)
+{
+	return a->start < b->start ? -1 : (a->start > b->start ? 1 : 0);
+}
+
+/* Sorts runs and merges overlapping and adjacent ones: nested
+ * contexts may have the same tag as their parents. */
+static void
+normalize_tag_runs (GArray *array)
+{
+	guint i, n;
+
+	g_array_sort (array, (GCompareFunc) compare_tag_runs);
+
+	for (i = 1, n = 0; i < array->len; ++i)
+	{
+		struct TagRun *last = &g_array_index (array, struct TagRun, n);
+		struct TagRun *run = &g_array_index (array, struct TagRun, i);
+
+		if (run->start <= last->end)
+			last->end = MAX (last->end, run->end);
+		else
+			g_array_index (array, struct TagRun, ++n) = *run;
+	}
+
+	if (array->len != 0)
+		g_array_set_size (array, n + 1);
+}
+
+/**
+ * collect_tags:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @segment: the segment.
+ * @start_offset: start of the region being highlighted.
+ * @end_offset: end of the region being highlighted.
+ * @runs: GtkTextTag -> GArray of struct TagRun.
+ *
+ * Collects ranges of tags which should be applied to the region
+ * according to @segment and its children.
+ */
 static void
-apply_tags (GtkSourceContextEngine *ce,
-	    Segment                *segment,
-	    gint                    start_offset,
-	    gint                    end_offset)
+collect_tags (GtkSourceContextEngine *ce,
+	      Segment                *segment,
+	      gint                    start_offset,
+	      gint                    end_offset,
+	      GHashTable             *runs)
 {
 	GtkTextTag *tag;
-	GtkTextIter start_iter, end_iter;
-	GtkTextBuffer *buffer = ce->priv->buffer;
 	SubPattern *sp;
 	Segment *child;
 
@@ -792,16 +982,9 @@ apply_tags (GtkSourceContextEngine *ce,
 		}
 
 		if (style_start_at > style_end_at)
-		{
 			g_critical ("oops");
-		}
 		else
-		{
-			gtk_text_buffer_get_iter_at_offset (buffer, &start_iter, style_start_at);
-			end_iter = start_iter;
-			gtk_text_iter_forward_chars (&end_iter, style_end_at - style_start_at);
-			gtk_text_buffer_apply_tag (ce->priv->buffer, tag, &start_iter, &end_iter);
-		}
+			add_tag_run (runs, tag, style_start_at, style_end_at);
 	}
 
 	for (sp = segment->sub_patterns; sp != NULL; sp = sp->next)
@@ -811,14 +994,9 @@ apply_tags (GtkSourceContextEngine *ce,
 			tag = get_subpattern_tag (ce, segment->context, sp->definition);
 
 			if (tag != NULL)
-			{
-				gint start = MAX (start_offset, sp->start_at);
-				gint end = MIN (end_offset, sp->end_at);
-				gtk_text_buffer_get_iter_at_offset (buffer, &start_iter, start);
-				end_iter = start_iter;
-				gtk_text_iter_forward_chars (&end_iter, end - start);
-				gtk_text_buffer_apply_tag (ce->priv->buffer, tag, &start_iter, &end_iter);
-			}
+				add_tag_run (runs, tag,
+					     MAX (start_offset, sp->start_at),
+					     MIN (end_offset, sp->end_at));
 		}
 	}
 
@@ -827,10 +1005,224 @@ apply_tags (GtkSourceContextEngine *ce,
 	     child = child->next)
 	{
 		if (child->end_at > start_offset)
-			apply_tags (ce, child, start_offset, end_offset);
+			collect_tags (ce, child, start_offset, end_offset, runs);
+	}
+}
+
+struct TagDiff {
+	GtkTextBuffer *buffer;
+	GtkTextTag *tag;
+	/* Moves forward through the region. Changing tags doesn't
+	 * invalidate iterators, only text changes do. */
+	GtkTextIter iter;
+	gboolean apply;
+};
+
+/**
+ * get_applied_runs:
+ *
+ * Finds ranges where @tag is applied in the region, using tag toggles
+ * (text btree knows where the tag is, so it's fast for absent tags).
+ */
+static GArray *
+get_applied_runs (GtkTextTag        *tag,
+		  const GtkTextIter *start,
+		  gint               start_offset,
+		  gint               end_offset)
+{
+	GArray *array;
+	GtkTextIter iter = *start;
+	gint run_start = -1;
+
+	array = g_array_new (FALSE, FALSE, sizeof (struct TagRun));
+
+	if (gtk_text_iter_has_tag (&iter, tag))
+		run_start = start_offset;
+
+	while (gtk_text_iter_forward_to_tag_toggle (&iter, tag))
+	{
+		gint offset = gtk_text_iter_get_offset (&iter);
+		struct TagRun run;
+
+		if (offset >= end_offset)
+			break;
+
+		if (run_start < 0)
+		{
+			run_start = offset;
+			continue;
+		}
+
+		run.start = run_start;
+		run.end = offset;
+		g_array_append_val (array, run);
+		run_start = -1;
+	}
+
+	if (run_start >= 0)
+	{
+		struct TagRun run;
+		run.start = run_start;
+		run.end = end_offset;
+		g_array_append_val (array, run);
+	}
+
+	return array;
+}
+
+static void
+tag_diff_range (struct TagDiff *diff,
+		gint            start,
+		gint            end)
+{
+	GtkTextIter end_iter;
+	gint delta = start - gtk_text_iter_get_offset (&diff->iter);
+
+	if (delta >= 0)
+		gtk_text_iter_forward_chars (&diff->iter, delta);
+	else
+		gtk_text_iter_set_offset (&diff->iter, start);
+
+	end_iter = diff->iter;
+	gtk_text_iter_forward_chars (&end_iter, end - start);
+
+	if (diff->apply)
+		gtk_text_buffer_apply_tag (diff->buffer, diff->tag, &diff->iter, &end_iter);
+	else
+		gtk_text_buffer_remove_tag (diff->buffer, diff->tag, &diff->iter, &end_iter);
+
+	diff->iter = end_iter;
+}
+
+/**
+ * tag_diff_subtract:
+ *
+ * @diff: what to do with ranges.
+ * @a: sorted non-overlapping runs.
+ * @b: sorted non-overlapping runs.
+ *
+ * Applies or removes tag in ranges covered by @a and not by @b.
+ */
+static void
+tag_diff_subtract (struct TagDiff *diff,
+		   GArray         *a,
+		   GArray         *b)
+{
+	guint i, j = 0;
+
+	for (i = 0; i < a->len; ++i)
+	{
+		struct TagRun *run = &g_array_index (a, struct TagRun, i);
+		gint pos = run->start;
+		guint k;
+
+		while (j < b->len && g_array_index (b, struct TagRun, j).end <= pos)
+			j++;
+
+		for (k = j; pos < run->end; ++k)
+		{
+			struct TagRun *other;
+
+			if (k >= b->len || g_array_index (b, struct TagRun, k).start >= run->end)
+			{
+				tag_diff_range (diff, pos, run->end);
+				break;
+			}
+
+			other = &g_array_index (b, struct TagRun, k);
+
+			if (other->start > pos)
+				tag_diff_range (diff, pos, other->start);
+
+			pos = MAX (pos, other->end);
+		}
+	}
+}
+
+struct UpdateTagsData {
+	GtkSourceContextEngine *ce;
+	GHashTable *runs;
+	const GtkTextIter *start;
+	gint start_offset;
+	gint end_offset;
+	GArray *empty;
+};
+
+static void
+update_tags_cb (G_GNUC_UNUSED gpointer style,
+		GSList                *tags,
+		struct UpdateTagsData *data)
+{
+	while (tags != NULL)
+	{
+		GtkTextTag *tag = tags->data;
+		GArray *wanted, *applied;
+		struct TagDiff diff;
+
+		wanted = g_hash_table_lookup (data->runs, tag);
+
+		if (wanted == NULL)
+			wanted = data->empty;
+		else
+			normalize_tag_runs (wanted);
+
+		applied = get_applied_runs (tag, data->start,
+					    data->start_offset,
+					    data->end_offset);
+
+		diff.buffer = data->ce->priv->buffer;
+		diff.tag = tag;
+		diff.iter = *data->start;
+
+		diff.apply = FALSE;
+		tag_diff_subtract (&diff, applied, wanted);
+
+		diff.iter = *data->start;
+		diff.apply = TRUE;
+		tag_diff_subtract (&diff, wanted, applied);
+
+		g_array_free (applied, TRUE);
+		tags = tags->next;
 	}
 }
 
+/**
+ * highlight_tree:
+ *
+ * @ce: a #GtkSourceContextEngine.
+ * @root: root of the syntax tree, it may be a detached tree.
+ * @start: the beginning of the region to highlight.
+ * @end: the end of the region to highlight.
+ *
+ * Makes tags in the region match the tree. It only touches tags
+ * which differ from what the tree says, so that rehighlighting
+ * mostly unchanged text doesn't churn tag toggles.
+ */
+static void
+highlight_tree (GtkSourceContextEngine *ce,
+		Segment                *root,
+		const GtkTextIter      *start,
+		const GtkTextIter      *end)
+{
+	struct UpdateTagsData data;
+
+	data.ce = ce;
+	data.start = start;
+	data.start_offset = gtk_text_iter_get_offset (start);
+	data.end_offset = gtk_text_iter_get_offset (end);
+	data.empty = g_array_new (FALSE, FALSE, sizeof (struct TagRun));
+	data.runs = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+					   (GDestroyNotify) tag_runs_free);
+
+	collect_tags (ce, root, data.start_offset, data.end_offset, data.runs);
+
+	/* collect_tags() may create new tags, so it must be done first. */
+	g_hash_table_foreach (ce->priv->tags, (GHFunc) update_tags_cb, &data);
+
+	g_hash_table_destroy (data.runs);
+	g_array_free (data.empty, TRUE);
+}
+
 /**
  * highlight_region:
  *
@@ -858,12 +1250,7 @@ highlight_region (GtkSourceContextEngine *ce,
 	timer = g_timer_new ();
 #endif
 
-	/* First we need to delete tags in the regions. */
-	unhighlight_region (ce, start, end);
-
-	apply_tags (ce, ce->priv->root_segment,
-		    gtk_text_iter_get_offset (start),
-		    gtk_text_iter_get_offset (end));
+	highlight_tree (ce, ce->priv->root_segment, start, end);
 
 #ifdef ENABLE_PROFILE
 	g_print ("highlight (from %d to %d), %g ms elapsed\n",
@@ -1498,6 +1885,18 @@ invalidate_region (GtkSourceContextEngine *ce,
 
 	end_offset = length >= 0 ? offset + length : offset;
 
+	/* Text snapshots of jobs after offset are stale now. */
+	cancel_analysis_jobs (ce, offset);
+
+	/* So is provisional highlighting */
+	if (ce->priv->provisional_region != NULL)
+	{
+		GtkTextIter end;
+		gtk_text_buffer_get_iter_at_offset (buffer, &iter, offset);
+		gtk_text_buffer_get_end_iter (buffer, &end);
+		gtk_text_region_subtract (ce->priv->provisional_region, &iter, &end);
+	}
+
 	if (region->empty)
 	{
 		region->empty = FALSE;
@@ -1995,18 +2394,26 @@ gtk_source_context_engine_update_highlight (GtkSourceEngine   *engine,
 	}
 	else
 	{
-		if (gtk_text_iter_get_line (start) >= invalid_line)
+		GtkTextIter request_start = *start;
+
+		if (gtk_text_iter_get_line (start) < invalid_line)
 		{
-			gtk_text_region_add (ce->priv->highlight_requests, start, end);
+			gtk_text_iter_set_line (&request_start, invalid_line);
+			ensure_highlighted (ce, start, &request_start);
 		}
-		else
+
+		/* It's going to take a while until analysis gets there */
+		if (gtk_text_iter_get_line (&request_start) - invalid_line >= PROVISIONAL_MIN_LINES)
 		{
-			GtkTextIter valid_end = *start;
-			gtk_text_iter_set_line (&valid_end, invalid_line);
-			ensure_highlighted (ce, start, &valid_end);
-			gtk_text_region_add (ce->priv->highlight_requests, &valid_end, end);
+			highlight_provisionally (ce, &request_start, end);
+
+			/* and in lazy mode it doesn't go there at all */
+			if (ce->priv->lazy)
+				return;
 		}
 
+		gtk_text_region_add (ce->priv->highlight_requests, &request_start, end);
+
 		install_first_update (ce);
 	}
 }
@@ -2064,30 +2471,131 @@ all_analyzed (GtkSourceContextEngine *ce)
 	return ce->priv->invalid == NULL && ce->priv->invalid_region.empty;
 }
 
+/* Engines waiting for idle_worker(), most recently scheduled last. */
+static GQueue scheduled_engines = G_QUEUE_INIT;
+static guint idle_worker_id;
+
 /**
- * idle_worker:
+ * has_highlight_requests:
  *
  * @ce: #GtkSourceContextEngine.
  *
- * Analyzes a batch in idle. Stops when
- * whole buffer is analyzed.
+ * Drops requests for text which has been analyzed already.
+ *
+ * Returns: whether some view waits for text to be analyzed.
  */
 static gboolean
-idle_worker (GtkSourceContextEngine *ce)
+has_highlight_requests (GtkSourceContextEngine *ce)
 {
-	gboolean retval = TRUE;
+	GtkTextIter start, end;
+	gint invalid_line;
 
-	g_return_val_if_fail (ce->priv->buffer != NULL, FALSE);
+	if (gtk_text_region_subregions (ce->priv->highlight_requests) == 0)
+		return FALSE;
+
+	gtk_text_buffer_get_start_iter (ce->priv->buffer, &start);
+	invalid_line = get_invalid_line (ce);
+
+	if (invalid_line < 0)
+		gtk_text_buffer_get_end_iter (ce->priv->buffer, &end);
+	else
+		gtk_text_buffer_get_iter_at_line (ce->priv->buffer, &end, invalid_line);
+
+	gtk_text_region_subtract (ce->priv->highlight_requests, &start, &end);
+
+	return gtk_text_region_subregions (ce->priv->highlight_requests) != 0;
+}
+
+/**
+ * idle_worker:
+ *
+ * Analyzes a batch of text in idle, for all engines which need it.
+ * Engines whose views wait for highlighting go first and may use the
+ * whole time slice, others are limited to BACKGROUND_UPDATE_TIME_SLICE
+ * each and take turns, so that many open documents don't block the ui.
+ * Stops when nothing is scheduled.
+ */
+static gboolean
+idle_worker (G_GNUC_UNUSED gpointer data)
+{
+	GQueue waiting = G_QUEUE_INIT;
+	GQueue background = G_QUEUE_INIT;
+	GTimer *timer;
+	gboolean retval = TRUE;
 
 	gdk_threads_enter ();
 
-	/* analyze batch of text */
-	update_syntax (ce, NULL, INCREMENTAL_UPDATE_TIME_SLICE);
-	CHECK_TREE (ce);
+	while (!g_queue_is_empty (&scheduled_engines))
+	{
+		GtkSourceContextEngine *ce = g_queue_pop_head (&scheduled_engines);
+
+		if (has_highlight_requests (ce))
+			g_queue_push_tail (&waiting, ce);
+		else
+			g_queue_push_tail (&background, ce);
+	}
+
+	scheduled_engines = waiting;
+	while (!g_queue_is_empty (&background))
+		g_queue_push_tail (&scheduled_engines, g_queue_pop_head (&background));
+
+	timer = g_timer_new ();
+
+	while (!g_queue_is_empty (&scheduled_engines))
+	{
+		GtkSourceContextEngine *ce;
+		gint time_left, slice;
+
+		time_left = INCREMENTAL_UPDATE_TIME_SLICE - g_timer_elapsed (timer, NULL) * 1000;
+
+		if (time_left <= 0)
+			break;
+
+		ce = g_queue_pop_head (&scheduled_engines);
+
+		slice = time_left;
+		if (!has_highlight_requests (ce))
+		{
+			/* Nobody is waiting for it */
+			if (ce->priv->lazy)
+			{
+				ce->priv->incremental_update = FALSE;
+				continue;
+			}
+
+			slice = MIN (slice, BACKGROUND_UPDATE_TIME_SLICE);
+		}
+
+		/* analyze batch of text */
+		update_syntax (ce, NULL, slice);
+
+		/* It might have been disabled or detached */
+		if (!ce->priv->incremental_update)
+			continue;
+
+		CHECK_TREE (ce);
+
+		/* If it's waiting for a worker thread, the job will reinstall
+		 * idle worker when it's done. */
+		if (all_analyzed (ce) || ce->priv->waiting_for_job)
+		{
+			ce->priv->incremental_update = FALSE;
+		}
+		else
+		{
+			/* Whoever is not done goes to the end of the line */
+			g_queue_push_tail (&background, ce);
+		}
+	}
+
+	while (!g_queue_is_empty (&background))
+		g_queue_push_tail (&scheduled_engines, g_queue_pop_head (&background));
+
+	g_timer_destroy (timer);
 
-	if (all_analyzed (ce))
+	if (g_queue_is_empty (&scheduled_engines))
 	{
-		ce->priv->incremental_update = 0;
+		idle_worker_id = 0;
 		retval = FALSE;
 	}
 
@@ -2117,7 +2625,7 @@ first_update_callback (GtkSourceContextEngine *ce)
 
 	ce->priv->first_update = 0;
 
-	if (!all_analyzed (ce))
+	if (!all_analyzed (ce) && !ce->priv->waiting_for_job)
 		install_idle_worker (ce);
 
 	gdk_threads_leave ();
@@ -2137,9 +2645,32 @@ static void
 install_idle_worker (GtkSourceContextEngine *ce)
 {
 	if (ce->priv->first_update == 0 && ce->priv->incremental_update == 0)
-		ce->priv->incremental_update =
-			g_idle_add_full (INCREMENTAL_UPDATE_PRIORITY,
-					 (GSourceFunc) idle_worker, ce, NULL);
+	{
+		ce->priv->incremental_update = TRUE;
+		g_queue_push_tail (&scheduled_engines, ce);
+
+		if (idle_worker_id == 0)
+			idle_worker_id = g_idle_add_full (INCREMENTAL_UPDATE_PRIORITY,
+							  idle_worker, NULL, NULL);
+	}
+}
+
+/**
+ * remove_idle_worker:
+ *
+ * @ce: #GtkSourceContextEngine.
+ *
+ * Removes the engine from idle worker queue.
+ * Always safe to call.
+ */
+static void
+remove_idle_worker (GtkSourceContextEngine *ce)
+{
+	if (ce->priv->incremental_update)
+	{
+		g_queue_remove (&scheduled_engines, ce);
+		ce->priv->incremental_update = FALSE;
+	}
 }
 
 /**
@@ -2155,11 +2686,7 @@ install_first_update (GtkSourceContextEngine *ce)
 {
 	if (ce->priv->first_update == 0)
 	{
-		if (ce->priv->incremental_update != 0)
-		{
-			g_source_remove (ce->priv->incremental_update);
-			ce->priv->incremental_update = 0;
-		}
+		remove_idle_worker (ce);
 
 		ce->priv->first_update =
 			g_idle_add_full (FIRST_UPDATE_PRIORITY,
@@ -2243,10 +2770,15 @@ gtk_source_context_engine_attach_buffer (GtkSourceEngine *engine,
 
 		if (ce->priv->first_update != 0)
 			g_source_remove (ce->priv->first_update);
-		if (ce->priv->incremental_update != 0)
-			g_source_remove (ce->priv->incremental_update);
 		ce->priv->first_update = 0;
-		ce->priv->incremental_update = 0;
+		remove_idle_worker (ce);
+
+		cancel_analysis_jobs (ce, 0);
+		ce->priv->waiting_for_job = FALSE;
+
+		if (ce->priv->checkpoints != NULL)
+			g_ptr_array_free (ce->priv->checkpoints, TRUE);
+		ce->priv->checkpoints = NULL;
 
 		if (ce->priv->root_segment != NULL)
 			segment_destroy (ce, ce->priv->root_segment);
@@ -2280,8 +2812,11 @@ gtk_source_context_engine_attach_buffer (GtkSourceEngine *engine,
 			gtk_text_region_destroy (ce->priv->refresh_region, FALSE);
 		if (ce->priv->highlight_requests != NULL)
 			gtk_text_region_destroy (ce->priv->highlight_requests, FALSE);
+		if (ce->priv->provisional_region != NULL)
+			gtk_text_region_destroy (ce->priv->provisional_region, FALSE);
 		ce->priv->refresh_region = NULL;
 		ce->priv->highlight_requests = NULL;
+		ce->priv->provisional_region = NULL;
 	}
 
 	ce->priv->buffer = buffer;
@@ -2326,6 +2861,7 @@ gtk_source_context_engine_attach_buffer (GtkSourceEngine *engine,
 		g_object_get (ce->priv->buffer, "highlight-syntax", &ce->priv->highlight, NULL);
 		ce->priv->refresh_region = gtk_text_region_new (buffer);
 		ce->priv->highlight_requests = gtk_text_region_new (buffer);
+		ce->priv->provisional_region = gtk_text_region_new (buffer);
 
 		g_signal_connect_swapped (buffer,
 					  "notify::highlight-syntax",
@@ -2398,6 +2934,31 @@ gtk_source_context_engine_set_style_scheme (GtkSourceEngine      *engine,
 	g_hash_table_foreach (ce->priv->tags, (GHFunc) set_tag_style_hash_cb, ce);
 }
 
+/**
+ * gtk_source_context_engine_set_lazy:
+ *
+ * @engine: #GtkSourceContextEngine.
+ * @lazy: whether to analyze only requested text.
+ *
+ * GtkSourceEngine::set_lazy method.
+ */
+static void
+gtk_source_context_engine_set_lazy (GtkSourceEngine *engine,
+				    gboolean         lazy)
+{
+	GtkSourceContextEngine *ce = GTK_SOURCE_CONTEXT_ENGINE (engine);
+
+	lazy = lazy != 0;
+
+	if (lazy == ce->priv->lazy)
+		return;
+
+	ce->priv->lazy = lazy;
+
+	if (!lazy && ce->priv->buffer != NULL && !ce->priv->disabled && !all_analyzed (ce))
+		install_idle_worker (ce);
+}
+
 static void
 gtk_source_context_engine_finalize (GObject *object)
 {
@@ -2425,6 +2986,8 @@ gtk_source_context_engine_finalize (GObject *object)
 	g_assert (!ce->priv->root_segment);
 	g_assert (!ce->priv->first_update);
 	g_assert (!ce->priv->incremental_update);
+	g_assert (!ce->priv->jobs);
+	g_assert (!ce->priv->checkpoints);
 
 	_gtk_source_context_data_unref (ce->priv->ctx_data);
 
@@ -2447,6 +3010,7 @@ _gtk_source_context_engine_class_init (GtkSourceContextEngineClass *klass)
 	engine_class->text_deleted = gtk_source_context_engine_text_deleted;
 	engine_class->update_highlight = gtk_source_context_engine_update_highlight;
 	engine_class->set_style_scheme = gtk_source_context_engine_set_style_scheme;
+	engine_class->set_lazy = gtk_source_context_engine_set_lazy;
 
 	g_type_class_add_private (object_class, sizeof (GtkSourceContextEnginePrivate));
 }
@@ -2532,6 +3096,8 @@ _gtk_source_context_data_unref (GtkSourceContextData *ctx_data)
 		if (ctx_data->lang != NULL && ctx_data->lang->priv != NULL &&
 		    ctx_data->lang->priv->ctx_data == ctx_data)
 			ctx_data->lang->priv->ctx_data = NULL;
+		g_slist_foreach (ctx_data->copies, (GFunc) context_data_copy_free, NULL);
+		g_slist_free (ctx_data->copies);
 		g_hash_table_destroy (ctx_data->definitions);
 		g_slice_free (GtkSourceContextData, ctx_data);
 	}
@@ -2560,6 +3126,7 @@ regex_unref (Regex *regex)
 		}
 		else
 			g_free (regex->u.info.pattern);
+		g_free (regex->child_groups);
 		g_slice_free (Regex, regex);
 	}
 }
@@ -2622,6 +3189,7 @@ regex_new (const gchar           *pattern,
 {
 	Regex *regex;
 	static GRegex *start_ref_re = NULL;
+	static gsize start_ref_re_init = 0;
 
 	g_return_val_if_fail (error == NULL || *error == NULL, NULL);
 
@@ -2636,13 +3204,17 @@ regex_new (const gchar           *pattern,
 	regex = g_slice_new0 (Regex);
 	regex->ref_count = 1;
 
-	if (start_ref_re == NULL)
+	/* It's also called from worker threads, see analysis_job_run() */
+	if (g_once_init_enter (&start_ref_re_init))
+	{
 		start_ref_re = g_regex_new (START_REF_REGEX,
 					    /* http://bugzilla.gnome.org/show_bug.cgi?id=455640
 					     * we don't care about line ends anyway */
 					    G_REGEX_OPTIMIZE | G_REGEX_NEWLINE_LF,
 					    0,
 					    NULL);
+		g_once_init_leave (&start_ref_re_init, 1);
+	}
 
 	if (g_regex_match (start_ref_re, pattern, 0, NULL))
 	{
@@ -2911,6 +3483,88 @@ regex_get_pattern (Regex *regex)
 	return g_regex_get_pattern (regex->u.regex.regex);
 }
 
+/**
+ * regex_numbers_groups:
+ *
+ * @pattern: a pattern.
+ *
+ * Checks whether the pattern refers to groups by number (back references,
+ * recursion, conditions), so that it would break if groups in front of it
+ * were renumbered.
+ */
+static gboolean
+regex_numbers_groups (const gchar *pattern)
+{
+	const gchar *p;
+
+	for (p = pattern; *p; ++p)
+	{
+		if (p[0] == '\\' && p[1] != 0)
+		{
+			if (g_ascii_isdigit (p[1]) && p[1] != '0')
+				return TRUE;
+			if (p[1] == 'g' && (g_ascii_isdigit (p[2]) || p[2] == '-' ||
+					    p[2] == '+' || p[2] == '{'))
+				return TRUE;
+			++p;
+		}
+		else if (p[0] == '(' && p[1] == '?')
+		{
+			if (g_ascii_isdigit (p[2]) || p[2] == '-' || p[2] == '+' ||
+			    p[2] == 'R' || (p[2] == '(' && g_ascii_isdigit (p[3])))
+				return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static gint
+regex_get_capture_count (Regex *regex)
+{
+	g_return_val_if_fail (regex && regex->resolved, 0);
+	return g_regex_get_capture_count (regex->u.regex.regex);
+}
+
+/**
+ * regex_get_child_match:
+ *
+ * @reg_all: reg_all regex after a successful regex_match().
+ * @group: where to store the group of the child which matched, or 0.
+ *
+ * Alternatives in reg_all are tried in order, so if a child pattern
+ * matched, then children before it do not match at this position.
+ * Groups of the child pattern follow @group in reg_all, so its match
+ * can be used instead of matching the child regex again.
+ *
+ * Returns: index of the first child which may match here.
+ */
+static guint
+regex_get_child_match (Regex *reg_all,
+		       gint  *group)
+{
+	guint i;
+
+	for (i = 0; i < reg_all->n_child_groups; ++i)
+	{
+		gint start_pos;
+
+		if (reg_all->child_groups[i] > 0 &&
+		    g_match_info_fetch_pos (reg_all->u.regex.match,
+					    reg_all->child_groups[i],
+					    &start_pos, NULL) &&
+		    start_pos >= 0)
+		{
+			*group = reg_all->child_groups[i];
+			return i;
+		}
+	}
+
+	/* Closing regex or one of ancestors matched, so children weren't tried */
+	*group = 0;
+	return 0;
+}
+
 /* SYNTAX TREE ------------------------------------------------------------ */
 
 /**
@@ -2922,6 +3576,7 @@ regex_get_pattern (Regex *regex)
  * @line_pos: the position inside @line.
  * @line_length: the length of @line.
  * @regex: regex that matched.
+ * @group: group of the match in @regex, see can_apply_match().
  * @where: kind of sub patterns to apply.
  *
  * Applies sub patterns of kind @where to the matched text.
@@ -2930,6 +3585,7 @@ static void
 apply_sub_patterns (Segment         *state,
 		    LineInfo        *line,
 		    Regex           *regex,
+		    gint             group,
 		    SubPatternWhere  where)
 {
 	GSList *sub_pattern_list = state->context->definition->sub_patterns;
@@ -2939,7 +3595,7 @@ apply_sub_patterns (Segment         *state,
 		gint start_pos;
 		gint end_pos;
 
-		regex_fetch_pos (regex, line->text, 0, &start_pos, &end_pos);
+		regex_fetch_pos (regex, line->text, group, &start_pos, &end_pos);
 
 		if (where == SUB_PATTERN_WHERE_START)
 		{
@@ -2979,7 +3635,7 @@ apply_sub_patterns (Segment         *state,
 			else
 				regex_fetch_pos (regex,
 						 line->text,
-						 sp_def->u.num,
+						 group + sp_def->u.num,
 						 &start_pos,
 						 &end_pos);
 
@@ -3003,10 +3659,14 @@ apply_sub_patterns (Segment         *state,
  * @line: the line to analyze.
  * @match_start: start position of match, bytes.
  * @match_end: where to put end of match, bytes.
- * @where: kind of sub patterns to apply.
+ * @regex: the regex.
+ * @matched: regex which holds the match: @regex itself, or reg_all of
+ * the parent context if @regex matched as an alternative in it.
+ * @group: group of the match in @matched, 0 if it's @regex.
  *
  * See apply_match(), this function is a helper function
- * called from where, it doesn't modify syntax tree.
+ * called from where, it doesn't modify syntax tree. If @regex
+ * has to be matched again, @matched and @group are reset to it.
  *
  * Returns: %TRUE if the match can be applied.
  */
@@ -3015,7 +3675,9 @@ can_apply_match (Context  *state,
 		 LineInfo *line,
 		 gint      match_start,
 		 gint     *match_end,
-		 Regex    *regex)
+		 Regex    *regex,
+		 Regex   **matched,
+		 gint     *group)
 {
 	gint end_match_pos;
 	gboolean ancestor_ends;
@@ -3023,7 +3685,7 @@ can_apply_match (Context  *state,
 
 	ancestor_ends = FALSE;
 	/* end_match_pos is the position of the end of the matched regex. */
-	regex_fetch_pos_bytes (regex, 0, NULL, &end_match_pos);
+	regex_fetch_pos_bytes (*matched, *group, NULL, &end_match_pos);
 
 	g_assert (end_match_pos <= line->byte_length);
 
@@ -3057,6 +3719,9 @@ can_apply_match (Context  *state,
 		 * the end of the ancestor.
 		 * For instance in C a net-address context matches even if
 		 * it contains the end of a multi-line comment. */
+		*matched = regex;
+		*group = 0;
+
 		if (!regex_match (regex, line->text, pos, match_start))
 		{
 			/* This match is not valid, so we can try to match
@@ -3106,12 +3771,15 @@ apply_match (Segment         *state,
 	     SubPatternWhere  where)
 {
 	gint match_end;
+	Regex *matched = regex;
+	gint group = 0;
 
-	if (!can_apply_match (state->context, line, *line_pos, &match_end, regex))
+	if (!can_apply_match (state->context, line, *line_pos, &match_end,
+			      regex, &matched, &group))
 		return FALSE;
 
 	segment_extend (state, line_pos_to_offset (line, match_end));
-	apply_sub_patterns (state, line, regex, where);
+	apply_sub_patterns (state, line, matched, group, where);
 	*line_pos = match_end;
 
 	return TRUE;
@@ -3146,6 +3814,9 @@ create_reg_all (Context           *context,
 	GString *all;
 	Regex *regex;
 	GError *error = NULL;
+	GArray *child_groups;
+	gint n_groups = 1;
+	gboolean numbered = FALSE;
 
 	g_return_val_if_fail ((context == NULL && definition != NULL) ||
 			      (context != NULL && definition == NULL), NULL);
@@ -3154,6 +3825,7 @@ create_reg_all (Context           *context,
 		definition = context->definition;
 
 	all = g_string_new ("(");
+	child_groups = g_array_new (FALSE, FALSE, sizeof (gint));
 
 	/* Closing regex. */
 	if (definition->type == CONTEXT_TYPE_CONTAINER &&
@@ -3173,6 +3845,8 @@ create_reg_all (Context           *context,
 
 		g_string_append (all, regex_get_pattern (end));
 		g_string_append (all, "|");
+		n_groups += regex_get_capture_count (end);
+		numbered |= regex_numbers_groups (regex_get_pattern (end));
 	}
 
 	/* Ancestors. */
@@ -3190,7 +3864,11 @@ create_reg_all (Context           *context,
 				 * Remove FIXME's below if everything is fine. */
 
 				if (tmp->parent->end != NULL)
+				{
 					g_string_append (all, regex_get_pattern (tmp->parent->end));
+					n_groups += regex_get_capture_count (tmp->parent->end);
+					numbered |= regex_numbers_groups (regex_get_pattern (tmp->parent->end));
+				}
 				/* FIXME ?
 				 * The old code insisted on having tmp->parent->end != NULL here,
 				 * though e.g. in case line-comment -> email-address it's not the case.
@@ -3235,8 +3913,20 @@ create_reg_all (Context           *context,
 
 		if (child_regex != NULL)
 		{
+			/* Wrap it in a group to find out which child matched */
+			gint group = ++n_groups;
+
+			g_string_append (all, "(");
 			g_string_append (all, regex_get_pattern (child_regex));
-			g_string_append (all, "|");
+			g_string_append (all, ")|");
+			n_groups += regex_get_capture_count (child_regex);
+			numbered |= regex_numbers_groups (regex_get_pattern (child_regex));
+			g_array_append_val (child_groups, group);
+		}
+		else
+		{
+			gint no_group = 0;
+			g_array_append_val (child_groups, no_group);
 		}
 	}
 	definition_iter_destroy (&iter);
@@ -3258,7 +3948,16 @@ create_reg_all (Context           *context,
 			     "than usual.\nThe error was: %s"), error->message);
 		g_error_free (error);
 	}
+	else if (regex->resolved && !numbered &&
+		 regex_get_capture_count (regex) == n_groups)
+	{
+		regex->n_child_groups = child_groups->len;
+		regex->child_groups = (gint*) g_array_free (child_groups, FALSE);
+		child_groups = NULL;
+	}
 
+	if (child_groups != NULL)
+		g_array_free (child_groups, TRUE);
 	g_string_free (all, TRUE);
 	return regex;
 }
@@ -3937,6 +4636,9 @@ segment_destroy (GtkSourceContextEngine *ce,
         if (ce->priv->hint2 == segment)
                 ce->priv->hint2 = NULL;
 
+	if (segment->is_checkpoint)
+		checkpoint_remove (ce, segment);
+
 	if (SEGMENT_IS_INVALID (segment))
 		remove_invalid (ce, segment);
 
@@ -3950,6 +4652,46 @@ segment_destroy (GtkSourceContextEngine *ce,
 #endif
 }
 
+/**
+ * child_regex_match:
+ *
+ * @regex: start regex of a child context.
+ * @reg_all: reg_all of the parent context, or %NULL.
+ * @group: group of @regex in @reg_all, 0 if it's not known.
+ * @line: line to analyze.
+ * @line_pos: the position inside @line, bytes.
+ *
+ * Finds the match of @regex at @line_pos. If @reg_all matched here with
+ * @regex as the alternative, then its match is used, otherwise @regex
+ * is matched and @group is set to 0.
+ *
+ * Returns: the regex which holds the match, %NULL if @regex doesn't match.
+ */
+static Regex *
+child_regex_match (Regex    *regex,
+		   Regex    *reg_all,
+		   gint     *group,
+		   LineInfo *line,
+		   gint      line_pos)
+{
+	if (reg_all != NULL && *group > 0)
+	{
+		gint start_pos;
+
+		regex_fetch_pos_bytes (reg_all, *group, &start_pos, NULL);
+
+		if (start_pos == line_pos)
+			return reg_all;
+	}
+
+	*group = 0;
+
+	if (!regex_match (regex, line->text, line->byte_length, line_pos))
+		return NULL;
+
+	return regex;
+}
+
 /**
  * container_context_starts_here:
  *
@@ -3961,10 +4703,12 @@ container_context_starts_here (GtkSourceContextEngine  *ce,
 			       DefinitionChild         *child_def,
 			       LineInfo                *line,
 			       gint                    *line_pos, /* bytes */
-			       Segment                **new_state)
+			       Segment                **new_state,
+			       gint                     group)
 {
 	Context *new_context;
 	Segment *new_segment;
+	Regex *matched;
 	gint match_end;
 	ContextDefinition *definition = child_def->u.definition;
 
@@ -3975,17 +4719,23 @@ container_context_starts_here (GtkSourceContextEngine  *ce,
 	if (definition->u.start_end.start == NULL)
 		return FALSE;
 
-	if (!regex_match (definition->u.start_end.start,
-			  line->text, line->byte_length, *line_pos))
-	{
+	/* The end regex is made from groups of the start regex match,
+	 * see create_child_context(), so it needs the start regex itself */
+	if (definition->u.start_end.end != NULL &&
+	    !definition->u.start_end.end->resolved)
+		group = 0;
+
+	matched = child_regex_match (definition->u.start_end.start,
+				     state->context->reg_all, &group,
+				     line, *line_pos);
+	if (matched == NULL)
 		return FALSE;
-	}
 
 	new_context = create_child_context (state->context, child_def, line->text);
 	g_return_val_if_fail (new_context != NULL, FALSE);
 
 	if (!can_apply_match (new_context, line, *line_pos, &match_end,
-			      definition->u.start_end.start))
+			      definition->u.start_end.start, &matched, &group))
 	{
 		context_unref (new_context);
 		return FALSE;
@@ -4016,8 +4766,7 @@ container_context_starts_here (GtkSourceContextEngine  *ce,
 		return FALSE;
 	}
 
-	apply_sub_patterns (new_segment, line,
-			    definition->u.start_end.start,
+	apply_sub_patterns (new_segment, line, matched, group,
 			    SUB_PATTERN_WHERE_START);
 	*line_pos = match_end;
 	*new_state = new_segment;
@@ -4037,9 +4786,11 @@ simple_context_starts_here (GtkSourceContextEngine *ce,
 			    DefinitionChild        *child_def,
 			    LineInfo               *line,
 			    gint                   *line_pos, /* bytes */
-			    Segment               **new_state)
+			    Segment               **new_state,
+			    gint                    group)
 {
 	gint match_end;
+	Regex *matched;
 	Context *new_context;
 	ContextDefinition *definition = child_def->u.definition;
 
@@ -4047,13 +4798,16 @@ simple_context_starts_here (GtkSourceContextEngine *ce,
 
 	g_assert (*line_pos <= line->byte_length);
 
-	if (!regex_match (definition->u.match, line->text, line->byte_length, *line_pos))
+	matched = child_regex_match (definition->u.match, state->context->reg_all,
+				     &group, line, *line_pos);
+	if (matched == NULL)
 		return FALSE;
 
 	new_context = create_child_context (state->context, child_def, line->text);
 	g_return_val_if_fail (new_context != NULL, FALSE);
 
-	if (!can_apply_match (new_context, line, *line_pos, &match_end, definition->u.match))
+	if (!can_apply_match (new_context, line, *line_pos, &match_end,
+			      definition->u.match, &matched, &group))
 	{
 		context_unref (new_context);
 		return FALSE;
@@ -4085,7 +4839,7 @@ simple_context_starts_here (GtkSourceContextEngine *ce,
 					      line_pos_to_offset (line, match_end),
 					      TRUE,
 					      ce->priv->hint2);
-		apply_sub_patterns (new_segment, line, definition->u.match, SUB_PATTERN_WHERE_DEFAULT);
+		apply_sub_patterns (new_segment, line, matched, group, SUB_PATTERN_WHERE_DEFAULT);
 		ce->priv->hint2 = new_segment;
 	}
 
@@ -4115,6 +4869,8 @@ simple_context_starts_here (GtkSourceContextEngine *ce,
  * @line: line to analyze.
  * @line_pos: the position inside @line, bytes.
  * @new_state: where to store the new state.
+ * @group: group of the child in reg_all of @state if reg_all matched
+ * at @line_pos with this child, otherwise 0.
  *
  * Verifies if a context of the type in @curr_definition starts at
  * @line_pos in @line. If the contexts start here @new_state and
@@ -4128,7 +4884,8 @@ child_starts_here (GtkSourceContextEngine *ce,
 		   DefinitionChild        *child_def,
 		   LineInfo               *line,
 		   gint                   *line_pos,
-		   Segment               **new_state)
+		   Segment               **new_state,
+		   gint                    group)
 {
 	g_return_val_if_fail (child_def->resolved, FALSE);
 
@@ -4140,14 +4897,16 @@ child_starts_here (GtkSourceContextEngine *ce,
 							   child_def,
 							   line,
 							   line_pos,
-							   new_state);
+							   new_state,
+							   group);
 		case CONTEXT_TYPE_CONTAINER:
 			return container_context_starts_here (ce,
 							      state,
 							      child_def,
 							      line,
 							      line_pos,
-							      new_state);
+							      new_state,
+							      group);
 		default:
 			g_return_val_if_reached (FALSE);
 	}
@@ -4314,6 +5073,8 @@ next_segment (GtkSourceContextEngine  *ce,
 		DefinitionsIter def_iter;
 		gboolean context_end_found;
 		DefinitionChild *child_def;
+		guint first_child = 0, child_index = 0;
+		gint child_group = 0;
 
 		if (state->context->reg_all)
 		{
@@ -4327,6 +5088,8 @@ next_segment (GtkSourceContextEngine  *ce,
 
 			regex_fetch_pos_bytes (state->context->reg_all,
 					       0, &pos, NULL);
+			first_child = regex_get_child_match (state->context->reg_all,
+							     &child_group);
 		}
 
 		/* Does an ancestor end here? */
@@ -4347,7 +5110,11 @@ next_segment (GtkSourceContextEngine  *ce,
 		definition_iter_init (&def_iter, state->context->definition);
 		while ((child_def = definition_iter_next (&def_iter)) != NULL)
 		{
-			gboolean try_this = TRUE;
+			gboolean try_this = child_index >= first_child;
+			/* reg_all has the match of this child already */
+			gint group = child_index == first_child ? child_group : 0;
+
+			child_index++;
 
 			g_return_val_if_fail (child_def->resolved, FALSE);
 
@@ -4380,7 +5147,7 @@ next_segment (GtkSourceContextEngine  *ce,
 				/* Does this child definition start a new
 				 * context at the current position? */
 				if (child_starts_here (ce, state, child_def,
-						       line, &pos, new_state))
+						       line, &pos, new_state, group))
 				{
 					g_assert (pos <= line->byte_length);
 					*line_pos = pos;
@@ -4625,64 +5392,158 @@ analyze_line (GtkSourceContextEngine *ce,
 }
 
 /**
- * get_line_info:
+ * line_info_scan:
  *
- * @buffer: #GtkTextBuffer.
- * @line_start: iterator pointing to the beginning of line.
- * @line_start: iterator pointing to the beginning of next line or to the end
- * of this line if it's the last line in @buffer.
  * @line: #LineInfo structure to be filled.
+ * @text: line text.
+ * @text_end: end of the text, it may contain more lines.
+ *
+ * Finds the line terminator (same ones as pango_find_paragraph_boundary()
+ * and GtkTextBuffer recognize) and character length of the line in a single
+ * pass. @line text points into @text, it's not nul-terminated, regexes are
+ * given its byte length. line->start_at is not set.
  *
- * Retrieves line text from the buffer, finds line terminator and fills
- * @line structure.
+ * Returns: length of the line including terminator, bytes.
  */
-static void
-get_line_info (GtkTextBuffer     *buffer,
-	       const GtkTextIter *line_start,
-	       const GtkTextIter *line_end,
-	       LineInfo          *line)
+static gsize
+line_info_scan (LineInfo    *line,
+		const gchar *text,
+		const gchar *text_end)
 {
-	g_assert (!gtk_text_iter_equal (line_start, line_end));
+	const guchar *p = (const guchar*) text;
+	const guchar *end = (const guchar*) text_end;
+	gint n_chars = 0;
+
+	while (TRUE)
+	{
+		/* ASCII text doesn't need any utf8 business */
+		while (p < end && *p < 0x80 && *p != '\n' && *p != '\r')
+		{
+			p++;
+			n_chars++;
+		}
+
+		if (p == end || *p == '\n' || *p == '\r')
+			break;
 
-	line->text = gtk_text_buffer_get_slice (buffer, line_start, line_end, TRUE);
-	line->start_at = gtk_text_iter_get_offset (line_start);
+		/* U+2029 PARAGRAPH SEPARATOR */
+		if (p[0] == 0xE2 && end - p >= 3 && p[1] == 0x80 && p[2] == 0xA9)
+			break;
+
+		for (p++; p < end && (*p & 0xC0) == 0x80; p++) ;
+		n_chars++;
+	}
+
+	line->text = (gchar*) text;
+	line->byte_length = (const gchar*) p - text;
+	line->char_length = n_chars;
 
-	if (!gtk_text_iter_starts_line (line_end))
+	if (p == end)
 	{
 		line->eol_length = 0;
-		line->char_length = g_utf8_strlen (line->text, -1);
-		line->byte_length = strlen (line->text);
 	}
 	else
 	{
-		gint eol_index, next_line_index;
+		line->eol_length = 1;
 
-		pango_find_paragraph_boundary (line->text, -1,
-					       &eol_index,
-					       &next_line_index);
+		if (p[0] == '\r' && p + 1 < end && p[1] == '\n')
+		{
+			line->eol_length = 2;
+			p += 2;
+		}
+		else if (p[0] == 0xE2)
+		{
+			p += 3;
+		}
+		else
+		{
+			p += 1;
+		}
+	}
 
-		g_assert (eol_index < next_line_index);
+	return (const gchar*) p - text;
+}
 
-		line->char_length = g_utf8_strlen (line->text, eol_index);
-		line->eol_length = g_utf8_strlen (line->text + eol_index, -1);
-		line->byte_length = eol_index;
-	}
+/**
+ * line_reader_init:
+ *
+ * @reader: #LineReader.
+ * @buffer: #GtkTextBuffer.
+ * @limit: end of text which is going to be read.
+ *
+ * Line reader fetches text from the buffer in chunks of
+ * LINE_READER_CHUNK_LINES lines, so that sequential lines don't
+ * need a buffer slice each.
+ */
+static void
+line_reader_init (LineReader        *reader,
+		  GtkTextBuffer     *buffer,
+		  const GtkTextIter *limit)
+{
+	reader->buffer = buffer;
+	reader->limit = *limit;
+	reader->chunk = NULL;
+	reader->pos = NULL;
+	reader->chunk_end = NULL;
+	reader->pos_offset = -1;
+}
 
-	g_assert (gtk_text_iter_get_offset (line_end) ==
-			line->start_at + line->char_length + line->eol_length);
+static void
+line_reader_destroy (LineReader *reader)
+{
+	g_free (reader->chunk);
+	reader->chunk = NULL;
 }
 
 /**
- * line_info_destroy:
+ * line_reader_read:
  *
- * @line: #LineInfo.
+ * @reader: #LineReader.
+ * @line_start: iterator pointing to the beginning of line.
+ * @line_end: iterator pointing to the beginning of next line or to the end
+ * of this line if it's the last line in the buffer.
+ * @line: #LineInfo structure to be filled.
  *
- * Destroys data allocated by get_line_info().
+ * Fills @line structure. Line text is owned by the reader and is valid
+ * until next call or line_reader_destroy().
  */
 static void
-line_info_destroy (LineInfo *line)
+line_reader_read (LineReader        *reader,
+		  const GtkTextIter *line_start,
+		  const GtkTextIter *line_end,
+		  LineInfo          *line)
 {
-	g_free (line->text);
+	gint offset;
+
+	g_assert (!gtk_text_iter_equal (line_start, line_end));
+
+	offset = gtk_text_iter_get_offset (line_start);
+
+	if (reader->chunk == NULL ||
+	    reader->pos_offset != offset ||
+	    reader->pos == reader->chunk_end)
+	{
+		GtkTextIter chunk_end = *line_start;
+
+		gtk_text_iter_forward_lines (&chunk_end, LINE_READER_CHUNK_LINES);
+
+		if (gtk_text_iter_compare (&chunk_end, &reader->limit) > 0)
+			chunk_end = reader->limit;
+		if (gtk_text_iter_compare (&chunk_end, line_end) < 0)
+			chunk_end = *line_end;
+
+		g_free (reader->chunk);
+		reader->chunk = gtk_text_buffer_get_slice (reader->buffer, line_start,
+							   &chunk_end, TRUE);
+		reader->pos = reader->chunk;
+		reader->chunk_end = reader->chunk + strlen (reader->chunk);
+	}
+
+	reader->pos += line_info_scan (line, reader->pos, reader->chunk_end);
+	line->start_at = offset;
+	reader->pos_offset = NEXT_LINE_OFFSET (line);
+
+	g_assert (gtk_text_iter_get_offset (line_end) == reader->pos_offset);
 }
 
 /**
@@ -4915,6 +5776,133 @@ get_segment_ (Segment *segment,
 #undef SEGMENT_CONTAINS
 #undef SEGMENT_DISTANCE
 
+/**
+ * checkpoint_find:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @offset: the offset, characters.
+ *
+ * Returns: index of the first checkpoint which starts after @offset.
+ */
+static guint
+checkpoint_find (GtkSourceContextEngine *ce,
+		 gint                    offset)
+{
+	GPtrArray *checkpoints = ce->priv->checkpoints;
+	guint lo = 0, hi = checkpoints->len;
+
+	while (lo < hi)
+	{
+		guint mid = (lo + hi) / 2;
+		Segment *segment = g_ptr_array_index (checkpoints, mid);
+
+		if (segment->start_at <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/**
+ * checkpoint_add:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @segment: segment near the start of a line.
+ *
+ * Remembers @segment, so that lookups of offsets near it don't need
+ * to walk from the current hint, which may be anywhere in the buffer
+ * (e.g. after analyzing the whole file, ce->priv->hint is at the end
+ * of it, and an edit at the top would walk through all segments).
+ * Parents of the segment are the context stack at that line.
+ */
+static void
+checkpoint_add (GtkSourceContextEngine *ce,
+		Segment                *segment)
+{
+	GPtrArray *checkpoints;
+	guint index;
+
+	if (segment == NULL ||
+	    segment == ce->priv->root_segment ||
+	    segment->is_checkpoint)
+		return;
+
+	if (ce->priv->checkpoints == NULL)
+		ce->priv->checkpoints = g_ptr_array_new ();
+
+	checkpoints = ce->priv->checkpoints;
+	index = checkpoint_find (ce, segment->start_at);
+
+	g_ptr_array_add (checkpoints, NULL);
+	memmove (checkpoints->pdata + index + 1,
+		 checkpoints->pdata + index,
+		 (checkpoints->len - index - 1) * sizeof (gpointer));
+	checkpoints->pdata[index] = segment;
+
+	segment->is_checkpoint = TRUE;
+}
+
+/**
+ * checkpoint_remove:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @segment: the segment being destroyed.
+ */
+static void
+checkpoint_remove (GtkSourceContextEngine *ce,
+		   Segment                *segment)
+{
+	GPtrArray *checkpoints = ce->priv->checkpoints;
+	guint index;
+
+	segment->is_checkpoint = FALSE;
+
+	/* Whole tree is being destroyed */
+	if (checkpoints == NULL)
+		return;
+
+	/* Offsets of segments being erased may be off, then search
+	 * the whole array. */
+	index = checkpoint_find (ce, segment->start_at);
+
+	if (index > 0 && g_ptr_array_index (checkpoints, index - 1) == segment)
+		g_ptr_array_remove_index (checkpoints, index - 1);
+	else
+		g_ptr_array_remove (checkpoints, segment);
+}
+
+/**
+ * checkpoint_hint:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @hint: segment to start search from or %NULL.
+ * @offset: the offset, characters.
+ *
+ * Returns: @hint or the checkpoint before @offset, whichever is closer.
+ */
+static Segment *
+checkpoint_hint (GtkSourceContextEngine *ce,
+		 Segment                *hint,
+		 gint                    offset)
+{
+	Segment *checkpoint;
+	guint index;
+
+	if (ce->priv->checkpoints == NULL || ce->priv->checkpoints->len == 0)
+		return hint;
+
+	index = checkpoint_find (ce, offset);
+	checkpoint = g_ptr_array_index (ce->priv->checkpoints, index > 0 ? index - 1 : 0);
+
+	if (hint == NULL ||
+	    ABS (checkpoint->start_at - offset) < ABS (hint->start_at - offset))
+		return checkpoint;
+
+	return hint;
+}
+
 /**
  * get_segment_at_offset:
  *
@@ -4950,6 +5938,7 @@ get_segment_at_offset (GtkSourceContextEngine *ce,
 	}
 #endif
 
+	hint = checkpoint_hint (ce, hint, offset);
 	result = get_segment_ (hint ? hint : ce->priv->root_segment, offset);
 
 #ifdef ENABLE_CHECK_TREE
@@ -5344,6 +6333,8 @@ erase_segments (GtkSourceContextEngine *ce,
 	if (hint == NULL)
 		hint = ce->priv->hint;
 
+	hint = checkpoint_hint (ce, hint, start);
+
 	if (hint != NULL)
 		while (hint != NULL && hint->parent != ce->priv->root_segment)
 			hint = hint->parent;
@@ -5434,8 +6425,11 @@ update_syntax (GtkSourceContextEngine *ce,
         gint analyzed_end;
 	GtkTextBuffer *buffer = ce->priv->buffer;
 	Segment *state = ce->priv->root_segment;
+	LineReader reader;
 	GTimer *timer;
 
+	ce->priv->waiting_for_job = FALSE;
+
 	context_freeze (ce->priv->root_context);
 	update_tree (ce);
 
@@ -5497,13 +6491,19 @@ update_syntax (GtkSourceContextEngine *ce,
 	line_end = line_start;
 	gtk_text_iter_forward_line (&line_end);
 	line_end_offset = gtk_text_iter_get_offset (&line_end);
-	analyzed_end = line_end_offset;
+	analyzed_end = start_offset;
+
+	if (end == NULL && !ce->priv->lazy)
+		queue_analysis_jobs (ce, start_offset);
 
 	timer = g_timer_new ();
+	line_reader_init (&reader, buffer, &end_iter);
 
 	while (TRUE)
 	{
 		LineInfo line;
+		AnalysisJob *job;
+		gint spliced_end = -1;
 		gboolean next_line_invalid = FALSE;
 		gboolean need_invalidate_next = FALSE;
 
@@ -5514,55 +6514,83 @@ update_syntax (GtkSourceContextEngine *ce,
 			break;
 		}
 
-		/* Analyze the line */
-		erase_segments (ce, line_start_offset, line_end_offset, ce->priv->hint);
-                get_line_info (buffer, &line_start, &line_end, &line);
+		job = get_analysis_job (ce, line_start_offset);
 
-#ifdef ENABLE_CHECK_TREE
+		/* A worker thread is busy with the text here. In idle, wait for
+		 * it; otherwise just analyze the text, the job will be dropped. */
+		if (job != NULL && !job->done && end == NULL)
 		{
-			Segment *inv = get_invalid_segment (ce);
-			g_assert (inv == NULL || inv->start_at >= line_end_offset);
+			ce->priv->waiting_for_job = TRUE;
+			break;
 		}
-#endif
 
-		if (line_start_offset == 0)
-			state = ce->priv->root_segment;
+		if (job != NULL && job->done)
+			spliced_end = splice_analysis_job (ce, job, line_start_offset);
+
+		if (spliced_end >= 0)
+		{
+			line_end_offset = spliced_end;
+			gtk_text_buffer_get_iter_at_offset (buffer, &line_end, line_end_offset);
+			state = get_segment_at_offset (ce, ce->priv->hint, line_end_offset - 1);
+			ce->priv->hint = state;
+		}
 		else
-			state = get_segment_at_offset (ce,
-						       ce->priv->hint ? ce->priv->hint : state,
-						       line_start_offset - 1);
-		g_assert (state->context != NULL);
+		{
+			/* Analyze the line */
+			erase_segments (ce, line_start_offset, line_end_offset, ce->priv->hint);
+			line_reader_read (&reader, &line_start, &line_end, &line);
+
+#ifdef ENABLE_CHECK_TREE
+			{
+				Segment *inv = get_invalid_segment (ce);
+				g_assert (inv == NULL || inv->start_at >= line_end_offset);
+			}
+#endif
+
+			if (line_start_offset == 0)
+				state = ce->priv->root_segment;
+			else
+				state = get_segment_at_offset (ce,
+							       ce->priv->hint ? ce->priv->hint : state,
+							       line_start_offset - 1);
+			g_assert (state->context != NULL);
 
-		ce->priv->hint2 = ce->priv->hint;
+			ce->priv->hint2 = ce->priv->hint;
 
-		if (ce->priv->hint2 != NULL && ce->priv->hint2->parent != state)
-			ce->priv->hint2 = NULL;
+			if (ce->priv->hint2 != NULL && ce->priv->hint2->parent != state)
+				ce->priv->hint2 = NULL;
 
-		state = analyze_line (ce, state, &line);
+			state = analyze_line (ce, state, &line);
 
-		/* At this point analyze_line() could have disabled highlighting */
-		if (ce->priv->disabled)
-			return;
+			/* At this point analyze_line() could have disabled highlighting */
+			if (ce->priv->disabled)
+			{
+				line_reader_destroy (&reader);
+				return;
+			}
 
 #ifdef ENABLE_CHECK_TREE
-		{
-			Segment *inv = get_invalid_segment (ce);
-			g_assert (inv == NULL || inv->start_at >= line_end_offset);
-		}
+			{
+				Segment *inv = get_invalid_segment (ce);
+				g_assert (inv == NULL || inv->start_at >= line_end_offset);
+			}
 #endif
 
-		/* XXX this is wrong */
-		/* I don't know anymore why it's wrong, I guess it means
-		 * "may be inefficient" */
-		if (ce->priv->hint2 != NULL)
-			ce->priv->hint = ce->priv->hint2;
-		else
-			ce->priv->hint = state;
-
-		line_info_destroy (&line);
+			/* XXX this is wrong */
+			/* I don't know anymore why it's wrong, I guess it means
+			 * "may be inefficient" */
+			if (ce->priv->hint2 != NULL)
+				ce->priv->hint = ce->priv->hint2;
+			else
+				ce->priv->hint = state;
+		}
 
 		gtk_text_region_add (ce->priv->refresh_region, &line_start, &line_end);
 		analyzed_end = line_end_offset;
+
+		if (gtk_text_iter_get_line (&line_end) % CHECKPOINT_LINES == 0)
+			checkpoint_add (ce, ce->priv->hint);
+
 		invalid = get_invalid_segment (ce);
 
 		if (invalid != NULL)
@@ -5638,7 +6666,7 @@ update_syntax (GtkSourceContextEngine *ce,
 		}
 	}
 
-	if (!all_analyzed (ce))
+	if (!all_analyzed (ce) && !ce->priv->waiting_for_job)
 		install_idle_worker (ce);
 
 	gtk_text_iter_set_offset (&end_iter, analyzed_end);
@@ -5649,6 +6677,7 @@ update_syntax (GtkSourceContextEngine *ce,
 			  g_timer_elapsed (timer, NULL) * 1000));
 
 	g_timer_destroy (timer);
+	line_reader_destroy (&reader);
 
 out:
 	/* must call context_thaw, so this is the only return point */
@@ -5656,25 +6685,1023 @@ out:
 }
 
 
-/* DEFINITIONS MANAGEMENT ------------------------------------------------- */
+/* BACKGROUND ANALYSIS ---------------------------------------------------- */
 
-static DefinitionChild *
-definition_child_new (ContextDefinition *definition,
-		      const gchar       *child_id,
-		      const gchar       *style,
-		      gboolean           override_style,
-		      gboolean           is_ref_all,
-		      gboolean           original_ref)
+/* Analysis of a big buffer is split into jobs of ANALYSIS_JOB_LINES lines
+ * which are analyzed in worker threads, see AnalysisJob. A job assumes the
+ * text before it ends in the root context; it's true for most of the lines
+ * in most of the files, and update_syntax() checks it before splicing the
+ * result. If it's not true the job result is thrown away and the main thread
+ * analyzes the text as usual. */
+
+/**
+ * detached_engine_new:
+ *
+ * @ctx_data: context definitions.
+ * @offset: where the text starts.
+ *
+ * Creates an engine without a buffer, whose tree starts with the
+ * root context at @offset. Lines are fed to it with
+ * detached_engine_analyze_line().
+ */
+static GtkSourceContextEngine *
+detached_engine_new (GtkSourceContextData *ctx_data,
+		     gint                  offset)
 {
-	DefinitionChild *ch;
+	GtkSourceContextEngine *dce;
+	ContextDefinition *main_definition;
+	gchar *root_id;
 
-	g_return_val_if_fail (child_id != NULL, NULL);
+	dce = _gtk_source_context_engine_new (ctx_data);
 
-	ch = g_slice_new0 (DefinitionChild);
+	root_id = g_strdup_printf ("%s:%s", ENGINE_ID (dce), ENGINE_ID (dce));
+	main_definition = LOOKUP_DEFINITION (dce->priv->ctx_data, root_id);
+	g_free (root_id);
+	g_assert (main_definition != NULL);
 
-	if (original_ref)
-		ch->u.id = g_strdup_printf ("@%s", child_id);
-	else
+	dce->priv->root_context = context_new (NULL, main_definition, NULL, NULL, FALSE);
+	dce->priv->root_segment = create_segment (dce, NULL, dce->priv->root_context,
+						  offset, offset, TRUE, NULL);
+
+	return dce;
+}
+
+/**
+ * detached_engine_analyze_line:
+ *
+ * @dce: engine created with detached_engine_new().
+ * @line: next line.
+ *
+ * Same thing update_syntax() does for a line, except that the tree
+ * is always empty after the line.
+ *
+ * Returns: %FALSE if analysis failed.
+ */
+static gboolean
+detached_engine_analyze_line (GtkSourceContextEngine *dce,
+			      LineInfo               *line)
+{
+	Segment *state;
+
+	if (line->start_at == dce->priv->root_segment->start_at)
+		state = dce->priv->root_segment;
+	else
+		state = get_segment_at_offset (dce, dce->priv->hint, line->start_at - 1);
+
+	dce->priv->hint2 = dce->priv->hint;
+
+	if (dce->priv->hint2 != NULL && dce->priv->hint2->parent != state)
+		dce->priv->hint2 = NULL;
+
+	state = analyze_line (dce, state, line);
+
+	if (dce->priv->disabled)
+		return FALSE;
+
+	if (dce->priv->hint2 != NULL)
+		dce->priv->hint = dce->priv->hint2;
+	else
+		dce->priv->hint = state;
+
+	return TRUE;
+}
+
+static void
+detached_engine_free (GtkSourceContextEngine *dce)
+{
+	if (dce->priv->root_segment != NULL)
+		segment_destroy (dce, dce->priv->root_segment);
+	if (dce->priv->root_context != NULL)
+		context_unref (dce->priv->root_context);
+	dce->priv->root_segment = NULL;
+	dce->priv->root_context = NULL;
+
+	g_object_unref (dce);
+}
+
+/**
+ * highlight_provisionally:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @start: the beginning of requested text.
+ * @end: the end of requested text.
+ *
+ * Highlights text which a view wants to show, long before the analysis
+ * gets there (e.g. after jumping to the end of a big file). It analyzes
+ * the text as if it started in the root context, which is right most of
+ * the time, and applies tags from that tree. The text stays unanalyzed,
+ * and once update_syntax() gets there highlight_region() fixes whatever
+ * was wrong.
+ */
+static void
+highlight_provisionally (GtkSourceContextEngine *ce,
+			 const GtkTextIter      *start,
+			 const GtkTextIter      *end)
+{
+	GtkTextRegion *todo, *done;
+	GtkTextRegionIterator reg_iter;
+	GtkTextIter line_start, line_end;
+
+	line_start = *start;
+	gtk_text_iter_set_line_offset (&line_start, 0);
+	line_end = *end;
+	if (!gtk_text_iter_starts_line (&line_end))
+		gtk_text_iter_forward_line (&line_end);
+
+	if (gtk_text_iter_compare (&line_start, &line_end) >= 0)
+		return;
+
+	/* Find what's not done yet */
+	todo = gtk_text_region_new (ce->priv->buffer);
+	gtk_text_region_add (todo, &line_start, &line_end);
+
+	done = gtk_text_region_intersect (ce->priv->provisional_region, &line_start, &line_end);
+
+	if (done != NULL)
+	{
+		gtk_text_region_get_iterator (done, &reg_iter, 0);
+
+		while (!gtk_text_region_iterator_is_end (&reg_iter))
+		{
+			GtkTextIter s, e;
+			gtk_text_region_iterator_get_subregion (&reg_iter, &s, &e);
+			gtk_text_region_subtract (todo, &s, &e);
+			gtk_text_region_iterator_next (&reg_iter);
+		}
+
+		gtk_text_region_destroy (done, TRUE);
+	}
+
+	gtk_text_region_add (ce->priv->provisional_region, &line_start, &line_end);
+
+	gtk_text_region_get_iterator (todo, &reg_iter, 0);
+
+	while (!gtk_text_region_iterator_is_end (&reg_iter))
+	{
+		GtkSourceContextEngine *dce;
+		GtkTextIter s, e, iter;
+		LineReader reader;
+
+		gtk_text_region_iterator_get_subregion (&reg_iter, &s, &e);
+		gtk_text_iter_set_line_offset (&s, 0);
+
+		dce = detached_engine_new (ce->priv->ctx_data, gtk_text_iter_get_offset (&s));
+		line_reader_init (&reader, ce->priv->buffer, &e);
+
+		for (iter = s; gtk_text_iter_compare (&iter, &e) < 0; )
+		{
+			GtkTextIter next = iter;
+			LineInfo line;
+
+			gtk_text_iter_forward_line (&next);
+			line_reader_read (&reader, &iter, &next, &line);
+
+			if (!detached_engine_analyze_line (dce, &line))
+				break;
+
+			iter = next;
+		}
+
+		line_reader_destroy (&reader);
+
+		if (!dce->priv->disabled)
+		{
+			e = iter;
+			if (gtk_text_iter_starts_line (&e) && gtk_text_iter_compare (&s, &e) < 0)
+				gtk_text_iter_backward_char (&e);
+			highlight_tree (ce, dce->priv->root_segment, &s, &e);
+		}
+
+		detached_engine_free (dce);
+		gtk_text_region_iterator_next (&reg_iter);
+	}
+
+	gtk_text_region_destroy (todo, TRUE);
+
+	PROFILE (g_print ("provisionally highlighted lines %d to %d\n",
+			  gtk_text_iter_get_line (&line_start),
+			  gtk_text_iter_get_line (&line_end)));
+}
+
+struct CopyData {
+	GtkSourceContextData	*copy;
+	/* original definition -> copy */
+	GHashTable		*copies;
+	/* copy -> original, for definitions and sub pattern definitions */
+	GHashTable		*origin;
+	gboolean		 failed;
+};
+
+static Regex *
+regex_copy (Regex    *regex,
+	    gboolean *failed)
+{
+	Regex *copy;
+
+	if (regex == NULL)
+		return NULL;
+
+	copy = g_slice_new0 (Regex);
+	copy->ref_count = 1;
+	copy->resolved = regex->resolved;
+
+	if (regex->resolved)
+	{
+#if GLIB_CHECK_VERSION(2,74,0)
+		/* pcre2 GRegex jit-compiles the pattern on first match,
+		 * so it can't be shared between threads */
+		GRegex *re = regex->u.regex.regex;
+		copy->u.regex.regex = g_regex_new (g_regex_get_pattern (re),
+						   g_regex_get_compile_flags (re),
+						   g_regex_get_match_flags (re),
+						   NULL);
+#else
+		copy->u.regex.regex = g_regex_ref (regex->u.regex.regex);
+#endif
+
+		if (copy->u.regex.regex == NULL)
+		{
+			g_slice_free (Regex, copy);
+			*failed = TRUE;
+			return NULL;
+		}
+	}
+	else
+	{
+		copy->u.info.pattern = g_strdup (regex->u.info.pattern);
+		copy->u.info.flags = regex->u.info.flags;
+	}
+
+	return copy;
+}
+
+static ContextDefinition *
+context_definition_copy (ContextDefinition *definition,
+			 struct CopyData   *data)
+{
+	ContextDefinition *copy;
+	GSList *l;
+
+	copy = g_hash_table_lookup (data->copies, definition);
+
+	if (copy != NULL)
+		return copy;
+
+	copy = g_slice_new0 (ContextDefinition);
+	copy->ref_count = 1;
+	copy->id = g_strdup (definition->id);
+	copy->type = definition->type;
+	copy->default_style = g_strdup (definition->default_style);
+	copy->flags = definition->flags;
+
+	switch (definition->type)
+	{
+		case CONTEXT_TYPE_SIMPLE:
+			copy->u.match = regex_copy (definition->u.match, &data->failed);
+			break;
+		case CONTEXT_TYPE_CONTAINER:
+			copy->u.start_end.start = regex_copy (definition->u.start_end.start, &data->failed);
+			copy->u.start_end.end = regex_copy (definition->u.start_end.end, &data->failed);
+			break;
+	}
+
+	for (l = definition->sub_patterns; l != NULL; l = l->next)
+	{
+		SubPatternDefinition *sp_def = l->data;
+		SubPatternDefinition *sp_copy = g_slice_new0 (SubPatternDefinition);
+
+#ifdef NEED_DEBUG_ID
+		sp_copy->id = g_strdup (sp_def->id);
+#endif
+		sp_copy->style = g_strdup (sp_def->style);
+		sp_copy->where = sp_def->where;
+		sp_copy->index = sp_def->index;
+		sp_copy->is_named = sp_def->is_named;
+
+		if (sp_def->is_named)
+			sp_copy->u.name = g_strdup (sp_def->u.name);
+		else
+			sp_copy->u.num = sp_def->u.num;
+
+		copy->sub_patterns = g_slist_prepend (copy->sub_patterns, sp_copy);
+		g_hash_table_insert (data->origin, sp_copy, sp_def);
+	}
+
+	copy->sub_patterns = g_slist_reverse (copy->sub_patterns);
+	copy->n_sub_patterns = definition->n_sub_patterns;
+
+	/* Register it before copying children, they may refer back to it. */
+	g_hash_table_insert (data->copies, definition, copy);
+	g_hash_table_insert (data->origin, copy, definition);
+
+	for (l = definition->children; l != NULL; l = l->next)
+	{
+		DefinitionChild *child_def = l->data;
+		DefinitionChild *child_copy = g_slice_new0 (DefinitionChild);
+
+		if (child_def->resolved)
+			child_copy->u.definition = context_definition_copy (child_def->u.definition, data);
+		else
+			child_copy->u.id = g_strdup (child_def->u.id);
+
+		child_copy->style = g_strdup (child_def->style);
+		child_copy->is_ref_all = child_def->is_ref_all;
+		child_copy->resolved = child_def->resolved;
+		child_copy->override_style = child_def->override_style;
+		child_copy->override_style_deep = child_def->override_style_deep;
+
+		copy->children = g_slist_prepend (copy->children, child_copy);
+	}
+
+	copy->children = g_slist_reverse (copy->children);
+
+	return copy;
+}
+
+static void
+copy_definition_cb (const gchar       *id,
+		    ContextDefinition *definition,
+		    struct CopyData   *data)
+{
+	ContextDefinition *copy = context_definition_copy (definition, data);
+	g_hash_table_insert (data->copy->definitions, g_strdup (id),
+			     context_definition_ref (copy));
+}
+
+/**
+ * context_data_copy:
+ *
+ * @ctx_data: #GtkSourceContextData.
+ * @origin: location to return the map from copied definitions
+ * and sub pattern definitions to the original ones.
+ *
+ * Makes a deep copy of context definitions, so that the copy can be
+ * used in another thread: Regex structures contain match data, and
+ * definitions cache reg_all. It only reads @ctx_data, which does not
+ * change after parsing is done, so it may be called in any thread.
+ *
+ * Returns: the copy, or %NULL if it failed to compile regexes.
+ */
+static GtkSourceContextData *
+context_data_copy (GtkSourceContextData  *ctx_data,
+		   GHashTable           **origin)
+{
+	struct CopyData data;
+
+	data.copy = _gtk_source_context_data_new (ctx_data->lang);
+	data.copies = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+					     (GDestroyNotify) context_definition_unref);
+	data.origin = g_hash_table_new (g_direct_hash, g_direct_equal);
+	data.failed = FALSE;
+
+	g_hash_table_foreach (ctx_data->definitions, (GHFunc) copy_definition_cb, &data);
+	g_hash_table_destroy (data.copies);
+
+	if (data.failed)
+	{
+		_gtk_source_context_data_unref (data.copy);
+		g_hash_table_destroy (data.origin);
+		return NULL;
+	}
+
+	*origin = data.origin;
+	return data.copy;
+}
+
+struct _ContextDataCopy {
+	GtkSourceContextData	*ctx_data;
+	/* copy -> original, see context_data_copy() */
+	GHashTable		*origin;
+};
+
+G_LOCK_DEFINE_STATIC (context_data_copies);
+
+static void
+context_data_copy_free (ContextDataCopy *copy)
+{
+	_gtk_source_context_data_unref (copy->ctx_data);
+	g_hash_table_destroy (copy->origin);
+	g_slice_free (ContextDataCopy, copy);
+}
+
+/**
+ * get_context_data_copy:
+ *
+ * @ctx_data: #GtkSourceContextData.
+ *
+ * Takes an idle copy of @ctx_data or makes a new one. Copying compiles
+ * every regex again with newer GLib, so copies are kept in @ctx_data
+ * and reused by following jobs. A copy is used by one job at a time:
+ * the detached tree refers to copied definitions until the main thread
+ * splices it, so it's given back in analysis_job_free().
+ *
+ * Returns: the copy, or %NULL if it failed to compile regexes.
+ */
+static ContextDataCopy *
+get_context_data_copy (GtkSourceContextData *ctx_data)
+{
+	ContextDataCopy *copy = NULL;
+	GtkSourceContextData *data;
+	GHashTable *origin;
+
+	G_LOCK (context_data_copies);
+	if (ctx_data->copies != NULL)
+	{
+		copy = ctx_data->copies->data;
+		ctx_data->copies = g_slist_delete_link (ctx_data->copies,
+							ctx_data->copies);
+	}
+	G_UNLOCK (context_data_copies);
+
+	if (copy != NULL)
+		return copy;
+
+	data = context_data_copy (ctx_data, &origin);
+
+	if (data == NULL)
+		return NULL;
+
+	copy = g_slice_new (ContextDataCopy);
+	copy->ctx_data = data;
+	copy->origin = origin;
+	return copy;
+}
+
+static void
+put_context_data_copy (GtkSourceContextData *ctx_data,
+		       ContextDataCopy      *copy)
+{
+	G_LOCK (context_data_copies);
+	if (g_slist_length (ctx_data->copies) < MAX_ANALYSIS_THREADS * ANALYSIS_JOBS_PER_THREAD)
+	{
+		ctx_data->copies = g_slist_prepend (ctx_data->copies, copy);
+		copy = NULL;
+	}
+	G_UNLOCK (context_data_copies);
+
+	if (copy != NULL)
+		context_data_copy_free (copy);
+}
+
+static void
+analysis_job_free (AnalysisJob *job)
+{
+	if (job->detached != NULL)
+		detached_engine_free (job->detached);
+
+	if (job->copy != NULL)
+		put_context_data_copy (job->ctx_data, job->copy);
+
+	_gtk_source_context_data_unref (job->ctx_data);
+	g_object_unref (job->lang);
+	g_free (job->text);
+	g_slice_free (AnalysisJob, job);
+}
+
+/**
+ * analysis_job_cancel:
+ *
+ * @job: the job.
+ *
+ * Frees the job if it's done, otherwise tells the worker thread to
+ * stop, and the job is freed in analysis_job_done().
+ */
+static void
+analysis_job_cancel (AnalysisJob *job)
+{
+	if (job->done)
+	{
+		analysis_job_free (job);
+	}
+	else
+	{
+		job->ce = NULL;
+		g_atomic_int_set (&job->cancelled, 1);
+	}
+}
+
+static gboolean
+analysis_job_done (AnalysisJob *job)
+{
+	gdk_threads_enter ();
+
+	if (job->ce == NULL)
+	{
+		analysis_job_free (job);
+	}
+	else
+	{
+		job->done = TRUE;
+		install_idle_worker (job->ce);
+	}
+
+	gdk_threads_leave ();
+
+	return FALSE;
+}
+
+/**
+ * detached_tree_can_splice:
+ *
+ * @segment: a segment of the detached tree.
+ *
+ * Contexts whose end regex refers to the start match can't be mapped
+ * to the engine's contexts without the start match, so chunks of text
+ * which have them are left to the main thread.
+ */
+static gboolean
+detached_tree_can_splice (Segment *segment)
+{
+	Segment *child;
+
+	if (CONTEXT_IS_CONTAINER (segment->context) &&
+	    segment->context->definition->u.start_end.end != NULL &&
+	    !segment->context->definition->u.start_end.end->resolved)
+		return FALSE;
+
+	for (child = segment->children; child != NULL; child = child->next)
+		if (!detached_tree_can_splice (child))
+			return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * analysis_job_analyze:
+ *
+ * @job: the job.
+ *
+ * Analyzes job text, it's the same thing update_syntax() does for
+ * the invalid text except that the tree is empty.
+ *
+ * Returns: %TRUE on success.
+ */
+static gboolean
+analysis_job_analyze (AnalysisJob *job)
+{
+	GtkSourceContextEngine *dce;
+	const gchar *p, *text_end;
+	gint offset;
+
+	job->copy = get_context_data_copy (job->ctx_data);
+
+	if (job->copy == NULL)
+		return FALSE;
+
+	job->origin = job->copy->origin;
+	job->detached = dce = detached_engine_new (job->copy->ctx_data, job->start_at);
+
+	offset = job->start_at;
+	p = job->text;
+	text_end = job->text + strlen (job->text);
+
+	while (p < text_end)
+	{
+		LineInfo line;
+		gsize line_bytes;
+
+		if (g_atomic_int_get (&job->cancelled))
+			return FALSE;
+
+		line_bytes = line_info_scan (&line, p, text_end);
+		line.start_at = offset;
+
+		if (!detached_engine_analyze_line (dce, &line))
+			return FALSE;
+
+		offset = NEXT_LINE_OFFSET (&line);
+		p += line_bytes;
+	}
+
+	g_return_val_if_fail (offset == job->end_at, FALSE);
+
+	return detached_tree_can_splice (dce->priv->root_segment);
+}
+
+static void
+analysis_job_run (AnalysisJob          *job,
+		  G_GNUC_UNUSED gpointer user_data)
+{
+	if (!g_atomic_int_get (&job->cancelled))
+		job->failed = !analysis_job_analyze (job);
+
+	g_free (job->text);
+	job->text = NULL;
+
+	g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
+			 (GSourceFunc) analysis_job_done,
+			 job, NULL);
+}
+
+static GThreadPool *
+get_analysis_pool (void)
+{
+	static GThreadPool *pool = NULL;
+
+	if (pool == NULL)
+	{
+		gint n_threads;
+
+#if GLIB_CHECK_VERSION(2,36,0)
+		n_threads = g_get_num_processors ();
+#else
+		n_threads = 2;
+#endif
+
+		pool = g_thread_pool_new ((GFunc) analysis_job_run, NULL,
+					  CLAMP (n_threads, 1, MAX_ANALYSIS_THREADS),
+					  FALSE, NULL);
+	}
+
+	return pool;
+}
+
+static AnalysisJob *
+analysis_job_new (GtkSourceContextEngine *ce,
+		  const GtkTextIter      *start,
+		  const GtkTextIter      *end)
+{
+	AnalysisJob *job;
+
+	job = g_slice_new0 (AnalysisJob);
+	job->ce = ce;
+	job->ctx_data = _gtk_source_context_data_ref (ce->priv->ctx_data);
+	job->lang = g_object_ref (ce->priv->ctx_data->lang);
+	job->text = gtk_text_buffer_get_slice (ce->priv->buffer, start, end, TRUE);
+	job->start_at = gtk_text_iter_get_offset (start);
+	job->end_at = gtk_text_iter_get_offset (end);
+
+	return job;
+}
+
+/**
+ * root_allows_background_analysis:
+ *
+ * @ce: #GtkSourceContextEngine.
+ *
+ * A job doesn't see what's before it, so it would let once-only
+ * children of the root context start again.
+ */
+static gboolean
+root_allows_background_analysis (GtkSourceContextEngine *ce)
+{
+	DefinitionsIter iter;
+	DefinitionChild *child_def;
+	gboolean ok = TRUE;
+
+	definition_iter_init (&iter, ce->priv->root_context->definition);
+
+	while (ok && (child_def = definition_iter_next (&iter)) != NULL)
+	{
+		if (HAS_OPTION (child_def->u.definition, ONCE_ONLY) &&
+		    !HAS_OPTION (child_def->u.definition, FIRST_LINE_ONLY))
+			ok = FALSE;
+	}
+
+	definition_iter_destroy (&iter);
+
+	return ok;
+}
+
+/**
+ * queue_analysis_jobs:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @offset: start of the first invalid line.
+ *
+ * Starts jobs for the text after @offset if it's big enough and
+ * it's all invalid, i.e. nothing is there to be reused.
+ */
+static void
+queue_analysis_jobs (GtkSourceContextEngine *ce,
+		     gint                    offset)
+{
+	GtkTextBuffer *buffer = ce->priv->buffer;
+	GThreadPool *pool;
+	GtkTextIter start;
+	Segment *invalid;
+	guint n_jobs, max_jobs;
+
+	if (!ce->priv->invalid_region.empty ||
+	    ce->priv->invalid == NULL ||
+	    ce->priv->invalid->next != NULL)
+		return;
+
+	invalid = ce->priv->invalid->data;
+
+	if (invalid->parent != ce->priv->root_segment ||
+	    invalid->end_at != gtk_text_buffer_get_char_count (buffer))
+		return;
+
+	pool = get_analysis_pool ();
+
+	if (pool == NULL)
+		return;
+
+	if (ce->priv->jobs == NULL)
+	{
+		gtk_text_buffer_get_iter_at_offset (buffer, &start, offset);
+
+		if (gtk_text_buffer_get_line_count (buffer) - gtk_text_iter_get_line (&start) <
+			BACKGROUND_ANALYSIS_MIN_LINES)
+			return;
+
+		if (!root_allows_background_analysis (ce))
+			return;
+
+		/* If text before offset doesn't end in the root context,
+		 * the first chunk is for the main thread. */
+		if (offset != 0 &&
+		    get_segment_at_offset (ce, ce->priv->hint, offset - 1) != ce->priv->root_segment)
+			gtk_text_iter_forward_lines (&start, ANALYSIS_JOB_LINES);
+	}
+	else
+	{
+		AnalysisJob *last = g_slist_last (ce->priv->jobs)->data;
+		gtk_text_buffer_get_iter_at_offset (buffer, &start, last->end_at);
+	}
+
+	n_jobs = g_slist_length (ce->priv->jobs);
+	max_jobs = g_thread_pool_get_max_threads (pool) * ANALYSIS_JOBS_PER_THREAD;
+
+	while (n_jobs < max_jobs && !gtk_text_iter_is_end (&start))
+	{
+		GtkTextIter end = start;
+		AnalysisJob *job;
+
+		gtk_text_iter_forward_lines (&end, ANALYSIS_JOB_LINES);
+
+		job = analysis_job_new (ce, &start, &end);
+		ce->priv->jobs = g_slist_append (ce->priv->jobs, job);
+		g_thread_pool_push (pool, job, NULL);
+
+		n_jobs++;
+		start = end;
+	}
+}
+
+/**
+ * cancel_analysis_jobs:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @offset: offset in the buffer.
+ *
+ * Cancels jobs for text which ends after @offset.
+ */
+static void
+cancel_analysis_jobs (GtkSourceContextEngine *ce,
+		      gint                    offset)
+{
+	GSList *l, *keep = NULL;
+
+	for (l = ce->priv->jobs; l != NULL; l = l->next)
+	{
+		AnalysisJob *job = l->data;
+
+		if (job->end_at > offset)
+			analysis_job_cancel (job);
+		else
+			keep = g_slist_prepend (keep, job);
+	}
+
+	g_slist_free (ce->priv->jobs);
+	ce->priv->jobs = g_slist_reverse (keep);
+}
+
+/**
+ * get_analysis_job:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @offset: start of line being analyzed.
+ *
+ * Drops jobs for text before @offset, the main thread has got there first.
+ *
+ * Returns: the job which starts at @offset, or %NULL.
+ */
+static AnalysisJob *
+get_analysis_job (GtkSourceContextEngine *ce,
+		  gint                    offset)
+{
+	while (ce->priv->jobs != NULL)
+	{
+		AnalysisJob *job = ce->priv->jobs->data;
+
+		if (job->start_at > offset)
+			return NULL;
+
+		if (job->start_at == offset)
+			return job;
+
+		ce->priv->jobs = g_slist_delete_link (ce->priv->jobs, ce->priv->jobs);
+		analysis_job_cancel (job);
+	}
+
+	return NULL;
+}
+
+/**
+ * splice_context:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @job: the job.
+ * @contexts: map from detached contexts to engine contexts.
+ * @dctx: a context from the detached tree.
+ *
+ * Finds or creates the engine context corresponding to @dctx.
+ * Contexts are identified by their definitions, since the ones
+ * from the detached tree can't have references to the start match.
+ */
+static Context *
+splice_context (GtkSourceContextEngine *ce,
+		AnalysisJob            *job,
+		GHashTable             *contexts,
+		Context                *dctx)
+{
+	Context *parent, *context;
+	ContextDefinition *definition;
+	DefinitionsIter iter;
+	DefinitionChild *child_def;
+
+	if (dctx->parent == NULL)
+		return ce->priv->root_context;
+
+	context = g_hash_table_lookup (contexts, dctx);
+
+	if (context != NULL)
+		return context;
+
+	parent = splice_context (ce, job, contexts, dctx->parent);
+	definition = g_hash_table_lookup (job->origin, dctx->definition);
+	g_return_val_if_fail (parent != NULL && definition != NULL, NULL);
+
+	/* The first child wins, like in next_segment() */
+	definition_iter_init (&iter, parent->definition);
+	while ((child_def = definition_iter_next (&iter)) != NULL)
+		if (child_def->u.definition == definition)
+			break;
+	definition_iter_destroy (&iter);
+
+	g_return_val_if_fail (child_def != NULL, NULL);
+
+	/* line text is only needed to resolve end regex */
+	context = create_child_context (parent, child_def, "");
+	g_hash_table_insert (contexts, dctx, context);
+
+	return context;
+}
+
+static void
+splice_segment (GtkSourceContextEngine *ce,
+		AnalysisJob            *job,
+		GHashTable             *contexts,
+		Segment                *parent,
+		Segment                *dsegment,
+		Segment               **hint)
+{
+	Segment *segment, *child;
+	Segment *child_hint = NULL;
+	Context *context;
+	SubPattern *sp;
+
+	context = splice_context (ce, job, contexts, dsegment->context);
+	g_return_if_fail (context != NULL);
+
+	segment = create_segment (ce, parent, context,
+				  dsegment->start_at, dsegment->end_at,
+				  dsegment->is_start, *hint);
+	segment->start_len = dsegment->start_len;
+	segment->end_len = dsegment->end_len;
+
+	for (sp = dsegment->sub_patterns; sp != NULL; sp = sp->next)
+		sub_pattern_new (segment, sp->start_at, sp->end_at,
+				 g_hash_table_lookup (job->origin, sp->definition));
+
+	for (child = dsegment->children; child != NULL; child = child->next)
+		splice_segment (ce, job, contexts, segment, child, &child_hint);
+
+	*hint = segment;
+}
+
+/**
+ * checkpoint_add_spliced:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @start: start of the spliced text.
+ * @end: end of the spliced text.
+ *
+ * Adds checkpoints inside the spliced text, which update_syntax()
+ * steps over in one go. Lines are picked the same way it does for
+ * the text it analyzes; the line which ends at @end is left to it.
+ */
+static void
+checkpoint_add_spliced (GtkSourceContextEngine *ce,
+			gint                    start,
+			gint                    end)
+{
+	GtkTextIter iter;
+	Segment *hint = NULL;
+	gint line, end_line;
+
+	gtk_text_buffer_get_iter_at_offset (ce->priv->buffer, &iter, end);
+	end_line = gtk_text_iter_get_line (&iter);
+	gtk_text_buffer_get_iter_at_offset (ce->priv->buffer, &iter, start);
+	line = gtk_text_iter_get_line (&iter);
+
+	for (line += CHECKPOINT_LINES - line % CHECKPOINT_LINES;
+	     line < end_line;
+	     line += CHECKPOINT_LINES)
+	{
+		gtk_text_iter_set_line (&iter, line);
+		hint = get_segment_at_offset (ce, hint, gtk_text_iter_get_offset (&iter) - 1);
+		checkpoint_add (ce, hint);
+	}
+}
+
+/**
+ * splice_analysis_job:
+ *
+ * @ce: #GtkSourceContextEngine.
+ * @job: a finished job.
+ * @offset: start of the job text.
+ *
+ * Replaces the tree between job start and end with the detached tree
+ * built by the job, if text before @offset ends in the root context.
+ * Frees @job.
+ *
+ * Returns: job end offset or -1 if the job result can't be used.
+ */
+static gint
+splice_analysis_job (GtkSourceContextEngine *ce,
+		     AnalysisJob            *job,
+		     gint                    offset)
+{
+	Segment *state;
+	gint end_at = -1;
+
+	g_assert (job->done && job->start_at == offset);
+
+	ce->priv->jobs = g_slist_remove (ce->priv->jobs, job);
+
+	if (offset == 0)
+		state = ce->priv->root_segment;
+	else
+		state = get_segment_at_offset (ce, ce->priv->hint, offset - 1);
+
+	if (!job->failed && state == ce->priv->root_segment)
+	{
+		GHashTable *contexts;
+		Segment *child, *hint = NULL;
+
+		contexts = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+						  (GDestroyNotify) context_unref);
+
+		erase_segments (ce, job->start_at, job->end_at, ce->priv->hint);
+
+		for (child = job->detached->priv->root_segment->children;
+		     child != NULL;
+		     child = child->next)
+		{
+			splice_segment (ce, job, contexts, ce->priv->root_segment, child, &hint);
+		}
+
+		g_hash_table_destroy (contexts);
+
+		if (hint != NULL)
+			ce->priv->hint = hint;
+
+		checkpoint_add_spliced (ce, job->start_at, job->end_at);
+
+		end_at = job->end_at;
+		CHECK_TREE (ce);
+	}
+
+	PROFILE (g_print ("%s job from %d to %d\n", end_at >= 0 ? "spliced" : "dropped",
+			  job->start_at, job->end_at));
+
+	analysis_job_free (job);
+	return end_at;
+}
+
+
+/* DEFINITIONS MANAGEMENT ------------------------------------------------- */
+
+static DefinitionChild *
+definition_child_new (ContextDefinition *definition,
+		      const gchar       *child_id,
+		      const gchar       *style,
+		      gboolean           override_style,
+		      gboolean           is_ref_all,
+		      gboolean           original_ref)
+{
+	DefinitionChild *ch;
+
+	g_return_val_if_fail (child_id != NULL, NULL);
+
+	ch = g_slice_new0 (DefinitionChild);
+
+	if (original_ref)
+		ch->u.id = g_strdup_printf ("@%s", child_id);
+	else
 		ch->u.id = g_strdup (child_id);
 
 	ch->style = g_strdup (style);
@@ -6536,6 +8563,10 @@ check_tree (GtkSourceContextEngine *ce)
 {
 	Segment *root = ce->priv->root_segment;
 
+	/* Detached trees of analysis jobs start in the middle of text. */
+	if (ce->priv->buffer == NULL)
+		return;
+
 	check_regex ();
 
 	g_assert (root->start_at == 0);
@@ -104,3 +104,15 @@ _gtk_source_engine_set_style_scheme (GtkSourceEngine      *engine,
 
 	GTK_SOURCE_ENGINE_GET_CLASS (engine)->set_style_scheme (engine, scheme);
 }
+
+/* Lazy engine only analyzes text which is about to be displayed,
+ * instead of analyzing whole buffer in background. */
+void
+_gtk_source_engine_set_lazy (GtkSourceEngine *engine,
+			     gboolean         lazy)
+{
+	g_return_if_fail (GTK_IS_SOURCE_ENGINE (engine));
+
+	if (GTK_SOURCE_ENGINE_GET_CLASS (engine)->set_lazy != NULL)
+		GTK_SOURCE_ENGINE_GET_CLASS (engine)->set_lazy (engine, lazy);
+}
@@ -63,6 +63,9 @@ struct _GtkSourceEngineClass
 
 	void     (* set_style_scheme) (GtkSourceEngine      *engine,
 				       GtkSourceStyleScheme *scheme);
+
+	void     (* set_lazy)         (GtkSourceEngine      *engine,
+				       gboolean              lazy);
 };
 
 GType       _gtk_source_engine_get_type		(void) G_GNUC_CONST;
@@ -81,6 +84,8 @@ void        _gtk_source_engine_update_highlight	(GtkSourceEngine      *engine,
 						 gboolean              synchronous);
 void        _gtk_source_engine_set_style_scheme	(GtkSourceEngine      *engine,
 						 GtkSourceStyleScheme *scheme);
+void        _gtk_source_engine_set_lazy		(GtkSourceEngine      *engine,
+						 gboolean              lazy);
 
 G_END_DECLS
 
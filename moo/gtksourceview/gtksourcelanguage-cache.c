@@ -0,0 +1,666 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8; coding: utf-8 -*-
+ *  gtksourcelanguage-cache.c
+ *  Binary cache of parsed version 2 lang files
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Library General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Library General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Parsing a lang file means reading and validating the XML of the file
+ * and of every lang file it refers to, expanding regex variables and
+ * checking regexes, and only then feeding the context definitions to
+ * GtkSourceContextData. The parser records what it feeds to the context
+ * data, together with the resulting styles, and the record is saved in
+ * the cache directory of the language manager. Next time the record is
+ * memory-mapped and replayed into the context data directly, strings are
+ * used in place.
+ *
+ * The cache file is valid as long as every lang file which was read is
+ * the same (path, mtime and size), every referenced language still comes
+ * from the same file, and the locale is the same (style names are
+ * translated).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <mooglib/moo-glib.h>
+#include <mooglib/moo-stat.h>
+#include "gtksourcelanguage.h"
+#include "gtksourcelanguage-private.h"
+#include "gtksourcecontextengine.h"
+
+#define CACHE_MAGIC		"GSVLANGC"
+#define CACHE_MAGIC_LEN		8
+#define CACHE_FORMAT_VERSION	1
+#define CACHE_FILE_SUFFIX	".lang-cache"
+
+typedef enum {
+	OP_DEFINE_CONTEXT = 1,
+	OP_SUB_PATTERN,
+	OP_REF,
+	OP_REPLACE
+} CacheOp;
+
+struct _GtkSourceLanguageCache
+{
+	GtkSourceLanguage *language;
+	GByteArray *files;
+	GByteArray *ops;
+	guint n_files;
+	guint n_ops;
+	gboolean failed;
+};
+
+
+/*****************************************************************************/
+/* Writing
+ */
+
+static void
+put_uint (GByteArray *data,
+	  guint32     value)
+{
+	g_byte_array_append (data, (const guint8*) &value, sizeof value);
+}
+
+static void
+put_int64 (GByteArray *data,
+	   gint64      value)
+{
+	g_byte_array_append (data, (const guint8*) &value, sizeof value);
+}
+
+/* length including the nul byte, zero for NULL */
+static void
+put_string (GByteArray  *data,
+	    const gchar *string)
+{
+	if (string == NULL)
+	{
+		put_uint (data, 0);
+	}
+	else
+	{
+		guint32 len = strlen (string) + 1;
+		put_uint (data, len);
+		g_byte_array_append (data, (const guint8*) string, len);
+	}
+}
+
+static gchar *
+get_cache_file (GtkSourceLanguage *language)
+{
+	GtkSourceLanguageManager *lm;
+	const gchar *dir;
+	gchar *basename, *filename;
+
+	lm = _gtk_source_language_get_language_manager (language);
+
+	if (lm == NULL || (dir = _gtk_source_language_manager_get_cache_dir (lm)) == NULL)
+		return NULL;
+
+	basename = g_strconcat (language->priv->id, CACHE_FILE_SUFFIX, NULL);
+	filename = g_build_filename (dir, basename, NULL);
+
+	g_free (basename);
+	return filename;
+}
+
+static const gchar *
+get_locale (void)
+{
+	return g_get_language_names ()[0];
+}
+
+/**
+ * _gtk_source_language_cache_new:
+ * @language: language being parsed.
+ *
+ * Returns: a new cache writer, or %NULL if the language manager
+ * doesn't cache languages.
+ */
+GtkSourceLanguageCache *
+_gtk_source_language_cache_new (GtkSourceLanguage *language)
+{
+	GtkSourceLanguageCache *cache;
+	gchar *filename;
+
+	if (!(filename = get_cache_file (language)))
+		return NULL;
+
+	g_free (filename);
+
+	cache = g_slice_new0 (GtkSourceLanguageCache);
+	cache->language = language;
+	cache->files = g_byte_array_new ();
+	cache->ops = g_byte_array_new ();
+
+	return cache;
+}
+
+void
+_gtk_source_language_cache_free (GtkSourceLanguageCache *cache)
+{
+	if (cache != NULL)
+	{
+		g_byte_array_free (cache->files, TRUE);
+		g_byte_array_free (cache->ops, TRUE);
+		g_slice_free (GtkSourceLanguageCache, cache);
+	}
+}
+
+/**
+ * _gtk_source_language_cache_add_file:
+ * @cache: cache writer, may be %NULL.
+ * @file_language: the language whose lang file is about to be parsed.
+ */
+void
+_gtk_source_language_cache_add_file (GtkSourceLanguageCache *cache,
+				     GtkSourceLanguage      *file_language)
+{
+	MgwStatBuf buf;
+	mgw_errno_t err;
+
+	if (cache == NULL || cache->failed)
+		return;
+
+	if (mgw_stat (file_language->priv->lang_file_name, &buf, &err) != 0)
+	{
+		cache->failed = TRUE;
+		return;
+	}
+
+	put_string (cache->files, file_language->priv->id);
+	put_string (cache->files, file_language->priv->lang_file_name);
+	put_int64 (cache->files, buf.mtime.value);
+	put_int64 (cache->files, (gint64) buf.size);
+	cache->n_files += 1;
+}
+
+void
+_gtk_source_language_cache_define_context (GtkSourceLanguageCache *cache,
+					   const gchar            *id,
+					   const gchar            *parent_id,
+					   const gchar            *match_regex,
+					   const gchar            *start_regex,
+					   const gchar            *end_regex,
+					   const gchar            *style,
+					   GtkSourceContextFlags   flags)
+{
+	if (cache == NULL)
+		return;
+
+	put_uint (cache->ops, OP_DEFINE_CONTEXT);
+	put_string (cache->ops, id);
+	put_string (cache->ops, parent_id);
+	put_string (cache->ops, match_regex);
+	put_string (cache->ops, start_regex);
+	put_string (cache->ops, end_regex);
+	put_string (cache->ops, style);
+	put_uint (cache->ops, flags);
+	cache->n_ops += 1;
+}
+
+void
+_gtk_source_language_cache_add_sub_pattern (GtkSourceLanguageCache *cache,
+					    const gchar            *id,
+					    const gchar            *parent_id,
+					    const gchar            *name,
+					    const gchar            *where,
+					    const gchar            *style)
+{
+	if (cache == NULL)
+		return;
+
+	put_uint (cache->ops, OP_SUB_PATTERN);
+	put_string (cache->ops, id);
+	put_string (cache->ops, parent_id);
+	put_string (cache->ops, name);
+	put_string (cache->ops, where);
+	put_string (cache->ops, style);
+	cache->n_ops += 1;
+}
+
+void
+_gtk_source_language_cache_add_ref (GtkSourceLanguageCache     *cache,
+				    const gchar                *parent_id,
+				    const gchar                *ref_id,
+				    GtkSourceContextRefOptions  options,
+				    const gchar                *style,
+				    gboolean                    all)
+{
+	if (cache == NULL)
+		return;
+
+	put_uint (cache->ops, OP_REF);
+	put_string (cache->ops, parent_id);
+	put_string (cache->ops, ref_id);
+	put_uint (cache->ops, options);
+	put_string (cache->ops, style);
+	put_uint (cache->ops, all != FALSE);
+	cache->n_ops += 1;
+}
+
+void
+_gtk_source_language_cache_add_replace (GtkSourceLanguageCache *cache,
+					const gchar            *to_replace_id,
+					const gchar            *replace_with_id)
+{
+	if (cache == NULL)
+		return;
+
+	put_uint (cache->ops, OP_REPLACE);
+	put_string (cache->ops, to_replace_id);
+	put_string (cache->ops, replace_with_id);
+	cache->n_ops += 1;
+}
+
+static void
+put_style (const gchar        *id,
+	   GtkSourceStyleInfo *info,
+	   GByteArray         *data)
+{
+	put_string (data, id);
+	put_string (data, info->name);
+	put_string (data, info->map_to);
+}
+
+/**
+ * _gtk_source_language_cache_save:
+ * @cache: cache writer, may be %NULL.
+ * @styles: styles mapping resulting from parsing.
+ *
+ * Writes the cache file; called after the language has been
+ * parsed successfully.
+ */
+void
+_gtk_source_language_cache_save (GtkSourceLanguageCache *cache,
+				 GHashTable             *styles)
+{
+	GByteArray *data;
+	gchar *filename, *dirname;
+	GError *error = NULL;
+	mgw_errno_t err;
+
+	if (cache == NULL || cache->failed)
+		return;
+
+	if (!(filename = get_cache_file (cache->language)))
+		return;
+
+	data = g_byte_array_new ();
+
+	g_byte_array_append (data, (const guint8*) CACHE_MAGIC, CACHE_MAGIC_LEN);
+	put_uint (data, CACHE_FORMAT_VERSION);
+	put_uint (data, glib_major_version);
+	put_uint (data, glib_minor_version);
+	put_string (data, get_locale ());
+
+	put_uint (data, cache->n_files);
+	g_byte_array_append (data, cache->files->data, cache->files->len);
+
+	put_uint (data, cache->n_ops);
+	g_byte_array_append (data, cache->ops->data, cache->ops->len);
+
+	put_uint (data, g_hash_table_size (styles));
+	g_hash_table_foreach (styles, (GHFunc) put_style, data);
+
+	dirname = g_path_get_dirname (filename);
+
+	if (mgw_mkdir_with_parents (dirname, 0755, &err) != 0)
+		g_warning ("could not create directory '%s': %s",
+			   dirname, mgw_strerror (err));
+	else if (!g_file_set_contents (filename, (const gchar*) data->data, data->len, &error))
+		g_warning ("could not save language cache: %s", error->message);
+
+	if (error != NULL)
+		g_error_free (error);
+
+	g_free (dirname);
+	g_free (filename);
+	g_byte_array_free (data, TRUE);
+}
+
+
+/*****************************************************************************/
+/* Reading
+ */
+
+typedef struct {
+	const gchar *ptr;
+	const gchar *end;
+	gboolean error;
+} CacheReader;
+
+static guint32
+get_uint (CacheReader *reader)
+{
+	guint32 value = 0;
+
+	if (reader->error || reader->end - reader->ptr < (gssize) sizeof value)
+		reader->error = TRUE;
+	else
+		memcpy (&value, reader->ptr, sizeof value);
+
+	if (!reader->error)
+		reader->ptr += sizeof value;
+
+	return value;
+}
+
+static gint64
+get_int64 (CacheReader *reader)
+{
+	gint64 value = 0;
+
+	if (reader->error || reader->end - reader->ptr < (gssize) sizeof value)
+		reader->error = TRUE;
+	else
+		memcpy (&value, reader->ptr, sizeof value);
+
+	if (!reader->error)
+		reader->ptr += sizeof value;
+
+	return value;
+}
+
+/* points into the mapped file */
+static const gchar *
+get_string (CacheReader *reader)
+{
+	const gchar *string;
+	guint32 len;
+
+	len = get_uint (reader);
+
+	if (reader->error || len == 0)
+		return NULL;
+
+	if ((gsize) (reader->end - reader->ptr) < len || reader->ptr[len - 1] != 0)
+	{
+		reader->error = TRUE;
+		return NULL;
+	}
+
+	string = reader->ptr;
+	reader->ptr += len;
+	return string;
+}
+
+static gboolean
+check_header (CacheReader *reader)
+{
+	const gchar *locale;
+
+	if (reader->end - reader->ptr < CACHE_MAGIC_LEN ||
+	    memcmp (reader->ptr, CACHE_MAGIC, CACHE_MAGIC_LEN) != 0)
+		return FALSE;
+
+	reader->ptr += CACHE_MAGIC_LEN;
+
+	if (get_uint (reader) != CACHE_FORMAT_VERSION ||
+	    get_uint (reader) != glib_major_version ||
+	    get_uint (reader) != glib_minor_version)
+		return FALSE;
+
+	locale = get_string (reader);
+
+	return !reader->error && locale != NULL && strcmp (locale, get_locale ()) == 0;
+}
+
+static gboolean
+check_files (CacheReader       *reader,
+	     GtkSourceLanguage *language)
+{
+	GtkSourceLanguageManager *lm;
+	guint n_files, i;
+
+	lm = _gtk_source_language_get_language_manager (language);
+	n_files = get_uint (reader);
+
+	for (i = 0; i < n_files && !reader->error; ++i)
+	{
+		const gchar *id, *filename;
+		GtkSourceLanguage *file_language;
+		gint64 mtime, size;
+		MgwStatBuf buf;
+		mgw_errno_t err;
+
+		id = get_string (reader);
+		filename = get_string (reader);
+		mtime = get_int64 (reader);
+		size = get_int64 (reader);
+
+		if (reader->error || id == NULL || filename == NULL)
+			return FALSE;
+
+		/* the language may come from a different file now,
+		 * e.g. if the user installed their own copy */
+		file_language = gtk_source_language_manager_get_language (lm, id);
+
+		if (file_language == NULL ||
+		    strcmp (file_language->priv->lang_file_name, filename) != 0)
+			return FALSE;
+
+		if (mgw_stat (filename, &buf, &err) != 0 ||
+		    buf.mtime.value != mtime ||
+		    (gint64) buf.size != size)
+			return FALSE;
+	}
+
+	return n_files > 0 && !reader->error;
+}
+
+static gboolean
+replay_ops (CacheReader          *reader,
+	    GtkSourceContextData *ctx_data,
+	    GQueue               *replacements,
+	    GError              **error)
+{
+	guint n_ops, i;
+
+	n_ops = get_uint (reader);
+
+	for (i = 0; i < n_ops && !reader->error; ++i)
+	{
+		const gchar *id, *parent_id, *style;
+		const gchar *match, *start, *end;
+		const gchar *name, *where;
+		guint flags, all;
+		gboolean success = TRUE;
+
+		switch (get_uint (reader))
+		{
+			case OP_DEFINE_CONTEXT:
+				id = get_string (reader);
+				parent_id = get_string (reader);
+				match = get_string (reader);
+				start = get_string (reader);
+				end = get_string (reader);
+				style = get_string (reader);
+				flags = get_uint (reader);
+
+				if (!reader->error && id != NULL)
+					success = _gtk_source_context_data_define_context (ctx_data, id, parent_id,
+											   match, start, end, style,
+											   flags, error);
+				else
+					reader->error = TRUE;
+				break;
+
+			case OP_SUB_PATTERN:
+				id = get_string (reader);
+				parent_id = get_string (reader);
+				name = get_string (reader);
+				where = get_string (reader);
+				style = get_string (reader);
+
+				if (!reader->error && id != NULL && parent_id != NULL && name != NULL)
+					success = _gtk_source_context_data_add_sub_pattern (ctx_data, id, parent_id,
+											    name, where, style,
+											    error);
+				else
+					reader->error = TRUE;
+				break;
+
+			case OP_REF:
+				parent_id = get_string (reader);
+				id = get_string (reader);
+				flags = get_uint (reader);
+				style = get_string (reader);
+				all = get_uint (reader);
+
+				if (!reader->error && parent_id != NULL && id != NULL)
+					success = _gtk_source_context_data_add_ref (ctx_data, parent_id, id,
+										    flags, style, all,
+										    error);
+				else
+					reader->error = TRUE;
+				break;
+
+			case OP_REPLACE:
+				id = get_string (reader);
+				name = get_string (reader);
+
+				if (!reader->error && id != NULL && name != NULL)
+					g_queue_push_tail (replacements,
+							   _gtk_source_context_replace_new (id, name));
+				else
+					reader->error = TRUE;
+				break;
+
+			default:
+				reader->error = TRUE;
+				break;
+		}
+
+		if (!success)
+			return FALSE;
+	}
+
+	return !reader->error;
+}
+
+static gboolean
+read_styles (CacheReader *reader,
+	     GHashTable  *styles)
+{
+	guint n_styles, i;
+
+	n_styles = get_uint (reader);
+
+	for (i = 0; i < n_styles && !reader->error; ++i)
+	{
+		const gchar *id, *name, *map_to;
+
+		id = get_string (reader);
+		name = get_string (reader);
+		map_to = get_string (reader);
+
+		if (reader->error || id == NULL)
+			return FALSE;
+
+		g_hash_table_insert (styles, g_strdup (id),
+				     _gtk_source_style_info_new (name, map_to));
+	}
+
+	return !reader->error && reader->ptr == reader->end;
+}
+
+/**
+ * _gtk_source_language_cache_load:
+ * @language: the language.
+ * @ctx_data: empty context data.
+ *
+ * Loads the language from its cache file if it's up to date.
+ *
+ * Returns: whether the language was loaded. If it returns %FALSE,
+ * @ctx_data may be partially filled and must be discarded.
+ */
+gboolean
+_gtk_source_language_cache_load (GtkSourceLanguage    *language,
+				 GtkSourceContextData *ctx_data)
+{
+	GMappedFile *file;
+	gchar *filename;
+	CacheReader reader;
+	GQueue *replacements;
+	GHashTable *styles;
+	GError *error = NULL;
+	gboolean success;
+
+	if (!(filename = get_cache_file (language)))
+		return FALSE;
+
+	if (!(file = g_mapped_file_new (filename, FALSE, NULL)))
+	{
+		g_free (filename);
+		return FALSE;
+	}
+
+	reader.ptr = g_mapped_file_get_contents (file);
+	reader.end = reader.ptr + g_mapped_file_get_length (file);
+	reader.error = FALSE;
+
+	if (!check_header (&reader) || !check_files (&reader, language))
+	{
+		g_mapped_file_unref (file);
+		g_free (filename);
+		return FALSE;
+	}
+
+	replacements = g_queue_new ();
+	styles = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+					(GDestroyNotify) _gtk_source_style_info_free);
+
+	success = replay_ops (&reader, ctx_data, replacements, &error) &&
+		  read_styles (&reader, styles) &&
+		  _gtk_source_context_data_finish_parse (ctx_data, replacements->head, &error);
+
+	if (success)
+	{
+		GHashTableIter iter;
+		gpointer id, info;
+
+		g_hash_table_iter_init (&iter, styles);
+		while (g_hash_table_iter_next (&iter, &id, &info))
+		{
+			g_hash_table_iter_steal (&iter);
+			g_hash_table_insert (language->priv->styles, id, info);
+		}
+	}
+	else
+	{
+		mgw_errno_t err;
+
+		g_warning ("invalid language cache file '%s'%s%s", filename,
+			   error ? ": " : "", error ? error->message : "");
+		mgw_remove (filename, &err);
+	}
+
+	if (error != NULL)
+		g_error_free (error);
+
+	g_queue_foreach (replacements, (GFunc) _gtk_source_context_replace_free, NULL);
+	g_queue_free (replacements);
+	g_hash_table_destroy (styles);
+	g_mapped_file_unref (file);
+	g_free (filename);
+
+	return success;
+}
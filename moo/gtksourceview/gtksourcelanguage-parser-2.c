@@ -102,6 +102,9 @@ struct _ParserState
 	 * so parser_state only adds stuff to it */
 	GQueue *replacements;
 
+	/* Records what is fed to ctx_data, may be NULL; owned by the caller */
+	GtkSourceLanguageCache *cache;
+
 	/* A serial number incremented to get unique generated names */
 	guint id_cookie;
 
@@ -130,6 +133,7 @@ static ParserState *parser_state_new           (GtkSourceLanguage      *language
                                                 GHashTable             *defined_regexes,
                                                 GHashTable             *styles_mapping,
 						GQueue                 *replacements,
+						GtkSourceLanguageCache *cache,
                                                 xmlTextReader          *reader,
 						const char             *filename,
                                                 GHashTable             *loaded_lang_ids);
@@ -142,6 +146,7 @@ static gboolean   file_parse                   (gchar                  *filename
                                                 GHashTable             *styles,
                                                 GHashTable             *loaded_lang_ids,
 						GQueue                 *replacements,
+						GtkSourceLanguageCache *cache,
                                                 GError                **error);
 
 static GRegexCompileFlags
@@ -247,6 +252,66 @@ lang_id_is_already_loaded (ParserState *parser_state, gchar *lang_id)
 	return g_hash_table_lookup (parser_state->loaded_lang_ids, lang_id) != NULL;
 }
 
+/* These feed ctx_data and record what they fed */
+
+static gboolean
+define_context (ParserState          *parser_state,
+		const gchar          *id,
+		const gchar          *parent_id,
+		const gchar          *match_regex,
+		const gchar          *start_regex,
+		const gchar          *end_regex,
+		const gchar          *style,
+		GtkSourceContextFlags flags,
+		GError              **error)
+{
+	if (!_gtk_source_context_data_define_context (parser_state->ctx_data, id, parent_id,
+						      match_regex, start_regex, end_regex,
+						      style, flags, error))
+		return FALSE;
+
+	_gtk_source_language_cache_define_context (parser_state->cache, id, parent_id,
+						   match_regex, start_regex, end_regex,
+						   style, flags);
+	return TRUE;
+}
+
+static gboolean
+add_sub_pattern (ParserState *parser_state,
+		 const gchar *id,
+		 const gchar *parent_id,
+		 const gchar *name,
+		 const gchar *where,
+		 const gchar *style,
+		 GError     **error)
+{
+	if (!_gtk_source_context_data_add_sub_pattern (parser_state->ctx_data, id, parent_id,
+						       name, where, style, error))
+		return FALSE;
+
+	_gtk_source_language_cache_add_sub_pattern (parser_state->cache, id, parent_id,
+						    name, where, style);
+	return TRUE;
+}
+
+static gboolean
+add_context_ref (ParserState               *parser_state,
+		 const gchar               *parent_id,
+		 const gchar               *ref_id,
+		 GtkSourceContextRefOptions options,
+		 const gchar               *style,
+		 gboolean                   all,
+		 GError                   **error)
+{
+	if (!_gtk_source_context_data_add_ref (parser_state->ctx_data, parent_id, ref_id,
+					       options, style, all, error))
+		return FALSE;
+
+	_gtk_source_language_cache_add_ref (parser_state->cache, parent_id, ref_id,
+					    options, style, all);
+	return TRUE;
+}
+
 static GRegexCompileFlags
 get_regex_flags (xmlNode             *node,
 		 GRegexCompileFlags flags)
@@ -468,15 +533,15 @@ create_definition (ParserState *parser_state,
 	}
 
 	if (tmp_error == NULL)
-		_gtk_source_context_data_define_context (parser_state->ctx_data,
-							 id,
-							 parent_id,
-							 match,
-							 start,
-							 end,
-							 style,
-							 flags,
-							 &tmp_error);
+		define_context (parser_state,
+				id,
+				parent_id,
+				match,
+				start,
+				end,
+				style,
+				flags,
+				&tmp_error);
 
 	g_free (match);
 	g_free (start);
@@ -528,6 +593,8 @@ add_ref (ParserState               *parser_state,
 			}
 			else
 			{
+				_gtk_source_language_cache_add_file (parser_state->cache,
+								     imported_language);
 				file_parse (imported_language->priv->lang_file_name,
 					    parser_state->language,
 					    parser_state->ctx_data,
@@ -535,6 +602,7 @@ add_ref (ParserState               *parser_state,
 					    parser_state->styles_mapping,
 					    parser_state->loaded_lang_ids,
 					    parser_state->replacements,
+					    parser_state->cache,
 					    &tmp_error);
 
 				if (tmp_error != NULL)
@@ -584,13 +652,13 @@ add_ref (ParserState               *parser_state,
 		/* If the document is validated container_id is never NULL */
 		g_assert (container_id);
 
-		_gtk_source_context_data_add_ref (parser_state->ctx_data,
-						  container_id,
-						  ref_id,
-						  options,
-						  style,
-						  all,
-						  &tmp_error);
+		add_context_ref (parser_state,
+				 container_id,
+				 ref_id,
+				 options,
+				 style,
+				 all,
+				 &tmp_error);
 
 		DEBUG (g_message ("appended %s in %s", ref_id, container_id));
 	}
@@ -628,13 +696,13 @@ create_sub_pattern (ParserState *parser_state,
 
 	where = xmlTextReaderGetAttribute (parser_state->reader, BAD_CAST "where");
 
-	_gtk_source_context_data_add_sub_pattern (parser_state->ctx_data,
-						  id,
-						  container_id,
-						  sub_pattern,
-						  (gchar*) where,
-						  style,
-						  &tmp_error);
+	add_sub_pattern (parser_state,
+			 id,
+			 container_id,
+			 sub_pattern,
+			 (gchar*) where,
+			 style,
+			 &tmp_error);
 
 	xmlFree (where);
 
@@ -754,15 +822,15 @@ handle_context_element (ParserState *parser_state)
 						parser_state->reader);
 
 				if (is_empty)
-					success = _gtk_source_context_data_define_context (parser_state->ctx_data,
-											   id,
-											   parent_id,
-											   "$^",
-											   NULL,
-											   NULL,
-											   NULL,
-											   0,
-											   &tmp_error);
+					success = define_context (parser_state,
+								  id,
+								  parent_id,
+								  "$^",
+								  NULL,
+								  NULL,
+								  NULL,
+								  0,
+								  &tmp_error);
 				else
 					success = create_definition (parser_state, id, parent_id,
 								     style_ref, &tmp_error);
@@ -806,6 +874,8 @@ handle_replace_element (ParserState *parser_state)
 
 	repl = _gtk_source_context_replace_new ((const gchar *) id, replace_with);
 	g_queue_push_tail (parser_state->replacements, repl);
+	_gtk_source_language_cache_add_replace (parser_state->cache,
+						(const gchar *) id, replace_with);
 
 	g_free (replace_with);
 	xmlFree (ref);
@@ -1283,6 +1353,8 @@ parse_language_with_id (ParserState *parser_state,
 	}
 	else
 	{
+		_gtk_source_language_cache_add_file (parser_state->cache,
+						     imported_language);
 		file_parse (imported_language->priv->lang_file_name,
 			    parser_state->language,
 			    parser_state->ctx_data,
@@ -1290,6 +1362,7 @@ parse_language_with_id (ParserState *parser_state,
 			    parser_state->styles_mapping,
 			    parser_state->loaded_lang_ids,
 			    parser_state->replacements,
+			    parser_state->cache,
 			    &parser_state->error);
 	}
 }
@@ -1524,6 +1597,7 @@ file_parse (gchar                     *filename,
 	    GHashTable                *styles,
 	    GHashTable                *loaded_lang_ids,
 	    GQueue                    *replacements,
+	    GtkSourceLanguageCache    *cache,
 	    GError                   **error)
 {
 	ParserState *parser_state;
@@ -1579,7 +1653,7 @@ file_parse (gchar                     *filename,
 
 	parser_state = parser_state_new (language, ctx_data,
 					 defined_regexes, styles,
-					 replacements, reader,
+					 replacements, cache, reader,
 					 filename, loaded_lang_ids);
 	xmlTextReaderSetStructuredErrorHandler (reader,
 						(xmlStructuredErrorFunc) text_reader_structured_error_func,
@@ -1637,6 +1711,7 @@ parser_state_new (GtkSourceLanguage       *language,
 		  GHashTable              *defined_regexes,
 		  GHashTable              *styles_mapping,
 		  GQueue                  *replacements,
+		  GtkSourceLanguageCache  *cache,
 		  xmlTextReader	          *reader,
 		  const char              *filename,
 		  GHashTable              *loaded_lang_ids)
@@ -1662,6 +1737,7 @@ parser_state_new (GtkSourceLanguage       *language,
 	parser_state->defined_regexes = defined_regexes;
 	parser_state->styles_mapping = styles_mapping;
 	parser_state->replacements = replacements;
+	parser_state->cache = cache;
 
 	parser_state->loaded_lang_ids = loaded_lang_ids;
 
@@ -1713,6 +1789,7 @@ _gtk_source_language_file_parse_version2 (GtkSourceLanguage       *language,
 	gchar *filename;
 	GHashTable *loaded_lang_ids;
 	GQueue *replacements;
+	GtkSourceLanguageCache *cache;
 
 	g_return_val_if_fail (ctx_data != NULL, FALSE);
 
@@ -1738,19 +1815,26 @@ _gtk_source_language_file_parse_version2 (GtkSourceLanguage       *language,
 						 NULL);
 	replacements = g_queue_new ();
 
+	cache = _gtk_source_language_cache_new (language);
+	_gtk_source_language_cache_add_file (cache, language);
+
 	success = file_parse (filename, language, ctx_data,
 			      defined_regexes, styles,
 			      loaded_lang_ids, replacements,
-			      &error);
+			      cache, &error);
 
 	if (success)
 		success = _gtk_source_context_data_finish_parse (ctx_data, replacements->head, &error);
 
+	if (success)
+		_gtk_source_language_cache_save (cache, styles);
+
 	if (success)
 		g_hash_table_foreach_steal (styles,
 					    (GHRFunc) steal_styles_mapping,
 					    language->priv->styles);
 
+	_gtk_source_language_cache_free (cache);
 	g_queue_foreach (replacements, (GFunc) _gtk_source_context_replace_free, NULL);
 	g_queue_free (replacements);
 	g_hash_table_destroy (loaded_lang_ids);
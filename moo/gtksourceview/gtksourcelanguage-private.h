@@ -69,6 +69,10 @@ GtkSourceLanguageManager *_gtk_source_language_get_language_manager 	(GtkSourceL
 
 const gchar		 *_gtk_source_language_manager_get_rng_file	(GtkSourceLanguageManager *lm);
 
+void			  _gtk_source_language_manager_set_cache_dir	(GtkSourceLanguageManager *lm,
+									 const gchar              *dir);
+const gchar		 *_gtk_source_language_manager_get_cache_dir	(GtkSourceLanguageManager *lm);
+
 gchar       		 *_gtk_source_language_translate_string 	(GtkSourceLanguage        *language,
 									 const gchar              *string);
 
@@ -80,6 +84,41 @@ gboolean 		  _gtk_source_language_file_parse_version1 	(GtkSourceLanguage
 gboolean 		  _gtk_source_language_file_parse_version2	(GtkSourceLanguage        *language,
 									 GtkSourceContextData     *ctx_data);
 
+/* Binary cache of parsed version 2 lang files, see gtksourcelanguage-cache.c */
+typedef struct _GtkSourceLanguageCache GtkSourceLanguageCache;
+
+GtkSourceLanguageCache	 *_gtk_source_language_cache_new		(GtkSourceLanguage	  *language);
+void			  _gtk_source_language_cache_free		(GtkSourceLanguageCache   *cache);
+void			  _gtk_source_language_cache_add_file		(GtkSourceLanguageCache   *cache,
+									 GtkSourceLanguage	  *file_language);
+void			  _gtk_source_language_cache_define_context	(GtkSourceLanguageCache   *cache,
+									 const gchar		  *id,
+									 const gchar		  *parent_id,
+									 const gchar		  *match_regex,
+									 const gchar		  *start_regex,
+									 const gchar		  *end_regex,
+									 const gchar		  *style,
+									 GtkSourceContextFlags	   flags);
+void			  _gtk_source_language_cache_add_sub_pattern	(GtkSourceLanguageCache   *cache,
+									 const gchar		  *id,
+									 const gchar		  *parent_id,
+									 const gchar		  *name,
+									 const gchar		  *where,
+									 const gchar		  *style);
+void			  _gtk_source_language_cache_add_ref		(GtkSourceLanguageCache   *cache,
+									 const gchar		  *parent_id,
+									 const gchar		  *ref_id,
+									 GtkSourceContextRefOptions options,
+									 const gchar		  *style,
+									 gboolean		   all);
+void			  _gtk_source_language_cache_add_replace	(GtkSourceLanguageCache   *cache,
+									 const gchar		  *to_replace_id,
+									 const gchar		  *replace_with_id);
+void			  _gtk_source_language_cache_save		(GtkSourceLanguageCache   *cache,
+									 GHashTable		  *styles);
+gboolean		  _gtk_source_language_cache_load		(GtkSourceLanguage	  *language,
+									 GtkSourceContextData	  *ctx_data);
+
 GtkSourceEngine 	 *_gtk_source_language_create_engine		(GtkSourceLanguage	  *language);
 
 /* Utility functions for GtkSourceStyleInfo */
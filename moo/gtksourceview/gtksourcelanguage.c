@@ -699,7 +699,15 @@ gtk_source_language_parse_file (GtkSourceLanguage *language)
 					break;
 
 				case GTK_SOURCE_LANGUAGE_VERSION_2_0:
-					success = _gtk_source_language_file_parse_version2 (language, ctx_data);
+					success = _gtk_source_language_cache_load (language, ctx_data);
+
+					if (!success)
+					{
+						/* the cache may have left something behind */
+						_gtk_source_context_data_unref (ctx_data);
+						ctx_data = _gtk_source_context_data_new (language);
+						success = _gtk_source_language_file_parse_version2 (language, ctx_data);
+					}
 					break;
 			}
 
@@ -44,6 +44,7 @@ struct _GtkSourceLanguageManagerPrivate
 
 	gchar	       **lang_dirs;
 	gchar		*rng_file;
+	gchar		*cache_dir;
 
 	gchar          **ids; /* Cache the IDs of the available languages */
 };
@@ -113,6 +114,7 @@ gtk_source_language_manager_finalize (GObject *object)
 
 	g_strfreev (lm->priv->lang_dirs);
 	g_free (lm->priv->rng_file);
+	g_free (lm->priv->cache_dir);
 
 	G_OBJECT_CLASS (gtk_source_language_manager_parent_class)->finalize (object);
 }
@@ -158,6 +160,7 @@ gtk_source_language_manager_init (GtkSourceLanguageManager *lm)
 	lm->priv->ids = NULL;
 	lm->priv->lang_dirs = NULL;
 	lm->priv->rng_file = NULL;
+	lm->priv->cache_dir = NULL;
 }
 
 /**
@@ -304,6 +307,32 @@ _gtk_source_language_manager_get_rng_file (GtkSourceLanguageManager *lm)
 	return lm->priv->rng_file;
 }
 
+/**
+ * _gtk_source_language_manager_set_cache_dir:
+ * @lm: a #GtkSourceLanguageManager.
+ * @dir: directory for parsed language files, or %NULL.
+ *
+ * Sets the directory where parsed language definitions are cached,
+ * see gtksourcelanguage-cache.c. Nothing is cached if it's %NULL,
+ * which is the default.
+ */
+void
+_gtk_source_language_manager_set_cache_dir (GtkSourceLanguageManager *lm,
+					    const gchar              *dir)
+{
+	g_return_if_fail (GTK_IS_SOURCE_LANGUAGE_MANAGER (lm));
+
+	g_free (lm->priv->cache_dir);
+	lm->priv->cache_dir = g_strdup (dir);
+}
+
+const gchar *
+_gtk_source_language_manager_get_cache_dir (GtkSourceLanguageManager *lm)
+{
+	g_return_val_if_fail (GTK_IS_SOURCE_LANGUAGE_MANAGER (lm), NULL);
+	return lm->priv->cache_dir;
+}
+
 static void
 ensure_languages (GtkSourceLanguageManager *lm)
 {
@@ -6,6 +6,7 @@ SET(gtksourceview_sources
     gtksourceview/gtksourceengine.h
     gtksourceview/gtksourceiter.c
     gtksourceview/gtksourceiter.h
+    gtksourceview/gtksourcelanguage-cache.c
     gtksourceview/gtksourcelanguage-parser-1.c
     gtksourceview/gtksourcelanguage-parser-2.c
     gtksourceview/gtksourcelanguage-private.h
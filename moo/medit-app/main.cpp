@@ -16,6 +16,10 @@
 #include <config.h>
 #include "mooapp/mooapp.h"
 #include "mooedit/mooplugin.h"
+#include "mooedit/moolangmgr.h"
+#include "mooedit/mootextbuffer.h"
+#include "mooedit/mootext-private.h"
+#include "mooedit/mootextprint.h"
 #include "mooutils/mooi18n.h"
 #include "mooutils/mooutils-fs.h"
 #include "mooutils/mooutils-misc.h"
@@ -63,6 +67,8 @@ static struct MeditOpts {
     char **ut_tests;
     char **run_script;
     char **send_script;
+    const char *export_format;
+    const char *export_dir;
     gboolean portable;
 } medit_opts = { -1, -1 };
 
@@ -144,6 +150,12 @@ static GOptionEntry medit_options[] = {
     { "geometry", 0, 0, G_OPTION_ARG_STRING, (gpointer) &medit_opts.geometry,
             /* help message for command line option --geometry=WIDTHxHEIGHT[+X+Y] */ N_("Default window size and position"),
             /* "WIDTHxHEIGHT[+X+Y]" part in --geometry=WIDTHxHEIGHT[+X+Y] */ N_("WIDTHxHEIGHT[+X+Y]") },
+    { "export", 0, 0, G_OPTION_ARG_STRING, (gpointer) &medit_opts.export_format,
+            /* help message for command line option --export=FORMAT */ N_("Export highlighted file(s) to FORMAT and exit"),
+            "html|pdf" },
+    { "export-dir", 0, 0, G_OPTION_ARG_FILENAME, (gpointer) &medit_opts.export_dir,
+            /* help message for command line option --export-dir=DIR */ N_("Put exported files in DIR"),
+            /* "DIR" part in --export-dir=DIR */ N_("DIR") },
     { "version", 0, 0, G_OPTION_ARG_NONE, &medit_opts.show_version,
             /* help message for command line option --version */ N_("Show version information and exit"), NULL },
     { "ut", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &medit_opts.ut,
@@ -240,6 +252,16 @@ post_parse_func (void)
         medit_opts.files = NULL;
     }
 
+    if (medit_opts.export_format &&
+        strcmp (medit_opts.export_format, "html") != 0 &&
+        strcmp (medit_opts.export_format, "pdf") != 0)
+    {
+        /* error message for wrong commmand line */
+        g_printerr (_("Invalid value '%s' for option %s"), medit_opts.export_format, "--export");
+        g_printerr ("\n");
+        exit (EXIT_FAILURE);
+    }
+
     if (medit_opts.pid > 0 && medit_opts.instance_name)
     {
         /* error message for wrong commmand line */
@@ -629,6 +651,93 @@ check_portable_mode (void)
 }
 #endif // __WIN32__
 
+static gboolean
+export_file (const char *filename,
+             GError    **error)
+{
+    gsize len;
+    char *contents = NULL;
+    gboolean retval = FALSE;
+
+    if (!g_file_get_contents (filename, &contents, &len, error))
+        return FALSE;
+
+    if (medit_opts.encoding)
+    {
+        char *converted = g_convert (contents, len, "UTF-8", medit_opts.encoding,
+                                     NULL, &len, error);
+        g_free (contents);
+        if (!(contents = converted))
+            return FALSE;
+    }
+
+    if (!g_utf8_validate (contents, len, NULL))
+    {
+        g_set_error (error, G_CONVERT_ERROR, G_CONVERT_ERROR_ILLEGAL_SEQUENCE,
+                     "file is not valid UTF-8, use --encoding to specify its encoding");
+        g_free (contents);
+        return FALSE;
+    }
+
+    MooLangMgr *mgr = moo_lang_mgr_default ();
+    GtkTextBuffer *buffer = moo_text_buffer_new (NULL);
+
+    moo_text_buffer_begin_non_undoable_action (MOO_TEXT_BUFFER (buffer));
+    gtk_text_buffer_set_text (buffer, contents, len);
+    moo_text_buffer_end_non_undoable_action (MOO_TEXT_BUFFER (buffer));
+    g_free (contents);
+
+    _moo_text_buffer_set_style_scheme (MOO_TEXT_BUFFER (buffer),
+                                       moo_lang_mgr_get_active_scheme (mgr));
+    moo_text_buffer_set_lang (MOO_TEXT_BUFFER (buffer),
+                              moo_lang_mgr_get_lang_for_file (mgr, *g::File::new_for_path (filename)));
+
+    gstr basename = gstr::wrap_new (g_path_get_basename (filename));
+    gstr out_name = gstr::printf ("%s.%s", basename, medit_opts.export_format);
+    gstr out_dir = gstr::wrap_new (medit_opts.export_dir ? g_strdup (medit_opts.export_dir) :
+                                                           g_path_get_dirname (filename));
+    gstr out_file = g::build_filename (out_dir, out_name);
+
+    if (strcmp (medit_opts.export_format, "pdf") == 0)
+        retval = _moo_text_buffer_export_pdf (buffer, filename, out_file, error);
+    else
+        retval = _moo_text_buffer_export_html (buffer, filename, out_file, error);
+
+    g_object_unref (buffer);
+    return retval;
+}
+
+/* Exports files one at a time and exits; this doesn't need a display
+   or a running instance, so it can be used in scripts */
+static int
+export_files (void)
+{
+    int status = 0;
+    char **p;
+
+    gtk_init_check (NULL, NULL);
+
+    if (!medit_opts.files || !*medit_opts.files)
+    {
+        g_printerr ("--export: no files given\n");
+        return EXIT_FAILURE;
+    }
+
+    for (p = medit_opts.files; *p; ++p)
+    {
+        GError *error = NULL;
+
+        if (!export_file (*p, &error))
+        {
+            g_printerr ("%s: %s\n", *p, moo_error_message (error));
+            g_error_free (error);
+            status = EXIT_FAILURE;
+        }
+    }
+
+    return status;
+}
+
 namespace moo
 {
 namespace _test
@@ -680,6 +789,9 @@ medit_main (int argc, char *argv[])
     check_portable_mode ();
 #endif
 
+    if (medit_opts.export_format)
+        exit (export_files ());
+
     if (medit_opts.new_app)
         new_instance = TRUE;
 
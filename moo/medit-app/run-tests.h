@@ -2,6 +2,7 @@
 #include <moolua/moolua-tests.h>
 #include <moopython/moopython-tests.h>
 #include <mooutils/mooutils-tests.h>
+#include <plugins/moofind-search.h>
 #include <gtk/gtk.h>
 #include <stdio.h>
 #include "mem-debug.h"
@@ -13,8 +14,10 @@ add_tests (MooTestOptions opts)
     moo_test_mooaccel ();
     moo_test_mooutils_fs ();
     moo_test_moo_file_writer ();
+    moo_test_moo_cmd ();
     moo_test_mooutils_misc ();
     moo_test_i18n (opts);
+    moo_test_undo ();
 
 #ifdef __WIN32__
     moo_test_mooutils_win32 ();
@@ -27,6 +30,9 @@ add_tests (MooTestOptions opts)
 #endif
 
     moo_test_editor ();
+    moo_test_encoding_sniffer ();
+    moo_test_lang_mgr ();
+    moo_test_find_search ();
 }
 
 static int
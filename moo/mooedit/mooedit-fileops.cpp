@@ -24,6 +24,8 @@
 #include "mooedit/mooeditdialogs.h"
 #include "mooedit/mootextbuffer.h"
 #include "mooedit/mooeditprefs.h"
+#include "mooedit/mooencodingsniffer.h"
+#include "mooedit/mootext-private.h"
 #include "mooutils/moofileicon.h"
 #include "mooutils/moofilewatch.h"
 #include "mooutils/mooencodings.h"
@@ -32,7 +34,11 @@
 #include "mooutils/mooutils.h"
 #include "mooutils/mooutils-fs.h"
 #include "mooutils/moocompat.h"
+#include "mooutils/moofilewriter.h"
+#include "mooutils/mooundo.h"
+#include "mooutils/mooutils-thread.h"
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #ifdef HAVE_UNISTD_H
@@ -41,8 +47,11 @@
 #include <stdio.h>
 
 #include <mooglib/moo-glib.h>
+#include <mooglib/moo-stat.h>
 
 #include <list>
+#include <memory>
+#include <vector>
 #include <moocpp/moocpp.h>
 using namespace moo;
 
@@ -61,10 +70,11 @@ static void     file_deleted                (Edit           edit);
 static void     add_status                  (Edit           edit,
                                              MooEditStatus  s);
 
-static void     moo_edit_load_text          (Edit               edit,
+static bool     moo_edit_load_local         (Edit               edit,
                                              g::File            file,
-                                             const char*        encoding,
-                                             const char*        text);
+                                             const gstr&        encoding,
+                                             const gstr&        cached_encoding,
+                                             gerrp&             error);
 static bool     moo_edit_reload_local       (Edit               edit,
                                              const char*        encoding,
                                              gerrp&             error);
@@ -80,11 +90,14 @@ static bool     moo_edit_save_copy_local    (Edit               edit,
                                              gerrp&             error);
 static void     _moo_edit_start_file_watch  (Edit               edit);
 
-static char    *moo_convert_file_data_to_utf8   (const char     *data,
+static gboolean data_has_bom                    (const char     *data,
                                                  gsize           len,
-                                                 const char     *encoding,
-                                                 const char     *cached_encoding,
-                                                 gstr& /*out*/   used_enc);
+                                                 const char    **bom_enc);
+static gboolean encoding_needs_bom_load         (const char     *enc,
+                                                 gboolean       *bom_optional,
+                                                 const char    **enc_no_bom,
+                                                 const char    **bom,
+                                                 gsize          *bom_len);
 static bool     encoding_needs_bom_save         (const char     *enc,
                                                  const char    **enc_no_bom,
                                                  const char    **bom,
@@ -130,73 +143,6 @@ bool _moo_edit_file_is_new(g::File file)
 }
 
 
-static gboolean
-load_file_contents (g::File file,
-                    gstr&   data,
-                    gsize&  data_len,
-                    gerrp&  error)
-{
-    if (!check_regular (file, error))
-        return FALSE;
-
-    auto path = file.get_path();
-
-    if (path.empty())
-    {
-        g_set_error (&error, MOO_EDIT_FILE_ERROR,
-                     MOO_EDIT_FILE_ERROR_NOT_IMPLEMENTED,
-                     "Loading remote files is not implemented");
-        return FALSE;
-    }
-
-    return g::file_get_contents (path, data, data_len, error);
-}
-
-static gstrp
-convert_file_data_to_utf8_with_prompt (const char*    data,
-                                       gsize          data_len,
-                                       g::File        file,
-                                       gstr           encoding,
-                                       gstr           cached_encoding,
-                                       /*out*/ gstr&  used_encoding)
-{
-    gstrp text_utf8;
-
-    used_encoding.reset();
-
-    while (TRUE)
-    {
-        MooEditTryEncodingResponse response;
-
-        text_utf8 = moo_convert_file_data_to_utf8 (data, data_len, encoding, cached_encoding, /*out*/ used_encoding);
-
-        if (text_utf8)
-            break;
-
-        used_encoding.reset();
-        response = _moo_edit_try_encoding_dialog (file, encoding, /*out*/ used_encoding);
-
-        switch (response)
-        {
-            case MOO_EDIT_TRY_ENCODING_RESPONSE_CANCEL:
-                used_encoding.reset();
-                break;
-
-            case MOO_EDIT_TRY_ENCODING_RESPONSE_TRY_ANOTHER:
-                g_assert(!used_encoding.empty());
-                break;
-        }
-
-        if (used_encoding.empty())
-            break;
-
-        encoding = normalize_encoding (used_encoding, false);
-        cached_encoding = NULL;
-    }
-
-    return text_utf8;
-}
-
 bool
 _moo_edit_load_file (Edit        edit,
                      g::File     file,
@@ -204,10 +150,6 @@ _moo_edit_load_file (Edit        edit,
                      const gstr& init_cached_encoding,
                      gerrp&      error)
 {
-    bool result = false;
-    gstrp data_utf8;
-    gstr used_encoding;
-
     moo_return_error_if_fail(!edit._is_busy());
 
     gstr encoding = normalize_encoding(init_encoding, false);
@@ -215,24 +157,8 @@ _moo_edit_load_file (Edit        edit,
     if (!init_cached_encoding.empty())
         cached_encoding = normalize_encoding(init_cached_encoding, false);
 
-    gstr data;
-    gsize data_len = 0;
-
-    if (!load_file_contents(file, /*out*/ data, /*out*/ data_len, error))
-        goto done;
-
-    data_utf8 = convert_file_data_to_utf8_with_prompt(data, data_len, file, encoding, cached_encoding, /*out*/ used_encoding);
-
-    if (data_utf8 == nullptr)
-    {
-        g_set_error (&error, MOO_EDIT_FILE_ERROR, MOO_EDIT_FILE_ERROR_CANCELLED, "Cancelled");
-        goto done;
-    }
+    bool result = moo_edit_load_local(edit, file, encoding, cached_encoding, error);
 
-    moo_edit_load_text(edit, file, used_encoding, data_utf8);
-    result = TRUE;
-
-done:
     if (!result)
         edit._stop_file_watch();
 
@@ -326,8 +252,182 @@ moo_edit_set_line_end_type (MooEdit        *edit,
 /* File loading
  */
 
-static void do_load_text(Edit        edit,
-                         const char* text);
+#define LOAD_CHUNK_SIZE     (1 << 20)
+#define LOAD_MAX_CARRY      16
+
+// Converts file contents to UTF-8 incrementally, normalizing line endings
+// to '\n' on the way. Input may be split at arbitrary byte boundaries:
+// feed() leaves an incomplete trailing character unconsumed, and a trailing
+// '\r' is held back until it's known whether it's followed by '\n'.
+class TextDecoder
+{
+public:
+    explicit TextDecoder (const char *encoding);
+    ~TextDecoder ();
+
+    MOO_DISABLE_COPY_OPS (TextDecoder);
+
+    bool            feed                (const char     *data,
+                                         gsize           len,
+                                         bool            eof,
+                                         gsize&          consumed,
+                                         GString        *out);
+    MooLineEndType  get_line_end_type   () const;
+
+private:
+    bool            decode_utf8         (const char     *data,
+                                         gsize           len,
+                                         bool            eof,
+                                         gsize&          consumed,
+                                         GString        *out);
+    bool            decode_iconv        (const char     *data,
+                                         gsize           len,
+                                         bool            eof,
+                                         gsize&          consumed,
+                                         GString        *out);
+    bool            add_text            (const char     *text,
+                                         gsize           len,
+                                         GString        *out);
+    void            add_line_end        (MooLineEndType  le);
+
+    gstr            m_encoding;
+    const char     *m_bom;
+    gsize           m_bom_len;
+    bool            m_bom_optional;
+    bool            m_bom_checked;
+    bool            m_utf8;
+    GIConv          m_cd;
+    bool            m_seen_nul;
+    bool            m_pending_cr;
+    MooLineEndType  m_le;
+    bool            m_mixed_le;
+};
+
+#define LOAD_MAX_PENDING    4
+
+enum LoadResult {
+    LOAD_IN_PROGRESS,
+    LOAD_OK,
+    LOAD_ENCODING_FAILED,
+    LOAD_ERROR
+};
+
+enum LoadEventType {
+    LOAD_EVENT_TEXT,
+    LOAD_EVENT_RESTART,
+    LOAD_EVENT_DONE,
+    LOAD_EVENT_ENCODING_FAILED,
+    LOAD_EVENT_ERROR
+};
+
+// Message sent from the loader thread to the main thread
+struct LoadEvent
+{
+    LoadEvent (LoadEventType type);
+    ~LoadEvent ();
+
+    MOO_DISABLE_COPY_OPS (LoadEvent);
+
+    static void free (LoadEvent *event) { delete event; }
+
+    LoadEventType   type;
+    GString        *text;
+    double          fraction;
+    gstr            encoding;
+    MooLineEndType  le;
+    GError         *error;
+};
+
+// Runs in a MooAsyncJob thread: reads the file, sniffs BOM, ranks and
+// tries candidate encodings and sends decoded text to the main thread
+// chunk by chunk. It stays at most LOAD_MAX_PENDING chunks ahead of the main
+// thread, so memory use is still bounded by the chunk size.
+class LoadWorker
+{
+public:
+    LoadWorker (const char      *path,
+                std::list<gstr>  encodings,
+                const gstr&      preferred,
+                bool             detect,
+                guint            event_id);
+    ~LoadWorker ();
+
+    MOO_DISABLE_COPY_OPS (LoadWorker);
+
+    LoadWorker     *ref                 ();
+    static void     unref               (LoadWorker     *worker);
+    static gboolean run                 (LoadWorker     *worker);
+
+    void            chunk_processed     ();
+
+private:
+    bool            step                ();
+    bool            open                (gerrp&          error);
+    bool            rewind              (gerrp&          error);
+    bool            read_chunk          (gerrp&          error);
+    void            push                (LoadEvent      *event);
+
+    gstr            m_path;
+    std::list<gstr> m_encodings;
+    gstr            m_preferred;
+    bool            m_detect;
+    guint           m_event_id;
+    std::unique_ptr<TextDecoder> m_decoder;
+    gstr            m_encoding;
+    MooFileReader  *m_reader;
+    char           *m_buf;
+    gsize           m_buf_len;
+    bool            m_at_start;
+    bool            m_eof;
+    guint64         m_file_size;
+    guint64         m_bytes_read;
+    int             m_pending;
+    int             m_ref_count;
+};
+
+// Main thread part of loading: starts a LoadWorker and inserts the text
+// it produces into the document buffer, keeping the main loop running
+// meanwhile, so the window stays responsive and the progress bar can
+// cancel the operation.
+class FileLoader
+{
+public:
+    FileLoader (Edit edit, const char *path);
+    ~FileLoader ();
+
+    MOO_DISABLE_COPY_OPS (FileLoader);
+
+    void            begin               ();
+    LoadResult      load                (std::list<gstr> encodings,
+                                         const gstr&     preferred,
+                                         bool            detect,
+                                         gstr&           used_encoding,
+                                         gerrp&          error);
+    void            end                 (bool            success);
+
+    MooLineEndType  get_line_end_type   () const { return m_le; }
+
+private:
+    static void     cancel              (FileLoader     *loader);
+    static void     process_events      (GList          *events,
+                                         FileLoader     *loader);
+    void            process_event       (LoadEvent      *event);
+    void            finish              (LoadResult      result);
+
+    Edit            m_edit;
+    GtkTextBuffer  *m_buffer;
+    gstr            m_path;
+    guint           m_event_id;
+    GMainLoop      *m_loop;
+    LoadWorker     *m_worker;
+    LoadResult      m_result;
+    GError         *m_error;
+    gstr            m_used_encoding;
+    bool            m_undo;
+    bool            m_was_modified;
+    gboolean        m_highlight;
+    MooLineEndType  m_le;
+};
 
 static std::list<gstr>
 get_encodings (void)
@@ -394,303 +494,1313 @@ static bool check_regular (g::File file, gerrp& error)
     return true;
 }
 
-static void
-moo_edit_load_text (Edit        edit,
-                    g::File     file,
-                    const char* encoding,
-                    const char* text)
+LoadEvent::LoadEvent (LoadEventType type)
+    : type (type)
+    , text (nullptr)
+    , fraction (-1)
+    , le (MOO_LE_NONE)
+    , error (nullptr)
 {
-    MooEditPrivate& priv = edit.get_priv();
+}
+
+LoadEvent::~LoadEvent ()
+{
+    if (text)
+        g_string_free (text, TRUE);
+    if (error)
+        g_error_free (error);
+}
 
-    bool undo = !moo_edit_is_empty(&edit);
 
-    GtkTextBuffer *buffer = moo_edit_get_buffer(&edit);
+LoadWorker::LoadWorker (const char      *path,
+                        std::list<gstr>  encodings,
+                        const gstr&      preferred,
+                        bool             detect,
+                        guint            event_id)
+    : m_path (gstr::wrap (path))
+    , m_encodings (std::move (encodings))
+    , m_preferred (gstr::wrap (preferred.get ()))
+    , m_detect (detect)
+    , m_event_id (event_id)
+    , m_reader (nullptr)
+    , m_buf (nullptr)
+    , m_buf_len (0)
+    , m_at_start (false)
+    , m_eof (false)
+    , m_file_size (0)
+    , m_bytes_read (0)
+    , m_pending (0)
+    , m_ref_count (1)
+{
+}
 
-    block_buffer_signals(edit);
+LoadWorker::~LoadWorker ()
+{
+    if (m_reader)
+        moo_file_reader_close (m_reader);
+    g_free (m_buf);
+}
 
-    if (undo)
-        gtk_text_buffer_begin_user_action(buffer);
-    else
-        moo_text_buffer_begin_non_undoable_action(MOO_TEXT_BUFFER(buffer));
+LoadWorker *
+LoadWorker::ref ()
+{
+    g_atomic_int_inc (&m_ref_count);
+    return this;
+}
 
-    moo_text_buffer_begin_non_interactive_action(MOO_TEXT_BUFFER(buffer));
+void
+LoadWorker::unref (LoadWorker *worker)
+{
+    if (worker && g_atomic_int_dec_and_test (&worker->m_ref_count))
+        delete worker;
+}
 
-    MooLineEndType saved_le = priv.line_end_type;
+void
+LoadWorker::chunk_processed ()
+{
+    g_atomic_int_add (&m_pending, -1);
+}
 
-    gboolean enable_highlight;
-    buffer = moo_edit_get_buffer(&edit);
-    gtk_text_buffer_set_text(buffer, "", 0);
-    g_object_get(buffer, "highlight-syntax", &enable_highlight, (char*) 0);
-    g_object_set(buffer, "highlight-syntax", FALSE, (char*) 0);
-    do_load_text(edit, text);
-    g_object_set(buffer, "highlight-syntax", enable_highlight, (char*) 0);
+void
+LoadWorker::push (LoadEvent *event)
+{
+    _moo_event_queue_push (m_event_id, event, (GDestroyNotify) LoadEvent::free);
+}
 
-    unblock_buffer_signals(edit);
+bool
+LoadWorker::open (gerrp& error)
+{
+    MgwStatBuf buf;
+    mgw_errno_t err;
 
-    if (undo)
-        gtk_text_buffer_end_user_action(buffer);
-    else
-        moo_text_buffer_end_non_undoable_action(MOO_TEXT_BUFFER(buffer));
+    if (mgw_stat (m_path, &buf, &err) == 0)
+        m_file_size = buf.size;
 
-    moo_text_buffer_end_non_interactive_action(MOO_TEXT_BUFFER(buffer));
+    if (!(m_reader = moo_file_reader_new (m_path, error)))
+        return false;
 
-    GtkTextIter start;
-    gtk_text_buffer_get_start_iter(buffer, &start);
-    gtk_text_buffer_place_cursor(buffer, &start);
-    priv.status = (MooEditStatus) 0;
-    moo_edit_set_modified(&edit, false);
-    edit._set_file(&file, encoding);
-    if (priv.line_end_type != saved_le)
-        edit.notify("line-end-type");
-    _moo_edit_start_file_watch(edit);
+    m_buf = g_new (char, LOAD_CHUNK_SIZE + LOAD_MAX_CARRY);
+    m_at_start = true;
+
+    return read_chunk (error);
 }
 
+bool
+LoadWorker::read_chunk (gerrp& error)
+{
+    gsize size_read = 0;
+
+    g_return_val_if_fail (m_buf_len <= LOAD_MAX_CARRY, false);
+
+    if (!moo_file_reader_read (m_reader, m_buf + m_buf_len, LOAD_CHUNK_SIZE, &size_read, error))
+        return false;
+
+    m_buf_len += size_read;
+    m_bytes_read += size_read;
+    m_eof = size_read < LOAD_CHUNK_SIZE;
 
-static void do_load_text(Edit  edit, const char* text)
+    return true;
+}
+
+bool
+LoadWorker::rewind (gerrp& error)
 {
-    MooLineEndType le = MOO_LE_NONE;
+    if (m_at_start)
+        return true;
 
-    GString *strbuf = g_string_new(NULL);
-    GtkTextBuffer *buffer = moo_edit_get_buffer(&edit);
+    moo_file_reader_close (m_reader);
+    m_reader = nullptr;
+    m_buf_len = 0;
+    m_bytes_read = 0;
+
+    if (!(m_reader = moo_file_reader_new (m_path, error)))
+        return false;
 
-    MooLineReader lr;
-    moo_line_reader_init(&lr, text, -1);
+    m_at_start = true;
+    return read_chunk (error);
+}
+
+// Returns false when there's nothing left to do
+bool
+LoadWorker::step ()
+{
+    gerrp error;
 
-    bool mixed_le = false;
-    const char *line;
-    gsize line_len;
-    gsize line_term_len;
-    while ((line = moo_line_reader_get_line(&lr, &line_len, &line_term_len)) != NULL)
+    if (!m_reader)
     {
-        gboolean insert_line_term = FALSE;
-        MooLineEndType le_here = MOO_LE_NONE;
-        gsize copy_len = line_len;
+        const char *bom_enc = NULL;
 
-        if (line_term_len != 0)
+        if (!open (error))
+            goto error;
+
+        if (m_detect && data_has_bom (m_buf, m_buf_len, &bom_enc))
+        {
+            m_encodings.clear ();
+            m_encodings.emplace_back (gstr::wrap (bom_enc));
+        }
+        else if (m_detect && m_encodings.size () > 1)
         {
-            const char *line_term = line + line_len;
+            // the first chunk is the sample, so the file is read once
+            MooEncodingSniffer sniffer;
+            sniffer.feed (m_buf, MIN (m_buf_len, MOO_ENCODING_SNIFF_SAMPLE_SIZE), m_eof);
+            m_encodings = sniffer.rank (std::move (m_encodings), m_preferred);
+        }
+    }
 
-            insert_line_term = TRUE;
+    if (!m_decoder)
+    {
+        if (m_encodings.empty ())
+        {
+            push (new LoadEvent (LOAD_EVENT_ENCODING_FAILED));
+            return false;
+        }
 
-            if (line_term_len == 1 && !strncmp(line_term, "\r", line_term_len))
-            {
-                le_here = MOO_LE_MAC;
-            }
-            else if (line_term_len == 1 && !strncmp(line_term, "\n", line_term_len))
-            {
-                le_here = MOO_LE_UNIX;
-            }
-            else if (line_term_len == 2 && !strncmp(line_term, "\r\n", line_term_len))
-            {
-                le_here = MOO_LE_WIN32;
-            }
-            else if (line_term_len == 3 && !strncmp("\xe2\x80\xa9", line_term, line_term_len))
-            {
-                insert_line_term = FALSE;
-                copy_len += line_term_len;
-            }
-            else
-            {
-                g_critical("oops");
-                copy_len += line_term_len;
-            }
+        if (!rewind (error))
+            goto error;
 
-            if (le_here)
-            {
-                if (mixed_le || (le && le != le_here))
-                    mixed_le = TRUE;
-                else
-                    le = le_here;
-            }
+        m_encoding = std::move (m_encodings.front ());
+        m_encodings.pop_front ();
+        m_decoder.reset (new TextDecoder (m_encoding));
+    }
+
+    if (g_atomic_int_get (&m_pending) >= LOAD_MAX_PENDING)
+        return true;
+
+    {
+        gsize consumed = 0;
+        LoadEvent *event = new LoadEvent (LOAD_EVENT_TEXT);
+        event->text = g_string_sized_new (LOAD_CHUNK_SIZE);
+
+        if (!m_decoder->feed (m_buf, m_buf_len, m_eof, consumed, event->text))
+        {
+            // text from this encoding which was already sent must go
+            delete event;
+            m_decoder.reset ();
+            push (new LoadEvent (LOAD_EVENT_RESTART));
+            return true;
         }
 
-        g_string_append_len(strbuf, line, copy_len);
+        if (m_file_size != 0)
+            event->fraction = (double) m_bytes_read / m_file_size;
 
-        if (insert_line_term)
-            g_string_append_c(strbuf, '\n');
+        g_atomic_int_inc (&m_pending);
+        push (event);
+
+        if (m_eof)
+        {
+            event = new LoadEvent (LOAD_EVENT_DONE);
+            event->encoding = gstr::wrap (m_encoding.get ());
+            event->le = m_decoder->get_line_end_type ();
+            push (event);
+            return false;
+        }
+
+        // keep the incomplete character for the next round
+        m_buf_len -= consumed;
+        memmove (m_buf, m_buf + consumed, m_buf_len);
+        m_at_start = false;
+
+        if (m_buf_len > LOAD_MAX_CARRY)
+        {
+            m_decoder.reset ();
+            push (new LoadEvent (LOAD_EVENT_RESTART));
+            return true;
+        }
+
+        if (!read_chunk (error))
+            goto error;
     }
 
-    gtk_text_buffer_insert_at_cursor(buffer, strbuf->str, (int) strbuf->len);
+    return true;
+
+error:
+    LoadEvent *event = new LoadEvent (LOAD_EVENT_ERROR);
+    event->error = g_error_copy (error.get ());
+    push (event);
+    return false;
+}
+
+gboolean
+LoadWorker::run (LoadWorker *worker)
+{
+    return worker->step ();
+}
+
 
-    if (mixed_le)
-        le = MOO_LE_NATIVE;
+FileLoader::FileLoader (Edit edit, const char *path)
+    : m_edit (edit)
+    , m_buffer (moo_edit_get_buffer (&edit))
+    , m_path (gstr::wrap (path))
+    , m_event_id (0)
+    , m_loop (nullptr)
+    , m_worker (nullptr)
+    , m_result (LOAD_IN_PROGRESS)
+    , m_error (nullptr)
+    , m_undo (false)
+    , m_was_modified (false)
+    , m_highlight (FALSE)
+    , m_le (MOO_LE_NONE)
+{
+}
+
+FileLoader::~FileLoader ()
+{
+    if (m_error)
+        g_error_free (m_error);
+}
+
+void
+FileLoader::finish (LoadResult result)
+{
+    if (m_result != LOAD_IN_PROGRESS)
+        return;
 
-    if (le != MOO_LE_NONE)
-        moo_edit_set_line_end_type_full(edit, le, TRUE);
+    m_result = result;
 
-    g_string_free(strbuf, TRUE);
+    if (m_loop)
+        g_main_loop_quit (m_loop);
 }
 
+void
+FileLoader::cancel (FileLoader *loader)
+{
+    if (loader->m_result != LOAD_IN_PROGRESS)
+        return;
 
-/* XXX */
-static bool moo_edit_reload_local(Edit        edit,
-                                  const char* encoding,
-                                  gerrp&      error)
+    g_set_error (&loader->m_error, MOO_EDIT_FILE_ERROR, MOO_EDIT_FILE_ERROR_CANCELLED, "Cancelled");
+    loader->finish (LOAD_ERROR);
+}
+
+void
+FileLoader::process_event (LoadEvent *event)
 {
-    g::FilePtr file = wrap_new(moo_edit_get_file(&edit));
-    moo_return_error_if_fail(file != nullptr);
+    GtkTextIter end;
+
+    switch (event->type)
+    {
+        case LOAD_EVENT_TEXT:
+            m_worker->chunk_processed ();
+            gtk_text_buffer_get_end_iter (m_buffer, &end);
+            gtk_text_buffer_insert (m_buffer, &end, event->text->str, (int) event->text->len);
+            if (event->fraction >= 0)
+                _moo_edit_set_progress_fraction (&m_edit, event->fraction);
+            break;
+
+        case LOAD_EVENT_RESTART:
+            gtk_text_buffer_set_text (m_buffer, "", 0);
+            break;
+
+        case LOAD_EVENT_DONE:
+            m_used_encoding = std::move (event->encoding);
+            m_le = event->le;
+            finish (LOAD_OK);
+            break;
+
+        case LOAD_EVENT_ENCODING_FAILED:
+            finish (LOAD_ENCODING_FAILED);
+            break;
+
+        case LOAD_EVENT_ERROR:
+            m_error = event->error;
+            event->error = nullptr;
+            finish (LOAD_ERROR);
+            break;
+    }
+}
+
+void
+FileLoader::process_events (GList      *events,
+                            FileLoader *loader)
+{
+    gdk_threads_enter ();
+
+    for (; events != nullptr; events = events->next)
+        if (loader->m_result == LOAD_IN_PROGRESS)
+            loader->process_event ((LoadEvent*) events->data);
+
+    gdk_threads_leave ();
+}
+
+void
+FileLoader::begin ()
+{
+    m_undo = !moo_edit_is_empty (&m_edit);
+    m_was_modified = moo_edit_is_modified (&m_edit);
+
+    _moo_edit_set_state (&m_edit, MOO_EDIT_STATE_LOADING, "Loading",
+                         (GDestroyNotify) cancel, this);
+
+    block_buffer_signals (m_edit);
+
+    if (m_undo)
+        gtk_text_buffer_begin_user_action (m_buffer);
+    else
+        moo_text_buffer_begin_non_undoable_action (MOO_TEXT_BUFFER (m_buffer));
+
+    moo_text_buffer_begin_non_interactive_action (MOO_TEXT_BUFFER (m_buffer));
+
+    g_object_get (m_buffer, "highlight-syntax", &m_highlight, (char*) 0);
+    g_object_set (m_buffer, "highlight-syntax", FALSE, (char*) 0);
+}
+
+void
+FileLoader::end (bool success)
+{
+    if (!success && !m_undo)
+        gtk_text_buffer_set_text (m_buffer, "", 0);
+
+    g_object_set (m_buffer, "highlight-syntax", m_highlight, (char*) 0);
+
+    unblock_buffer_signals (m_edit);
+
+    if (m_undo)
+        gtk_text_buffer_end_user_action (m_buffer);
+    else
+        moo_text_buffer_end_non_undoable_action (MOO_TEXT_BUFFER (m_buffer));
+
+    moo_text_buffer_end_non_interactive_action (MOO_TEXT_BUFFER (m_buffer));
+
+    // failed reload must leave the document as it was
+    if (!success && m_undo)
+    {
+        moo_undo_stack_undo (MOO_UNDO_STACK (_moo_text_buffer_get_undo_stack (MOO_TEXT_BUFFER (m_buffer))));
+        moo_edit_set_modified (&m_edit, m_was_modified);
+    }
+
+    _moo_edit_set_state (&m_edit, MOO_EDIT_STATE_NORMAL, NULL, NULL, NULL);
+}
+
+LoadResult
+FileLoader::load (std::list<gstr> encodings,
+                  const gstr&     preferred,
+                  bool            detect,
+                  gstr&           used_encoding,
+                  gerrp&          error)
+{
+    gtk_text_buffer_set_text (m_buffer, "", 0);
+    m_result = LOAD_IN_PROGRESS;
+
+    m_event_id = _moo_event_queue_connect ((MooEventQueueCallback) process_events, this, NULL);
+
+    m_worker = new LoadWorker (m_path, std::move (encodings), preferred, detect, m_event_id);
+    MooAsyncJob *job = moo_async_job_new ((MooAsyncJobCallback) LoadWorker::run,
+                                          m_worker->ref (),
+                                          (GDestroyNotify) LoadWorker::unref);
+    moo_async_job_start (job);
+
+    m_loop = g_main_loop_new (NULL, FALSE);
+    gdk_threads_leave ();
+    g_main_loop_run (m_loop);
+    gdk_threads_enter ();
+    g_main_loop_unref (m_loop);
+    m_loop = nullptr;
+
+    // does nothing if the worker is done already
+    moo_async_job_cancel (job);
+    moo_async_job_unref (job);
+
+    // whatever the worker managed to send after this point is dropped
+    _moo_event_queue_disconnect (m_event_id);
+    m_event_id = 0;
+
+    LoadWorker::unref (m_worker);
+    m_worker = nullptr;
+
+    if (m_result == LOAD_OK)
+        used_encoding = std::move (m_used_encoding);
+
+    if (m_result == LOAD_ERROR)
+    {
+        g_propagate_error (&error, m_error);
+        m_error = nullptr;
+    }
+
+    return m_result;
+}
+
+
+static std::list<gstr>
+get_load_encodings (const gstr& encoding,
+                    const gstr& cached_encoding)
+{
+    std::list<gstr> encodings;
+
+    if (!encoding.empty())
+    {
+        encodings.push_back(encoding);
+    }
+    else
+    {
+        encodings = get_encodings();
+
+        if (!cached_encoding.empty())
+            encodings.push_front(cached_encoding);
+    }
+
+    return encodings;
+}
+
+static bool
+load_with_prompt (FileLoader&   loader,
+                  g::File       file,
+                  gstr          encoding,
+                  gstr          cached_encoding,
+                  /*out*/ gstr& used_encoding,
+                  gerrp&        error)
+{
+    while (TRUE)
+    {
+        MooEditTryEncodingResponse response;
+
+        // BOM and contents are only looked at if the encoding wasn't
+        // specified explicitly
+        switch (loader.load (get_load_encodings (encoding, cached_encoding),
+                             cached_encoding, encoding.empty(), used_encoding, error))
+        {
+            case LOAD_OK:
+                return true;
+            case LOAD_ENCODING_FAILED:
+                break;
+            case LOAD_IN_PROGRESS:
+            case LOAD_ERROR:
+                return false;
+        }
+
+        used_encoding.reset();
+        response = _moo_edit_try_encoding_dialog (file, encoding, /*out*/ used_encoding);
+
+        if (response == MOO_EDIT_TRY_ENCODING_RESPONSE_CANCEL || used_encoding.empty())
+        {
+            g_set_error (&error, MOO_EDIT_FILE_ERROR, MOO_EDIT_FILE_ERROR_CANCELLED, "Cancelled");
+            return false;
+        }
+
+        encoding = normalize_encoding (used_encoding, false);
+        cached_encoding.reset();
+    }
+}
+
+static bool
+moo_edit_load_local (Edit        edit,
+                     g::File     file,
+                     const gstr& encoding,
+                     const gstr& cached_encoding,
+                     gerrp&      error)
+{
+    MooEditPrivate& priv = edit.get_priv();
+
+    if (!check_regular (file, error))
+        return false;
+
+    gstr path = file.get_path();
+
+    if (path.empty())
+    {
+        g_set_error (&error, MOO_EDIT_FILE_ERROR,
+                     MOO_EDIT_FILE_ERROR_NOT_IMPLEMENTED,
+                     "Loading remote files is not implemented");
+        return false;
+    }
+
+    FileLoader loader (edit, path);
+
+    MooLineEndType saved_le = priv.line_end_type;
+    gstr used_encoding;
+
+    loader.begin ();
+    bool success = load_with_prompt (loader, file, encoding, cached_encoding, /*out*/ used_encoding, error);
+    loader.end (success);
+
+    if (!success)
+        return false;
+
+    if (loader.get_line_end_type () != MOO_LE_NONE)
+        moo_edit_set_line_end_type_full (edit, loader.get_line_end_type (), TRUE);
+
+    GtkTextBuffer *buffer = moo_edit_get_buffer(&edit);
+    GtkTextIter start;
+    gtk_text_buffer_get_start_iter(buffer, &start);
+    gtk_text_buffer_place_cursor(buffer, &start);
+    priv.status = (MooEditStatus) 0;
+    moo_edit_set_modified(&edit, false);
+    edit._set_file(&file, used_encoding);
+    if (priv.line_end_type != saved_le)
+        edit.notify("line-end-type");
+    _moo_edit_start_file_watch(edit);
+
+    return true;
+}
+
+
+/* XXX */
+static bool moo_edit_reload_local(Edit        edit,
+                                  const char* encoding,
+                                  gerrp&      error)
+{
+    g::FilePtr file = wrap_new(moo_edit_get_file(&edit));
+    moo_return_error_if_fail(file != nullptr);
+
+    auto& priv = edit.get_priv();
+    gboolean result = _moo_edit_load_file(edit, *file,
+                                          encoding ? gstr::wrap(encoding) : priv.encoding,
+                                          nullptr,
+                                          error);
+
+    if (result)
+    {
+        priv.status = (MooEditStatus) 0;
+        moo_edit_set_modified(&edit, false);
+        _moo_edit_start_file_watch(edit);
+        g_clear_error (&error);
+    }
+
+    return result;
+}
+
+
+/***************************************************************************/
+/* File saving
+ */
+
+#define SAVE_CHUNK_CHARS        (64 * 1024)
+#define SAVE_CONVERT_BUF_SIZE   (64 * 1024)
+
+// Streams buffer contents into a file writer without making a copy of
+// the whole text: the buffer is read a chunk at a time, line endings are
+// replaced and the text is converted to the target encoding on the fly.
+// With no writer it only checks that the text can be converted.
+class ContentsWriter
+{
+public:
+    ContentsWriter (MooFileWriter *writer,
+                    const char    *le,
+                    gsize          le_len);
+    ~ContentsWriter ();
+
+    MOO_DISABLE_COPY_OPS (ContentsWriter);
+
+    bool    set_encoding    (const char     *encoding,
+                             gerrp&          error);
+    bool    write_buffer    (GtkTextBuffer  *buffer,
+                             gerrp&          error);
+
+    bool    write_text      (const char     *text,
+                             gsize           len,
+                             gerrp&          error);
+    bool    finish          (gerrp&          error);
+
+private:
+    bool    convert         (const char     *text,
+                             gsize           len,
+                             gerrp&          error);
+    bool    flush_converted ();
+    bool    output          (const char     *data,
+                             gsize           len);
+
+    MooFileWriter  *m_writer;
+    const char     *m_le;
+    gsize           m_le_len;
+    gstr            m_encoding;
+    GIConv          m_cd;
+    char           *m_out;
+    gsize           m_out_len;
+    bool            m_pending_cr;
+};
+
+ContentsWriter::ContentsWriter (MooFileWriter *writer,
+                                const char    *le,
+                                gsize          le_len)
+    : m_writer (writer)
+    , m_le (le)
+    , m_le_len (le_len)
+    , m_cd ((GIConv) -1)
+    , m_out (nullptr)
+    , m_out_len (0)
+    , m_pending_cr (false)
+{
+}
+
+ContentsWriter::~ContentsWriter ()
+{
+    if (m_cd != (GIConv) -1)
+        g_iconv_close (m_cd);
+    g_free (m_out);
+}
+
+bool
+ContentsWriter::set_encoding (const char *encoding,
+                              gerrp&      error)
+{
+    g_return_val_if_fail (encoding != nullptr, false);
+    g_return_val_if_fail (m_cd == (GIConv) -1, false);
+
+    m_cd = g_iconv_open (encoding, "UTF-8");
+
+    if (m_cd == (GIConv) -1)
+    {
+        g_set_error (&error, G_CONVERT_ERROR, G_CONVERT_ERROR_NO_CONVERSION,
+                     "Conversion from UTF-8 to %s is not supported", encoding);
+        return false;
+    }
+
+    m_encoding.set (encoding);
+    m_out = g_new (char, SAVE_CONVERT_BUF_SIZE);
+    return true;
+}
+
+bool
+ContentsWriter::output (const char *data,
+                        gsize       len)
+{
+    // write errors are reported when the writer is closed
+    return !m_writer || moo_file_writer_write (m_writer, data, len);
+}
+
+bool
+ContentsWriter::flush_converted ()
+{
+    bool ret = output (m_out, m_out_len);
+    m_out_len = 0;
+    return ret;
+}
+
+bool
+ContentsWriter::convert (const char *text,
+                         gsize       len,
+                         gerrp&      error)
+{
+    if (m_cd == (GIConv) -1)
+        return output (text, len);
+
+    char *inbuf = const_cast<char*> (text);
+    gsize inleft = len;
+
+    while (inleft != 0)
+    {
+        char *outbuf = m_out + m_out_len;
+        gsize outleft = SAVE_CONVERT_BUF_SIZE - m_out_len;
+        gsize result = g_iconv (m_cd, &inbuf, &inleft, &outbuf, &outleft);
+
+        m_out_len = outbuf - m_out;
+
+        if (result != (gsize) -1)
+            break;
+
+        // text comes in whole characters, so anything but a full
+        // output buffer means the character can't be represented
+        if (errno != E2BIG)
+        {
+            g_set_error (&error, G_CONVERT_ERROR, G_CONVERT_ERROR_ILLEGAL_SEQUENCE,
+                         "Could not convert text to %s", m_encoding.get ());
+            return false;
+        }
+
+        if (!flush_converted ())
+            return false;
+    }
+
+    if (m_out_len > SAVE_CONVERT_BUF_SIZE / 2)
+        return flush_converted ();
+
+    return true;
+}
+
+// Replaces line endings: any of \n, \r, \r\n and U+2029, same as
+// GtkTextIter understands them
+bool
+ContentsWriter::write_text (const char *text,
+                            gsize       len,
+                            gerrp&      error)
+{
+    const char *p = text;
+    const char *end = text + len;
+    const char *run = text;
+
+    if (m_pending_cr && p != end && *p == '\n')
+        run = ++p;
+
+    m_pending_cr = false;
+
+    while (p != end)
+    {
+        gsize le_len;
+
+        if (*p == '\n')
+            le_len = 1;
+        else if (*p == '\r')
+            le_len = (p + 1 != end && p[1] == '\n') ? 2 : 1;
+        else if (*p == '\xE2' && end - p >= 3 && p[1] == '\x80' && p[2] == '\xA9')
+            le_len = 3;
+        else
+        {
+            ++p;
+            continue;
+        }
+
+        if (!convert (run, p - run, error) || !convert (m_le, m_le_len, error))
+            return false;
+
+        // \r\n may be split between chunks
+        if (*p == '\r' && le_len == 1 && p + 1 == end)
+            m_pending_cr = true;
+
+        p += le_len;
+        run = p;
+    }
+
+    return convert (run, end - run, error);
+}
+
+bool
+ContentsWriter::finish (gerrp& error)
+{
+    if (m_cd != (GIConv) -1)
+    {
+        char *outbuf = m_out + m_out_len;
+        gsize outleft = SAVE_CONVERT_BUF_SIZE - m_out_len;
+
+        // reset the shift state for stateful encodings
+        if (g_iconv (m_cd, NULL, NULL, &outbuf, &outleft) == (gsize) -1)
+        {
+            g_set_error (&error, G_CONVERT_ERROR, G_CONVERT_ERROR_FAILED,
+                         "Could not convert text to %s", m_encoding.get ());
+            return false;
+        }
+
+        m_out_len = outbuf - m_out;
+        return flush_converted ();
+    }
+
+    return true;
+}
+
+bool
+ContentsWriter::write_buffer (GtkTextBuffer *buffer,
+                              gerrp&         error)
+{
+    GtkTextIter start, end;
+
+    gtk_text_buffer_get_start_iter (buffer, &start);
+
+    while (!gtk_text_iter_is_end (&start))
+    {
+        end = start;
+        gtk_text_iter_forward_chars (&end, SAVE_CHUNK_CHARS);
+
+        gstrp text = gtk_text_buffer_get_text (buffer, &start, &end, TRUE);
+        if (!write_text (text.get (), strlen (text.get ()), error))
+            return false;
+
+        start = end;
+    }
+
+    return finish (error);
+}
+
+static void
+get_line_end (Edit         edit,
+              const char **le,
+              gsize       *le_len)
+{
+    switch (moo_edit_get_line_end_type (&edit))
+    {
+    case MOO_LE_UNIX:
+        *le = "\n";
+        *le_len = 1;
+        break;
+    case MOO_LE_WIN32:
+        *le = "\r\n";
+        *le_len = 2;
+        break;
+    case MOO_LE_MAC:
+        *le = "\r";
+        *le_len = 1;
+        break;
+    default:
+        moo_assert_not_reached();
+        *le = "\n";
+        *le_len = 1;
+        break;
+    }
+}
+
+// Returns the encoding to convert to, or NULL if none is needed
+static const char *
+get_save_encoding (const char  *encoding,
+                   const char **bom,
+                   gsize       *bom_len)
+{
+    const char *enc_no_bom = NULL;
+
+    *bom = NULL;
+    *bom_len = 0;
+
+    if (encoding_needs_bom_save(encoding, &enc_no_bom, bom, bom_len))
+        encoding = enc_no_bom;
+
+    if (encoding && encoding_is_utf8(encoding))
+        encoding = NULL;
+
+    return encoding;
+}
+
+static MooFileWriterFlags
+get_writer_flags (MooEditSaveFlags flags)
+{
+    return (flags & MOO_EDIT_SAVE_BACKUP) ? MOO_FILE_WRITER_SAVE_BACKUP : (MooFileWriterFlags) 0;
+}
+
+static bool
+do_save_local(Edit             edit,
+              g::File          file,
+              const char*      encoding,
+              MooEditSaveFlags flags,
+              gerrp&           error)
+{
+    const char *bom;
+    gsize bom_len;
+    const char *le;
+    gsize le_len;
+    MooFileWriter *writer;
+
+    GtkTextBuffer *buffer = moo_edit_get_buffer(&edit);
+    get_line_end(edit, &le, &le_len);
+    encoding = get_save_encoding(encoding, &bom, &bom_len);
+
+    // Make sure the text can be converted before the file is touched.
+    // This costs an extra conversion pass, but no memory.
+    if (encoding)
+    {
+        ContentsWriter check(nullptr, le, le_len);
+        gerrp encoding_error;
+
+        if (!check.set_encoding(encoding, encoding_error) ||
+            !check.write_buffer(buffer, encoding_error))
+        {
+            error = std::move(encoding_error);
+            set_encoding_error(error);
+            return false;
+        }
+    }
+
+    if (!(writer = moo_file_writer_new_for_file(file, get_writer_flags(flags), error)))
+        return false;
+
+    ContentsWriter contents(writer, le, le_len);
+    gerrp write_error;
+
+    if (bom_len > 0)
+        moo_file_writer_write(writer, bom, bom_len);
+
+    bool success = (!encoding || contents.set_encoding(encoding, write_error)) &&
+                   contents.write_buffer(buffer, write_error);
+
+    if (!moo_file_writer_close(writer, error))
+        return false;
+
+    if (!success)
+    {
+        error = std::move(write_error);
+        set_encoding_error(error);
+        return false;
+    }
+
+    return true;
+}
+
+
+enum SaveEventType {
+    SAVE_EVENT_PROGRESS,
+    SAVE_EVENT_WRITING,
+    SAVE_EVENT_DONE
+};
+
+// Message sent from the saver thread to the main thread
+struct SaveEvent
+{
+    SaveEvent (SaveEventType type);
+    ~SaveEvent ();
+
+    MOO_DISABLE_COPY_OPS (SaveEvent);
+
+    static void free (SaveEvent *event) { delete event; }
+
+    SaveEventType   type;
+    double          fraction;
+    GError         *error;
+    bool            encoding_error;
+};
+
+// Runs in a MooAsyncJob thread: converts a copy of the document text,
+// then writes it out. Backup, fsync and the atomic rename all happen
+// in the file writer.
+class SaveWorker
+{
+public:
+    SaveWorker (g::File              file,
+                std::vector<gstr>    chunks,
+                const char          *le,
+                gsize                le_len,
+                const char          *encoding,
+                const char          *bom,
+                gsize                bom_len,
+                MooFileWriterFlags   flags,
+                guint                event_id);
+
+    MOO_DISABLE_COPY_OPS (SaveWorker);
+
+    SaveWorker     *ref             ();
+    static void     unref           (SaveWorker     *worker);
+    static gboolean run             (SaveWorker     *worker);
+
+    // only has effect until writing starts
+    void            cancel          () { g_atomic_int_set (&m_cancelled, 1); }
+
+private:
+    bool            check_encoding  (gerrp&          error);
+    bool            write           (gerrp&          error);
+    bool            is_cancelled    (gerrp&          error);
+    void            push            (SaveEvent      *event);
+
+    g::FilePtr          m_file;
+    std::vector<gstr>   m_chunks;
+    const char         *m_le;
+    gsize               m_le_len;
+    gstr                m_encoding;
+    const char         *m_bom;
+    gsize               m_bom_len;
+    MooFileWriterFlags  m_flags;
+    guint               m_event_id;
+    int                 m_cancelled;
+    int                 m_ref_count;
+};
+
+// Main thread part of background saving: takes a snapshot of the text
+// and waits for the SaveWorker, keeping the main loop running. The
+// document may be modified meanwhile, it's the snapshot which gets saved.
+class FileSaver
+{
+public:
+    FileSaver (Edit edit);
+    ~FileSaver ();
+
+    MOO_DISABLE_COPY_OPS (FileSaver);
+
+    bool            save                (g::File             file,
+                                         const char         *encoding,
+                                         MooEditSaveFlags    flags,
+                                         gerrp&              error);
+
+    bool            buffer_changed      () const { return m_buffer_changed; }
+
+private:
+    static void     cancel              (FileSaver      *saver);
+    static void     process_events      (GList          *events,
+                                         FileSaver      *saver);
+    static void     buffer_changed_cb   (FileSaver      *saver);
+    void            process_event       (SaveEvent      *event);
+
+    Edit            m_edit;
+    GtkTextBuffer  *m_buffer;
+    GMainLoop      *m_loop;
+    SaveWorker     *m_worker;
+    bool            m_done;
+    GError         *m_error;
+    bool            m_encoding_error;
+    bool            m_buffer_changed;
+};
+
+SaveEvent::SaveEvent (SaveEventType type)
+    : type (type)
+    , fraction (-1)
+    , error (nullptr)
+    , encoding_error (false)
+{
+}
+
+SaveEvent::~SaveEvent ()
+{
+    if (error)
+        g_error_free (error);
+}
+
+SaveWorker::SaveWorker (g::File              file,
+                        std::vector<gstr>    chunks,
+                        const char          *le,
+                        gsize                le_len,
+                        const char          *encoding,
+                        const char          *bom,
+                        gsize                bom_len,
+                        MooFileWriterFlags   flags,
+                        guint                event_id)
+    : m_file (file.dup ())
+    , m_chunks (std::move (chunks))
+    , m_le (le)
+    , m_le_len (le_len)
+    , m_encoding (gstr::wrap (encoding))
+    , m_bom (bom)
+    , m_bom_len (bom_len)
+    , m_flags (flags)
+    , m_event_id (event_id)
+    , m_cancelled (0)
+    , m_ref_count (1)
+{
+}
+
+SaveWorker *
+SaveWorker::ref ()
+{
+    g_atomic_int_inc (&m_ref_count);
+    return this;
+}
+
+void
+SaveWorker::unref (SaveWorker *worker)
+{
+    if (worker && g_atomic_int_dec_and_test (&worker->m_ref_count))
+        delete worker;
+}
+
+void
+SaveWorker::push (SaveEvent *event)
+{
+    _moo_event_queue_push (m_event_id, event, (GDestroyNotify) SaveEvent::free);
+}
+
+bool
+SaveWorker::is_cancelled (gerrp& error)
+{
+    if (!g_atomic_int_get (&m_cancelled))
+        return false;
+
+    g_set_error (&error, MOO_EDIT_FILE_ERROR, MOO_EDIT_FILE_ERROR_CANCELLED, "Cancelled");
+    return true;
+}
+
+bool
+SaveWorker::check_encoding (gerrp& error)
+{
+    ContentsWriter check (nullptr, m_le, m_le_len);
+
+    if (!check.set_encoding (m_encoding, error))
+        return false;
+
+    for (const auto& chunk: m_chunks)
+    {
+        if (is_cancelled (error) || !check.write_text (chunk, strlen (chunk), error))
+            return false;
+    }
+
+    return check.finish (error);
+}
+
+bool
+SaveWorker::write (gerrp& error)
+{
+    MooFileWriter *writer;
+    gerrp write_error;
+    bool success = true;
+
+    if (!(writer = moo_file_writer_new_for_file (*m_file, m_flags | MOO_FILE_WRITER_SYNC, error)))
+        return false;
+
+    ContentsWriter contents (writer, m_le, m_le_len);
+
+    if (m_bom_len > 0)
+        moo_file_writer_write (writer, m_bom, m_bom_len);
+
+    if (!m_encoding.is_null ())
+        success = contents.set_encoding (m_encoding, write_error);
+
+    for (gsize i = 0; success && i < m_chunks.size (); ++i)
+    {
+        success = contents.write_text (m_chunks[i], strlen (m_chunks[i]), write_error);
+
+        SaveEvent *event = new SaveEvent (SAVE_EVENT_PROGRESS);
+        event->fraction = (double) (i + 1) / m_chunks.size ();
+        push (event);
+    }
+
+    if (success)
+        success = contents.finish (write_error);
+
+    if (!moo_file_writer_close (writer, error))
+        return false;
+
+    if (!success)
+        error = std::move (write_error);
+
+    return success;
+}
 
-    auto& priv = edit.get_priv();
-    gboolean result = _moo_edit_load_file(edit, *file,
-                                          encoding ? gstr::wrap(encoding) : priv.encoding,
-                                          nullptr,
-                                          error);
+gboolean
+SaveWorker::run (SaveWorker *worker)
+{
+    gerrp error;
+    bool encoding_error = false;
 
-    if (result)
+    if (!worker->m_encoding.is_null () && !worker->check_encoding (error))
     {
-        priv.status = (MooEditStatus) 0;
-        moo_edit_set_modified(&edit, false);
-        _moo_edit_start_file_watch(edit);
-        g_clear_error (&error);
+        encoding_error = !g_error_matches (error.get (), MOO_EDIT_FILE_ERROR,
+                                           MOO_EDIT_FILE_ERROR_CANCELLED);
+    }
+    else if (!worker->is_cancelled (error))
+    {
+        // past this point the old file is going to be replaced
+        worker->push (new SaveEvent (SAVE_EVENT_WRITING));
+        worker->write (error);
     }
 
-    return result;
+    SaveEvent *event = new SaveEvent (SAVE_EVENT_DONE);
+    if (error)
+        event->error = g_error_copy (error.get ());
+    event->encoding_error = encoding_error;
+    worker->push (event);
+
+    return FALSE;
 }
 
 
-/***************************************************************************/
-/* File saving
- */
+FileSaver::FileSaver (Edit edit)
+    : m_edit (edit)
+    , m_buffer (moo_edit_get_buffer (&edit))
+    , m_loop (nullptr)
+    , m_worker (nullptr)
+    , m_done (false)
+    , m_error (nullptr)
+    , m_encoding_error (false)
+    , m_buffer_changed (false)
+{
+}
 
-static gstr
-get_contents_with_fixed_line_end (GtkTextBuffer *buffer, const char *le, gsize le_len)
+FileSaver::~FileSaver ()
 {
-    GtkTextIter line_start;
-    strbuilder contents;
+    if (m_error)
+        g_error_free (m_error);
+}
+
+void
+FileSaver::cancel (FileSaver *saver)
+{
+    if (saver->m_worker)
+        saver->m_worker->cancel ();
+}
 
-    gtk_text_buffer_get_start_iter (buffer, &line_start);
+void
+FileSaver::buffer_changed_cb (FileSaver *saver)
+{
+    saver->m_buffer_changed = true;
+}
 
-    do
+void
+FileSaver::process_event (SaveEvent *event)
+{
+    switch (event->type)
     {
-        GtkTextIter line_end = line_start;
+        case SAVE_EVENT_PROGRESS:
+            _moo_edit_set_progress_fraction (&m_edit, event->fraction);
+            break;
 
-        if (!gtk_text_iter_ends_line (&line_start))
-        {
-            gtk_text_iter_forward_to_line_end (&line_end);
-            gstrp line = gtk_text_buffer_get_text (buffer, &line_start, &line_end, TRUE);
-            contents.append (line);
-        }
+        case SAVE_EVENT_WRITING:
+            // too late to cancel
+            if (m_edit.get_priv().progress)
+                _moo_edit_progress_set_cancel_func (*m_edit.get_priv().progress, NULL, NULL);
+            break;
 
-        if (!gtk_text_iter_is_end (&line_end))
-            contents.append(le, le_len);
+        case SAVE_EVENT_DONE:
+            m_error = event->error;
+            event->error = nullptr;
+            m_encoding_error = event->encoding_error;
+            m_done = true;
+            g_main_loop_quit (m_loop);
+            break;
     }
-    while (gtk_text_iter_forward_line (&line_start));
-
-    return contents.release();
 }
 
-static gstr get_contents(MooEdit  edit)
+void
+FileSaver::process_events (GList     *events,
+                           FileSaver *saver)
 {
-    const char *le = "\n";
-    gsize le_len = 1;
-    GtkTextBuffer *buffer;
+    gdk_threads_enter ();
 
-    switch (moo_edit_get_line_end_type(&edit))
-    {
-    case MOO_LE_UNIX:
-        le = "\n";
-        le_len = 1;
-        break;
-    case MOO_LE_WIN32:
-        le = "\r\n";
-        le_len = 2;
-        break;
-    case MOO_LE_MAC:
-        le = "\r";
-        le_len = 1;
-        break;
-    default:
-        moo_assert_not_reached();
-    }
+    for (; events != nullptr; events = events->next)
+        if (!saver->m_done)
+            saver->process_event ((SaveEvent*) events->data);
 
-    buffer = moo_edit_get_buffer(&edit);
-    return get_contents_with_fixed_line_end(buffer, le, le_len);
+    gdk_threads_leave ();
 }
 
-static bool do_write(g::File          file,
-                     const char*      data1,
-                     gsize            len1,
-                     const char*      data2,
-                     gsize            len2,
-                     MooEditSaveFlags flags,
-                     gerrp&           error)
+bool
+FileSaver::save (g::File             file,
+                 const char         *encoding,
+                 MooEditSaveFlags    flags,
+                 gerrp&              error)
 {
-    MooFileWriter *writer;
-    MooFileWriterFlags writer_flags;
-    gboolean success = FALSE;
+    const char *bom;
+    gsize bom_len;
+    const char *le;
+    gsize le_len;
+
+    get_line_end (m_edit, &le, &le_len);
+    encoding = get_save_encoding (encoding, &bom, &bom_len);
 
-    writer_flags = (flags & MOO_EDIT_SAVE_BACKUP) ? MOO_FILE_WRITER_SAVE_BACKUP : (MooFileWriterFlags) 0;
+    std::vector<gstr> chunks;
+    GtkTextIter start, end;
 
-    if ((writer = moo_file_writer_new_for_file (file, writer_flags, error)))
+    gtk_text_buffer_get_start_iter (m_buffer, &start);
+
+    while (!gtk_text_iter_is_end (&start))
     {
-        success = TRUE;
-        if (success && len1 > 0)
-            success = moo_file_writer_write (writer, data1, len1);
-        if (success && len2 > 0)
-            success = moo_file_writer_write (writer, data2, len2);
-        if (success)
-            success = moo_file_writer_close (writer, error);
+        end = start;
+        gtk_text_iter_forward_chars (&end, SAVE_CHUNK_CHARS);
+        chunks.push_back (gstr::wrap_new (gtk_text_buffer_get_text (m_buffer, &start, &end, TRUE)));
+        start = end;
     }
 
-    return success;
-}
+    guint event_id = _moo_event_queue_connect ((MooEventQueueCallback) process_events, this, NULL);
+    gulong changed_id = g_signal_connect_swapped (m_buffer, "changed", G_CALLBACK (buffer_changed_cb), this);
 
-static bool
-do_save_local(Edit             edit,
-              g::File          file,
-              const char*      encoding,
-              MooEditSaveFlags flags,
-              gerrp&           error)
-{
-    const char *to_save;
-    gsize to_save_size;
-    const char *enc_no_bom = NULL;
-    const char *bom = NULL;
-    gsize bom_len = 0;
+    m_worker = new SaveWorker (file, std::move (chunks), le, le_len, encoding, bom, bom_len,
+                               get_writer_flags (flags), event_id);
+    MooAsyncJob *job = moo_async_job_new ((MooAsyncJobCallback) SaveWorker::run,
+                                          m_worker->ref (),
+                                          (GDestroyNotify) SaveWorker::unref);
 
-    gstr utf8_contents = get_contents(edit);
-    moo_release_assert(!utf8_contents.is_null());
+    _moo_edit_set_state (&m_edit, MOO_EDIT_STATE_SAVING, "Saving",
+                         (GDestroyNotify) cancel, this);
 
-    if (encoding_needs_bom_save(encoding, &enc_no_bom, &bom, &bom_len))
-        encoding = enc_no_bom;
+    moo_async_job_start (job);
 
-    if (encoding && encoding_is_utf8(encoding))
-        encoding = NULL;
+    m_loop = g_main_loop_new (NULL, FALSE);
+    gdk_threads_leave ();
+    g_main_loop_run (m_loop);
+    gdk_threads_enter ();
+    g_main_loop_unref (m_loop);
+    m_loop = nullptr;
 
-    if (encoding)
+    _moo_edit_set_state (&m_edit, MOO_EDIT_STATE_NORMAL, NULL, NULL, NULL);
+
+    moo_async_job_unref (job);
+    SaveWorker::unref (m_worker);
+    m_worker = nullptr;
+
+    g_signal_handler_disconnect (m_buffer, changed_id);
+    _moo_event_queue_disconnect (event_id);
+
+    if (m_error)
     {
-        gsize bytes_read;
-        gsize bytes_written;
-        gerrp encoding_error;
-        gstr encoded = g::convert(utf8_contents, -1, encoding, "UTF-8",
-                                  /*out*/ bytes_read, /*out*/ bytes_written,
-                                  encoding_error);
+        g_propagate_error (&error, m_error);
+        m_error = nullptr;
 
-        if (!encoded.is_null())
-        {
-            to_save = encoded;
-            to_save_size = bytes_written;
-        }
-        else
-        {
-            error = std::move (encoding_error);
+        if (m_encoding_error)
             set_encoding_error (error);
-            return false;
-        }
-    }
-    else
-    {
-        to_save = utf8_contents;
-        to_save_size = strlen(utf8_contents);
-    }
 
-    if (!do_write(file, bom, bom_len, to_save, to_save_size, flags, error))
         return false;
+    }
 
     return true;
 }
 
-
 static bool
 moo_edit_save_local(Edit             edit,
                     g::File          file,
@@ -698,12 +1808,34 @@ moo_edit_save_local(Edit             edit,
                     MooEditSaveFlags flags,
                     gerrp&           error)
 {
-    if (!do_save_local(edit, file, encoding, flags, error))
+    bool modified = false;
+
+    if (flags & MOO_EDIT_SAVE_BACKGROUND)
+    {
+        FileSaver saver(edit);
+        bool watched = edit.get_priv().file_monitor_id != 0;
+
+        // the file is going to change while the main loop is running
+        edit._stop_file_watch();
+
+        if (!saver.save(file, encoding, flags, error))
+        {
+            if (watched)
+                _moo_edit_start_file_watch (edit);
+            return FALSE;
+        }
+
+        // what's saved is the text as it was when saving started
+        modified = saver.buffer_changed();
+    }
+    else if (!do_save_local(edit, file, encoding, flags, error))
+    {
         return FALSE;
+    }
 
     edit.get_priv().status = (MooEditStatus) 0;
     edit._set_file(&file, encoding);
-    moo_edit_set_modified(&edit, false);
+    moo_edit_set_modified(&edit, modified);
     _moo_edit_start_file_watch (edit);
     return TRUE;
 }
@@ -1046,30 +2178,6 @@ _moo_edit_get_icon (MooEdit     *doc,
 #define BOM_UTF32 BOM_UTF32_BE
 #endif
 
-static char *
-try_convert_to_utf8_from_utf8 (const char *data,
-                               gsize       len)
-{
-    const char *invalid;
-    gboolean valid_utf8;
-
-//     g_print ("try_convert_to_utf8_from_utf8()\n");
-
-    if (len >= BOM_UTF8_LEN && memcmp (data, BOM_UTF8, BOM_UTF8_LEN) == 0)
-    {
-        data += BOM_UTF8_LEN;
-        len -= BOM_UTF8_LEN;
-    }
-
-    valid_utf8 = g_utf8_validate (data, len, &invalid);
-
-    // allow trailing zero byte
-    if (!valid_utf8 && invalid + 1 == data + len && *invalid == 0)
-        valid_utf8 = TRUE;
-
-    return valid_utf8 ? g_strdup (data) : NULL;
-}
-
 static gboolean
 encoding_needs_bom_load (const char  *enc,
                          gboolean    *bom_optional,
@@ -1147,78 +2255,6 @@ encoding_needs_bom_save (const char  *enc,
     return FALSE;
 }
 
-static char *
-try_convert_to_utf8_from_non_utf8_encoding (const char *data,
-                                            gsize       len,
-                                            const char *enc)
-{
-    const char *enc_no_bom = NULL;
-    const char *bom = NULL;
-    gsize bom_len = 0;
-    gsize bytes_read = 0;
-    gsize bytes_written = 0;
-    char *result = NULL;
-    gsize result_len = 0;
-    gboolean bom_optional = FALSE;
-
-//     g_print ("try_convert_to_utf8_from_non_utf8_encoding(%s)\n",
-//              enc ? enc : "<null>");
-
-    if (encoding_needs_bom_load (enc, &bom_optional, &enc_no_bom, &bom, &bom_len))
-    {
-        if (len < bom_len || memcmp (bom, data, bom_len) != 0)
-        {
-            if (!bom_optional)
-                return NULL;
-        }
-        else
-        {
-            data += bom_len;
-            len -= bom_len;
-            enc = enc_no_bom;
-        }
-    }
-
-    if (encoding_is_utf8 (enc))
-        return try_convert_to_utf8_from_utf8 (data, len);
-
-    result = g_convert (data, len, "UTF-8", enc, &bytes_read, &bytes_written, NULL);
-
-    if (!result)
-        return NULL;
-
-    if (bytes_read < len)
-    {
-        g_free (result);
-        return NULL;
-    }
-
-    result_len = strlen (result);
-
-    // ignore trailing zero
-    if (bytes_written == result_len + 1)
-        bytes_written -= 1;
-
-    if (result_len < bytes_written)
-    {
-        g_free (result);
-        return NULL;
-    }
-
-    return result;
-}
-
-static char *
-try_convert_to_utf8_from_encoding (const char *data,
-                                   gsize       len,
-                                   const char *enc)
-{
-    if (encoding_is_utf8 (enc))
-        return try_convert_to_utf8_from_utf8 (data, len);
-    else
-        return try_convert_to_utf8_from_non_utf8_encoding (data, len, enc);
-}
-
 static gboolean
 data_has_bom (const char  *data,
               gsize        len,
@@ -1258,51 +2294,263 @@ data_has_bom (const char  *data,
     return FALSE;
 }
 
-static char *
-moo_convert_file_data_to_utf8 (const char  *data,
-                               gsize        len,
-                               const char  *encoding,
-                               const char  *cached_encoding,
-                               gstr&        used_enc)
+
+TextDecoder::TextDecoder (const char *encoding)
+    : m_bom (NULL)
+    , m_bom_len (0)
+    , m_bom_optional (true)
+    , m_bom_checked (false)
+    , m_cd ((GIConv) -1)
+    , m_seen_nul (false)
+    , m_pending_cr (false)
+    , m_le (MOO_LE_NONE)
+    , m_mixed_le (false)
+{
+    const char *enc_no_bom = NULL;
+    gboolean bom_optional = FALSE;
+
+    if (encoding_needs_bom_load (encoding, &bom_optional, &enc_no_bom, &m_bom, &m_bom_len))
+    {
+        m_bom_optional = bom_optional;
+        encoding = enc_no_bom;
+    }
+    else if (encoding_is_utf8 (encoding))
+    {
+        // UTF-8 BOM is skipped if present
+        m_bom = BOM_UTF8;
+        m_bom_len = BOM_UTF8_LEN;
+    }
+
+    m_encoding.set (encoding);
+    m_utf8 = encoding_is_utf8 (encoding);
+
+    if (!m_utf8)
+        m_cd = g_iconv_open ("UTF-8", encoding);
+}
+
+TextDecoder::~TextDecoder ()
+{
+    if (m_cd != (GIConv) -1)
+        g_iconv_close (m_cd);
+}
+
+MooLineEndType
+TextDecoder::get_line_end_type () const
+{
+    return m_mixed_le ? MOO_LE_NATIVE : m_le;
+}
+
+void
+TextDecoder::add_line_end (MooLineEndType le)
+{
+    if (m_mixed_le || (m_le && m_le != le))
+        m_mixed_le = true;
+    else
+        m_le = le;
+}
+
+bool
+TextDecoder::add_text (const char *text,
+                       gsize       len,
+                       GString    *out)
 {
-    char *result = NULL;
-    const char *bom_enc = NULL;
+    const char *p = text;
+    const char *end = text + len;
+    const char *nul;
+
+    if (len == 0)
+        return true;
+
+    // allow trailing zero byte, but nothing after it
+    if (m_seen_nul)
+        return false;
 
-//     g_print ("moo_convert_file_data_to_utf8(%s, %s)\n",
-//              encoding ? encoding : "<null>",
-//              cached_encoding ? cached_encoding : "<null>");
+    if ((nul = (const char*) memchr (text, 0, len)))
+    {
+        if (nul != end - 1)
+            return false;
+        m_seen_nul = true;
+        end -= 1;
+    }
 
-    if (!encoding && data_has_bom (data, len, &bom_enc))
+    if (m_pending_cr && p < end)
     {
-        encoding = bom_enc;
-        result = try_convert_to_utf8_from_encoding (data, len, encoding);
-        used_enc.set(bom_enc);
+        m_pending_cr = false;
+
+        if (*p == '\n')
+        {
+            add_line_end (MOO_LE_WIN32);
+            p += 1;
+        }
+        else
+        {
+            add_line_end (MOO_LE_MAC);
+        }
+
+        g_string_append_c (out, '\n');
     }
-    else if (!encoding)
+
+    while (p < end)
     {
-        std::list<gstr> encodings = get_encodings ();
+        const char *cr = (const char*) memchr (p, '\r', end - p);
+        const char *piece_end = cr ? cr : end;
+
+        if (!m_mixed_le && m_le != MOO_LE_UNIX && memchr (p, '\n', piece_end - p))
+            add_line_end (MOO_LE_UNIX);
+
+        g_string_append_len (out, p, piece_end - p);
 
-        if (cached_encoding)
-            encodings.push_front(gstr::wrap(cached_encoding));
+        if (!cr)
+            break;
+
+        p = cr + 1;
 
-        for (auto& enc: encodings)
+        if (p == end)
         {
-            result = try_convert_to_utf8_from_encoding (data, len, enc);
+            m_pending_cr = true;
+            break;
+        }
 
-            if (result != NULL)
-            {
-                used_enc = std::move(enc);
-                break;
-            }
+        if (*p == '\n')
+        {
+            add_line_end (MOO_LE_WIN32);
+            p += 1;
         }
+        else
+        {
+            add_line_end (MOO_LE_MAC);
+        }
+
+        g_string_append_c (out, '\n');
+    }
+
+    return true;
+}
+
+bool
+TextDecoder::decode_utf8 (const char *data,
+                          gsize       len,
+                          bool        eof,
+                          gsize&      consumed,
+                          GString    *out)
+{
+    const char *invalid;
+    const char *end = data + len;
+
+    if (g_utf8_validate (data, len, &invalid))
+    {
+        consumed = len;
+        return add_text (data, len, out);
+    }
+
+    if (!add_text (data, invalid - data, out))
+        return false;
+
+    consumed = invalid - data;
+
+    if (*invalid == 0 && invalid + 1 == end)
+    {
+        consumed = len;
+        return add_text (invalid, 1, out);
+    }
+
+    // character split between two chunks
+    if (!eof && g_utf8_get_char_validated (invalid, end - invalid) == (gunichar) -2)
+        return true;
+
+    return false;
+}
+
+bool
+TextDecoder::decode_iconv (const char *data,
+                           gsize       len,
+                           bool        eof,
+                           gsize&      consumed,
+                           GString    *out)
+{
+    char buf[8192];
+    char *inbuf = const_cast<char*> (data);
+    gsize inleft = len;
+
+    while (inleft > 0)
+    {
+        char *outbuf = buf;
+        gsize outleft = sizeof buf;
+        gsize result = g_iconv (m_cd, &inbuf, &inleft, &outbuf, &outleft);
+        int err = result == (gsize) -1 ? errno : 0;
+
+        if (!add_text (buf, outbuf - buf, out))
+            return false;
+
+        if (err == 0 || err == E2BIG)
+            continue;
+
+        // incomplete character at the end of the chunk
+        if (err == EINVAL && !eof)
+            break;
+
+        return false;
+    }
+
+    consumed = len - inleft;
+
+    if (eof)
+    {
+        char *outbuf = buf;
+        gsize outleft = sizeof buf;
+
+        if (g_iconv (m_cd, NULL, NULL, &outbuf, &outleft) == (gsize) -1)
+            return false;
+
+        return add_text (buf, outbuf - buf, out);
+    }
+
+    return true;
+}
+
+bool
+TextDecoder::feed (const char *data,
+                   gsize       len,
+                   bool        eof,
+                   gsize&      consumed,
+                   GString    *out)
+{
+    gsize bom_skipped = 0;
+    bool success;
+
+    consumed = 0;
+
+    if (!m_utf8 && m_cd == (GIConv) -1)
+        return false;
+
+    if (!m_bom_checked && m_bom_len != 0)
+    {
+        if (len < m_bom_len && !eof)
+            return true;
+
+        if (len >= m_bom_len && memcmp (data, m_bom, m_bom_len) == 0)
+            bom_skipped = m_bom_len;
+        else if (!m_bom_optional)
+            return false;
     }
+
+    m_bom_checked = true;
+
+    if (m_utf8)
+        success = decode_utf8 (data + bom_skipped, len - bom_skipped, eof, consumed, out);
     else
+        success = decode_iconv (data + bom_skipped, len - bom_skipped, eof, consumed, out);
+
+    consumed += bom_skipped;
+
+    if (success && eof && m_pending_cr)
     {
-        result = try_convert_to_utf8_from_encoding (data, len, encoding);
-        used_enc.set(encoding);
+        m_pending_cr = false;
+        add_line_end (MOO_LE_MAC);
+        g_string_append_c (out, '\n');
     }
 
-    return result;
+    return success;
 }
 
 static bool
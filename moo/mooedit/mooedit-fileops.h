@@ -31,7 +31,8 @@ G_END_DECLS
 
 typedef enum {
     MOO_EDIT_SAVE_FLAGS_NONE = 0,
-    MOO_EDIT_SAVE_BACKUP = 1 << 0
+    MOO_EDIT_SAVE_BACKUP = 1 << 0,
+    MOO_EDIT_SAVE_BACKGROUND = 1 << 1
 } MooEditSaveFlags;
 
 #define MOO_EDIT_FILE_ERROR (_moo_edit_file_error_quark ())
@@ -93,6 +93,7 @@ enum {
     MOO_EDIT_SETTING_SHOW_LINE_NUMBERS,
     MOO_EDIT_SETTING_TAB_WIDTH,
     MOO_EDIT_SETTING_WORD_CHARS,
+    MOO_EDIT_SETTING_LARGE_FILE,
     MOO_EDIT_LAST_SETTING
 };
 
@@ -107,9 +108,15 @@ void            _moo_edit_update_global_config      (void);
 void            _moo_edit_check_actions             (MooEdit*       edit,
                                                      MooEditView*   view);
 
+gboolean        _moo_edit_is_large_file             (MooEdit        *doc);
+void            _moo_edit_set_large_file            (MooEdit        *doc,
+                                                     gboolean        large_file);
+
 MooEditState    _moo_edit_get_state                 (MooEdit        *doc);
 void            _moo_edit_set_progress_text         (MooEdit        *doc,
                                                      const char     *text);
+void            _moo_edit_set_progress_fraction     (MooEdit        *doc,
+                                                     double          fraction);
 void            _moo_edit_set_state                 (MooEdit        *doc,
                                                      MooEditState    state,
                                                      const char     *text,
@@ -42,6 +42,8 @@ SET(mooedit_sources
     mooedit/mooedit-enums.h	
     mooedit/mooedit-fileops.cpp
     mooedit/mooedit-fileops.h
+    mooedit/mooencodingsniffer.cpp
+    mooedit/mooencodingsniffer.h
     mooedit/mooeditfiltersettings.c
     mooedit/mooedithistoryitem.c
     mooedit/mooedit-impl.h	
@@ -86,6 +88,8 @@ SET(mooedit_sources
     mooedit/mootext-private.h
     mooedit/mootextsearch.c	
     mooedit/mootextsearch-private.h
+    mooedit/mootextmatches.c
+    mooedit/mootextmatches.h
     mooedit/mootextstylescheme.c
     mooedit/mootextview.c	
     mooedit/mootextview-input.c
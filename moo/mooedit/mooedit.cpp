@@ -42,6 +42,7 @@
 #include "mooedit/mooeditdialogs.h"
 #include "mooedit/mooeditprefs.h"
 #include "mooedit/mootextbuffer.h"
+#include "mooedit/mootext-private.h"
 #include "mooedit/mooeditfiltersettings.h"
 #include "mooedit/mooeditor-impl.h"
 #include "mooedit/mooedittab-impl.h"
@@ -53,6 +54,7 @@
 #include "mooutils/mooutils-misc.h"
 #include "mooutils/mootype-macros.h"
 #include "mooutils/mooatom.h"
+#include "mooutils/mooundo.h"
 #include "mooutils/moocompat.h"
 #include "mooedit/mooeditprogress-gxml.h"
 #include "moocpp/moocpp.h"
@@ -122,7 +124,8 @@ enum {
     PROP_HAS_COMMENTS,
     PROP_LINE_END_TYPE,
     PROP_LANG,
-    PROP_ENCODING
+    PROP_ENCODING,
+    PROP_LARGE_FILE
 };
 
 G_DEFINE_TYPE (MooEdit, moo_edit, G_TYPE_OBJECT)
@@ -168,6 +171,10 @@ moo_edit_class_init (MooEditClass *klass)
         g_param_spec_object ("lang", "lang", "lang",
                              MOO_TYPE_LANG, G_PARAM_READABLE));
 
+    g_object_class_install_property (gobject_class, PROP_LARGE_FILE,
+        g_param_spec_boolean ("large-file", "large-file", "large-file",
+                              FALSE, G_PARAM_READABLE));
+
     signals[DOC_STATUS_CHANGED] =
             g_signal_new ("doc-status-changed",
                           G_OBJECT_CLASS_TYPE (klass),
@@ -737,6 +744,10 @@ moo_edit_get_property (GObject        *object,
             g_value_set_enum (value, edit->priv->line_end_type);
             break;
 
+        case PROP_LARGE_FILE:
+            g_value_set_boolean (value, _moo_edit_is_large_file (edit));
+            break;
+
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
             break;
@@ -1257,6 +1268,24 @@ update_config_from_filter_settings (MooEdit *doc)
     g_free (filter_config);
 }
 
+static void
+update_config_from_size (MooEdit *doc)
+{
+    GtkTextBuffer *buffer = doc->priv->buffer.gobj();
+    int max_size = moo_prefs_get_int (moo_edit_setting (MOO_EDIT_PREFS_LARGE_FILE_SIZE));
+    int max_lines = moo_prefs_get_int (moo_edit_setting (MOO_EDIT_PREFS_LARGE_FILE_LINES));
+    gboolean large_file = FALSE;
+
+    // character count is close enough to file size and it's free
+    if (max_size > 0 && gtk_text_buffer_get_char_count (buffer) / 1024 >= max_size)
+        large_file = TRUE;
+    if (max_lines > 0 && gtk_text_buffer_get_line_count (buffer) >= max_lines)
+        large_file = TRUE;
+
+    moo_edit_config_set (doc->config, MOO_EDIT_CONFIG_SOURCE_AUTO,
+                         "large-file", large_file, (char*) NULL);
+}
+
 static void
 update_config_from_lang (MooEdit *doc)
 {
@@ -1272,10 +1301,14 @@ moo_edit_apply_config (MooEdit *doc)
     MooLangMgr *mgr = moo_lang_mgr_default ();
     MooLang *lang = lang_id ? _moo_lang_mgr_find_lang (mgr, lang_id) : NULL;
 
+    // before the language, so that new highlighting engine is lazy from the start
+    _moo_text_buffer_set_large_file (MOO_TEXT_BUFFER (doc->priv->buffer.gobj()),
+                                     moo_edit_config_get_bool (doc->config, "large-file"));
     moo_text_buffer_set_lang (MOO_TEXT_BUFFER (doc->priv->buffer.gobj()), lang);
 
     g_object_notify (G_OBJECT (doc), "has-comments");
     g_object_notify (G_OBJECT (doc), "lang");
+    g_object_notify (G_OBJECT (doc), "large-file");
 
     for (const auto& view: doc->priv->views)
         view->_apply_config();
@@ -1301,6 +1334,9 @@ moo_edit_recheck_config (MooEdit *doc)
     // First global settings
     moo_edit_apply_prefs (doc);
 
+    // then large file mode if the document is big
+    update_config_from_size (doc);
+
     // then language from globs
     update_lang_config_from_lang_globs (doc);
 
@@ -1339,6 +1375,33 @@ void Edit::_queue_recheck_config()
                                   gobj(), NULL);
 }
 
+/*
+ * Large file mode: syntax analysis is limited to displayed text, whitespace
+ * is not drawn, and bracket matching doesn't look far. It's switched on
+ * when a document exceeds MOO_EDIT_PREFS_LARGE_FILE_SIZE or
+ * MOO_EDIT_PREFS_LARGE_FILE_LINES, and can be overridden for a document
+ * with the "large-file" setting.
+ */
+gboolean
+_moo_edit_is_large_file (MooEdit *doc)
+{
+    g_return_val_if_fail (MOO_IS_EDIT (doc), FALSE);
+    return _moo_text_buffer_get_large_file (MOO_TEXT_BUFFER (doc->priv->buffer.gobj()));
+}
+
+void
+_moo_edit_set_large_file (MooEdit  *doc,
+                          gboolean  large_file)
+{
+    g_return_if_fail (MOO_IS_EDIT (doc));
+
+    if (!_moo_edit_is_large_file (doc) == !large_file)
+        return;
+
+    moo_edit_config_set (doc->config, MOO_EDIT_CONFIG_SOURCE_USER,
+                         "large-file", large_file, (char*) NULL);
+}
+
 static void
 config_changed (MooEdit *doc)
 {
@@ -1350,10 +1413,19 @@ config_changed (MooEdit *doc)
 static void
 moo_edit_apply_prefs (MooEdit *edit)
 {
+    MooUndoStack *undo_stack;
+    int undo_memory, undo_disk;
+
     g_return_if_fail (MOO_IS_EDIT (edit));
 
     moo_edit_freeze_notify (edit);
 
+    undo_stack = MOO_UNDO_STACK (_moo_text_buffer_get_undo_stack (MOO_TEXT_BUFFER (edit->priv->buffer.gobj())));
+    undo_memory = moo_prefs_get_int (moo_edit_setting (MOO_EDIT_PREFS_UNDO_MEMORY));
+    moo_undo_stack_set_max_memory (undo_stack, (gsize) MAX (undo_memory, 0) << 20);
+    undo_disk = moo_prefs_get_int (moo_edit_setting (MOO_EDIT_PREFS_UNDO_DISK));
+    moo_undo_stack_set_max_disk (undo_stack, (gsize) MAX (undo_disk, 0) << 20);
+
     for (const auto& view: edit->priv->views)
         _moo_edit_view_apply_prefs (view.gobj());
 
@@ -1487,6 +1559,18 @@ _moo_edit_set_progress_text (MooEdit    *doc,
     _moo_edit_progress_set_text (*doc->priv->progress, text);
 }
 
+void
+_moo_edit_set_progress_fraction (MooEdit *doc,
+                                 double   fraction)
+{
+    g_return_if_fail (MOO_IS_EDIT (doc));
+    g_return_if_fail (doc->priv->state != MOO_EDIT_STATE_NORMAL);
+
+    // documents which are not in a window yet have no progress widget
+    if (doc->priv->progress)
+        _moo_edit_progress_set_fraction (*doc->priv->progress, fraction);
+}
+
 void
 _moo_edit_set_state (MooEdit        *doc,
                      MooEditState    state,
@@ -1508,8 +1592,11 @@ _moo_edit_set_state (MooEdit        *doc,
 
     doc->priv->state = state;
 
+    // text is copied before saving starts, so it's fine to edit it meanwhile
     for (const auto& view: doc->priv->views)
-        gtk_text_view_set_editable (view.gobj<GtkTextView>(), !state);
+        gtk_text_view_set_editable (view.gobj<GtkTextView>(),
+                                    state == MOO_EDIT_STATE_NORMAL ||
+                                    state == MOO_EDIT_STATE_SAVING);
 
     tab = moo_edit_get_tab (doc);
 
@@ -23,6 +23,11 @@ MooFileWatch    *_moo_editor_get_file_watch     (MooEditor      *editor);
 
 void             _moo_editor_apply_prefs        (MooEditor      *editor);
 
+void             _moo_editor_save_interactive   (MooEditor      *editor,
+                                                 MooEdit        *doc);
+void             _moo_editor_save_as_interactive (MooEditor     *editor,
+                                                 MooEdit        *doc);
+
 G_END_DECLS
 
 #endif /* MOO_EDITOR_IMPL_H */
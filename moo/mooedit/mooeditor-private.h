@@ -27,6 +27,7 @@ enum MooEditorOptions {
     SINGLE_WINDOW       = 1 << 2,
     SAVE_BACKUPS        = 1 << 3,
     STRIP_WHITESPACE    = 1 << 4,
+    BACKGROUND_SAVE     = 1 << 5,
 };
 
 MOO_DEFINE_FLAGS(MooEditorOptions);
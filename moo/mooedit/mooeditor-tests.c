@@ -1,5 +1,10 @@
 #include "mooedit/mooeditor-tests.h"
 #include "mooedit/mooeditor-impl.h"
+#include "mooedit/mootextprint.h"
+#include "mooedit/mootextbuffer.h"
+#include "mooedit/mootext-private.h"
+#include "mooedit/mootextsearch.h"
+#include "mooutils/mooundo.h"
 #include "mooutils/mooutils-fs.h"
 #include "mooutils/moohistorymgr.h"
 
@@ -207,6 +212,208 @@ test_encodings (void)
     g_dir_close (dir);
 }
 
+static void
+test_export_pdf (void)
+{
+    GtkTextBuffer *buffer;
+    GtkPrintOperation *op;
+    GtkPrintOperationResult result;
+    GString *text;
+    char *filename;
+    int n_pages = 0;
+    int i;
+
+    text = g_string_new (NULL);
+    for (i = 0; i < 500; ++i)
+        g_string_append_printf (text, "line %d\n", i);
+
+    buffer = gtk_text_buffer_new (NULL);
+    gtk_text_buffer_set_text (buffer, text->str, -1);
+    filename = g_build_filename (test_data.working_dir, "test.pdf", (char*)0);
+
+    op = GTK_PRINT_OPERATION (g_object_new (MOO_TYPE_PRINT_OPERATION,
+                                            "buffer", buffer,
+                                            "export-filename", filename,
+                                            (const char*) NULL));
+    result = gtk_print_operation_run (op, GTK_PRINT_OPERATION_ACTION_EXPORT, NULL, NULL);
+    g_object_get (op, "n-pages", &n_pages, (const char*) NULL);
+
+    TEST_ASSERT (result == GTK_PRINT_OPERATION_RESULT_APPLY);
+    TEST_ASSERT_MSG (n_pages > 1, "%d pages", n_pages);
+    TEST_ASSERT (g_file_test (filename, G_FILE_TEST_EXISTS));
+
+    TEST_ASSERT (_moo_text_buffer_export_pdf (buffer, "test.txt", filename, NULL));
+    TEST_ASSERT (g_file_test (filename, G_FILE_TEST_EXISTS));
+
+    g_object_unref (op);
+    g_object_unref (buffer);
+    g_string_free (text, TRUE);
+    g_free (filename);
+}
+
+static char *
+get_buffer_text (GtkTextBuffer *buffer)
+{
+    GtkTextIter start, end;
+    gtk_text_buffer_get_bounds (buffer, &start, &end);
+    return gtk_text_buffer_get_slice (buffer, &start, &end, TRUE);
+}
+
+#define TEST_BUFFER_TEXT(buffer,expected)           \
+G_STMT_START {                                      \
+    char *text__ = get_buffer_text (buffer);        \
+    TEST_ASSERT_STR_EQ (text__, expected);          \
+    g_free (text__);                                \
+} G_STMT_END
+
+static void
+test_undo_large_edit (void)
+{
+    GtkTextBuffer *buffer;
+    MooUndoStack *stack;
+    GtkTextIter start, end;
+    GString *text;
+    int i;
+
+    /* bigger than the size at which undo text goes to a temporary file */
+    text = g_string_new (NULL);
+    for (i = 0; text->len < (3 << 19); ++i)
+        g_string_append_printf (text, "line %d\n", i);
+
+    buffer = moo_text_buffer_new (NULL);
+    stack = MOO_UNDO_STACK (_moo_text_buffer_get_undo_stack (MOO_TEXT_BUFFER (buffer)));
+
+    gtk_text_buffer_insert_at_cursor (buffer, text->str, -1);
+    TEST_BUFFER_TEXT (buffer, text->str);
+
+    gtk_text_buffer_get_bounds (buffer, &start, &end);
+    gtk_text_buffer_delete (buffer, &start, &end);
+    TEST_BUFFER_TEXT (buffer, "");
+
+    TEST_ASSERT (moo_undo_stack_can_undo (stack));
+    moo_undo_stack_undo (stack);
+    TEST_BUFFER_TEXT (buffer, text->str);
+    moo_undo_stack_undo (stack);
+    TEST_BUFFER_TEXT (buffer, "");
+    TEST_ASSERT (!moo_undo_stack_can_undo (stack));
+
+    TEST_ASSERT (moo_undo_stack_can_redo (stack));
+    moo_undo_stack_redo (stack);
+    TEST_BUFFER_TEXT (buffer, text->str);
+    moo_undo_stack_redo (stack);
+    TEST_BUFFER_TEXT (buffer, "");
+    TEST_ASSERT (!moo_undo_stack_can_redo (stack));
+
+    moo_undo_stack_undo (stack);
+    TEST_BUFFER_TEXT (buffer, text->str);
+
+    g_object_unref (buffer);
+    g_string_free (text, TRUE);
+}
+
+static void
+count_edit (G_GNUC_UNUSED GtkTextBuffer *buffer,
+            G_GNUC_UNUSED GtkTextIter   *start,
+            G_GNUC_UNUSED gpointer       arg,
+            int                         *count)
+{
+    *count += 1;
+}
+
+static int
+replace_all (GtkTextBuffer      *buffer,
+             const char         *text,
+             const char         *replacement,
+             MooTextSearchFlags  flags)
+{
+    GtkTextIter start, end;
+    gtk_text_buffer_get_bounds (buffer, &start, &end);
+    return moo_text_replace_all (&start, &end, text, replacement, flags);
+}
+
+static void
+test_replace_all (void)
+{
+    const char *text = "foo bar\nFOO\nbaz foo\nqux\nfoo";
+    GtkTextBuffer *buffer;
+    MooUndoStack *stack;
+    GtkTextMark *mark, *inner_mark;
+    MooLineMark *line_mark1, *line_mark2;
+    GtkTextIter iter;
+    int n_deletes = 0;
+
+    buffer = moo_text_buffer_new (NULL);
+    stack = MOO_UNDO_STACK (_moo_text_buffer_get_undo_stack (MOO_TEXT_BUFFER (buffer)));
+    gtk_text_buffer_set_text (buffer, text, -1);
+    moo_undo_stack_clear (stack);
+
+    /* marks between the matches stay where they are */
+    gtk_text_buffer_get_iter_at_line_offset (buffer, &iter, 3, 1);
+    mark = gtk_text_buffer_create_mark (buffer, NULL, &iter, FALSE);
+    gtk_text_buffer_get_iter_at_line_offset (buffer, &iter, 0, 5);
+    gtk_text_buffer_place_cursor (buffer, &iter);
+    line_mark1 = MOO_LINE_MARK (g_object_new (MOO_TYPE_LINE_MARK, (const char*) NULL));
+    line_mark2 = MOO_LINE_MARK (g_object_new (MOO_TYPE_LINE_MARK, (const char*) NULL));
+    moo_text_buffer_add_line_mark (MOO_TEXT_BUFFER (buffer), line_mark1, 1);
+    moo_text_buffer_add_line_mark (MOO_TEXT_BUFFER (buffer), line_mark2, 3);
+    /* a mark inside a match goes where it would with a separate edit */
+    gtk_text_buffer_get_iter_at_line_offset (buffer, &iter, 2, 5);
+    inner_mark = gtk_text_buffer_create_mark (buffer, NULL, &iter, FALSE);
+    g_signal_connect (buffer, "delete-range", G_CALLBACK (count_edit), &n_deletes);
+
+    TEST_ASSERT_INT_EQ (replace_all (buffer, "foo", "x", MOO_TEXT_SEARCH_CASELESS), 4);
+    TEST_BUFFER_TEXT (buffer, "x bar\nx\nbaz x\nqux\nx");
+    /* all matches are replaced with one edit */
+    TEST_ASSERT_INT_EQ (n_deletes, 1);
+    g_signal_handlers_disconnect_by_func (buffer, (gpointer) count_edit, &n_deletes);
+
+    gtk_text_buffer_get_iter_at_mark (buffer, &iter, inner_mark);
+    TEST_ASSERT_INT_EQ (gtk_text_iter_get_line (&iter), 2);
+    TEST_ASSERT_INT_EQ (gtk_text_iter_get_line_offset (&iter), 5);
+
+    gtk_text_buffer_get_iter_at_mark (buffer, &iter, mark);
+    TEST_ASSERT_INT_EQ (gtk_text_iter_get_line (&iter), 3);
+    TEST_ASSERT_INT_EQ (gtk_text_iter_get_line_offset (&iter), 1);
+    gtk_text_buffer_get_iter_at_mark (buffer, &iter, gtk_text_buffer_get_insert (buffer));
+    TEST_ASSERT_INT_EQ (gtk_text_iter_get_line (&iter), 0);
+    TEST_ASSERT_INT_EQ (gtk_text_iter_get_line_offset (&iter), 3);
+    TEST_ASSERT_INT_EQ (moo_line_mark_get_line (line_mark1), 1);
+    TEST_ASSERT_INT_EQ (moo_line_mark_get_line (line_mark2), 3);
+
+    /* one undo action for all the pieces */
+    moo_undo_stack_undo (stack);
+    TEST_BUFFER_TEXT (buffer, text);
+    TEST_ASSERT (!moo_undo_stack_can_undo (stack));
+    moo_undo_stack_redo (stack);
+    TEST_BUFFER_TEXT (buffer, "x bar\nx\nbaz x\nqux\nx");
+    moo_undo_stack_undo (stack);
+    TEST_BUFFER_TEXT (buffer, text);
+    TEST_ASSERT_INT_EQ (moo_line_mark_get_line (line_mark1), 1);
+    TEST_ASSERT_INT_EQ (moo_line_mark_get_line (line_mark2), 3);
+
+    /* pieces which add and remove lines */
+    TEST_ASSERT_INT_EQ (replace_all (buffer, "o+", "\\n\\n", MOO_TEXT_SEARCH_REGEX), 3);
+    TEST_BUFFER_TEXT (buffer, "f\n\n bar\nFOO\nbaz f\n\n\nqux\nf\n\n");
+    TEST_ASSERT_INT_EQ (moo_line_mark_get_line (line_mark1), 3);
+    TEST_ASSERT_INT_EQ (moo_line_mark_get_line (line_mark2), 7);
+
+    TEST_ASSERT_INT_EQ (replace_all (buffer, "\n\n", "", 0), 3);
+    TEST_BUFFER_TEXT (buffer, "f bar\nFOO\nbaz f\nqux\nf");
+    TEST_ASSERT_INT_EQ (moo_line_mark_get_line (line_mark1), 1);
+    TEST_ASSERT_INT_EQ (moo_line_mark_get_line (line_mark2), 3);
+
+    moo_undo_stack_undo (stack);
+    moo_undo_stack_undo (stack);
+    TEST_BUFFER_TEXT (buffer, text);
+    TEST_ASSERT_INT_EQ (moo_line_mark_get_line (line_mark1), 1);
+    TEST_ASSERT_INT_EQ (moo_line_mark_get_line (line_mark2), 3);
+    TEST_ASSERT (!moo_undo_stack_can_undo (stack));
+
+    g_object_unref (line_mark1);
+    g_object_unref (line_mark2);
+    g_object_unref (buffer);
+}
+
 static void
 test_types (void)
 {
@@ -297,4 +504,7 @@ moo_test_editor (void)
     moo_test_suite_add_test (suite, "basic", "basic editor functionality", (MooTestFunc) test_basic, NULL);
     moo_test_suite_add_test (suite, "encodings", "character encoding handling", (MooTestFunc) test_encodings, NULL);
     moo_test_suite_add_test (suite, "types", "sanity checks for GObject types", (MooTestFunc) test_types, NULL);
+    moo_test_suite_add_test (suite, "undo-large-edit", "undo and redo of edits kept in temporary files", (MooTestFunc) test_undo_large_edit, NULL);
+    moo_test_suite_add_test (suite, "replace-all", "replacing all matches in one undo action", (MooTestFunc) test_replace_all, NULL);
+    moo_test_suite_add_test (suite, "export-pdf", "exporting a buffer to pdf", (MooTestFunc) test_export_pdf, NULL);
 }
@@ -22,6 +22,8 @@ G_BEGIN_DECLS
 
 void    moo_test_key_file           (void);
 void    moo_test_editor             (void);
+void    moo_test_encoding_sniffer   (void);
+void    moo_test_lang_mgr           (void);
 
 G_END_DECLS
 
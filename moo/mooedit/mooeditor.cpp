@@ -111,6 +111,7 @@ enum {
     PROP_SINGLE_WINDOW,
     PROP_SAVE_BACKUPS,
     PROP_STRIP_WHITESPACE,
+    PROP_BACKGROUND_SAVE,
 };
 
 enum {
@@ -186,6 +187,10 @@ moo_editor_class_init (MooEditorClass *klass)
         g_param_spec_boolean ("strip-whitespace", "strip-whitespace", "strip-whitespace",
                               FALSE, (GParamFlags) (G_PARAM_READWRITE | G_PARAM_CONSTRUCT)));
 
+    g_object_class_install_property (gobject_class, PROP_BACKGROUND_SAVE,
+        g_param_spec_boolean ("background-save", "background-save", "background-save",
+                              FALSE, (GParamFlags) (G_PARAM_READWRITE | G_PARAM_CONSTRUCT)));
+
     signals[BEFORE_CLOSE_WINDOW] =
             g_signal_new ("before-close-window",
                           G_OBJECT_CLASS_TYPE (klass),
@@ -426,6 +431,10 @@ moo_editor_set_property (GObject        *object,
             set_flag (editor, STRIP_WHITESPACE, g_value_get_boolean (value));
             break;
 
+        case PROP_BACKGROUND_SAVE:
+            set_flag (editor, BACKGROUND_SAVE, g_value_get_boolean (value));
+            break;
+
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
             break;
@@ -462,6 +471,10 @@ moo_editor_get_property (GObject        *object,
             g_value_set_boolean (value, test_flag (editor, STRIP_WHITESPACE));
             break;
 
+        case PROP_BACKGROUND_SAVE:
+            g_value_set_boolean (value, test_flag (editor, BACKGROUND_SAVE));
+            break;
+
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
             break;
@@ -2415,13 +2428,19 @@ moo_editor_before_save (G_GNUC_UNUSED MooEditor *editor,
     return MOO_SAVE_RESPONSE_CONTINUE;
 }
 
+// Background save runs a main loop while the file is written, so only
+// Save and Save As invoked by the user may use it; save all, saving on
+// close or quit, tools and copies must not be reentered from there.
 static MooEditSaveFlags
-moo_editor_get_save_flags (MooEditor *editor)
+moo_editor_get_save_flags (MooEditor *editor,
+                           bool       interactive)
 {
     MooEditSaveFlags flags = MOO_EDIT_SAVE_FLAGS_NONE;
 
     if (test_flag (editor, SAVE_BACKUPS))
         flags |= MOO_EDIT_SAVE_BACKUP;
+    if (interactive && test_flag (editor, BACKGROUND_SAVE))
+        flags |= MOO_EDIT_SAVE_BACKGROUND;
 
     return flags;
 }
@@ -2443,6 +2462,7 @@ do_save(MooEditor&  editor,
         Edit        doc,
         g::File     file,
         const char* encoding,
+        bool        interactive,
         gerrp&      error)
 {
     int response = MOO_SAVE_RESPONSE_CONTINUE;
@@ -2467,7 +2487,7 @@ do_save(MooEditor&  editor,
     doc.signal_emit_by_name ("will-save", file.gobj ());
 
     result = _moo_edit_save_file(doc, file, encoding,
-                                 moo_editor_get_save_flags(&editor),
+                                 moo_editor_get_save_flags(&editor, interactive),
                                  error_here);
     if (!result && error_here->domain == MOO_EDIT_FILE_ERROR &&
         error_here->code == MOO_EDIT_FILE_ERROR_ENCODING)
@@ -2477,7 +2497,7 @@ do_save(MooEditor&  editor,
         if (_moo_edit_save_error_enc_dialog(doc, file, encoding))
         {
             result = _moo_edit_save_file(doc, file, "UTF-8",
-                                         moo_editor_get_save_flags(&editor),
+                                         moo_editor_get_save_flags(&editor, interactive),
                                          error_here);
         }
         else
@@ -2505,13 +2525,18 @@ do_save(MooEditor&  editor,
     return true;
 }
 
-/**
- * moo_editor_save:
- **/
-gboolean
-moo_editor_save (MooEditor  *editor,
-                 MooEdit    *doc,
-                 GError    **error)
+static gboolean
+editor_save_as (MooEditor   *editor,
+                MooEdit     *doc,
+                MooSaveInfo *info_init,
+                bool         interactive,
+                GError     **error);
+
+static gboolean
+editor_save (MooEditor  *editor,
+             MooEdit    *doc,
+             bool        interactive,
+             GError    **error)
 {
     moo_return_error_if_fail (MOO_IS_EDITOR (editor));
     moo_return_error_if_fail (MOO_IS_EDIT (doc));
@@ -2526,7 +2551,7 @@ moo_editor_save (MooEditor  *editor,
     }
 
     if (moo_edit_is_untitled (doc))
-        return moo_editor_save_as (editor, doc, NULL, error);
+        return editor_save_as (editor, doc, NULL, interactive, error);
 
     g::FilePtr file = wrap_new(moo_edit_get_file(doc));
     gstr encoding = gstr::wrap(moo_edit_get_encoding(doc));
@@ -2542,25 +2567,15 @@ moo_editor_save (MooEditor  *editor,
     }
 
     gerrp error_here(error);
-    return do_save(*editor, *doc, *file, encoding, error_here);
+    return do_save(*editor, *doc, *file, encoding, interactive, error_here);
 }
 
-/**
- * moo_editor_save_as:
- *
- * @editor:
- * @doc:
- * @info: (allow-none) (default NULL)
- * @error:
- *
- * Save document with new filename and/or encoding. If @info is
- * missing or %NULL then user is asked for new filename first.
- **/
-gboolean
-moo_editor_save_as (MooEditor   *editor,
-                    MooEdit     *doc,
-                    MooSaveInfo *info_init,
-                    GError     **error)
+static gboolean
+editor_save_as (MooEditor   *editor,
+                MooEdit     *doc,
+                MooSaveInfo *info_init,
+                bool         interactive,
+                GError     **error)
 {
     moo_return_error_if_fail (MOO_IS_EDITOR (editor));
     moo_return_error_if_fail (MOO_IS_EDIT (doc));
@@ -2598,7 +2613,53 @@ moo_editor_save_as (MooEditor   *editor,
     update_history_item_for_doc(editor, doc, FALSE);
 
     gerrp error_here(error);
-    return do_save(*editor, *doc, *info->file, info->encoding, error_here);
+    return do_save(*editor, *doc, *info->file, info->encoding, interactive, error_here);
+}
+
+/**
+ * moo_editor_save:
+ **/
+gboolean
+moo_editor_save (MooEditor  *editor,
+                 MooEdit    *doc,
+                 GError    **error)
+{
+    return editor_save (editor, doc, false, error);
+}
+
+/**
+ * moo_editor_save_as:
+ *
+ * @editor:
+ * @doc:
+ * @info: (allow-none) (default NULL)
+ * @error:
+ *
+ * Save document with new filename and/or encoding. If @info is
+ * missing or %NULL then user is asked for new filename first.
+ **/
+gboolean
+moo_editor_save_as (MooEditor   *editor,
+                    MooEdit     *doc,
+                    MooSaveInfo *info_init,
+                    GError     **error)
+{
+    return editor_save_as (editor, doc, info_init, false, error);
+}
+
+/* Save and Save As actions: these may save in background */
+void
+_moo_editor_save_interactive (MooEditor *editor,
+                              MooEdit   *doc)
+{
+    editor_save (editor, doc, true, NULL);
+}
+
+void
+_moo_editor_save_as_interactive (MooEditor *editor,
+                                 MooEdit   *doc)
+{
+    editor_save_as (editor, doc, NULL, true, NULL);
 }
 
 /**
@@ -2617,7 +2678,7 @@ moo_editor_save_copy (MooEditor   *editor,
     gerrp error_here(error);
     return _moo_edit_save_file_copy (*doc, *info->file,
                                      !info->encoding.empty() ? info->encoding : moo_edit_get_encoding (doc),
-                                     moo_editor_get_save_flags (editor),
+                                     moo_editor_get_save_flags (editor, false),
                                      error_here);
 }
 
@@ -2771,7 +2832,7 @@ moo_editor_set_doc_type (MooEditor      *editor,
 void
 _moo_editor_apply_prefs (MooEditor *editor)
 {
-    gboolean backups;
+    gboolean backups, background_save;
     const char *color_scheme;
 
     _moo_edit_window_update_title ();
@@ -2786,9 +2847,11 @@ _moo_editor_apply_prefs (MooEditor *editor)
         _moo_lang_mgr_set_active_scheme (editor->priv->lang_mgr.gobj(), color_scheme);
 
     backups = moo_prefs_get_bool (moo_edit_setting (MOO_EDIT_PREFS_MAKE_BACKUPS));
+    background_save = moo_prefs_get_bool (moo_edit_setting (MOO_EDIT_PREFS_BACKGROUND_SAVE));
 
     g_object_set (editor,
                   "save-backups", backups,
+                  "background-save", background_save,
                   NULL);
 }
 
@@ -105,6 +105,10 @@ _moo_edit_init_config (void)
     _moo_edit_settings[MOO_EDIT_SETTING_WORD_CHARS] =
         moo_edit_config_install_setting (g_param_spec_string ("word-chars", "word-chars", "word-chars",
                                                               NULL, (GParamFlags) G_PARAM_READWRITE));
+    _moo_edit_settings[MOO_EDIT_SETTING_LARGE_FILE] =
+        moo_edit_config_install_setting (g_param_spec_boolean ("large-file", "large-file", "large-file",
+                                                               FALSE,
+                                                               (GParamFlags) G_PARAM_READWRITE));
 }
 
 
@@ -133,6 +137,7 @@ _moo_edit_init_prefs (void)
     NEW_KEY_BOOL (MOO_EDIT_PREFS_AUTO_SAVE, FALSE);
     NEW_KEY_INT (MOO_EDIT_PREFS_AUTO_SAVE_INTERVAL, 5);
     NEW_KEY_BOOL (MOO_EDIT_PREFS_MAKE_BACKUPS, FALSE);
+    NEW_KEY_BOOL (MOO_EDIT_PREFS_BACKGROUND_SAVE, FALSE);
     NEW_KEY_BOOL (MOO_EDIT_PREFS_STRIP, FALSE);
     NEW_KEY_BOOL (MOO_EDIT_PREFS_ADD_NEWLINE, FALSE);
 
@@ -155,6 +160,7 @@ _moo_edit_init_prefs (void)
     NEW_KEY_BOOL (MOO_EDIT_PREFS_HIGHLIGHT_MATCHING, TRUE);
     NEW_KEY_BOOL (MOO_EDIT_PREFS_HIGHLIGHT_MISMATCHING, FALSE);
     NEW_KEY_BOOL (MOO_EDIT_PREFS_HIGHLIGHT_CURRENT_LINE, TRUE);
+    NEW_KEY_BOOL (MOO_EDIT_PREFS_HIGHLIGHT_SEARCH_MATCHES, FALSE);
     NEW_KEY_BOOL (MOO_EDIT_PREFS_DRAW_RIGHT_MARGIN, FALSE);
     NEW_KEY_INT (MOO_EDIT_PREFS_RIGHT_MARGIN_OFFSET, 80);
     NEW_KEY_BOOL (MOO_EDIT_PREFS_SHOW_LINE_NUMBERS, FALSE);
@@ -164,6 +170,13 @@ _moo_edit_init_prefs (void)
     NEW_KEY_STRING (MOO_EDIT_PREFS_FONT, DEFAULT_FONT);
     NEW_KEY_INT (MOO_EDIT_PREFS_QUICK_SEARCH_FLAGS, MOO_TEXT_SEARCH_CASELESS);
     NEW_KEY_STRING (MOO_EDIT_PREFS_LINE_NUMBERS_FONT, NULL);
+    /* size in kilobytes; zero means never */
+    NEW_KEY_INT (MOO_EDIT_PREFS_LARGE_FILE_SIZE, 10 * 1024);
+    NEW_KEY_INT (MOO_EDIT_PREFS_LARGE_FILE_LINES, 200000);
+    /* undo history size in megabytes; zero means unlimited */
+    NEW_KEY_INT (MOO_EDIT_PREFS_UNDO_MEMORY, 100);
+    /* size of undo text kept in temporary files in megabytes; zero means unlimited */
+    NEW_KEY_INT (MOO_EDIT_PREFS_UNDO_DISK, 1024);
 
     NEW_KEY_STRING (MOO_EDIT_PREFS_ENCODINGS, _moo_get_default_encodings ());
     NEW_KEY_STRING (MOO_EDIT_PREFS_ENCODING_SAVE, MOO_ENCODING_UTF8);
@@ -212,12 +225,37 @@ _moo_edit_update_global_config (void)
 }
 
 
+/* Whitespace drawing comes from prefs, unless the document is in large
+   file mode: it walks every visible character on each expose. */
+void
+_moo_edit_view_apply_draw_ws (MooEditView *view)
+{
+    MooEdit *doc;
+    MooDrawWsFlags ws_flags = MOO_DRAW_WS_NONE;
+
+    g_return_if_fail (MOO_IS_EDIT_VIEW (view));
+
+    doc = moo_edit_view_get_doc (view);
+
+    if (!doc || !moo_edit_config_get_bool (doc->config, "large-file"))
+    {
+        if (get_bool (MOO_EDIT_PREFS_SHOW_TABS))
+            ws_flags |= MOO_DRAW_WS_TABS;
+        if (get_bool (MOO_EDIT_PREFS_SHOW_SPACES))
+            ws_flags |= MOO_DRAW_WS_SPACES;
+        if (get_bool (MOO_EDIT_PREFS_SHOW_TRAILING_SPACES))
+            ws_flags |= MOO_DRAW_WS_TRAILING;
+    }
+
+    g_object_set (view, "draw-whitespace", ws_flags, NULL);
+}
+
+
 void
 _moo_edit_view_apply_prefs (MooEditView *view)
 {
     MooLangMgr *mgr;
     MooTextStyleScheme *scheme;
-    MooDrawWsFlags ws_flags = MOO_DRAW_WS_NONE;
 
     g_return_if_fail (MOO_IS_EDIT_VIEW (view));
 
@@ -226,19 +264,13 @@ _moo_edit_view_apply_prefs (MooEditView *view)
     mgr = moo_lang_mgr_default ();
     scheme = moo_lang_mgr_get_active_scheme (mgr);
 
-    if (get_bool (MOO_EDIT_PREFS_SHOW_TABS))
-        ws_flags |= MOO_DRAW_WS_TABS;
-    if (get_bool (MOO_EDIT_PREFS_SHOW_SPACES))
-        ws_flags |= MOO_DRAW_WS_SPACES;
-    if (get_bool (MOO_EDIT_PREFS_SHOW_TRAILING_SPACES))
-        ws_flags |= MOO_DRAW_WS_TRAILING;
-
     g_object_set (view,
                   "smart-home-end", get_bool (MOO_EDIT_PREFS_SMART_HOME_END),
                   "enable-highlight", get_bool (MOO_EDIT_PREFS_ENABLE_HIGHLIGHTING),
                   "highlight-matching-brackets", get_bool (MOO_EDIT_PREFS_HIGHLIGHT_MATCHING),
                   "highlight-mismatching-brackets", get_bool (MOO_EDIT_PREFS_HIGHLIGHT_MISMATCHING),
                   "highlight-current-line", get_bool (MOO_EDIT_PREFS_HIGHLIGHT_CURRENT_LINE),
+                  "highlight-search-matches", get_bool (MOO_EDIT_PREFS_HIGHLIGHT_SEARCH_MATCHES),
                   "draw-right-margin", get_bool (MOO_EDIT_PREFS_DRAW_RIGHT_MARGIN),
                   "right-margin-offset", get_int (MOO_EDIT_PREFS_RIGHT_MARGIN_OFFSET),
                   "quick-search-flags", get_int (MOO_EDIT_PREFS_QUICK_SEARCH_FLAGS),
@@ -247,7 +279,7 @@ _moo_edit_view_apply_prefs (MooEditView *view)
                   "backspace-indents", get_bool (MOO_EDIT_PREFS_BACKSPACE_INDENTS),
                   NULL);
 
-    g_object_set (view, "draw-whitespace", ws_flags, NULL);
+    _moo_edit_view_apply_draw_ws (view);
 
     moo_text_view_set_font_from_string (MOO_TEXT_VIEW (view),
                                         get_string (MOO_EDIT_PREFS_FONT));
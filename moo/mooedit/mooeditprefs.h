@@ -50,6 +50,7 @@ const char *moo_edit_setting            (const char *setting_name);
 #define MOO_EDIT_PREFS_AUTO_SAVE                "auto_save"
 #define MOO_EDIT_PREFS_AUTO_SAVE_INTERVAL       "auto_save_interval"
 #define MOO_EDIT_PREFS_MAKE_BACKUPS             "make_backups"
+#define MOO_EDIT_PREFS_BACKGROUND_SAVE          "background_save"
 #define MOO_EDIT_PREFS_STRIP                    "strip"
 #define MOO_EDIT_PREFS_ADD_NEWLINE              "add_newline"
 
@@ -62,6 +63,7 @@ const char *moo_edit_setting            (const char *setting_name);
 #define MOO_EDIT_PREFS_HIGHLIGHT_MATCHING       "highlight_matching_brackets"
 #define MOO_EDIT_PREFS_HIGHLIGHT_MISMATCHING    "highlight_mismatching_brackets"
 #define MOO_EDIT_PREFS_HIGHLIGHT_CURRENT_LINE   "highlight_current_line"
+#define MOO_EDIT_PREFS_HIGHLIGHT_SEARCH_MATCHES "highlight_search_matches"
 #define MOO_EDIT_PREFS_DRAW_RIGHT_MARGIN        "draw_right_margin"
 #define MOO_EDIT_PREFS_RIGHT_MARGIN_OFFSET      "right_margin_offset"
 #define MOO_EDIT_PREFS_SHOW_LINE_NUMBERS        "show_line_numbers"
@@ -69,6 +71,10 @@ const char *moo_edit_setting            (const char *setting_name);
 #define MOO_EDIT_PREFS_SHOW_SPACES              "show_spaces"
 #define MOO_EDIT_PREFS_SHOW_TRAILING_SPACES     "show_trailing_spaces"
 #define MOO_EDIT_PREFS_FONT                     "font"
+#define MOO_EDIT_PREFS_LARGE_FILE_SIZE          "large_file_size"
+#define MOO_EDIT_PREFS_LARGE_FILE_LINES         "large_file_lines"
+#define MOO_EDIT_PREFS_UNDO_MEMORY              "undo_memory"
+#define MOO_EDIT_PREFS_UNDO_DISK                "undo_disk"
 #define MOO_EDIT_PREFS_LINE_NUMBERS_FONT        "line_numbers_font"
 
 #define MOO_EDIT_PREFS_LAST_DIR                 "last_dir"
@@ -231,6 +231,7 @@ page_view_init_ui (MooPrefsPage *page)
     BIND_SETTING (check_highlight_matching_brackets, MOO_EDIT_PREFS_HIGHLIGHT_MATCHING);
     BIND_SETTING (check_highlight_mismatching_brackets, MOO_EDIT_PREFS_HIGHLIGHT_MISMATCHING);
     BIND_SETTING (check_highlight_current_line, MOO_EDIT_PREFS_HIGHLIGHT_CURRENT_LINE);
+    BIND_SETTING (check_highlight_search_matches, MOO_EDIT_PREFS_HIGHLIGHT_SEARCH_MATCHES);
     BIND_SETTING (show_line_numbers, MOO_EDIT_PREFS_SHOW_LINE_NUMBERS);
     BIND_SETTING (check_show_tabs, MOO_EDIT_PREFS_SHOW_TABS);
     BIND_SETTING (check_show_spaces, MOO_EDIT_PREFS_SHOW_SPACES);
@@ -282,6 +283,7 @@ page_file_init_ui (MooPrefsPage *page)
     BIND_SETTING (check_strip, MOO_EDIT_PREFS_STRIP);
     BIND_SETTING (check_add_newline, MOO_EDIT_PREFS_ADD_NEWLINE);
     BIND_SETTING (check_make_backups, MOO_EDIT_PREFS_MAKE_BACKUPS);
+    BIND_SETTING (check_background_save, MOO_EDIT_PREFS_BACKGROUND_SAVE);
     BIND_SETTING (check_save_session, MOO_EDIT_PREFS_SAVE_SESSION);
     BIND_SETTING (check_open_dialog_follows_doc, MOO_EDIT_PREFS_DIALOGS_OPEN_FOLLOWS_DOC);
     BIND_SETTING (check_auto_sync, MOO_EDIT_PREFS_AUTO_SYNC);
@@ -22,6 +22,7 @@ struct MooEditProgress
 
     guint timeout;
     moo::gstr text;
+    double fraction;
     GDestroyNotify cancel_op;
     gpointer cancel_data;
 
@@ -41,6 +42,7 @@ static void
 moo_edit_progress_init (MooEditProgress *pr)
 {
     new(pr)(MooEditProgress);
+    pr->fraction = -1;
     pr->xml = progress_widget_xml_new_with_root (GTK_WIDGET (pr));
     g_signal_connect_swapped (pr->xml->cancel, "clicked", G_CALLBACK (cancel_clicked), pr);
 }
@@ -94,12 +96,24 @@ _moo_edit_progress_set_text (MooEditProgress& progress,
     progress.update();
 }
 
+// Switches the progress bar from pulsing to showing actual progress;
+// negative fraction switches it back to pulsing.
+void
+_moo_edit_progress_set_fraction (MooEditProgress& progress,
+                                 double           fraction)
+{
+    progress.fraction = CLAMP (fraction, -1., 1.);
+    if (progress.fraction >= 0)
+        gtk_progress_bar_set_fraction (progress.xml->progressbar, progress.fraction);
+}
+
 static gboolean
 pulse_progress (MooEditProgress *progress)
 {
     g_return_val_if_fail (MOO_IS_EDIT_PROGRESS (progress), FALSE);
     g_return_val_if_fail (GTK_IS_WIDGET (progress->xml->progressbar), FALSE);
-    gtk_progress_bar_pulse (GTK_PROGRESS_BAR (progress->xml->progressbar));
+    if (progress->fraction < 0)
+        gtk_progress_bar_pulse (GTK_PROGRESS_BAR (progress->xml->progressbar));
     progress->update();
     return TRUE;
 }
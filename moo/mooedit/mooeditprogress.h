@@ -22,5 +22,7 @@ void            _moo_edit_progress_set_cancel_func (MooEditProgress& progress,
                                                     gpointer         cancel_func_data);
 void            _moo_edit_progress_set_text        (MooEditProgress& progress,
                                                     const char*      text);
+void            _moo_edit_progress_set_fraction    (MooEditProgress& progress,
+                                                    double           fraction);
 
 #endif __cplusplus
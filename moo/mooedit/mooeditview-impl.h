@@ -29,6 +29,7 @@ public:
 G_BEGIN_DECLS
 
 void            _moo_edit_view_apply_prefs              (MooEditView    *view);
+void            _moo_edit_view_apply_draw_ws            (MooEditView    *view);
 
 void            _moo_edit_view_ui_set_line_wrap         (MooEditView    *view,
                                                          gboolean        enabled);
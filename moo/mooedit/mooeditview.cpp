@@ -254,6 +254,8 @@ void EditView::_apply_config()
     moo_text_view_set_tab_width (MOO_TEXT_VIEW (gobj()), tab_width);
     moo_text_view_set_word_chars (MOO_TEXT_VIEW (gobj()), word_chars);
 
+    _moo_edit_view_apply_draw_ws (gobj());
+
     gtk_widget_queue_draw (GTK_WIDGET (gobj()));
 
     ::g_free (word_chars);
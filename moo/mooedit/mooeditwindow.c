@@ -95,6 +95,7 @@ struct MooEditWindowPrivate {
     GtkLabel *cursor_label;
     GtkLabel *chars_label;
     GtkLabel *insert_label;
+    GtkWidget *large_file_label;
     GtkWidget *info;
 
     GtkWidget *doc_paned;
@@ -283,6 +284,8 @@ static void action_abort_jobs                   (MooEditWindow      *window);
 
 static void wrap_text_toggled                   (MooEditWindow      *window,
                                                  gboolean            active);
+static void large_file_toggled                  (MooEditWindow      *window,
+                                                 gboolean            active);
 static void line_numbers_toggled                (MooEditWindow      *window,
                                                  gboolean            active);
 
@@ -623,6 +626,15 @@ moo_edit_window_class_init (MooEditWindowClass *klass)
                                  "condition::sensitive", "has-open-document",
                                  NULL);
 
+    moo_window_class_new_action (window_class, "LargeFileMode", NULL,
+                                 "action-type::", MOO_TYPE_TOGGLE_ACTION,
+                                 "display-name", _("Toggle Large File Mode"),
+                                 "label", _("Large _File Mode"),
+                                 "tooltip", _("Disable features which are slow in huge documents"),
+                                 "toggled-callback", large_file_toggled,
+                                 "condition::sensitive", "has-open-document",
+                                 NULL);
+
     moo_window_class_new_action (window_class, "FocusDoc", NULL,
                                  "display-name", _("Focus Document"),
                                  "label", _("_Focus Document"),
@@ -1493,7 +1505,7 @@ action_save (MooEditWindow *window)
 {
     MooEdit *doc = ACTIVE_DOC (window);
     g_return_if_fail (doc != NULL);
-    moo_editor_save (window->priv->editor, doc, NULL);
+    _moo_editor_save_interactive (window->priv->editor, doc);
 }
 
 
@@ -1502,7 +1514,7 @@ action_save_as (MooEditWindow *window)
 {
     MooEdit *doc = ACTIVE_DOC (window);
     g_return_if_fail (doc != NULL);
-    moo_editor_save_as (window->priv->editor, doc, NULL, NULL);
+    _moo_editor_save_as_interactive (window->priv->editor, doc);
 }
 
 
@@ -2061,6 +2073,16 @@ line_numbers_toggled (MooEditWindow *window,
 }
 
 
+static void
+large_file_toggled (MooEditWindow *window,
+                    gboolean       active)
+{
+    MooEdit *doc = ACTIVE_DOC (window);
+    g_return_if_fail (doc != NULL);
+    _moo_edit_set_large_file (doc, active);
+}
+
+
 /****************************************************************************/
 /* Notebook popup menu
  */
@@ -2608,6 +2630,28 @@ view_show_line_numbers_changed (MooEditWindow *window,
 }
 
 
+static void
+edit_large_file_changed (MooEditWindow *window,
+                         G_GNUC_UNUSED GParamSpec *pspec,
+                         MooEdit       *doc)
+{
+    GtkAction *action;
+
+    if (doc != ACTIVE_DOC (window))
+        return;
+
+    action = moo_window_get_action (MOO_WINDOW (window), "LargeFileMode");
+    g_return_if_fail (action != NULL);
+
+    gtk_toggle_action_set_active (GTK_TOGGLE_ACTION (action), _moo_edit_is_large_file (doc));
+
+    /* XXX menu item and action go out of sync for some reason */
+    sync_proxies (action);
+
+    update_statusbar (window);
+}
+
+
 static void
 update_doc_view_actions (MooEditWindow *window)
 {
@@ -2620,6 +2664,7 @@ update_doc_view_actions (MooEditWindow *window)
 
     view_wrap_mode_changed (window, NULL, view);
     view_show_line_numbers_changed (window, NULL, view);
+    edit_large_file_changed (window, NULL, moo_edit_view_get_doc (view));
 }
 
 
@@ -3071,6 +3116,8 @@ _moo_edit_window_insert_tab (MooEditWindow *window,
                               G_CALLBACK (proxy_boolean_property), window);
     g_signal_connect_swapped (doc, "notify::lang",
                               G_CALLBACK (edit_lang_changed), window);
+    g_signal_connect_swapped (doc, "notify::large-file",
+                              G_CALLBACK (edit_large_file_changed), window);
 
     for (i = 0; i < moo_edit_view_array_get_size (views); ++i)
         connect_view (window, views->elms[i]);
@@ -3132,6 +3179,7 @@ _moo_edit_window_remove_doc (MooEditWindow *window,
     g_signal_handlers_disconnect_by_func (doc, (gpointer) edit_filename_changed, window);
     g_signal_handlers_disconnect_by_func (doc, (gpointer) proxy_boolean_property, window);
     g_signal_handlers_disconnect_by_func (doc, (gpointer) edit_lang_changed, window);
+    g_signal_handlers_disconnect_by_func (doc, (gpointer) edit_large_file_changed, window);
 
     for (i = 0; i < views->n_elms; ++i)
         disconnect_view (window, views->elms[i]);
@@ -3887,6 +3935,11 @@ do_update_statusbar (MooEditWindow *window)
     ovr = gtk_text_view_get_overwrite (GTK_TEXT_VIEW (view));
     /* Label in the editor window statusbar - Overwrite or Insert mode */
     gtk_label_set_text (window->priv->insert_label, ovr ? _("OVR") : _("INS"));
+
+    if (_moo_edit_is_large_file (doc))
+        gtk_widget_show (window->priv->large_file_label);
+    else
+        gtk_widget_hide (window->priv->large_file_label);
 }
 
 static gboolean
@@ -3925,6 +3978,9 @@ create_statusbar (MooEditWindow *window)
     window->priv->cursor_label = xml->cursor;
     window->priv->chars_label = xml->chars;
     window->priv->insert_label = xml->insert;
+    window->priv->large_file_label = GTK_WIDGET (xml->large_file);
+    /* Label in the editor window statusbar - document is in large file mode */
+    gtk_label_set_text (xml->large_file, _("LARGE"));
     window->priv->info = GTK_WIDGET (xml->info);
 }
 
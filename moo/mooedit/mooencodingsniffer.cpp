@@ -0,0 +1,755 @@
+/*
+ *   mooencodingsniffer.cpp
+ *
+ *   Copyright (C) 2004-2016 by Yevgen Muntyan <emuntyan@users.sourceforge.net>
+ *
+ *   This file is part of medit.  medit is free software; you can
+ *   redistribute it and/or modify it under the terms of the
+ *   GNU Lesser General Public License as published by the
+ *   Free Software Foundation; either version 2.1 of the License,
+ *   or (at your option) any later version.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with medit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "mooedit/mooencodingsniffer.h"
+#include "mooedit/mooeditor-tests.h"
+#include "mooutils/moofilewriter.h"
+#include "mooutils/mooutils-fs.h"
+#include <mooglib/moo-glib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+using namespace moo;
+
+namespace {
+
+enum Family {
+    FAMILY_UTF8,
+    FAMILY_UTF16LE,
+    FAMILY_UTF16BE,
+    FAMILY_UTF32LE,
+    FAMILY_UTF32BE,
+    FAMILY_EUC,
+    FAMILY_SJIS,
+    FAMILY_DBCS,
+    FAMILY_ISO2022,
+    FAMILY_SINGLE_BYTE
+};
+
+struct FamilyNames
+{
+    Family      family;
+    const char *names;
+};
+
+// Names are uppercase with '-' and '_' stripped, see normalize_name()
+const FamilyNames family_names[] = {
+    { FAMILY_UTF8,    "|UTF8|" },
+    { FAMILY_UTF16LE, "|UTF16LE|UCS2LE|" },
+    { FAMILY_UTF16BE, "|UTF16BE|UCS2BE|UTF16|" },
+    { FAMILY_UTF32LE, "|UTF32LE|UCS4LE|" },
+    { FAMILY_UTF32BE, "|UTF32BE|UCS4BE|UTF32|UCS4|" },
+    { FAMILY_EUC,     "|EUCJP|EUCKR|EUCCN|EUCTW|GB2312|" },
+    { FAMILY_SJIS,    "|SHIFTJIS|SJIS|CP932|WINDOWS31J|MSKANJI|" },
+    { FAMILY_DBCS,    "|GBK|GB18030|BIG5|BIG5HKSCS|CP936|CP950|CP949|UHC|" },
+    { FAMILY_ISO2022, "|ISO2022JP|ISO2022JP2|ISO2022KR|ISO2022CN|" },
+};
+
+// Where letters live in single-byte encodings. Text in a given script
+// is mostly lowercase letters, and for non-latin scripts most letters
+// are non-ASCII; that's enough to tell e.g. CP1251 from KOI8-R or
+// ISO-8859-1 from CP1251.
+struct SingleByteProfile
+{
+    const char *names;
+    guchar      upper_start, upper_end;
+    guchar      lower_start, lower_end;
+    guchar      lower2_start, lower2_end;
+    bool        latin;
+    bool        c1_controls;    // 0x80-0x9F are control characters
+    const char *undefined;      // bytes iconv refuses to convert
+};
+
+const SingleByteProfile single_byte_profiles[] = {
+    { "|ISO88591|LATIN1|L1|ISO885915|LATIN9|",
+      0xC0, 0xDE, 0xDF, 0xFF, 0, 0, true, true, "" },
+    { "|CP1252|WINDOWS1252|",
+      0xC0, 0xDE, 0xDF, 0xFF, 0, 0, true, false, "\x81\x8D\x8F\x90\x9D" },
+    { "|ISO88592|LATIN2|L2|",
+      0xC0, 0xDE, 0xDF, 0xFF, 0, 0, true, true, "" },
+    { "|CP1250|WINDOWS1250|",
+      0xC0, 0xDE, 0xDF, 0xFF, 0, 0, true, false, "\x81\x83\x88\x90\x98" },
+    { "|CP1251|WINDOWS1251|",
+      0xC0, 0xDF, 0xE0, 0xFF, 0, 0, false, false, "\x98" },
+    { "|KOI8R|KOI8U|KOI8RU|",
+      0xE0, 0xFF, 0xC0, 0xDF, 0, 0, false, false, "" },
+    { "|ISO88595|",
+      0xB0, 0xCF, 0xD0, 0xEF, 0, 0, false, true, "" },
+    { "|CP866|IBM866|",
+      0x80, 0x9F, 0xA0, 0xAF, 0xE0, 0xEF, false, false, "" },
+    { "|ISO88597|",
+      0xC1, 0xD9, 0xDC, 0xFE, 0, 0, false, true, "" },
+    { "|CP1253|WINDOWS1253|",
+      0xC1, 0xD9, 0xDC, 0xFE, 0, 0, false, false, "\x81\x88\x8A\x8C\x8D\x8E\x8F\x90\x98\x9A\x9C\x9D\x9E\x9F\xAA\xD2\xFF" },
+};
+
+#define SCORE_IMPOSSIBLE    (-1)
+#define SCORE_ASCII         50
+
+void
+normalize_name (const char *encoding,
+                char       *buf,
+                gsize       bufsize)
+{
+    gsize len = 0;
+
+    buf[len++] = '|';
+
+    for (const char *p = encoding; *p && len + 2 < bufsize; ++p)
+        if (*p != '-' && *p != '_' && *p != ' ')
+            buf[len++] = g_ascii_toupper (*p);
+
+    buf[len++] = '|';
+    buf[len] = 0;
+}
+
+bool
+name_in_list (const char *name,
+              const char *list)
+{
+    return strstr (list, name) != nullptr;
+}
+
+gsize
+count_range (const gsize *hist,
+             guint        start,
+             guint        end)
+{
+    gsize count = 0;
+
+    if (start == 0 && end == 0)
+        return 0;
+
+    for (guint i = start; i <= end; ++i)
+        count += hist[i];
+
+    return count;
+}
+
+// How much of the data the two most frequent values cover
+double
+top2_coverage (const gsize *hist,
+               gsize        total)
+{
+    gsize first = 0, second = 0;
+
+    if (total == 0)
+        return 0;
+
+    for (guint i = 0; i < 256; ++i)
+    {
+        if (hist[i] > first)
+        {
+            second = first;
+            first = hist[i];
+        }
+        else if (hist[i] > second)
+        {
+            second = hist[i];
+        }
+    }
+
+    return (double) (first + second) / total;
+}
+
+int
+clamp_score (double score)
+{
+    return (int) CLAMP (score, 1, 100);
+}
+
+} // namespace
+
+
+MooEncodingSniffer::MooEncodingSniffer ()
+    : m_len (0)
+    , m_eof (false)
+    , m_high (0)
+    , m_ascii_letters (0)
+    , m_last_nul (0)
+    , m_utf8_invalid (0)
+    , m_utf8_multibyte (0)
+    , m_euc_invalid (0)
+    , m_sjis_invalid (0)
+    , m_sjis_kana (0)
+    , m_dbcs_invalid (0)
+{
+    memset (m_hist, 0, sizeof m_hist);
+    memset (m_hist_odd, 0, sizeof m_hist_odd);
+    memset (m_nul_pos, 0, sizeof m_nul_pos);
+}
+
+// All statistics are collected in this single loop; the state machines
+// check whether the data is a valid byte sequence in UTF-8, EUC, Shift_JIS
+// and generic double-byte encodings (GBK, GB18030, Big5, UHC).
+void
+MooEncodingSniffer::feed (const char *data,
+                          gsize       len,
+                          bool        eof)
+{
+    g_return_if_fail (m_len == 0);
+
+    const guchar *p = reinterpret_cast<const guchar*> (data);
+
+    guint utf8_need = 0;
+    guchar utf8_lo = 0x80, utf8_hi = 0xBF;
+    guint euc_need = 0;
+    bool sjis_trail = false;
+    guint dbcs_state = 0;
+
+    for (gsize i = 0; i < len; ++i)
+    {
+        guchar c = p[i];
+
+        m_hist[c] += 1;
+        if (i & 1)
+            m_hist_odd[c] += 1;
+
+        if (c < 0x80 && utf8_need == 0 && euc_need == 0 && !sjis_trail && dbcs_state == 0)
+        {
+            if (c == 0)
+            {
+                m_nul_pos[i & 3] += 1;
+                m_last_nul = i;
+            }
+
+            continue;
+        }
+
+        if (c == 0)
+        {
+            m_nul_pos[i & 3] += 1;
+            m_last_nul = i;
+        }
+
+        // UTF-8
+        if (utf8_need != 0)
+        {
+            if (c >= utf8_lo && c <= utf8_hi)
+            {
+                utf8_lo = 0x80;
+                utf8_hi = 0xBF;
+                if (--utf8_need == 0)
+                    m_utf8_multibyte += 1;
+                goto utf8_done;
+            }
+
+            m_utf8_invalid += 1;
+            utf8_need = 0;
+            utf8_lo = 0x80;
+            utf8_hi = 0xBF;
+        }
+
+        if (c < 0x80)
+            ;
+        else if (c >= 0xC2 && c <= 0xDF)
+            utf8_need = 1;
+        else if (c == 0xE0)
+            utf8_need = 2, utf8_lo = 0xA0;
+        else if (c == 0xED)
+            utf8_need = 2, utf8_hi = 0x9F;
+        else if (c >= 0xE1 && c <= 0xEF)
+            utf8_need = 2;
+        else if (c == 0xF0)
+            utf8_need = 3, utf8_lo = 0x90;
+        else if (c >= 0xF1 && c <= 0xF3)
+            utf8_need = 3;
+        else if (c == 0xF4)
+            utf8_need = 3, utf8_hi = 0x8F;
+        else
+            m_utf8_invalid += 1;
+
+utf8_done:
+        // EUC-JP, EUC-KR, EUC-CN: pairs of 0xA1-0xFE, plus single
+        // shifts 0x8E and 0x8F in EUC-JP
+        if (euc_need != 0)
+        {
+            if (c >= 0xA1 && c <= 0xFE)
+                euc_need -= 1;
+            else
+                m_euc_invalid += 1, euc_need = 0;
+        }
+        else if (c >= 0xA1 && c <= 0xFE)
+            euc_need = 1;
+        else if (c == 0x8E)
+            euc_need = 1;
+        else if (c == 0x8F)
+            euc_need = 2;
+        else if (c >= 0x80)
+            m_euc_invalid += 1;
+
+        // Shift_JIS
+        if (sjis_trail)
+        {
+            if (!((c >= 0x40 && c <= 0x7E) || (c >= 0x80 && c <= 0xFC)))
+                m_sjis_invalid += 1;
+            sjis_trail = false;
+        }
+        else if ((c >= 0x81 && c <= 0x9F) || (c >= 0xE0 && c <= 0xFC))
+            sjis_trail = true;
+        else if (c >= 0xA1 && c <= 0xDF)
+            m_sjis_kana += 1;
+        else if (c >= 0x80)
+            m_sjis_invalid += 1;
+
+        // GBK, Big5, UHC, and four-byte sequences of GB18030
+        switch (dbcs_state)
+        {
+            case 0:
+                if (c >= 0x81 && c <= 0xFE)
+                    dbcs_state = 1;
+                else if (c >= 0x80)
+                    m_dbcs_invalid += 1;
+                break;
+            case 1:
+                if (c >= 0x30 && c <= 0x39)
+                    dbcs_state = 2;
+                else if ((c >= 0x40 && c <= 0x7E) || (c >= 0x80 && c <= 0xFE))
+                    dbcs_state = 0;
+                else
+                    m_dbcs_invalid += 1, dbcs_state = 0;
+                break;
+            case 2:
+                if (c >= 0x81 && c <= 0xFE)
+                    dbcs_state = 3;
+                else
+                    m_dbcs_invalid += 1, dbcs_state = 0;
+                break;
+            case 3:
+                if (!(c >= 0x30 && c <= 0x39))
+                    m_dbcs_invalid += 1;
+                dbcs_state = 0;
+                break;
+        }
+    }
+
+    // an incomplete character at the end is fine if the sample was cut
+    if (eof)
+    {
+        if (utf8_need != 0)
+            m_utf8_invalid += 1;
+        if (euc_need != 0)
+            m_euc_invalid += 1;
+        if (sjis_trail)
+            m_sjis_invalid += 1;
+        if (dbcs_state != 0)
+            m_dbcs_invalid += 1;
+    }
+
+    m_len = len;
+    m_eof = eof;
+    m_high = count_range (m_hist, 0x80, 0xFF);
+    m_ascii_letters = count_range (m_hist, 'a', 'z') + count_range (m_hist, 'A', 'Z');
+}
+
+int
+MooEncodingSniffer::score_single_byte (const char *name) const
+{
+    const SingleByteProfile *profile = nullptr;
+
+    for (const auto& p: single_byte_profiles)
+    {
+        if (name_in_list (name, p.names))
+        {
+            profile = &p;
+            break;
+        }
+    }
+
+    if (profile)
+        for (const char *u = profile->undefined; *u; ++u)
+            if (m_hist[(guchar) *u] != 0)
+                return SCORE_IMPOSSIBLE;
+
+    if (m_high == 0)
+        return SCORE_ASCII;
+
+    if (!profile)
+        return 30;
+
+    gsize upper = count_range (m_hist, profile->upper_start, profile->upper_end);
+    gsize lower = count_range (m_hist, profile->lower_start, profile->lower_end) +
+                  count_range (m_hist, profile->lower2_start, profile->lower2_end);
+    gsize letters = upper + lower;
+
+    double letter_frac = (double) letters / m_high;
+    double lower_frac = letters ? (double) lower / letters : 0;
+    double high_ratio = (double) m_high / (m_high + m_ascii_letters);
+    double script_fit = profile->latin ? 1 - high_ratio : high_ratio;
+
+    double score = 20 + 25 * letter_frac + 25 * lower_frac + 20 * script_fit;
+
+    if (profile->c1_controls && count_range (m_hist, 0x80, 0x9F) != 0)
+        score -= 30;
+
+    return clamp_score (score);
+}
+
+int
+MooEncodingSniffer::score (const char *encoding) const
+{
+    g_return_val_if_fail (encoding != nullptr, SCORE_IMPOSSIBLE);
+
+    char name[64];
+    normalize_name (encoding, name, sizeof name);
+
+    Family family = FAMILY_SINGLE_BYTE;
+    for (const auto& fn: family_names)
+    {
+        if (name_in_list (name, fn.names))
+        {
+            family = fn.family;
+            break;
+        }
+    }
+
+    gsize nuls = m_nul_pos[0] + m_nul_pos[1] + m_nul_pos[2] + m_nul_pos[3];
+    double high_ratio = m_high ? (double) m_high / (m_high + m_ascii_letters) : 0;
+
+    switch (family)
+    {
+        case FAMILY_UTF16LE:
+        case FAMILY_UTF16BE:
+        {
+            if (m_eof && m_len % 2 != 0)
+                return SCORE_IMPOSSIBLE;
+
+            // Text is mostly in one script, so high bytes of characters
+            // take very few values: zero for ASCII and the script block
+            gsize hist_even[256];
+            for (guint i = 0; i < 256; ++i)
+                hist_even[i] = m_hist[i] - m_hist_odd[i];
+
+            double cov_odd = top2_coverage (m_hist_odd, m_len / 2);
+            double cov_even = top2_coverage (hist_even, m_len - m_len / 2);
+            double cov_high = family == FAMILY_UTF16LE ? cov_odd : cov_even;
+            double cov_low = family == FAMILY_UTF16LE ? cov_even : cov_odd;
+
+            if (cov_high > 0.8 && cov_low < cov_high - 0.2)
+                return 90;
+            else if (nuls == 0)
+                return 5;
+            else
+                return 10;
+        }
+
+        case FAMILY_UTF32LE:
+        case FAMILY_UTF32BE:
+        {
+            if (m_eof && m_len % 4 != 0)
+                return SCORE_IMPOSSIBLE;
+
+            gsize n4 = m_len / 4;
+            gsize nul_zero = family == FAMILY_UTF32LE ? m_nul_pos[3] : m_nul_pos[0];
+            gsize nul_ascii = family == FAMILY_UTF32LE ? m_nul_pos[0] : m_nul_pos[3];
+
+            if (nul_zero > n4 * 3 / 4 && m_nul_pos[1] + m_nul_pos[2] > n4 && nul_ascii < n4 / 8)
+                return 95;
+            else
+                return 3;
+        }
+
+        default:
+            break;
+    }
+
+    // Everything else is ASCII-compatible, and the loader only accepts
+    // a single NUL at the very end of the file
+    if (nuls > 1 || (nuls == 1 && !(m_eof && m_last_nul + 1 == m_len)))
+        return SCORE_IMPOSSIBLE;
+
+    switch (family)
+    {
+        case FAMILY_UTF8:
+            if (m_utf8_invalid != 0)
+                return SCORE_IMPOSSIBLE;
+            // pure ASCII is valid in any of these, leave it to the user
+            // preferences
+            return m_utf8_multibyte != 0 ? 100 : SCORE_ASCII;
+
+        case FAMILY_EUC:
+            if (m_euc_invalid != 0)
+                return SCORE_IMPOSSIBLE;
+            return m_high ? clamp_score (40 + 40 * high_ratio) : SCORE_ASCII;
+
+        case FAMILY_SJIS:
+            // half-width katakana are rare in real text, while EUC data
+            // looks like a stream of them
+            if (m_sjis_invalid != 0)
+                return SCORE_IMPOSSIBLE;
+            return m_high ? clamp_score (40 + 40 * high_ratio - 30.0 * m_sjis_kana / m_high) : SCORE_ASCII;
+
+        case FAMILY_DBCS:
+            if (m_dbcs_invalid != 0)
+                return SCORE_IMPOSSIBLE;
+            return m_high ? clamp_score (40 + 40 * high_ratio) : SCORE_ASCII;
+
+        case FAMILY_ISO2022:
+            if (m_high != 0)
+                return SCORE_IMPOSSIBLE;
+            return m_hist[0x1B] != 0 ? 60 : 20;
+
+        default:
+            return score_single_byte (name);
+    }
+}
+
+std::list<gstr>
+MooEncodingSniffer::rank (std::list<gstr>  encodings,
+                          const gstr&      preferred) const
+{
+    struct Candidate
+    {
+        gstr encoding;
+        int score;
+    };
+
+    std::vector<Candidate> candidates;
+
+    for (auto& enc: encodings)
+    {
+        int s = score (enc);
+
+        if (s >= 0 && !preferred.empty() && g_ascii_strcasecmp (enc, preferred) == 0)
+            s = G_MAXINT;
+
+        candidates.push_back ({ std::move (enc), s });
+    }
+
+    std::stable_sort (candidates.begin (), candidates.end (),
+                      [] (const Candidate& a, const Candidate& b) {
+                          return a.score > b.score;
+                      });
+
+    std::list<gstr> result;
+
+    for (auto& c: candidates)
+        result.push_back (std::move (c.encoding));
+
+    return result;
+}
+
+
+static const char *test_texts[] = {
+    "\xd0\xa1\xd1\x8a\xd0\xb5\xd1\x88\xd1\x8c \xd0\xb6\xd0\xb5 \xd0\xb5\xd1\x89\xd1\x91 "
+    "\xd1\x8d\xd1\x82\xd0\xb8\xd1\x85 \xd0\xbc\xd1\x8f\xd0\xb3\xd0\xba\xd0\xb8\xd1\x85 "
+    "\xd1\x84\xd1\x80\xd0\xb0\xd0\xbd\xd1\x86\xd1\x83\xd0\xb7\xd1\x81\xd0\xba\xd0\xb8\xd1\x85 "
+    "\xd0\xb1\xd1\x83\xd0\xbb\xd0\xbe\xd0\xba, \xd0\xb4\xd0\xb0 \xd0\xb2\xd1\x8b\xd0\xbf\xd0\xb5\xd0\xb9 "
+    "\xd1\x87\xd0\xb0\xd1\x8e.\n",
+
+    "Portez ce vieux whisky au juge blond qui fume. O\xc3\xb9 est la for\xc3\xaat ? "
+    "\xc3\x80 c\xc3\xb4t\xc3\xa9 de l'\xc3\xa9glise, pr\xc3\xa8s du ch\xc3\xa2teau.\n",
+
+    "\xe3\x81\x84\xe3\x82\x8d\xe3\x81\xaf\xe3\x81\xab\xe3\x81\xbb\xe3\x81\xb8\xe3\x81\xa8 "
+    "\xe3\x81\xa1\xe3\x82\x8a\xe3\x81\xac\xe3\x82\x8b\xe3\x82\x92 "
+    "\xe3\x82\x8f\xe3\x81\x8b\xe3\x82\x88\xe3\x81\x9f\xe3\x82\x8c\xe3\x81\x9d "
+    "\xe3\x81\xa4\xe3\x81\xad\xe3\x81\xaa\xe3\x82\x89\xe3\x82\x80\n",
+};
+
+static const struct {
+    int text;
+    const char *encoding;
+} test_samples[] = {
+    { 0, "UTF-8" },
+    { 0, "CP1251" },
+    { 0, "KOI8-R" },
+    { 0, "UTF-16LE" },
+    { 0, "UTF-16BE" },
+    { 1, "UTF-8" },
+    { 1, "ISO_8859-1" },
+    { 1, "CP1252" },
+    { 1, "UTF-32LE" },
+    { 2, "UTF-8" },
+    { 2, "EUC-JP" },
+    { 2, "SHIFT_JIS" },
+};
+
+static const char *test_candidates[] = {
+    "UTF-8", "ISO_8859-1", "KOI8-R", "CP1251", "SHIFT_JIS", "EUC-JP",
+    "UTF-16LE", "UTF-16BE", "UTF-32LE"
+};
+
+static char *
+make_test_data (int          text,
+                const char  *encoding,
+                gsize        size,
+                gsize       *len)
+{
+    gsize one_len;
+    char *one = g_convert (test_texts[text], -1, encoding, "UTF-8", NULL, &one_len, NULL);
+
+    if (!one)
+        return NULL;
+
+    gsize count = MAX (size / one_len, 1);
+    char *data = (char*) g_malloc (one_len * count);
+
+    for (gsize i = 0; i < count; ++i)
+        memcpy (data + i * one_len, one, one_len);
+
+    g_free (one);
+    *len = one_len * count;
+    return data;
+}
+
+static std::list<gstr>
+make_candidates (const char *encoding,
+                 bool        first)
+{
+    std::list<gstr> candidates;
+
+    for (const char *enc: test_candidates)
+    {
+        // ISO_8859-1 and CP1252 are indistinguishable here, keep only one
+        if (!strcmp (encoding, "CP1252") && !strcmp (enc, "ISO_8859-1"))
+            enc = "CP1252";
+
+        if (first)
+            candidates.push_front (gstr::wrap_const (enc));
+        else
+            candidates.push_back (gstr::wrap_const (enc));
+    }
+
+    return candidates;
+}
+
+static void
+test_sniffer (void)
+{
+    for (const auto& sample: test_samples)
+    {
+        gsize len;
+        char *data = make_test_data (sample.text, sample.encoding, 4096, &len);
+
+        TEST_ASSERT_MSG (data != NULL, "could not convert text to %s", sample.encoding);
+        if (!data)
+            continue;
+
+        MooEncodingSniffer sniffer;
+        sniffer.feed (data, len, true);
+
+        for (bool reverse: { false, true })
+        {
+            std::list<gstr> ranked = sniffer.rank (make_candidates (sample.encoding, reverse));
+            TEST_ASSERT_STR_EQ_MSG (ranked.front (), sample.encoding,
+                                    "text %d in encoding %s", sample.text, sample.encoding);
+        }
+
+        g_free (data);
+    }
+
+    {
+        const char *ascii = "int main ()\n{\n    return 0;\n}\n";
+        MooEncodingSniffer sniffer;
+        sniffer.feed (ascii, strlen (ascii), true);
+
+        std::list<gstr> encodings = { gstr::wrap_const ("ISO_8859-1"), gstr::wrap_const ("UTF-8") };
+        std::list<gstr> ranked = sniffer.rank (encodings);
+        TEST_ASSERT_STR_EQ (ranked.front (), "ISO_8859-1");
+
+        ranked = sniffer.rank (encodings, gstr::wrap_const ("UTF-8"));
+        TEST_ASSERT_STR_EQ (ranked.front (), "UTF-8");
+
+        ranked = sniffer.rank ({ gstr::wrap_const ("UTF-16LE"), gstr::wrap_const ("UTF-8") });
+        TEST_ASSERT_STR_EQ (ranked.front (), "UTF-8");
+    }
+
+    {
+        // cached encoding which doesn't fit any more is not tried first
+        const char *latin1 = "caf\xe9\n";
+        MooEncodingSniffer sniffer;
+        sniffer.feed (latin1, strlen (latin1), true);
+
+        std::list<gstr> ranked = sniffer.rank ({ gstr::wrap_const ("UTF-8"), gstr::wrap_const ("ISO_8859-1") },
+                                               gstr::wrap_const ("UTF-8"));
+        TEST_ASSERT_STR_EQ (ranked.front (), "ISO_8859-1");
+        TEST_ASSERT_STR_EQ (ranked.back (), "UTF-8");
+    }
+}
+
+// Times only opening the file, reading the sample from its beginning and
+// ranking the candidates; decoding the rest of the file is not measured.
+// Detection should take the same time whatever the file size is.
+static void
+test_sniffer_sample_benchmark (void)
+{
+    const gsize file_size = 100 << 20;
+    char *working_dir = g_build_filename (moo_test_get_working_dir (), "encoding-sniffer", (char*) 0);
+    mgw_errno_t err;
+
+    _moo_mkdir_with_parents (working_dir, &err);
+
+    for (const auto& sample: test_samples)
+    {
+        gsize len;
+        char *data = make_test_data (sample.text, sample.encoding, file_size, &len);
+        char *filename = g_build_filename (working_dir, "file", (char*) 0);
+        gerrp error;
+
+        if (!data || !g_file_set_contents (filename, data, len, &error))
+        {
+            TEST_ASSERT_MSG (FALSE, "could not create %s file", sample.encoding);
+            g_free (data);
+            g_free (filename);
+            continue;
+        }
+
+        g_free (data);
+
+        GTimer *timer = g_timer_new ();
+
+        MooFileReader *reader = moo_file_reader_new (filename, error);
+        char *buf = g_new (char, MOO_ENCODING_SNIFF_SAMPLE_SIZE);
+        gsize size_read = 0;
+
+        TEST_ASSERT (reader && moo_file_reader_read (reader, buf, MOO_ENCODING_SNIFF_SAMPLE_SIZE, &size_read, error));
+
+        MooEncodingSniffer sniffer;
+        sniffer.feed (buf, size_read, size_read < MOO_ENCODING_SNIFF_SAMPLE_SIZE);
+        std::list<gstr> ranked = sniffer.rank (make_candidates (sample.encoding, false));
+
+        double elapsed = g_timer_elapsed (timer, NULL);
+
+        TEST_ASSERT_STR_EQ (ranked.front (), sample.encoding);
+        moo_test_benchmark_report ("%-10s %d MB file, sample only: %.2f ms", sample.encoding,
+                                   (int) (len >> 20), elapsed * 1000);
+
+        if (reader)
+            moo_file_reader_close (reader);
+        g_timer_destroy (timer);
+        g_free (buf);
+        mgw_remove (filename, &err);
+        g_free (filename);
+    }
+
+    g_free (working_dir);
+}
+
+void
+moo_test_encoding_sniffer (void)
+{
+    MooTestSuite *suite;
+
+    suite = moo_test_suite_new ("MooEncodingSniffer", "Character encoding detection tests", NULL, NULL, NULL);
+
+    moo_test_suite_add_test (suite, "sniffer", "encoding detection",
+                             (MooTestFunc) test_sniffer, NULL);
+
+    if (moo_test_benchmarks_enabled ())
+        moo_test_suite_add_test (suite, "sample-benchmark", "encoding detection time on the sample of a large file",
+                                 (MooTestFunc) test_sniffer_sample_benchmark, NULL);
+}
@@ -0,0 +1,73 @@
+/*
+ *   mooencodingsniffer.h
+ *
+ *   Copyright (C) 2004-2016 by Yevgen Muntyan <emuntyan@users.sourceforge.net>
+ *
+ *   This file is part of medit.  medit is free software; you can
+ *   redistribute it and/or modify it under the terms of the
+ *   GNU Lesser General Public License as published by the
+ *   Free Software Foundation; either version 2.1 of the License,
+ *   or (at your option) any later version.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with medit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#ifdef __cplusplus
+
+#include <list>
+#include <moocpp/moocpp.h>
+
+#define MOO_ENCODING_SNIFF_SAMPLE_SIZE (1 << 20)
+
+// Collects byte statistics of a piece of a file in one pass and orders
+// candidate encodings by how well they fit, so that only the likely
+// encodings get to decode the whole file.
+class MooEncodingSniffer
+{
+public:
+    MooEncodingSniffer ();
+
+    MOO_DISABLE_COPY_OPS (MooEncodingSniffer);
+
+    // data is the beginning of the file; eof is true if it's all there is
+    void            feed    (const char             *data,
+                             gsize                   len,
+                             bool                    eof);
+
+    // Stable: encodings which score the same keep their order. Encodings
+    // which can't possibly decode the data are moved to the end rather
+    // than dropped, in case the sample is misleading. If preferred is
+    // not empty, it stays first unless it is ruled out.
+    std::list<moo::gstr> rank (std::list<moo::gstr>  encodings,
+                               const moo::gstr&      preferred = moo::gstr()) const;
+
+    // Score of a single encoding, negative if it can't decode the data
+    int             score   (const char             *encoding) const;
+
+private:
+    int             score_single_byte   (const char *encoding) const;
+
+    gsize   m_len;
+    bool    m_eof;
+
+    gsize   m_hist[256];
+    gsize   m_hist_odd[256];    // bytes at odd offsets
+    gsize   m_high;             // bytes >= 0x80
+    gsize   m_ascii_letters;
+    gsize   m_nul_pos[4];       // NUL bytes by offset modulo 4
+    gsize   m_last_nul;
+
+    gsize   m_utf8_invalid;
+    gsize   m_utf8_multibyte;
+    gsize   m_euc_invalid;
+    gsize   m_sjis_invalid;
+    gsize   m_sjis_kana;        // single-byte half-width katakana
+    gsize   m_dbcs_invalid;
+};
+
+#endif // __cplusplus
@@ -28,6 +28,7 @@ G_BEGIN_DECLS
 #define MOO_LANG_MGR_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS ((obj), MOO_TYPE_LANG_MGR, MooLangMgrClass))
 
 typedef struct MooLangMgrClass MooLangMgrClass;
+typedef struct MooLangIndex MooLangIndex;
 
 struct MooLangMgr {
     GObject base;
@@ -41,6 +42,8 @@ struct MooLangMgr {
 
     MooTextStyleScheme *active_scheme;
 
+    MooLangIndex *index;  /* globs and mime types of all languages, built on demand */
+
     gboolean got_langs;
     gboolean got_schemes;
     gboolean modified;
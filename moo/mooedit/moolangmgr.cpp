@@ -24,6 +24,7 @@
 #include "mooutils/mooprefs.h"
 #include "marshals.h"
 #include "mooutils/moo-mime.h"
+#include "mooedit/mooeditor-tests.h"
 #include "moocpp/moocpp.h"
 #include <string.h>
 
@@ -59,6 +60,7 @@ static MooLang *get_lang_for_filename   (MooLangMgr*    mgr,
                                          const gstr&    filename);
 static MooLang *get_lang_for_mime_type  (MooLangMgr*    mgr,
                                          const char*    mime_type);
+static void     invalidate_lang_index   (MooLangMgr*    mgr);
 
 
 G_DEFINE_TYPE (MooLangMgr, moo_lang_mgr, G_TYPE_OBJECT)
@@ -68,6 +70,7 @@ static void
 moo_lang_mgr_init (MooLangMgr *mgr)
 {
     char **dirs;
+    char *cache_dir;
 
     mgr->schemes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
 
@@ -79,11 +82,14 @@ moo_lang_mgr_init (MooLangMgr *mgr)
     mgr->lang_mgr = gtk_source_language_manager_new ();
     dirs = moo_get_data_subdirs (LANGUAGE_DIR);
     g_object_set (mgr->lang_mgr, "search-path", dirs, NULL);
+    cache_dir = moo_get_user_cache_file (LANGUAGE_DIR);
+    _gtk_source_language_manager_set_cache_dir (mgr->lang_mgr, cache_dir);
     mgr->style_mgr = gtk_source_style_scheme_manager_new ();
     gtk_source_style_scheme_manager_set_search_path (mgr->style_mgr, dirs);
 
     load_config (mgr);
 
+    g_free (cache_dir);
     g_strfreev (dirs);
 }
 
@@ -95,6 +101,7 @@ moo_lang_mgr_dispose (GObject *object)
 
     if (mgr->langs)
     {
+        invalidate_lang_index (mgr);
         g_object_unref (mgr->lang_mgr);
         g_object_unref (mgr->style_mgr);
         g_hash_table_destroy (mgr->langs);
@@ -253,48 +260,267 @@ _moo_lang_mgr_find_lang (MooLangMgr *mgr,
 }
 
 
-static MooLang *
-get_lang_by_extension (MooLangMgr *mgr,
-                       const char *filename)
+/*****************************************************************************/
+/* Language index
+ *
+ * Globs and mime types of all languages are put into hash tables once
+ * instead of walking all languages for every file. A glob which is a
+ * literal string, possibly preceded by '*', matches exactly the filenames
+ * which end with that string (see _moo_glob_to_regex()), so it goes into
+ * the suffix table. The rest are compiled into a single regex, one
+ * alternative per glob in language order, so the first alternative which
+ * matches belongs to the first matching language.
+ */
+
+typedef struct {
+    const char *mime_type;
+    guint lang;
+} MimeEntry;
+
+struct MooLangIndex {
+    GPtrArray *langs;           /* MooLang*, in moo_lang_mgr_get_available_langs() order */
+    GHashTable *suffixes;       /* literal glob -> index in langs + 1 */
+    GRegex *wildcards;
+    GArray *wildcard_langs;     /* regex alternative -> index in langs */
+    GHashTable *mime_types;     /* mime type -> index in langs + 1 */
+    GArray *mime_entries;       /* MimeEntry, in language order */
+};
+
+static char *
+lang_index_key (const char *string)
 {
-    MooLang *lang = NULL;
-    char *basename;
+#ifdef __WIN32__
+    return g_utf8_casefold (string, -1);
+#else
+    return g_strdup (string);
+#endif
+}
+
+static const char *
+glob_literal_suffix (const char *glob)
+{
+    while (*glob == '*')
+        glob++;
+
+    return strpbrk (glob, "*?[") ? NULL : glob;
+}
+
+static void
+lang_index_add_glob (MooLangIndex       *index,
+                     GString            *pattern,
+                     GRegexCompileFlags *flags,
+                     const char         *glob,
+                     guint               lang)
+{
+    const char *suffix;
+    GRegex *re;
+    char *re_pattern;
+
+    if ((suffix = glob_literal_suffix (glob)))
+    {
+        char *key = lang_index_key (suffix);
+
+        if (!g_hash_table_lookup (index->suffixes, key))
+            g_hash_table_insert (index->suffixes, key, GUINT_TO_POINTER (lang + 1));
+        else
+            g_free (key);
+
+        return;
+    }
+
+    if (!(re_pattern = _moo_glob_to_regex (glob, flags)))
+        return;
+
+    /* a broken glob never matched anything, don't let it break the others */
+    if (!(re = g_regex_new (re_pattern, *flags, GRegexMatchFlags (0), NULL)))
+    {
+        g_free (re_pattern);
+        return;
+    }
+
+    g_regex_unref (re);
+
+    if (index->wildcard_langs->len)
+        g_string_append_c (pattern, '|');
+    g_string_append_printf (pattern, "(.*?(?:%s))", re_pattern);
+    g_array_append_val (index->wildcard_langs, lang);
+
+    g_free (re_pattern);
+}
+
+static void
+lang_index_add_mime_type (MooLangIndex *index,
+                          const char   *mime_type,
+                          guint         lang)
+{
+    MimeEntry entry;
+    char *key;
+
+    if (g_hash_table_lookup (index->mime_types, mime_type))
+        return;
+
+    key = g_strdup (mime_type);
+    g_hash_table_insert (index->mime_types, key, GUINT_TO_POINTER (lang + 1));
+
+    entry.mime_type = key;
+    entry.lang = lang;
+    g_array_append_val (index->mime_entries, entry);
+}
+
+static MooLangIndex *
+lang_index_new (MooLangMgr *mgr)
+{
+    MooLangIndex *index;
+    GString *pattern;
+    GRegexCompileFlags flags = GRegexCompileFlags (0);
     GSList *langs, *l;
-    gboolean found = FALSE;
 
-    g_return_val_if_fail (filename != NULL, NULL);
+    index = g_new0 (MooLangIndex, 1);
+    index->langs = g_ptr_array_new_with_free_func (g_object_unref);
+    index->suffixes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    index->wildcard_langs = g_array_new (FALSE, FALSE, sizeof (guint));
+    index->mime_types = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    index->mime_entries = g_array_new (FALSE, FALSE, sizeof (MimeEntry));
+
+    pattern = g_string_new ("^(?:");
+    langs = moo_lang_mgr_get_available_langs (mgr);
+
+    for (l = langs; l != NULL; l = l->next)
+    {
+        MooLang *lang = (MooLang*) l->data;
+        guint n = index->langs->len;
+        LangInfo *info;
+        GSList *g;
+
+        g_ptr_array_add (index->langs, lang);
+
+        if (!(info = get_lang_info (mgr, _moo_lang_id (lang), FALSE)))
+            continue;
+
+        for (g = info->globs; g != NULL; g = g->next)
+            lang_index_add_glob (index, pattern, &flags, (const char*) g->data, n);
+
+        for (g = info->mime_types; g != NULL; g = g->next)
+            lang_index_add_mime_type (index, (const char*) g->data, n);
+    }
+
+    if (index->wildcard_langs->len)
+    {
+        GError *error = NULL;
+
+        g_string_append_c (pattern, ')');
+        index->wildcards = g_regex_new (pattern->str,
+                                        GRegexCompileFlags (flags | G_REGEX_OPTIMIZE),
+                                        GRegexMatchFlags (0), &error);
 
+        if (!index->wildcards)
+        {
+            g_warning ("%s", moo_error_message (error));
+            g_error_free (error);
+        }
+    }
+
+    g_string_free (pattern, TRUE);
+    g_slist_free (langs);
+    return index;
+}
+
+static void
+lang_index_free (MooLangIndex *index)
+{
+    if (index)
+    {
+        g_ptr_array_free (index->langs, TRUE);
+        g_hash_table_destroy (index->suffixes);
+        if (index->wildcards)
+            g_regex_unref (index->wildcards);
+        g_array_free (index->wildcard_langs, TRUE);
+        g_hash_table_destroy (index->mime_types);
+        g_array_free (index->mime_entries, TRUE);
+        g_free (index);
+    }
+}
+
+static MooLangIndex *
+get_lang_index (MooLangMgr *mgr)
+{
     read_langs (mgr);
 
-    basename = g_path_get_basename (filename);
-    g_return_val_if_fail (basename != NULL, NULL);
+    if (!mgr->index)
+        mgr->index = lang_index_new (mgr);
 
-    langs = moo_lang_mgr_get_available_langs (mgr);
+    return mgr->index;
+}
+
+static void
+invalidate_lang_index (MooLangMgr *mgr)
+{
+    lang_index_free (mgr->index);
+    mgr->index = NULL;
+}
+
+static MooLang *
+lang_index_lookup_basename (MooLangIndex *index,
+                            const char   *basename)
+{
+    guint best = G_MAXUINT;
+    char *key;
+    const char *p;
+
+    key = lang_index_key (basename);
 
-    for (l = langs; !found && l != NULL; l = l->next)
+    for (p = key; ; ++p)
     {
-        GSList *g, *globs;
+        guint n = GPOINTER_TO_UINT (g_hash_table_lookup (index->suffixes, p));
+
+        if (n && n - 1 < best)
+            best = n - 1;
+
+        if (!*p)
+            break;
+    }
 
-        lang = (MooLang*) l->data;
-        globs = _moo_lang_mgr_get_globs (mgr, _moo_lang_id (lang));
+    g_free (key);
+
+    if (index->wildcards && g_utf8_validate (basename, -1, NULL))
+    {
+        GMatchInfo *match_info = NULL;
 
-        for (g = globs; !found && g != NULL; g = g->next)
+        if (g_regex_match (index->wildcards, basename, GRegexMatchFlags (0), &match_info))
         {
-            if (_moo_glob_match_simple ((char*) g->data, basename))
+            for (guint i = 0; i < index->wildcard_langs->len; ++i)
             {
-                found = TRUE;
-                break;
+                int start;
+
+                if (g_match_info_fetch_pos (match_info, i + 1, &start, NULL) && start >= 0)
+                {
+                    best = MIN (best, g_array_index (index->wildcard_langs, guint, i));
+                    break;
+                }
             }
         }
 
-        string_list_free (globs);
+        g_match_info_free (match_info);
     }
 
-    if (!found)
-        lang = NULL;
+    return best < index->langs->len ? (MooLang*) g_ptr_array_index (index->langs, best) : NULL;
+}
+
+
+static MooLang *
+get_lang_by_extension (MooLangMgr *mgr,
+                       const char *filename)
+{
+    MooLang *lang;
+    char *basename;
+
+    g_return_val_if_fail (filename != NULL, NULL);
+
+    basename = g_path_get_basename (filename);
+    g_return_val_if_fail (basename != NULL, NULL);
+
+    lang = lang_index_lookup_basename (get_lang_index (mgr), basename);
 
-    g_slist_foreach (langs, (GFunc) extern_g_object_unref, NULL);
-    g_slist_free (langs);
     g_free (basename);
     return lang;
 }
@@ -441,56 +667,30 @@ get_lang_for_filename (MooLangMgr* mgr,
 }
 
 
-static int
-check_mime_subclass (const char *base,
-                     const char *mime)
-{
-    return !moo_mime_type_is_subclass (mime, base);
-}
-
-
 static MooLang *
 get_lang_for_mime_type (MooLangMgr *mgr,
                         const char *mime)
 {
-    GSList *l, *langs;
-    MooLang *lang = NULL;
-    gboolean found = FALSE;
+    MooLangIndex *index;
+    guint n;
 
     g_return_val_if_fail (MOO_IS_LANG_MGR (mgr), NULL);
     g_return_val_if_fail (mime != NULL, NULL);
 
-    langs = moo_lang_mgr_get_available_langs (mgr);
-
-    for (l = langs; !found && l != NULL; l = l->next)
-    {
-        GSList *mimetypes;
-
-        lang = (MooLang*) l->data;
-        mimetypes = _moo_lang_mgr_get_mime_types (mgr, _moo_lang_id (lang));
+    index = get_lang_index (mgr);
 
-        if (g_slist_find_custom (mimetypes, mime, (GCompareFunc) strcmp))
-            found = TRUE;
+    if ((n = GPOINTER_TO_UINT (g_hash_table_lookup (index->mime_types, mime))))
+        return (MooLang*) g_ptr_array_index (index->langs, n - 1);
 
-        string_list_free (mimetypes);
-    }
-
-    for (l = langs; !found && l != NULL; l = l->next)
+    for (guint i = 0; i < index->mime_entries->len; ++i)
     {
-        GSList *mimetypes;
-
-        lang = (MooLang*) l->data;
-        mimetypes = _moo_lang_mgr_get_mime_types (mgr, _moo_lang_id (lang));
-
-        if (g_slist_find_custom (mimetypes, mime, (GCompareFunc) check_mime_subclass))
-            found = TRUE;
+        MimeEntry *entry = &g_array_index (index->mime_entries, MimeEntry, i);
 
-        string_list_free (mimetypes);
+        if (moo_mime_type_is_subclass (mime, entry->mime_type))
+            return (MooLang*) g_ptr_array_index (index->langs, entry->lang);
     }
 
-    g_slist_foreach (langs, (GFunc) extern_g_object_unref, NULL);
-    g_slist_free (langs);
-    return found ? lang : NULL;
+    return NULL;
 }
 
 
@@ -556,6 +756,8 @@ set_list (MooLangMgr *mgr,
         info->globs_modified = TRUE;
     else
         info->mime_types_modified = TRUE;
+
+    invalidate_lang_index (mgr);
 }
 
 static void
@@ -901,6 +1103,8 @@ set_globs_or_mime_types (MooLangMgr *mgr,
         info->globs_modified = modified;
     else
         info->mime_types_modified = modified;
+
+    invalidate_lang_index (mgr);
 }
 
 
@@ -1096,3 +1300,278 @@ _moo_lang_mgr_save_config (MooLangMgr *mgr)
     data.root = NULL;
     g_hash_table_foreach (mgr->langs, (GHFunc) save_one, &data);
 }
+
+
+/*****************************************************************************/
+/* Tests
+ */
+
+/* what the language index replaces: walk all languages and all their globs */
+static MooLang *
+test_lang_for_basename_linear (MooLangMgr *mgr,
+                               const char *basename)
+{
+    MooLang *lang = NULL;
+    GSList *langs, *l;
+
+    langs = moo_lang_mgr_get_available_langs (mgr);
+
+    for (l = langs; !lang && l != NULL; l = l->next)
+    {
+        GSList *globs, *g;
+
+        globs = _moo_lang_mgr_get_globs (mgr, _moo_lang_id ((MooLang*) l->data));
+
+        for (g = globs; !lang && g != NULL; g = g->next)
+            if (_moo_glob_match_simple ((char*) g->data, basename))
+                lang = (MooLang*) l->data;
+
+        string_list_free (globs);
+    }
+
+    g_slist_foreach (langs, (GFunc) extern_g_object_unref, NULL);
+    g_slist_free (langs);
+    return lang;
+}
+
+static int
+test_check_mime_subclass (const char *base,
+                          const char *mime)
+{
+    return !moo_mime_type_is_subclass (mime, base);
+}
+
+static MooLang *
+test_lang_for_mime_type_linear (MooLangMgr *mgr,
+                                const char *mime)
+{
+    MooLang *lang = NULL;
+    GSList *langs, *l;
+    int pass;
+
+    langs = moo_lang_mgr_get_available_langs (mgr);
+
+    for (pass = 0; !lang && pass < 2; ++pass)
+    {
+        for (l = langs; !lang && l != NULL; l = l->next)
+        {
+            GSList *mime_types = _moo_lang_mgr_get_mime_types (mgr, _moo_lang_id ((MooLang*) l->data));
+
+            if (pass == 0 && g_slist_find_custom (mime_types, mime, (GCompareFunc) strcmp))
+                lang = (MooLang*) l->data;
+            else if (pass == 1 && g_slist_find_custom (mime_types, mime, (GCompareFunc) test_check_mime_subclass))
+                lang = (MooLang*) l->data;
+
+            string_list_free (mime_types);
+        }
+    }
+
+    g_slist_foreach (langs, (GFunc) extern_g_object_unref, NULL);
+    g_slist_free (langs);
+    return lang;
+}
+
+static const char *
+test_lang_name (MooLang *lang)
+{
+    return lang ? _moo_lang_id (lang) : "none";
+}
+
+/* a filename matched by the glob */
+static char *
+test_filename_for_glob (const char *glob)
+{
+    GString *name = g_string_new (NULL);
+    const char *p;
+
+    for (p = glob; *p; ++p)
+    {
+        const char *bracket;
+
+        if (*p == '*')
+            g_string_append (name, "file");
+        else if (*p == '?')
+            g_string_append_c (name, 'x');
+        else if (*p == '[' && (bracket = strchr (p + 1, ']')))
+        {
+            if (p[1] != '^' && p + 1 < bracket)
+                g_string_append_c (name, p[1]);
+            else
+                g_string_append_c (name, '_');
+            p = bracket;
+        }
+        else
+            g_string_append_c (name, *p);
+    }
+
+    return g_string_free (name, FALSE);
+}
+
+static const char *test_extra_filenames[] = {
+    "file.c", "file.C", "file.h.in", "file.tar.gz", "file", ".file", "file.",
+    "file.zzz", "Makefile", "GNUmakefile", "makefile.am", "CMakeLists.txt",
+    "ChangeLog", "configure.ac", "README", "file.py~",
+};
+
+static const char *test_extra_mime_types[] = {
+    "text/plain", "text/x-csrc", "application/xml", "application/x-shellscript",
+    "application/octet-stream", "application/x-zzz",
+};
+
+static GPtrArray *
+test_make_filenames (MooLangMgr *mgr)
+{
+    GPtrArray *names = g_ptr_array_new_with_free_func (g_free);
+    GSList *langs, *l;
+
+    langs = moo_lang_mgr_get_available_langs (mgr);
+
+    for (l = langs; l != NULL; l = l->next)
+    {
+        GSList *globs = _moo_lang_mgr_get_globs (mgr, _moo_lang_id ((MooLang*) l->data));
+
+        for (GSList *g = globs; g != NULL; g = g->next)
+            g_ptr_array_add (names, test_filename_for_glob ((const char*) g->data));
+
+        string_list_free (globs);
+    }
+
+    for (guint i = 0; i < G_N_ELEMENTS (test_extra_filenames); ++i)
+        g_ptr_array_add (names, g_strdup (test_extra_filenames[i]));
+
+    g_slist_foreach (langs, (GFunc) extern_g_object_unref, NULL);
+    g_slist_free (langs);
+    return names;
+}
+
+static void
+test_lang_index (void)
+{
+    MooLangMgr *mgr = moo_lang_mgr_default ();
+    GPtrArray *names = test_make_filenames (mgr);
+    GSList *langs, *l;
+
+    for (guint i = 0; i < names->len; ++i)
+    {
+        const char *name = (const char*) g_ptr_array_index (names, i);
+        TEST_ASSERT_STR_EQ_MSG (test_lang_name (lang_index_lookup_basename (get_lang_index (mgr), name)),
+                                test_lang_name (test_lang_for_basename_linear (mgr, name)),
+                                "language for '%s'", name);
+    }
+
+    langs = moo_lang_mgr_get_available_langs (mgr);
+
+    for (l = langs; l != NULL; l = l->next)
+    {
+        GSList *mime_types = _moo_lang_mgr_get_mime_types (mgr, _moo_lang_id ((MooLang*) l->data));
+
+        for (GSList *m = mime_types; m != NULL; m = m->next)
+        {
+            const char *mime = (const char*) m->data;
+            TEST_ASSERT_STR_EQ_MSG (test_lang_name (get_lang_for_mime_type (mgr, mime)),
+                                    test_lang_name (test_lang_for_mime_type_linear (mgr, mime)),
+                                    "language for '%s'", mime);
+        }
+
+        string_list_free (mime_types);
+    }
+
+    for (guint i = 0; i < G_N_ELEMENTS (test_extra_mime_types); ++i)
+    {
+        const char *mime = test_extra_mime_types[i];
+        TEST_ASSERT_STR_EQ_MSG (test_lang_name (get_lang_for_mime_type (mgr, mime)),
+                                test_lang_name (test_lang_for_mime_type_linear (mgr, mime)),
+                                "language for '%s'", mime);
+    }
+
+    /* the index follows glob changes */
+    if (langs)
+    {
+        MooLang *lang = (MooLang*) langs->data;
+        gboolean modified = mgr->modified;
+        GSList *old_globs = _moo_lang_mgr_get_globs (mgr, _moo_lang_id (lang));
+        char *old_string = list_to_string (old_globs);
+
+        _moo_lang_mgr_set_globs (mgr, _moo_lang_id (lang), "*.moo-test-glob");
+        TEST_ASSERT_STR_EQ (test_lang_name (get_lang_by_extension (mgr, "file.moo-test-glob")),
+                            _moo_lang_id (lang));
+
+        _moo_lang_mgr_set_globs (mgr, _moo_lang_id (lang), old_string);
+        TEST_ASSERT_STR_EQ (test_lang_name (get_lang_by_extension (mgr, "file.moo-test-glob")),
+                            "none");
+
+        mgr->modified = modified;
+        g_free (old_string);
+        string_list_free (old_globs);
+    }
+
+    g_slist_foreach (langs, (GFunc) extern_g_object_unref, NULL);
+    g_slist_free (langs);
+    g_ptr_array_free (names, TRUE);
+}
+
+/* The linear lookup compiles a regex for every glob of every language,
+   so it only gets one round */
+static void
+test_lang_index_benchmark (void)
+{
+    const guint n_rounds = 100;
+    MooLangMgr *mgr = moo_lang_mgr_default ();
+    GPtrArray *names = test_make_filenames (mgr);
+    guint n_mime_types = G_N_ELEMENTS (test_extra_mime_types);
+    GTimer *timer;
+    double elapsed;
+
+    timer = g_timer_new ();
+    invalidate_lang_index (mgr);
+    get_lang_index (mgr);
+    moo_test_benchmark_report ("building index: %.2f ms", g_timer_elapsed (timer, NULL) * 1000);
+
+    g_timer_start (timer);
+    for (guint r = 0; r < n_rounds; ++r)
+        for (guint i = 0; i < names->len; ++i)
+            lang_index_lookup_basename (get_lang_index (mgr), (const char*) g_ptr_array_index (names, i));
+    elapsed = g_timer_elapsed (timer, NULL);
+    moo_test_benchmark_report ("filename, indexed: %.2f us per lookup",
+                               elapsed * 1000000 / (n_rounds * names->len));
+
+    g_timer_start (timer);
+    for (guint i = 0; i < names->len; ++i)
+        test_lang_for_basename_linear (mgr, (const char*) g_ptr_array_index (names, i));
+    elapsed = g_timer_elapsed (timer, NULL);
+    moo_test_benchmark_report ("filename, linear: %.2f us per lookup",
+                               elapsed * 1000000 / names->len);
+
+    g_timer_start (timer);
+    for (guint r = 0; r < n_rounds; ++r)
+        for (guint i = 0; i < n_mime_types; ++i)
+            get_lang_for_mime_type (mgr, test_extra_mime_types[i]);
+    elapsed = g_timer_elapsed (timer, NULL);
+    moo_test_benchmark_report ("mime type, indexed: %.2f us per lookup",
+                               elapsed * 1000000 / (n_rounds * n_mime_types));
+
+    g_timer_start (timer);
+    for (guint i = 0; i < n_mime_types; ++i)
+        test_lang_for_mime_type_linear (mgr, test_extra_mime_types[i]);
+    elapsed = g_timer_elapsed (timer, NULL);
+    moo_test_benchmark_report ("mime type, linear: %.2f us per lookup",
+                               elapsed * 1000000 / n_mime_types);
+
+    g_timer_destroy (timer);
+    g_ptr_array_free (names, TRUE);
+}
+
+void
+moo_test_lang_mgr (void)
+{
+    MooTestSuite *suite;
+
+    suite = moo_test_suite_new ("MooLangMgr", "mooedit/moolangmgr.cpp", NULL, NULL, NULL);
+
+    moo_test_suite_add_test (suite, "index", "language lookup by filename and mime type",
+                             (MooTestFunc) test_lang_index, NULL);
+
+    if (moo_test_benchmarks_enabled ())
+        moo_test_suite_add_test (suite, "benchmark", "language lookup time",
+                                 (MooTestFunc) test_lang_index_benchmark, NULL);
+}
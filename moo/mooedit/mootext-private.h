@@ -25,6 +25,12 @@ G_BEGIN_DECLS
 
 #define MOO_PLACEHOLDER_TAG "moo-placeholder-tag"
 
+typedef struct {
+    int offset;         /* in characters */
+    int length;         /* characters to replace */
+    char *text;         /* replacement */
+} MooTextPiece;
+
 
 Line       *_moo_line_mark_get_line                 (MooLineMark        *mark);
 void        _moo_line_mark_set_line                 (MooLineMark        *mark,
@@ -47,11 +53,17 @@ void        _moo_line_mark_set_fold                 (MooLineMark        *mark,
                                                      MooFold            *fold);
 MooFold    *_moo_line_mark_get_fold                 (MooLineMark        *mark);
 
+void        _moo_text_buffer_set_large_file         (MooTextBuffer      *buffer,
+                                                     gboolean            large_file);
+gboolean    _moo_text_buffer_get_large_file         (MooTextBuffer      *buffer);
 void        _moo_text_buffer_update_highlight       (MooTextBuffer      *buffer,
                                                      const GtkTextIter  *start,
                                                      const GtkTextIter  *end,
                                                      gboolean            synchronous);
 gpointer    _moo_text_buffer_get_undo_stack         (MooTextBuffer      *buffer);
+void        _moo_text_buffer_replace_pieces         (MooTextBuffer      *buffer,
+                                                     const MooTextPiece *pieces,
+                                                     guint               n_pieces);
 gboolean    _moo_text_buffer_is_bracket_tag         (MooTextBuffer      *buffer,
                                                      GtkTextTag         *tag);
 void        _moo_text_buffer_set_style_scheme       (MooTextBuffer      *buffer,
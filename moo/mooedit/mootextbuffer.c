@@ -17,6 +17,7 @@
  * class:MooTextBuffer: (parent GtkTextBuffer) (moo.private 1)
  **/
 
+#include "config.h"
 #include "mooedit/mootextiter.h"
 #include "mooedit/mootext-private.h"
 #include "mooedit/moolang-private.h"
@@ -24,7 +25,12 @@
 #include "marshals.h"
 #include "mooutils/mooundo.h"
 #include "mooutils/mooutils-gobject.h"
+#include <glib/gstdio.h>
+#include <stdio.h>
 #include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 
 struct MooTextBufferPrivate {
@@ -52,9 +58,12 @@ struct MooTextBufferPrivate {
     guint non_interactive;
     int cursor_moved_frozen;
     gboolean cursor_moved;
+    guint cursor_moved_idle;
+    gboolean large_file;
     MooUndoStack *undo_stack;
     gpointer modifying_action;
     int move_cursor_to;
+    gboolean undo_failed;
 #if 0
     int cursor_was_at;
 #endif
@@ -104,6 +113,7 @@ static void     thaw_cursor_moved                   (MooTextBuffer      *buffer)
 
 static guint    INSERT_ACTION_TYPE;
 static guint    DELETE_ACTION_TYPE;
+static guint    REPLACE_ACTION_TYPE;
 static void     init_undo_actions                   (void);
 static MooUndoAction *insert_action_new             (GtkTextBuffer      *buffer,
                                                      GtkTextIter        *pos,
@@ -412,6 +422,12 @@ moo_text_buffer_dispose (GObject *object)
     	buffer->priv->engine = NULL;
     }
 
+    if (buffer->priv->cursor_moved_idle)
+    {
+        g_source_remove (buffer->priv->cursor_moved_idle);
+        buffer->priv->cursor_moved_idle = 0;
+    }
+
     if (buffer->priv->style_scheme)
     {
     	g_object_unref (buffer->priv->style_scheme);
@@ -800,6 +816,14 @@ after_undo_redo (MooTextBuffer *buffer)
 #if 0
     buffer->priv->cursor_was_at = -1;
 #endif
+
+    /* text of some action was lost, the rest of the history
+       does not match the buffer anymore */
+    if (buffer->priv->undo_failed)
+    {
+        buffer->priv->undo_failed = FALSE;
+        moo_undo_stack_clear (buffer->priv->undo_stack);
+    }
 }
 
 static void
@@ -839,6 +863,7 @@ moo_text_buffer_set_lang (MooTextBuffer  *buffer,
 
     	if (buffer->priv->engine)
     	{
+            _gtk_source_engine_set_lazy (buffer->priv->engine, buffer->priv->large_file);
             _gtk_source_engine_attach_buffer (buffer->priv->engine,
     						  GTK_TEXT_BUFFER (buffer));
 
@@ -988,6 +1013,33 @@ moo_text_buffer_has_selection (MooTextBuffer *buffer)
 }
 
 
+/* Large file mode: text is only analyzed as it's displayed, matching
+   brackets are not searched far, and cursor-moved is emitted in idle. */
+void
+_moo_text_buffer_set_large_file (MooTextBuffer *buffer,
+                                 gboolean       large_file)
+{
+    g_return_if_fail (MOO_IS_TEXT_BUFFER (buffer));
+
+    large_file = large_file != 0;
+
+    if (buffer->priv->large_file == large_file)
+        return;
+
+    buffer->priv->large_file = large_file;
+
+    if (buffer->priv->engine)
+        _gtk_source_engine_set_lazy (buffer->priv->engine, large_file);
+}
+
+gboolean
+_moo_text_buffer_get_large_file (MooTextBuffer *buffer)
+{
+    g_return_val_if_fail (MOO_IS_TEXT_BUFFER (buffer), FALSE);
+    return buffer->priv->large_file;
+}
+
+
 void
 _moo_text_buffer_update_highlight (MooTextBuffer      *buffer,
                                    const GtkTextIter  *start,
@@ -1157,15 +1209,44 @@ moo_text_iter_set_visual_line_offset (GtkTextIter *iter,
  */
 
 #define FIND_BRACKETS_LIMIT 3000
+#define FIND_BRACKETS_LIMIT_LARGE_FILE 300
+
+static gboolean
+emit_cursor_moved_idle (MooTextBuffer *buffer)
+{
+    GtkTextIter iter;
+    GtkTextMark *insert = gtk_text_buffer_get_insert (GTK_TEXT_BUFFER (buffer));
+
+    buffer->priv->cursor_moved_idle = 0;
+
+    gtk_text_buffer_get_iter_at_mark (GTK_TEXT_BUFFER (buffer), &iter, insert);
+    g_signal_emit (buffer, signals[CURSOR_MOVED], 0, &iter);
+
+    return FALSE;
+}
 
 static void
 emit_cursor_moved (MooTextBuffer      *buffer,
                    const GtkTextIter  *where)
 {
-    if (!buffer->priv->cursor_moved_frozen)
-        g_signal_emit (buffer, signals[CURSOR_MOVED], 0, where);
-    else
+    if (buffer->priv->cursor_moved_frozen)
+    {
         buffer->priv->cursor_moved = TRUE;
+    }
+    else if (buffer->priv->large_file)
+    {
+        /* Cursor may move many times before anything is redrawn,
+           it's enough to tell about it once, before redrawing */
+        if (!buffer->priv->cursor_moved_idle)
+            buffer->priv->cursor_moved_idle =
+                gdk_threads_add_idle_full (G_PRIORITY_HIGH_IDLE,
+                                           (GSourceFunc) emit_cursor_moved_idle,
+                                           buffer, NULL);
+    }
+    else
+    {
+        g_signal_emit (buffer, signals[CURSOR_MOVED], 0, where);
+    }
 }
 
 static void
@@ -1221,7 +1302,10 @@ moo_text_buffer_highlight_brackets (MooTextBuffer     *buffer,
         return;
 
     iter[2] = iter[0];
-    bracket_match = moo_text_iter_find_matching_bracket (&iter[2], FIND_BRACKETS_LIMIT);
+    bracket_match = moo_text_iter_find_matching_bracket (&iter[2],
+                                                         buffer->priv->large_file ?
+                                                            FIND_BRACKETS_LIMIT_LARGE_FILE :
+                                                            FIND_BRACKETS_LIMIT);
 
     buffer->priv->bracket_found = bracket_match;
 
@@ -1557,11 +1641,15 @@ moo_text_iter_find_matching_bracket (GtkTextIter *iter,
 
 typedef enum {
     ACTION_INSERT,
-    ACTION_DELETE
+    ACTION_DELETE,
+    ACTION_REPLACE
 } ActionType;
 
 typedef struct {
-    char *text;
+    char *text;         /* NULL if the text is in spill_file */
+    char *spill_file;
+    gsize bytes;
+    guint type        : 2;
     guint interactive : 1;
     guint mergeable   : 1;
 } EditAction;
@@ -1580,11 +1668,26 @@ typedef struct {
     guint forward : 1;
 } DeleteAction;
 
+/* Replacing pieces gives back the text before the replacement, so undo and
+   redo are the same operation with the pieces swapped each time */
+typedef struct {
+    EditAction edit;
+    MooTextPiece *pieces;
+    guint n_pieces;
+} ReplaceAction;
+
 #define EDIT_ACTION(action__)           ((EditAction*)action__)
 #define ACTION_INTERACTIVE(action__)    (((EditAction*)action__)->interactive)
 
+/* Text of bigger actions is kept in a temporary file instead of memory */
+#define SPILL_SIZE          (1 << 20)
+/* Deleted text is saved in pieces of this many characters */
+#define SPILL_CHUNK_CHARS   (1 << 18)
+
 static void     edit_action_destroy     (EditAction     *action,
                                          MooTextBuffer  *buffer);
+static gsize    edit_action_size        (EditAction     *action);
+static gsize    edit_action_disk_size   (EditAction     *action);
 
 static void     insert_action_undo      (InsertAction   *action,
                                          GtkTextBuffer  *buffer);
@@ -1602,18 +1705,42 @@ static gboolean delete_action_merge     (DeleteAction   *action,
                                          DeleteAction   *what,
                                          MooTextBuffer  *buffer);
 
+static void     replace_action_undo     (ReplaceAction  *action,
+                                         GtkTextBuffer  *buffer);
+static gboolean replace_action_merge    (ReplaceAction  *action,
+                                         ReplaceAction  *what,
+                                         MooTextBuffer  *buffer);
+static MooTextPiece *replace_pieces     (MooTextBuffer      *buffer,
+                                         const MooTextPiece *pieces,
+                                         guint               n_pieces);
+static void     pieces_free             (MooTextPiece       *pieces,
+                                         guint               n_pieces);
+
 static MooUndoActionClass InsertActionClass = {
     (MooUndoActionUndo) insert_action_undo,
     (MooUndoActionRedo) insert_action_redo,
     (MooUndoActionMerge) insert_action_merge,
-    (MooUndoActionDestroy) edit_action_destroy
+    (MooUndoActionDestroy) edit_action_destroy,
+    (MooUndoActionSize) edit_action_size,
+    (MooUndoActionSize) edit_action_disk_size
 };
 
 static MooUndoActionClass DeleteActionClass = {
     (MooUndoActionUndo) delete_action_undo,
     (MooUndoActionRedo) delete_action_redo,
     (MooUndoActionMerge) delete_action_merge,
-    (MooUndoActionDestroy) edit_action_destroy
+    (MooUndoActionDestroy) edit_action_destroy,
+    (MooUndoActionSize) edit_action_size,
+    (MooUndoActionSize) edit_action_disk_size
+};
+
+static MooUndoActionClass ReplaceActionClass = {
+    (MooUndoActionUndo) replace_action_undo,
+    (MooUndoActionRedo) replace_action_undo,
+    (MooUndoActionMerge) replace_action_merge,
+    (MooUndoActionDestroy) edit_action_destroy,
+    (MooUndoActionSize) edit_action_size,
+    (MooUndoActionSize) edit_action_disk_size
 };
 
 
@@ -1622,29 +1749,36 @@ init_undo_actions (void)
 {
     INSERT_ACTION_TYPE = moo_undo_action_register (&InsertActionClass);
     DELETE_ACTION_TYPE = moo_undo_action_register (&DeleteActionClass);
+    REPLACE_ACTION_TYPE = moo_undo_action_register (&ReplaceActionClass);
 }
 
 
-static EditAction *
-action_new (ActionType     type,
-            MooTextBuffer *buffer)
+static gsize
+action_struct_size (ActionType type)
 {
-    EditAction *action;
-    gsize size = 0;
-    GtkTextBuffer *text_buffer = GTK_TEXT_BUFFER (buffer);
-
     switch (type)
     {
         case ACTION_INSERT:
-            size = sizeof (InsertAction);
-            break;
+            return sizeof (InsertAction);
         case ACTION_DELETE:
-            size = sizeof (DeleteAction);
-            break;
+            return sizeof (DeleteAction);
+        case ACTION_REPLACE:
+            return sizeof (ReplaceAction);
     }
 
-    g_assert (size != 0);
-    action = g_malloc0 (size);
+    g_return_val_if_reached (0);
+}
+
+
+static EditAction *
+action_new (ActionType     type,
+            MooTextBuffer *buffer)
+{
+    EditAction *action;
+    GtkTextBuffer *text_buffer = GTK_TEXT_BUFFER (buffer);
+
+    action = g_slice_alloc0 (action_struct_size (type));
+    action->type = type;
     action->interactive = (!buffer->priv->non_interactive && text_buffer->user_action_count) ? TRUE : FALSE;
 
     if (!gtk_text_buffer_get_modified (text_buffer))
@@ -1654,6 +1788,149 @@ action_new (ActionType     type,
 }
 
 
+static FILE *
+spill_file_new (EditAction *action)
+{
+    GError *error = NULL;
+    FILE *file;
+    int fd;
+
+    fd = g_file_open_tmp ("medit-undo-XXXXXX", &action->spill_file, &error);
+
+    if (fd < 0)
+    {
+        g_warning ("could not create temporary file: %s", error->message);
+        g_error_free (error);
+        return NULL;
+    }
+
+    close (fd);
+
+    if (!(file = g_fopen (action->spill_file, "wb")))
+    {
+        g_unlink (action->spill_file);
+        g_free (action->spill_file);
+        action->spill_file = NULL;
+    }
+
+    return file;
+}
+
+static gboolean
+spill_file_close (EditAction *action,
+                  FILE       *file,
+                  gboolean    success)
+{
+    if (fclose (file) != 0)
+        success = FALSE;
+
+    if (!success)
+    {
+        g_warning ("could not write to temporary file %s", action->spill_file);
+        g_unlink (action->spill_file);
+        g_free (action->spill_file);
+        action->spill_file = NULL;
+    }
+
+    return success;
+}
+
+static void
+edit_action_set_text (EditAction *action,
+                      const char *text,
+                      gsize       length)
+{
+    FILE *file;
+
+    action->bytes = length;
+
+    if (length >= SPILL_SIZE && (file = spill_file_new (action)))
+    {
+        if (spill_file_close (action, file, fwrite (text, 1, length, file) == length))
+            return;
+    }
+
+    action->text = g_strndup (text, length);
+}
+
+/* Like edit_action_set_text (gtk_text_buffer_get_slice (start, end)),
+   but never holds a huge deleted range in memory */
+static void
+edit_action_save_range (EditAction        *action,
+                        GtkTextBuffer     *buffer,
+                        const GtkTextIter *start,
+                        const GtkTextIter *end)
+{
+    FILE *file;
+
+    if (gtk_text_iter_get_offset (end) - gtk_text_iter_get_offset (start) >= SPILL_SIZE &&
+        (file = spill_file_new (action)))
+    {
+        GtkTextIter chunk_start = *start;
+        gboolean success = TRUE;
+
+        action->bytes = 0;
+
+        while (success && gtk_text_iter_compare (&chunk_start, end) < 0)
+        {
+            GtkTextIter chunk_end = chunk_start;
+            char *text;
+            gsize len;
+
+            gtk_text_iter_forward_chars (&chunk_end, SPILL_CHUNK_CHARS);
+            if (gtk_text_iter_compare (&chunk_end, end) > 0)
+                chunk_end = *end;
+
+            text = gtk_text_buffer_get_slice (buffer, &chunk_start, &chunk_end, TRUE);
+            len = strlen (text);
+            success = fwrite (text, 1, len, file) == len;
+            action->bytes += len;
+            g_free (text);
+
+            chunk_start = chunk_end;
+        }
+
+        if (spill_file_close (action, file, success))
+            return;
+    }
+
+    action->text = gtk_text_buffer_get_slice (buffer, start, end, TRUE);
+    action->bytes = strlen (action->text);
+}
+
+/* Returns text of a spilled action, or NULL. If the temporary file
+   can't be read, or it is shorter or longer than the saved text, marks
+   the undo history as broken: the remaining actions are skipped and the
+   history is dropped in after_undo_redo(). */
+static char *
+edit_action_load_text (EditAction    *action,
+                       GtkTextBuffer *buffer)
+{
+    GError *error = NULL;
+    char *text = NULL;
+    gsize length = 0;
+
+    if (!action->spill_file)
+        return NULL;
+
+    if (!g_file_get_contents (action->spill_file, &text, &length, &error))
+    {
+        g_warning ("could not read temporary file: %s", error->message);
+        g_error_free (error);
+        MOO_TEXT_BUFFER (buffer)->priv->undo_failed = TRUE;
+    }
+    else if (length != action->bytes)
+    {
+        g_warning ("temporary file %s is truncated", action->spill_file);
+        g_free (text);
+        text = NULL;
+        MOO_TEXT_BUFFER (buffer)->priv->undo_failed = TRUE;
+    }
+
+    return text;
+}
+
+
 static MooUndoAction *
 insert_action_new (GtkTextBuffer    *buffer,
                    GtkTextIter      *pos,
@@ -1672,7 +1949,7 @@ insert_action_new (GtkTextBuffer    *buffer,
     action = (InsertAction*) edit_action;
 
     action->pos = gtk_text_iter_get_offset (pos);
-    action->edit.text = g_strndup (text, length);
+    edit_action_set_text (edit_action, text, length);
     action->length = length;
     action->chars = g_utf8_strlen (text, length);
 
@@ -1705,7 +1982,7 @@ delete_action_new (GtkTextBuffer      *buffer,
 
     action->start = start_offset;
     action->end = end_offset;
-    action->edit.text = gtk_text_buffer_get_slice (buffer, start, end, TRUE);
+    edit_action_save_range (edit_action, buffer, start, end);
 
     if (edit_action->interactive)
     {
@@ -1718,7 +1995,7 @@ delete_action_new (GtkTextBuffer      *buffer,
             action->forward = FALSE;
     }
 
-    if (action->end - action->start > 1 || action->edit.text[0] == '\n')
+    if (action->end - action->start > 1 || !action->edit.text || action->edit.text[0] == '\n')
         edit_action->mergeable = FALSE;
     else
         edit_action->mergeable = TRUE;
@@ -1755,6 +2032,9 @@ insert_action_undo (InsertAction   *action,
     GtkTextIter start, end;
     gboolean was_modified;
 
+    if (MOO_TEXT_BUFFER(buffer)->priv->undo_failed)
+        return;
+
     was_modified = gtk_text_buffer_get_modified (buffer);
 
     gtk_text_buffer_get_iter_at_offset (buffer, &start, action->pos);
@@ -1775,11 +2055,20 @@ delete_action_undo (DeleteAction   *action,
 {
     GtkTextIter start;
     gboolean was_modified;
+    char *spilled;
+
+    if (MOO_TEXT_BUFFER(buffer)->priv->undo_failed)
+        return;
 
     was_modified = gtk_text_buffer_get_modified (buffer);
+    spilled = edit_action_load_text (EDIT_ACTION (action), buffer);
+
+    if (!spilled && !action->edit.text)
+        return;
 
     gtk_text_buffer_get_iter_at_offset (buffer, &start, action->start);
-    gtk_text_buffer_insert (buffer, &start, action->edit.text, -1);
+    gtk_text_buffer_insert (buffer, &start, spilled ? spilled : action->edit.text, -1);
+    g_free (spilled);
 
     if (ACTION_INTERACTIVE (action))
     {
@@ -1799,11 +2088,21 @@ insert_action_redo (InsertAction   *action,
 {
     GtkTextIter start;
     gboolean was_modified;
+    char *spilled;
+
+    if (MOO_TEXT_BUFFER(buffer)->priv->undo_failed)
+        return;
 
     was_modified = gtk_text_buffer_get_modified (buffer);
+    spilled = edit_action_load_text (EDIT_ACTION (action), buffer);
+
+    if (!spilled && !action->edit.text)
+        return;
 
     gtk_text_buffer_get_iter_at_offset (buffer, &start, action->pos);
-    gtk_text_buffer_insert (buffer, &start, action->edit.text, action->length);
+    gtk_text_buffer_insert (buffer, &start, spilled ? spilled : action->edit.text,
+                            spilled ? (int) action->edit.bytes : action->length);
+    g_free (spilled);
 
     if (ACTION_INTERACTIVE (action))
         MOO_TEXT_BUFFER(buffer)->priv->move_cursor_to = action->pos + action->length;
@@ -1819,6 +2118,9 @@ delete_action_redo (DeleteAction   *action,
     GtkTextIter start, end;
     gboolean was_modified;
 
+    if (MOO_TEXT_BUFFER(buffer)->priv->undo_failed)
+        return;
+
     was_modified = gtk_text_buffer_get_modified (buffer);
 
     gtk_text_buffer_get_iter_at_offset (buffer, &start, action->start);
@@ -1840,12 +2142,41 @@ edit_action_destroy (EditAction    *action,
     {
         if (buffer->priv->modifying_action == action)
             buffer->priv->modifying_action = NULL;
+        if (action->spill_file)
+        {
+            g_unlink (action->spill_file);
+            g_free (action->spill_file);
+        }
+        if (action->type == ACTION_REPLACE)
+            pieces_free (((ReplaceAction*) action)->pieces,
+                         ((ReplaceAction*) action)->n_pieces);
         g_free (action->text);
-        g_free (action);
+        g_slice_free1 (action_struct_size (action->type), action);
     }
 }
 
 
+static gsize
+edit_action_size (EditAction *action)
+{
+    gsize size = action_struct_size (action->type);
+
+    if (action->text || action->type == ACTION_REPLACE)
+        size += action->bytes + 1;
+
+    return size;
+}
+
+
+/* Spilled text lives in a temporary file, so it counts against the
+   disk limit of the undo stack instead of the memory limit */
+static gsize
+edit_action_disk_size (EditAction *action)
+{
+    return action->spill_file ? action->bytes : 0;
+}
+
+
 static gboolean
 action_merge (EditAction     *last_action,
               EditAction     *action,
@@ -1854,7 +2185,7 @@ action_merge (EditAction     *last_action,
     if (!last_action->mergeable)
         return FALSE;
 
-    if (!action->mergeable ||
+    if (!action->mergeable || !action->text || !last_action->text ||
          buffer->priv->modifying_action == action ||
          action->interactive != last_action->interactive)
     {
@@ -1890,6 +2221,7 @@ insert_action_merge (InsertAction   *last_action,
     g_free (last_action->edit.text);
     last_action->length += action->length;
     last_action->edit.text = tmp;
+    last_action->edit.bytes += action->edit.bytes;
     last_action->chars += action->chars;
 
     return TRUE;
@@ -1930,6 +2262,7 @@ delete_action_merge (DeleteAction   *last_action,
         g_free (last_action->edit.text);
         last_action->end += (action->end - action->start);
         last_action->edit.text = tmp;
+        last_action->edit.bytes += action->edit.bytes;
     }
     else
     {
@@ -1945,12 +2278,389 @@ delete_action_merge (DeleteAction   *last_action,
         g_free (last_action->edit.text);
         last_action->start = action->start;
         last_action->edit.text = tmp;
+        last_action->edit.bytes += action->edit.bytes;
     }
 
     return TRUE;
 }
 
 
+/*****************************************************************************/
+/* Replacing many pieces of text at once
+ */
+
+static void
+pieces_free (MooTextPiece *pieces,
+             guint         n_pieces)
+{
+    guint i;
+
+    for (i = 0; i < n_pieces; ++i)
+        g_free (pieces[i].text);
+
+    g_free (pieces);
+}
+
+static gsize
+pieces_size (MooTextPiece *pieces,
+             guint         n_pieces)
+{
+    gsize size = n_pieces * sizeof (MooTextPiece);
+    guint i;
+
+    for (i = 0; i < n_pieces; ++i)
+        size += strlen (pieces[i].text) + 1;
+
+    return size;
+}
+
+typedef struct {
+    gpointer mark;
+    int offset;
+} SavedMark;
+
+/* Where text at @offset goes after replacing the pieces; @inverse holds new
+   offsets and lengths of the pieces. Text inside a piece goes to the start
+   or to the end of its replacement, the way a mark would with one delete and
+   insert. */
+static int
+map_offset (const MooTextPiece *pieces,
+            const MooTextPiece *inverse,
+            guint               n_pieces,
+            int                 offset,
+            gboolean            left_gravity)
+{
+    guint lo = 0, hi = n_pieces;
+
+    while (lo < hi)
+    {
+        guint mid = (lo + hi) / 2;
+
+        if (pieces[mid].offset <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0)
+        return offset;
+
+    lo--;
+
+    if (offset <= pieces[lo].offset + pieces[lo].length)
+        return inverse[lo].offset + (left_gravity ? 0 : inverse[lo].length);
+    else
+        return offset - pieces[lo].offset - pieces[lo].length +
+                inverse[lo].offset + inverse[lo].length;
+}
+
+static void
+save_text_marks (const GtkTextIter *start,
+                 const GtkTextIter *end,
+                 GArray            *saved)
+{
+    GtkTextIter iter = *start;
+
+    while (TRUE)
+    {
+        GSList *marks, *l;
+
+        marks = gtk_text_iter_get_marks (&iter);
+
+        for (l = marks; l != NULL; l = l->next)
+        {
+            SavedMark sm;
+            sm.mark = g_object_ref (l->data);
+            sm.offset = gtk_text_iter_get_offset (&iter);
+            g_array_append_val (saved, sm);
+        }
+
+        g_slist_free (marks);
+
+        if (gtk_text_iter_compare (&iter, end) >= 0 || !gtk_text_iter_forward_char (&iter))
+            break;
+    }
+}
+
+static void
+save_line_marks (MooTextBuffer *buffer,
+                 int            first_line,
+                 int            last_line,
+                 GArray        *saved)
+{
+    GSList *marks, *l;
+
+    marks = _moo_line_buffer_get_marks_in_range (buffer->priv->line_buf, first_line, last_line);
+
+    for (l = marks; l != NULL; l = l->next)
+    {
+        GtkTextIter iter;
+        SavedMark sm;
+
+        sm.mark = g_object_ref (l->data);
+        gtk_text_buffer_get_iter_at_line (GTK_TEXT_BUFFER (buffer), &iter,
+                                          moo_line_mark_get_line (l->data));
+        sm.offset = gtk_text_iter_get_offset (&iter);
+        g_array_append_val (saved, sm);
+
+        _moo_line_buffer_remove_mark (buffer->priv->line_buf, l->data);
+    }
+
+    g_slist_free (marks);
+}
+
+static void
+restore_marks (MooTextBuffer      *buffer,
+               const MooTextPiece *pieces,
+               const MooTextPiece *inverse,
+               guint               n_pieces,
+               GArray             *text_marks,
+               GArray             *line_marks)
+{
+    GtkTextBuffer *text_buffer = GTK_TEXT_BUFFER (buffer);
+    GtkTextIter iter;
+    guint i;
+
+    for (i = 0; i < text_marks->len; ++i)
+    {
+        SavedMark *sm = &g_array_index (text_marks, SavedMark, i);
+        GtkTextMark *mark = sm->mark;
+
+        if (!gtk_text_mark_get_deleted (mark))
+        {
+            int offset = map_offset (pieces, inverse, n_pieces, sm->offset,
+                                     gtk_text_mark_get_left_gravity (mark));
+            gtk_text_buffer_get_iter_at_offset (text_buffer, &iter, offset);
+            gtk_text_buffer_move_mark (text_buffer, mark, &iter);
+        }
+
+        g_object_unref (mark);
+    }
+
+    for (i = 0; i < line_marks->len; ++i)
+    {
+        SavedMark *sm = &g_array_index (line_marks, SavedMark, i);
+        MooLineMark *mark = sm->mark;
+        int old_line = moo_line_mark_get_line (mark);
+        int line;
+
+        gtk_text_buffer_get_iter_at_offset (text_buffer, &iter,
+                                            map_offset (pieces, inverse, n_pieces,
+                                                        sm->offset, TRUE));
+        line = gtk_text_iter_get_line (&iter);
+        _moo_line_buffer_add_mark (buffer->priv->line_buf, mark, line);
+
+        if (line != old_line)
+            line_mark_moved (buffer, mark);
+
+        g_object_unref (mark);
+    }
+}
+
+/* Folded text would lose its invisible tag if it was deleted and inserted back */
+static gboolean
+has_folded_text (GtkTextBuffer     *buffer,
+                 const GtkTextIter *start,
+                 const GtkTextIter *end)
+{
+    GtkTextTag *tag;
+    GtkTextIter iter = *start;
+
+    tag = gtk_text_tag_table_lookup (gtk_text_buffer_get_tag_table (buffer), MOO_FOLD_TAG);
+
+    if (!tag)
+        return FALSE;
+
+    return gtk_text_iter_has_tag (&iter, tag) ||
+           (gtk_text_iter_forward_to_tag_toggle (&iter, tag) &&
+            gtk_text_iter_compare (&iter, end) < 0);
+}
+
+static void
+replace_pieces_one_by_one (GtkTextBuffer      *buffer,
+                           const MooTextPiece *pieces,
+                           MooTextPiece       *inverse,
+                           guint               n_pieces)
+{
+    guint i;
+
+    for (i = n_pieces; i-- > 0; )
+    {
+        GtkTextIter start, end;
+
+        gtk_text_buffer_get_iter_at_offset (buffer, &start, pieces[i].offset);
+        gtk_text_buffer_get_iter_at_offset (buffer, &end, pieces[i].offset + pieces[i].length);
+        inverse[i].text = gtk_text_buffer_get_slice (buffer, &start, &end, TRUE);
+
+        if (!gtk_text_iter_equal (&start, &end))
+            gtk_text_buffer_delete (buffer, &start, &end);
+        if (*pieces[i].text)
+            gtk_text_buffer_insert (buffer, &start, pieces[i].text, -1);
+    }
+}
+
+/* Replaces the pieces with a single edit and returns pieces which undo it.
+   Text marks and line marks between the first and the last piece are saved
+   as offsets and put where they would be if every piece was a separate edit,
+   instead of being collapsed by deleting the whole range. */
+static MooTextPiece *
+replace_pieces (MooTextBuffer      *buffer,
+                const MooTextPiece *pieces,
+                guint               n_pieces)
+{
+    GtkTextBuffer *text_buffer = GTK_TEXT_BUFFER (buffer);
+    GtkTextIter start, end;
+    MooTextPiece *inverse;
+    GArray *text_marks, *line_marks;
+    GString *new_text;
+    char *old_text;
+    const char *p;
+    int char_pos, delta;
+    guint i;
+
+    inverse = g_new (MooTextPiece, n_pieces);
+
+    for (i = 0, delta = 0; i < n_pieces; ++i)
+    {
+        inverse[i].offset = pieces[i].offset + delta;
+        inverse[i].length = g_utf8_strlen (pieces[i].text, -1);
+        delta += inverse[i].length - pieces[i].length;
+    }
+
+    gtk_text_buffer_get_iter_at_offset (text_buffer, &start, pieces[0].offset);
+    gtk_text_buffer_get_iter_at_offset (text_buffer, &end,
+                                        pieces[n_pieces-1].offset + pieces[n_pieces-1].length);
+
+    freeze_cursor_moved (buffer);
+    moo_undo_stack_freeze (buffer->priv->undo_stack);
+
+    if (has_folded_text (text_buffer, &start, &end))
+    {
+        replace_pieces_one_by_one (text_buffer, pieces, inverse, n_pieces);
+        moo_undo_stack_thaw (buffer->priv->undo_stack);
+        thaw_cursor_moved (buffer);
+        return inverse;
+    }
+
+    old_text = gtk_text_buffer_get_slice (text_buffer, &start, &end, TRUE);
+    new_text = g_string_sized_new (strlen (old_text));
+
+    for (i = 0, p = old_text, char_pos = pieces[0].offset; i < n_pieces; ++i)
+    {
+        const char *piece_start, *piece_end;
+
+        piece_start = g_utf8_offset_to_pointer (p, pieces[i].offset - char_pos);
+        piece_end = g_utf8_offset_to_pointer (piece_start, pieces[i].length);
+
+        g_string_append_len (new_text, p, piece_start - p);
+        g_string_append (new_text, pieces[i].text);
+        inverse[i].text = g_strndup (piece_start, piece_end - piece_start);
+
+        p = piece_end;
+        char_pos = pieces[i].offset + pieces[i].length;
+    }
+
+    text_marks = g_array_new (FALSE, FALSE, sizeof (SavedMark));
+    line_marks = g_array_new (FALSE, FALSE, sizeof (SavedMark));
+    save_text_marks (&start, &end, text_marks);
+    save_line_marks (buffer, gtk_text_iter_get_line (&start),
+                     gtk_text_iter_get_line (&end), line_marks);
+
+    if (!gtk_text_iter_equal (&start, &end))
+        gtk_text_buffer_delete (text_buffer, &start, &end);
+    if (new_text->len)
+        gtk_text_buffer_insert (text_buffer, &start, new_text->str, new_text->len);
+
+    restore_marks (buffer, pieces, inverse, n_pieces, text_marks, line_marks);
+
+    moo_undo_stack_thaw (buffer->priv->undo_stack);
+    thaw_cursor_moved (buffer);
+
+    g_array_free (text_marks, TRUE);
+    g_array_free (line_marks, TRUE);
+    g_string_free (new_text, TRUE);
+    g_free (old_text);
+
+    return inverse;
+}
+
+
+static void
+replace_action_undo (ReplaceAction *action,
+                     GtkTextBuffer *buffer)
+{
+    MooTextPiece *inverse;
+    gboolean was_modified;
+
+    if (MOO_TEXT_BUFFER(buffer)->priv->undo_failed)
+        return;
+
+    was_modified = gtk_text_buffer_get_modified (buffer);
+
+    inverse = replace_pieces (MOO_TEXT_BUFFER (buffer), action->pieces, action->n_pieces);
+    pieces_free (action->pieces, action->n_pieces);
+    action->pieces = inverse;
+    action->edit.bytes = pieces_size (inverse, action->n_pieces);
+
+    if (ACTION_INTERACTIVE (action))
+        MOO_TEXT_BUFFER(buffer)->priv->move_cursor_to = inverse[0].offset;
+
+    action_undo_or_redo (EDIT_ACTION (action), buffer, was_modified);
+}
+
+
+static gboolean
+replace_action_merge (G_GNUC_UNUSED ReplaceAction *last_action,
+                      G_GNUC_UNUSED ReplaceAction *action,
+                      G_GNUC_UNUSED MooTextBuffer *buffer)
+{
+    return FALSE;
+}
+
+
+/**
+ * _moo_text_buffer_replace_pieces:
+ *
+ * Pieces must be sorted by offset and must not overlap, offsets are
+ * character offsets in the buffer before replacement. All pieces are
+ * replaced in one edit and make one undo action.
+ */
+void
+_moo_text_buffer_replace_pieces (MooTextBuffer      *buffer,
+                                 const MooTextPiece *pieces,
+                                 guint               n_pieces)
+{
+    ReplaceAction *action = NULL;
+    MooTextPiece *inverse;
+
+    g_return_if_fail (MOO_IS_TEXT_BUFFER (buffer));
+    g_return_if_fail (pieces != NULL || n_pieces == 0);
+
+    if (!n_pieces)
+        return;
+
+    if (!moo_undo_stack_frozen (buffer->priv->undo_stack))
+    {
+        action = (ReplaceAction*) action_new (ACTION_REPLACE, buffer);
+        action->edit.mergeable = FALSE;
+    }
+
+    inverse = replace_pieces (buffer, pieces, n_pieces);
+
+    if (action)
+    {
+        action->pieces = inverse;
+        action->n_pieces = n_pieces;
+        action->edit.bytes = pieces_size (inverse, n_pieces);
+        moo_undo_stack_add_action (buffer->priv->undo_stack, REPLACE_ACTION_TYPE, action);
+    }
+    else
+    {
+        pieces_free (inverse, n_pieces);
+    }
+}
+
+
 void
 moo_text_buffer_add_line_mark (MooTextBuffer *buffer,
                                MooLineMark   *mark,
@@ -14,7 +14,7 @@
  */
 
 #include "mooedit/mootextfind.h"
-#include "mooedit/mootextview.h"
+#include "mooedit/mootextview-private.h"
 #include "mooedit/mooeditdialogs.h"
 #include "mooedit/mootextsearch-private.h"
 #include "mooedit/mooeditprefs.h"
@@ -619,6 +619,19 @@ moo_find_get_replacement (MooFind *find)
 }
 
 
+static MooTextSearchFlags
+get_search_flags (MooFindFlags flags)
+{
+    MooTextSearchFlags search_flags = 0;
+
+    if (flags & MOO_FIND_CASELESS)
+        search_flags |= MOO_TEXT_SEARCH_CASELESS;
+    if (flags & MOO_FIND_WHOLE_WORDS)
+        search_flags |= MOO_TEXT_SEARCH_WHOLE_WORDS;
+
+    return search_flags;
+}
+
 static gboolean
 do_find (const GtkTextIter *start,
          const GtkTextIter *end,
@@ -641,12 +654,7 @@ do_find (const GtkTextIter *start,
     }
     else
     {
-        MooTextSearchFlags search_flags = 0;
-
-        if (flags & MOO_FIND_CASELESS)
-            search_flags |= MOO_TEXT_SEARCH_CASELESS;
-        if (flags & MOO_FIND_WHOLE_WORDS)
-            search_flags |= MOO_TEXT_SEARCH_WHOLE_WORDS;
+        MooTextSearchFlags search_flags = get_search_flags (flags);
 
         if (flags & MOO_FIND_BACKWARDS)
             return moo_text_search_backward (start, text, search_flags,
@@ -718,6 +726,78 @@ get_search_bounds2 (GtkTextBuffer *buffer,
 }
 
 
+/* Highlights matches of the last search in the view, if it wants that */
+static void
+set_search_pattern (GtkTextView *view)
+{
+    if (MOO_IS_TEXT_VIEW (view))
+        _moo_text_view_set_search_pattern (MOO_TEXT_VIEW (view), last_search, last_regex,
+                                           get_search_flags (last_search_flags));
+}
+
+/* Looks up next or previous match in the match index instead of searching
+   the text. Returns FALSE if the index can't be used: it's not complete, or
+   it is for a different pattern, or it's empty. Empty matches aren't indexed,
+   so if the pattern has them, the text is searched to find them as usual. */
+static gboolean
+find_in_index (GtkTextBuffer     *buffer,
+               const GtkTextIter *sel_start,
+               const GtkTextIter *sel_end,
+               gboolean           forward,
+               GtkTextIter       *match_start,
+               GtkTextIter       *match_end,
+               gboolean          *found,
+               gboolean          *wrapped)
+{
+    MooTextMatches *matches;
+    MooTextMatch match;
+    const MooTextMatch *all;
+    guint n_matches;
+
+    if (!(matches = _moo_text_matches_peek (buffer)) ||
+        !_moo_text_matches_is_complete (matches) ||
+        _moo_text_matches_has_empty (matches) ||
+        !_moo_text_matches_has_pattern (matches, last_search, last_regex,
+                                        get_search_flags (last_search_flags)))
+        return FALSE;
+
+    all = _moo_text_matches_get_all (matches, &n_matches);
+
+    if (!n_matches)
+        return FALSE;
+
+    *found = TRUE;
+    *wrapped = FALSE;
+
+    if (forward)
+    {
+        if (!_moo_text_matches_find (matches, gtk_text_iter_get_offset (sel_end), TRUE, &match))
+        {
+            match = all[0];
+            *wrapped = TRUE;
+            *found = match.start <= gtk_text_iter_get_offset (sel_start);
+        }
+    }
+    else
+    {
+        if (!_moo_text_matches_find (matches, gtk_text_iter_get_offset (sel_start), FALSE, &match))
+        {
+            match = all[n_matches - 1];
+            *wrapped = TRUE;
+            *found = match.end >= gtk_text_iter_get_offset (sel_end);
+        }
+    }
+
+    if (*found)
+    {
+        gtk_text_buffer_get_iter_at_offset (buffer, match_start, match.start);
+        gtk_text_buffer_get_iter_at_offset (buffer, match_end, match.end);
+    }
+
+    return TRUE;
+}
+
+
 static void
 scroll_to_found (GtkTextView *view)
 {
@@ -759,6 +839,8 @@ moo_text_view_run_find (GtkTextView    *view,
 
     gtk_widget_destroy (find);
 
+    set_search_pattern (view);
+
     buffer = gtk_text_view_get_buffer (view);
 
     get_search_bounds (buffer, flags, &start, &end);
@@ -833,6 +915,7 @@ moo_text_view_run_find_current_word (GtkTextView    *view,
     last_search = search_term;
     REGEX_FREE (last_regex);
     moo_history_list_add (search_history, search_term);
+    set_search_pattern (view);
 
     if (forward)
     {
@@ -927,36 +1010,42 @@ moo_text_view_run_find_next (GtkTextView    *view,
 
     has_selection = gtk_text_buffer_get_selection_bounds (buffer, &sel_start, &sel_end);
 
-    start = sel_end;
-    gtk_text_buffer_get_end_iter (buffer, &end);
-
-    found = do_find (&start, &end, last_search_flags & ~MOO_FIND_BACKWARDS,
-                     last_regex, last_search, &match_start, &match_end);
+    set_search_pattern (view);
 
-    if (found && !has_selection &&
-        gtk_text_iter_equal (&match_start, &match_end) &&
-        gtk_text_iter_equal (&match_start, &start))
+    if (!find_in_index (buffer, &sel_start, &sel_end, TRUE,
+                        &match_start, &match_end, &found, &wrapped))
     {
-        if (!gtk_text_iter_forward_char (&start))
+        start = sel_end;
+        gtk_text_buffer_get_end_iter (buffer, &end);
+
+        found = do_find (&start, &end, last_search_flags & ~MOO_FIND_BACKWARDS,
+                         last_regex, last_search, &match_start, &match_end);
+
+        if (found && !has_selection &&
+            gtk_text_iter_equal (&match_start, &match_end) &&
+            gtk_text_iter_equal (&match_start, &start))
         {
-            found = FALSE;
+            if (!gtk_text_iter_forward_char (&start))
+            {
+                found = FALSE;
+            }
+            else
+            {
+                found = do_find (&start, &end, last_search_flags & ~MOO_FIND_BACKWARDS,
+                                  last_regex, last_search, &match_start, &match_end);;
+            }
         }
-        else
+
+        if (!found && !gtk_text_iter_is_start (&sel_start))
         {
+            wrapped = TRUE;
+            gtk_text_buffer_get_start_iter (buffer, &start);
+            end = sel_start;
             found = do_find (&start, &end, last_search_flags & ~MOO_FIND_BACKWARDS,
-                              last_regex, last_search, &match_start, &match_end);;
+                              last_regex, last_search, &match_start, &match_end);
         }
     }
 
-    if (!found && !gtk_text_iter_is_start (&sel_start))
-    {
-        wrapped = TRUE;
-        gtk_text_buffer_get_start_iter (buffer, &start);
-        end = sel_start;
-        found = do_find (&start, &end, last_search_flags & ~MOO_FIND_BACKWARDS,
-                          last_regex, last_search, &match_start, &match_end);
-    }
-
     if (found)
     {
         gtk_text_buffer_select_range (buffer, &match_end, &match_start);
@@ -1003,36 +1092,42 @@ moo_text_view_run_find_prev (GtkTextView    *view,
 
     has_selection = gtk_text_buffer_get_selection_bounds (buffer, &sel_start, &sel_end);
 
-    start = sel_start;
-    gtk_text_buffer_get_start_iter (buffer, &end);
+    set_search_pattern (view);
 
-    found = do_find (&start, &end, last_search_flags | MOO_FIND_BACKWARDS,
-                     last_regex, last_search, &match_start, &match_end);
-
-    if (found && !has_selection &&
-        gtk_text_iter_equal (&match_start, &match_end) &&
-        gtk_text_iter_equal (&match_start, &start))
+    if (!find_in_index (buffer, &sel_start, &sel_end, FALSE,
+                        &match_start, &match_end, &found, &wrapped))
     {
-        if (!gtk_text_iter_backward_char (&start))
+        start = sel_start;
+        gtk_text_buffer_get_start_iter (buffer, &end);
+
+        found = do_find (&start, &end, last_search_flags | MOO_FIND_BACKWARDS,
+                         last_regex, last_search, &match_start, &match_end);
+
+        if (found && !has_selection &&
+            gtk_text_iter_equal (&match_start, &match_end) &&
+            gtk_text_iter_equal (&match_start, &start))
         {
-            found = FALSE;
+            if (!gtk_text_iter_backward_char (&start))
+            {
+                found = FALSE;
+            }
+            else
+            {
+                found = do_find (&start, &end, last_search_flags | MOO_FIND_BACKWARDS,
+                                 last_regex, last_search, &match_start, &match_end);;
+            }
         }
-        else
+
+        if (!found && !gtk_text_iter_is_end (&sel_end))
         {
+            gtk_text_buffer_get_end_iter (buffer, &start);
+            end = sel_end;
             found = do_find (&start, &end, last_search_flags | MOO_FIND_BACKWARDS,
-                             last_regex, last_search, &match_start, &match_end);;
+                             last_regex, last_search, &match_start, &match_end);
+            wrapped = TRUE;
         }
     }
 
-    if (!found && !gtk_text_iter_is_end (&sel_end))
-    {
-        gtk_text_buffer_get_end_iter (buffer, &start);
-        end = sel_end;
-        found = do_find (&start, &end, last_search_flags | MOO_FIND_BACKWARDS,
-                         last_regex, last_search, &match_start, &match_end);
-        wrapped = TRUE;
-    }
-
     if (found)
     {
         gtk_text_buffer_select_range (buffer, &match_start, &match_end);
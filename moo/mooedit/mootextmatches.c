@@ -0,0 +1,753 @@
+/*
+ *   mootextmatches.c
+ *
+ *   Copyright (C) 2004-2010 by Yevgen Muntyan <emuntyan@users.sourceforge.net>
+ *
+ *   This file is part of medit.  medit is free software; you can
+ *   redistribute it and/or modify it under the terms of the
+ *   GNU Lesser General Public License as published by the
+ *   Free Software Foundation; either version 2.1 of the License,
+ *   or (at your option) any later version.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with medit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mooedit/mootextmatches.h"
+#include "marshals.h"
+#include <string.h>
+
+#define MATCHES_DATA_KEY "moo-text-matches"
+
+/* characters searched at once, rounded up to the line end */
+#define SCAN_STEP_CHARS 32768
+/* how long an idle run may take, in seconds */
+#define SCAN_TIME_SLICE 0.01
+
+struct MooTextMatches
+{
+    GObject base;
+
+    GtkTextBuffer *buffer;
+
+    char *text;
+    MooRegex *regex;
+    MooTextSearchFlags flags;
+    int n_lines;            /* lines a match may span */
+
+    GArray *matches;        /* MooTextMatch, sorted, don't overlap */
+    GArray *dirty;          /* MooTextMatch, ranges to search again */
+    int scanned;            /* text before it is indexed, except dirty ranges */
+    gboolean has_empty;     /* the regex found empty matches, which aren't indexed */
+    guint idle;
+};
+
+enum {
+    CHANGED,
+    LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL];
+
+static void     moo_text_matches_finalize   (GObject            *object);
+static void     buffer_insert_text          (GtkTextBuffer      *buffer,
+                                             GtkTextIter        *where,
+                                             const char         *text,
+                                             int                 len,
+                                             MooTextMatches     *matches);
+static void     buffer_delete_range         (GtkTextBuffer      *buffer,
+                                             GtkTextIter        *start,
+                                             GtkTextIter        *end,
+                                             MooTextMatches     *matches);
+static void     queue_scan                  (MooTextMatches     *matches);
+
+
+G_DEFINE_TYPE (MooTextMatches, _moo_text_matches, G_TYPE_OBJECT)
+
+static void
+_moo_text_matches_class_init (MooTextMatchesClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+    gobject_class->finalize = moo_text_matches_finalize;
+
+    signals[CHANGED] =
+            g_signal_new ("changed",
+                          G_OBJECT_CLASS_TYPE (klass),
+                          G_SIGNAL_RUN_LAST,
+                          G_STRUCT_OFFSET (MooTextMatchesClass, changed),
+                          NULL, NULL,
+                          _moo_marshal_VOID__VOID,
+                          G_TYPE_NONE, 0);
+}
+
+
+static void
+_moo_text_matches_init (MooTextMatches *matches)
+{
+    matches->matches = g_array_new (FALSE, FALSE, sizeof (MooTextMatch));
+    matches->dirty = g_array_new (FALSE, FALSE, sizeof (MooTextMatch));
+}
+
+
+static void
+clear_pattern (MooTextMatches *matches)
+{
+    if (matches->idle)
+        g_source_remove (matches->idle);
+    matches->idle = 0;
+
+    if (matches->regex)
+        _moo_regex_unref (matches->regex);
+    matches->regex = NULL;
+    g_free (matches->text);
+    matches->text = NULL;
+
+    g_array_set_size (matches->matches, 0);
+    g_array_set_size (matches->dirty, 0);
+    matches->scanned = 0;
+    matches->has_empty = FALSE;
+}
+
+
+static void
+moo_text_matches_finalize (GObject *object)
+{
+    MooTextMatches *matches = MOO_TEXT_MATCHES (object);
+
+    clear_pattern (matches);
+    g_array_free (matches->matches, TRUE);
+    g_array_free (matches->dirty, TRUE);
+
+    G_OBJECT_CLASS (_moo_text_matches_parent_class)->finalize (object);
+}
+
+
+static void
+buffer_gone (MooTextMatches       *matches,
+             G_GNUC_UNUSED GObject *buffer)
+{
+    matches->buffer = NULL;
+    clear_pattern (matches);
+}
+
+MooTextMatches *
+_moo_text_matches_peek (GtkTextBuffer *buffer)
+{
+    g_return_val_if_fail (GTK_IS_TEXT_BUFFER (buffer), NULL);
+    return g_object_get_data (G_OBJECT (buffer), MATCHES_DATA_KEY);
+}
+
+MooTextMatches *
+_moo_text_matches_get (GtkTextBuffer *buffer)
+{
+    MooTextMatches *matches;
+
+    g_return_val_if_fail (GTK_IS_TEXT_BUFFER (buffer), NULL);
+
+    if ((matches = _moo_text_matches_peek (buffer)))
+        return matches;
+
+    matches = g_object_new (MOO_TYPE_TEXT_MATCHES, (const char*) NULL);
+    matches->buffer = buffer;
+
+    /* the buffer owns the index; its weak ref is notified before the
+       data is destroyed, so the idle handler never sees a dead buffer */
+    g_object_weak_ref (G_OBJECT (buffer), (GWeakNotify) buffer_gone, matches);
+    g_object_set_data_full (G_OBJECT (buffer), MATCHES_DATA_KEY,
+                            matches, g_object_unref);
+
+    g_signal_connect_after (buffer, "insert-text",
+                            G_CALLBACK (buffer_insert_text), matches);
+    g_signal_connect (buffer, "delete-range",
+                      G_CALLBACK (buffer_delete_range), matches);
+
+    return matches;
+}
+
+
+/* FALSE if there is no pattern, or it is an invalid regex */
+static gboolean
+can_scan (MooTextMatches *matches)
+{
+    return matches->buffer &&
+           (matches->regex || (matches->text && !(matches->flags & MOO_TEXT_SEARCH_REGEX)));
+}
+
+static int
+count_lines (const char *text)
+{
+    int n_lines = 1;
+
+    for ( ; *text; ++text)
+        if (*text == '\n')
+            n_lines++;
+
+    return n_lines;
+}
+
+void
+_moo_text_matches_set_pattern (MooTextMatches     *matches,
+                               const char         *text,
+                               MooRegex           *regex,
+                               MooTextSearchFlags  flags)
+{
+    g_return_if_fail (MOO_IS_TEXT_MATCHES (matches));
+
+    if (_moo_text_matches_has_pattern (matches, text, regex, flags))
+        return;
+
+    clear_pattern (matches);
+
+    if (!regex && text && text[0])
+    {
+        matches->text = g_strdup (text);
+        matches->flags = flags;
+
+        if (flags & MOO_TEXT_SEARCH_REGEX)
+            regex = _moo_regex_compile (text,
+                                        ((flags & MOO_TEXT_SEARCH_CASELESS) ? G_REGEX_CASELESS : 0) |
+                                            G_REGEX_OPTIMIZE,
+                                        0, NULL);
+        else
+            matches->n_lines = count_lines (text);
+    }
+    else if (regex)
+    {
+        _moo_regex_ref (regex);
+    }
+
+    if (regex)
+    {
+        matches->regex = regex;
+        matches->n_lines = regex->n_lines;
+    }
+
+    if (can_scan (matches))
+        queue_scan (matches);
+
+    g_signal_emit (matches, signals[CHANGED], 0);
+}
+
+gboolean
+_moo_text_matches_has_pattern (MooTextMatches     *matches,
+                               const char         *text,
+                               MooRegex           *regex,
+                               MooTextSearchFlags  flags)
+{
+    g_return_val_if_fail (MOO_IS_TEXT_MATCHES (matches), FALSE);
+
+    if (regex)
+        return matches->regex && !matches->text &&
+               (regex == matches->regex ||
+                (!strcmp (g_regex_get_pattern (regex->re),
+                          g_regex_get_pattern (matches->regex->re)) &&
+                 g_regex_get_compile_flags (regex->re) ==
+                    g_regex_get_compile_flags (matches->regex->re)));
+
+    if (text && text[0])
+        return matches->text && flags == matches->flags &&
+               !strcmp (text, matches->text);
+
+    return !matches->text && !matches->regex;
+}
+
+
+gboolean
+_moo_text_matches_is_complete (MooTextMatches *matches)
+{
+    g_return_val_if_fail (MOO_IS_TEXT_MATCHES (matches), FALSE);
+    return can_scan (matches) && !matches->idle;
+}
+
+gboolean
+_moo_text_matches_has_empty (MooTextMatches *matches)
+{
+    g_return_val_if_fail (MOO_IS_TEXT_MATCHES (matches), FALSE);
+    return matches->has_empty;
+}
+
+const MooTextMatch *
+_moo_text_matches_get_all (MooTextMatches *matches,
+                           guint          *n_matches)
+{
+    g_return_val_if_fail (MOO_IS_TEXT_MATCHES (matches), NULL);
+    g_return_val_if_fail (n_matches != NULL, NULL);
+    *n_matches = matches->matches->len;
+    return (const MooTextMatch*) matches->matches->data;
+}
+
+static guint
+first_ending_after (GArray *array,
+                    int     offset)
+{
+    guint low = 0, high = array->len;
+
+    /* matches don't overlap, so their ends are sorted too */
+    while (low < high)
+    {
+        guint mid = low + (high - low) / 2;
+
+        if (g_array_index (array, MooTextMatch, mid).end > offset)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+
+    return low;
+}
+
+guint
+_moo_text_matches_bsearch (MooTextMatches *matches,
+                           int             offset)
+{
+    g_return_val_if_fail (MOO_IS_TEXT_MATCHES (matches), 0);
+    return first_ending_after (matches->matches, offset);
+}
+
+int
+_moo_text_matches_index_of (MooTextMatches *matches,
+                            int             start,
+                            int             end)
+{
+    guint i;
+    MooTextMatch *m;
+
+    g_return_val_if_fail (MOO_IS_TEXT_MATCHES (matches), -1);
+
+    i = first_ending_after (matches->matches, end - 1);
+
+    if (i == matches->matches->len)
+        return -1;
+
+    m = &g_array_index (matches->matches, MooTextMatch, i);
+    return m->start == start && m->end == end ? (int) i : -1;
+}
+
+gboolean
+_moo_text_matches_find (MooTextMatches *matches,
+                        int             offset,
+                        gboolean        forward,
+                        MooTextMatch   *match)
+{
+    guint i;
+
+    g_return_val_if_fail (MOO_IS_TEXT_MATCHES (matches), FALSE);
+    g_return_val_if_fail (match != NULL, FALSE);
+
+    i = first_ending_after (matches->matches, offset);
+
+    if (forward)
+    {
+        if (i < matches->matches->len &&
+            g_array_index (matches->matches, MooTextMatch, i).start < offset)
+                i++;
+        if (i >= matches->matches->len)
+            return FALSE;
+    }
+    else
+    {
+        if (i == 0)
+            return FALSE;
+        i--;
+    }
+
+    *match = g_array_index (matches->matches, MooTextMatch, i);
+    return TRUE;
+}
+
+
+/* Adds a match unless it overlaps one which is already there, which
+   happens when a rescanned range ends in the middle of a match. */
+static void
+add_match (MooTextMatches *matches,
+           int             start,
+           int             end)
+{
+    GArray *array = matches->matches;
+    MooTextMatch m;
+    guint i;
+
+    if (array->len && g_array_index (array, MooTextMatch, array->len - 1).end <= start)
+    {
+        i = array->len;
+    }
+    else
+    {
+        i = first_ending_after (array, start);
+        if (i < array->len && g_array_index (array, MooTextMatch, i).start < end)
+            return;
+    }
+
+    m.start = start;
+    m.end = end;
+    g_array_insert_val (array, i, m);
+}
+
+/* Finds regex matches which start in [start, limit] in one slice of text.
+   Matches are the same as _moo_text_search_regex_forward() finds one after
+   another: g_match_info_next() goes on while they end on the first line of
+   the search window, then the window moves to the line where the last match
+   ended. Returns offset of the end of the last match. */
+static int
+scan_regex (MooTextMatches    *matches,
+            const GtkTextIter *start,
+            const GtkTextIter *limit,
+            const GtkTextIter *search_end)
+{
+    MooRegex *regex = matches->regex;
+    GtkTextIter slice_start;
+    char *text;
+    gsize len, pos, limit_pos;
+    gsize line, line_end, next_line, window_end;
+    gsize char_byte;
+    int char_pos, last_end;
+    gboolean has_next;
+    gboolean done = FALSE;
+
+    slice_start = *start;
+    gtk_text_iter_set_line_offset (&slice_start, 0);
+
+    text = gtk_text_buffer_get_slice (matches->buffer, &slice_start, search_end, TRUE);
+    len = strlen (text);
+
+    pos = g_utf8_offset_to_pointer (text, gtk_text_iter_get_line_offset (start)) - text;
+    limit_pos = g_utf8_offset_to_pointer (text + pos, gtk_text_iter_get_offset (limit) -
+                                                      gtk_text_iter_get_offset (start)) - text;
+
+    /* byte offsets are turned into character offsets as matches go */
+    char_byte = 0;
+    char_pos = gtk_text_iter_get_offset (&slice_start);
+    last_end = gtk_text_iter_get_offset (start);
+
+    line = 0;
+    has_next = _moo_text_search_find_window (text, len, line, regex->n_lines,
+                                             &line_end, &next_line, &window_end);
+
+    while (!done)
+    {
+        GMatchInfo *match_info = NULL;
+        gboolean matched;
+
+        matched = g_regex_match_full (regex->re, text + line, window_end - line,
+                                      pos - line, 0, &match_info, NULL);
+
+        while (matched)
+        {
+            int match_start, match_end;
+
+            g_match_info_fetch_pos (match_info, 0, &match_start, &match_end);
+            match_start += line;
+            match_end += line;
+
+            if ((gsize) match_start > limit_pos)
+            {
+                done = TRUE;
+                break;
+            }
+
+            char_pos += g_utf8_pointer_to_offset (text + char_byte, text + match_start);
+            char_byte = match_start;
+            pos = match_end;
+
+            /* empty matches aren't worth highlighting */
+            if (match_start == match_end)
+            {
+                matches->has_empty = TRUE;
+
+                /* don't find it again in the next window */
+                if (pos > line_end)
+                {
+                    if (pos >= len)
+                        done = TRUE;
+                    else
+                        pos = g_utf8_next_char (text + pos) - text;
+                }
+            }
+            else
+            {
+                int n_chars = g_utf8_pointer_to_offset (text + match_start, text + match_end);
+                add_match (matches, char_pos, char_pos + n_chars);
+                char_pos += n_chars;
+                char_byte = match_end;
+                last_end = char_pos;
+            }
+
+            if (done || pos > line_end)
+                break;
+
+            matched = g_match_info_next (match_info, NULL);
+        }
+
+        g_match_info_free (match_info);
+
+        if (done)
+            break;
+
+        if (!matched)
+        {
+            /* nothing more in this window, go to the next line */
+            if (!has_next || next_line > limit_pos)
+                break;
+            pos = next_line;
+        }
+
+        while (pos > line_end && has_next)
+        {
+            line = next_line;
+            has_next = _moo_text_search_find_window (text, len, line, regex->n_lines,
+                                                     &line_end, &next_line, &window_end);
+        }
+
+        if (pos > line_end)
+            break;
+
+        pos = MAX (pos, line);
+    }
+
+    g_free (text);
+    return last_end;
+}
+
+/* Looks for matches which start in [from, to], a step at a time.
+   Returns offset where the next step should start. */
+static int
+scan_step (MooTextMatches *matches,
+           int             from,
+           int             to)
+{
+    GtkTextIter start, limit, search_end;
+    GtkTextIter match_start, match_end;
+
+    gtk_text_buffer_get_iter_at_offset (matches->buffer, &start, from);
+
+    limit = start;
+    gtk_text_iter_forward_chars (&limit, SCAN_STEP_CHARS);
+    if (!gtk_text_iter_ends_line (&limit))
+        gtk_text_iter_forward_to_line_end (&limit);
+    if (gtk_text_iter_get_offset (&limit) > to)
+        gtk_text_buffer_get_iter_at_offset (matches->buffer, &limit, to);
+
+    /* matches may start at limit and go on for a few lines */
+    search_end = limit;
+    if (matches->n_lines > 1)
+        gtk_text_iter_forward_lines (&search_end, matches->n_lines - 1);
+    if (!gtk_text_iter_ends_line (&search_end))
+        gtk_text_iter_forward_to_line_end (&search_end);
+
+    if (matches->regex)
+        return MAX (gtk_text_iter_get_offset (&limit) + 1,
+                    scan_regex (matches, &start, &limit, &search_end));
+
+    /* plain text is never empty, and gtk_source_iter_forward_search()
+       doesn't copy the text */
+    while (gtk_text_iter_compare (&start, &limit) <= 0 &&
+           moo_text_search_forward (&start, matches->text, matches->flags,
+                                    &match_start, &match_end, &search_end) &&
+           gtk_text_iter_compare (&match_start, &limit) <= 0)
+    {
+        add_match (matches,
+                   gtk_text_iter_get_offset (&match_start),
+                   gtk_text_iter_get_offset (&match_end));
+        start = match_end;
+    }
+
+    return MAX (gtk_text_iter_get_offset (&limit) + 1,
+                gtk_text_iter_get_offset (&start));
+}
+
+static gboolean
+scan_idle (MooTextMatches *matches)
+{
+    GTimer *timer;
+    int char_count;
+    gboolean done = FALSE;
+
+    timer = g_timer_new ();
+    char_count = gtk_text_buffer_get_char_count (matches->buffer);
+
+    while (!done && g_timer_elapsed (timer, NULL) < SCAN_TIME_SLICE)
+    {
+        if (matches->dirty->len)
+        {
+            MooTextMatch *range = &g_array_index (matches->dirty, MooTextMatch, 0);
+
+            range->start = scan_step (matches, range->start, range->end);
+
+            if (range->start > range->end)
+                g_array_remove_index (matches->dirty, 0);
+        }
+        else if (matches->scanned <= char_count)
+        {
+            matches->scanned = scan_step (matches, matches->scanned, char_count);
+        }
+        else
+        {
+            done = TRUE;
+        }
+    }
+
+    g_timer_destroy (timer);
+
+    if (done)
+        matches->idle = 0;
+
+    g_signal_emit (matches, signals[CHANGED], 0);
+
+    return !done;
+}
+
+static void
+queue_scan (MooTextMatches *matches)
+{
+    if (!matches->idle)
+        matches->idle = g_idle_add_full (G_PRIORITY_LOW,
+                                         (GSourceFunc) scan_idle,
+                                         matches, NULL);
+}
+
+
+/* Text in [start, old_end] was replaced with text in [start, old_end + delta].
+   Removes matches touching it and shifts the following ones, then makes
+   the scanner look at the changed lines again. */
+static void
+text_changed (MooTextMatches *matches,
+              int             start,
+              int             old_end,
+              int             delta)
+{
+    GArray *array = matches->matches;
+    GArray *dirty;
+    MooTextMatch range;
+    guint i, j;
+
+    i = first_ending_after (array, start - 1);
+    for (j = i; j < array->len && g_array_index (array, MooTextMatch, j).start <= old_end; ++j)
+        ;
+
+    range.start = start;
+    range.end = old_end;
+
+    if (j > i)
+    {
+        range.start = MIN (range.start, g_array_index (array, MooTextMatch, i).start);
+        range.end = MAX (range.end, g_array_index (array, MooTextMatch, j - 1).end);
+        g_array_remove_range (array, i, j - i);
+    }
+
+    for ( ; i < array->len; ++i)
+    {
+        g_array_index (array, MooTextMatch, i).start += delta;
+        g_array_index (array, MooTextMatch, i).end += delta;
+    }
+
+    dirty = g_array_sized_new (FALSE, FALSE, sizeof (MooTextMatch), matches->dirty->len + 1);
+
+    for (i = 0; i < matches->dirty->len; ++i)
+    {
+        MooTextMatch r = g_array_index (matches->dirty, MooTextMatch, i);
+
+        if (r.end < range.start)
+        {
+            g_array_append_val (dirty, r);
+        }
+        else if (r.start > range.end)
+        {
+            r.start += delta;
+            r.end += delta;
+            g_array_append_val (dirty, r);
+        }
+        else
+        {
+            range.start = MIN (range.start, r.start);
+            range.end = MAX (range.end, r.end);
+        }
+    }
+
+    if (matches->scanned > range.end)
+    {
+        matches->scanned += delta;
+        range.end += delta;
+
+        for (i = 0; i < dirty->len && g_array_index (dirty, MooTextMatch, i).start < range.start; ++i)
+            ;
+        g_array_insert_val (dirty, i, range);
+    }
+    else if (matches->scanned > range.start)
+    {
+        matches->scanned = range.start;
+    }
+
+    g_array_free (matches->dirty, TRUE);
+    matches->dirty = dirty;
+
+    queue_scan (matches);
+    g_signal_emit (matches, signals[CHANGED], 0);
+}
+
+/* Extends [start, end] to whole lines, and by as many lines as a match
+   may span, so that every match which could change is looked at. */
+static void
+get_affected_range (MooTextMatches *matches,
+                    GtkTextIter    *start,
+                    GtkTextIter    *end)
+{
+    gtk_text_iter_set_line_offset (start, 0);
+    if (matches->n_lines > 1)
+        gtk_text_iter_backward_lines (start, matches->n_lines - 1);
+
+    if (matches->n_lines > 1)
+        gtk_text_iter_forward_lines (end, matches->n_lines - 1);
+    if (!gtk_text_iter_ends_line (end))
+        gtk_text_iter_forward_to_line_end (end);
+}
+
+static void
+buffer_insert_text (G_GNUC_UNUSED GtkTextBuffer *buffer,
+                    GtkTextIter    *where,
+                    const char     *text,
+                    int             len,
+                    MooTextMatches *matches)
+{
+    GtkTextIter start, end;
+    int n_chars;
+
+    if (!can_scan (matches))
+        return;
+
+    n_chars = g_utf8_strlen (text, len);
+
+    end = *where;
+    start = *where;
+    gtk_text_iter_backward_chars (&start, n_chars);
+    get_affected_range (matches, &start, &end);
+
+    text_changed (matches,
+                  gtk_text_iter_get_offset (&start),
+                  gtk_text_iter_get_offset (&end) - n_chars,
+                  n_chars);
+}
+
+static void
+buffer_delete_range (G_GNUC_UNUSED GtkTextBuffer *buffer,
+                     GtkTextIter    *start,
+                     GtkTextIter    *end,
+                     MooTextMatches *matches)
+{
+    GtkTextIter range_start, range_end;
+    int n_chars;
+
+    if (!can_scan (matches))
+        return;
+
+    range_start = *start;
+    range_end = *end;
+    gtk_text_iter_order (&range_start, &range_end);
+    n_chars = gtk_text_iter_get_offset (&range_end) - gtk_text_iter_get_offset (&range_start);
+    get_affected_range (matches, &range_start, &range_end);
+
+    text_changed (matches,
+                  gtk_text_iter_get_offset (&range_start),
+                  gtk_text_iter_get_offset (&range_end),
+                  -n_chars);
+}
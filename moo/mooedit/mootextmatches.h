@@ -0,0 +1,90 @@
+/*
+ *   mootextmatches.h
+ *
+ *   Copyright (C) 2004-2010 by Yevgen Muntyan <emuntyan@users.sourceforge.net>
+ *
+ *   This file is part of medit.  medit is free software; you can
+ *   redistribute it and/or modify it under the terms of the
+ *   GNU Lesser General Public License as published by the
+ *   Free Software Foundation; either version 2.1 of the License,
+ *   or (at your option) any later version.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with medit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOO_TEXT_MATCHES_H
+#define MOO_TEXT_MATCHES_H
+
+#include <mooedit/mootextsearch-private.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Index of all matches of a search pattern in a buffer. It is filled
+ * in an idle handler a piece at a time, and kept up to date when the
+ * buffer is modified: only matches around the changed text are
+ * looked for again.
+ */
+
+#define MOO_TYPE_TEXT_MATCHES               (_moo_text_matches_get_type ())
+#define MOO_TEXT_MATCHES(object)            (G_TYPE_CHECK_INSTANCE_CAST ((object), MOO_TYPE_TEXT_MATCHES, MooTextMatches))
+#define MOO_IS_TEXT_MATCHES(object)         (G_TYPE_CHECK_INSTANCE_TYPE ((object), MOO_TYPE_TEXT_MATCHES))
+
+typedef struct MooTextMatches MooTextMatches;
+typedef struct MooTextMatchesClass MooTextMatchesClass;
+
+typedef struct {
+    int start;
+    int end;
+} MooTextMatch;
+
+struct MooTextMatchesClass
+{
+    GObjectClass base_class;
+
+    void (*changed) (MooTextMatches *matches);
+};
+
+GType               _moo_text_matches_get_type      (void) G_GNUC_CONST;
+
+/* creates the index if the buffer doesn't have one yet */
+MooTextMatches     *_moo_text_matches_get           (GtkTextBuffer      *buffer);
+MooTextMatches     *_moo_text_matches_peek          (GtkTextBuffer      *buffer);
+
+/* regex is used if not NULL, otherwise text is searched for with flags;
+   NULL text and regex stop indexing */
+void                _moo_text_matches_set_pattern   (MooTextMatches     *matches,
+                                                     const char         *text,
+                                                     MooRegex           *regex,
+                                                     MooTextSearchFlags  flags);
+gboolean            _moo_text_matches_has_pattern   (MooTextMatches     *matches,
+                                                     const char         *text,
+                                                     MooRegex           *regex,
+                                                     MooTextSearchFlags  flags);
+
+/* TRUE if every match in the buffer is in the index */
+gboolean            _moo_text_matches_is_complete   (MooTextMatches     *matches);
+/* TRUE if the pattern matched empty text, such matches aren't indexed */
+gboolean            _moo_text_matches_has_empty     (MooTextMatches     *matches);
+
+const MooTextMatch *_moo_text_matches_get_all       (MooTextMatches     *matches,
+                                                     guint              *n_matches);
+/* index of the first match which ends after offset */
+guint               _moo_text_matches_bsearch       (MooTextMatches     *matches,
+                                                     int                 offset);
+/* index of the match which spans exactly [start, end], or -1 */
+int                 _moo_text_matches_index_of      (MooTextMatches     *matches,
+                                                     int                 start,
+                                                     int                 end);
+/* first match starting at or after offset, or last match ending at
+   or before it */
+gboolean            _moo_text_matches_find          (MooTextMatches     *matches,
+                                                     int                 offset,
+                                                     gboolean            forward,
+                                                     MooTextMatch       *match);
+
+
+G_END_DECLS
+
+#endif /* MOO_TEXT_MATCHES_H */
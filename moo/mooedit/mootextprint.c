@@ -23,6 +23,7 @@
 #include "mooutils/mooi18n.h"
 #include "mooutils/mooutils-misc.h"
 #include "mooutils/mooutils-debug.h"
+#include "mooutils/moofilewriter.h"
 #include "mooutils/mootype-macros.h"
 #include "mooedit/mooprint-gxml.h"
 #include "mooglib/moo-time.h"
@@ -58,6 +59,7 @@ MOO_DEBUG_INIT (printing, FALSE)
 #define PREFS_FOOTER_RIGHT              MOO_EDIT_PREFS_PREFIX "/print/footer/right"
 
 #define PRINT_SETTINGS_FILE             "printsettings.ini"
+#define DEFAULT_EXPORT_FONT             "Monospace 10"
 
 
 typedef struct {
@@ -86,11 +88,17 @@ struct MooPrintOperationPrivate {
 
     /* aux stuff */
     GArray *pages;          /* offsets */
+    GHashTable *attr_cache; /* tags -> attributes, see get_iter_attrs() */
     PangoLayout *layout;
     double ln_height;
     PangoLayout *ln_layout;
 
     Page page;              /* text area */
+
+    /* pagination state, it's done a piece at a time */
+    int paginate_offset;
+    int paginate_line;
+    double paginate_height;
 };
 
 
@@ -136,6 +144,9 @@ static void moo_print_operation_begin_print (GtkPrintOperation  *operation,
 static void moo_print_operation_draw_page   (GtkPrintOperation  *operation,
                                              GtkPrintContext    *context,
                                              int                 page);
+static gboolean moo_print_operation_paginate (GtkPrintOperation *operation,
+                                              GtkPrintContext   *context,
+                                              gpointer           data);
 static void moo_print_operation_end_print   (GtkPrintOperation  *operation,
                                              GtkPrintContext    *context);
 static void moo_print_operation_status_changed (GtkPrintOperation *operation);
@@ -160,6 +171,7 @@ static void fill_layout                     (MooPrintOperation  *op,
                                              const GtkTextIter  *start,
                                              const GtkTextIter  *end,
                                              gboolean            get_styles);
+static GHashTable *attr_cache_new            (void);
 
 static GtkPageSetup     *get_global_page_setup      (void);
 static GtkPrintSettings *get_global_print_settings  (void);
@@ -332,6 +344,8 @@ moo_print_operation_finalize (GObject *object)
     g_free (op->priv->filename);
     g_free (op->priv->basename);
     g_free (op->priv->tm);
+    if (op->priv->attr_cache)
+        g_hash_table_destroy (op->priv->attr_cache);
     g_free (op->priv);
 
     moo_dmsg ("moo_print_operation_finalize");
@@ -455,6 +469,12 @@ _moo_print_operation_init (MooPrintOperation *op)
     op->priv->last_line = -1;
 
     op->priv->settings = moo_print_settings_new_default ();
+
+    /* not a class handler: GtkPrintOperation only emits "paginate"
+       if g_signal_has_handler_pending() says so */
+    g_signal_connect (op, "paginate",
+                      G_CALLBACK (moo_print_operation_paginate),
+                      NULL);
 }
 
 
@@ -732,39 +752,64 @@ line_number_displayed (MooPrintOperation *op,
 }
 
 
+/* lines laid out in one go, between them the main loop gets to run */
+#define PAGINATE_CHUNK_LINES 1000
+
 static void
-moo_print_operation_paginate (MooPrintOperation *op)
+moo_print_operation_start_pagination (MooPrintOperation *op)
+{
+    GtkTextIter iter;
+
+    if (op->priv->pages)
+        g_array_free (op->priv->pages, TRUE);
+
+    op->priv->pages = g_array_new (FALSE, FALSE, sizeof (int));
+    gtk_text_buffer_get_iter_at_line (op->priv->buffer, &iter,
+                                      op->priv->first_line);
+    op->priv->paginate_offset = gtk_text_iter_get_offset (&iter);
+    op->priv->paginate_line = op->priv->first_line;
+    op->priv->paginate_height = 0;
+    g_array_append_val (op->priv->pages, op->priv->paginate_offset);
+}
+
+static gboolean
+moo_print_operation_paginate (GtkPrintOperation          *operation,
+                              G_GNUC_UNUSED GtkPrintContext *context,
+                              G_GNUC_UNUSED gpointer data)
 {
-    GtkTextIter iter, print_end;
+    MooPrintOperation *op = MOO_PRINT_OPERATION (operation);
+    GtkTextIter iter, print_end, chunk_end;
     double page_height;
     gboolean use_styles;
     int line_no;
     int offset;
 
+    g_return_val_if_fail (op->priv->pages != NULL, TRUE);
+
     moo_dmsg ("moo_print_operation_paginate");
     moo_dmsg ("page height: %f", op->priv->page.height);
 
-    if (op->priv->pages)
-        g_array_free (op->priv->pages, TRUE);
-
-    op->priv->pages = g_array_new (FALSE, FALSE, sizeof (int));
-    gtk_text_buffer_get_iter_at_line (op->priv->buffer, &iter,
-                                      op->priv->first_line);
+    gtk_text_buffer_get_iter_at_offset (op->priv->buffer, &iter,
+                                        op->priv->paginate_offset);
     gtk_text_buffer_get_iter_at_line (op->priv->buffer, &print_end,
                                       op->priv->last_line);
     gtk_text_iter_forward_line (&print_end);
-    offset = gtk_text_iter_get_offset (&iter);
-    g_array_append_val (op->priv->pages, offset);
-    page_height = 0;
-    line_no = op->priv->first_line;
+    page_height = op->priv->paginate_height;
+    line_no = op->priv->paginate_line;
+
+    chunk_end = iter;
+    gtk_text_iter_forward_lines (&chunk_end, PAGINATE_CHUNK_LINES);
+    if (gtk_text_iter_compare (&chunk_end, &print_end) > 0)
+        chunk_end = print_end;
 
     use_styles = GET_OPTION (op, MOO_PRINT_USE_STYLES);
 
+    /* only highlight what is going to be laid out now */
     if (use_styles && MOO_IS_TEXT_BUFFER (op->priv->buffer))
         _moo_text_buffer_update_highlight (MOO_TEXT_BUFFER (op->priv->buffer),
-                                           &iter, &print_end, TRUE);
+                                           &iter, &chunk_end, TRUE);
 
-    while (gtk_text_iter_compare (&iter, &print_end) < 0)
+    while (gtk_text_iter_compare (&iter, &chunk_end) < 0)
     {
         GtkTextIter end;
         double line_height;
@@ -774,8 +819,7 @@ moo_print_operation_paginate (MooPrintOperation *op)
         if (!gtk_text_iter_ends_line (&end))
             gtk_text_iter_forward_to_line_end (&end);
 
-        fill_layout (op, op->priv->layout, &iter, &end,
-                     GET_OPTION (op, MOO_PRINT_USE_STYLES));
+        fill_layout (op, op->priv->layout, &iter, &end, use_styles);
 
         get_layout_size (op->priv->layout, NULL, &line_height);
 
@@ -831,19 +875,32 @@ moo_print_operation_paginate (MooPrintOperation *op)
             page_height = line_height;
 
             if (!part)
+            {
                 gtk_text_iter_forward_line (&iter);
+                line_no += 1;
+            }
         }
         else
         {
             page_height += line_height;
             gtk_text_iter_forward_line (&iter);
+            line_no += 1;
         }
     }
 #undef EPS
 
+    op->priv->paginate_offset = gtk_text_iter_get_offset (&iter);
+    op->priv->paginate_line = line_no;
+    op->priv->paginate_height = page_height;
+
+    if (gtk_text_iter_compare (&iter, &print_end) < 0)
+        return FALSE;
+
     gtk_print_operation_set_n_pages (GTK_PRINT_OPERATION (op), op->priv->pages->len);
 
     moo_dmsg ("moo_print_operation_paginate done");
+
+    return TRUE;
 }
 
 
@@ -935,6 +992,9 @@ moo_print_operation_begin_print (GtkPrintOperation *operation,
         }
     }
 
+    if (!font && !op->priv->doc)
+        font = pango_font_description_from_string (DEFAULT_EXPORT_FONT);
+
     moo_print_operation_calc_page_size (op, context, font);
 
     if (op->priv->layout)
@@ -961,10 +1021,13 @@ moo_print_operation_begin_print (GtkPrintOperation *operation,
 
     set_tabs (op, op->priv->layout);
 
-    moo_print_operation_paginate (op);
+    if (op->priv->attr_cache)
+        g_hash_table_destroy (op->priv->attr_cache);
+    op->priv->attr_cache = attr_cache_new ();
 
-    moo_dmsg ("begin_print: %u pages in %f s", op->priv->pages->len,
-              g_timer_elapsed (timer, NULL));
+    moo_print_operation_start_pagination (op);
+
+    moo_dmsg ("begin_print: %f s", g_timer_elapsed (timer, NULL));
     g_timer_destroy (timer);
 
     if (!op->priv->tm)
@@ -984,40 +1047,32 @@ moo_print_operation_begin_print (GtkPrintOperation *operation,
 
 
 static gboolean
-ignore_tag (MooPrintOperation *op,
-            GtkTextTag        *tag)
+ignore_tag (GtkTextBuffer *buffer,
+            GtkTextTag    *tag)
 {
-    if (MOO_IS_TEXT_BUFFER (op->priv->buffer) &&
-        _moo_text_buffer_is_bracket_tag (MOO_TEXT_BUFFER (op->priv->buffer), tag))
+    if (MOO_IS_TEXT_BUFFER (buffer) &&
+        _moo_text_buffer_is_bracket_tag (MOO_TEXT_BUFFER (buffer), tag))
             return TRUE;
 
     return FALSE;
 }
 
 static GSList *
-get_iter_attrs (MooPrintOperation *op,
-                GtkTextIter       *iter,
-                const GtkTextIter *limit)
+get_tags_attrs (GtkTextBuffer *buffer,
+                GSList        *tags)
 {
-    GSList *attrs = NULL, *tags;
+    GSList *attrs = NULL;
     PangoAttribute *bg = NULL, *fg = NULL, *style = NULL, *ul = NULL;
     PangoAttribute *weight = NULL, *st = NULL;
 
-    tags = gtk_text_iter_get_tags (iter);
-    gtk_text_iter_forward_to_tag_toggle (iter, NULL);
-
-    if (gtk_text_iter_compare (iter, limit) > 0)
-        *iter = *limit;
-
-    while (tags)
+    for ( ; tags; tags = tags->next)
     {
         GtkTextTag *tag;
         gboolean bg_set, fg_set, style_set, ul_set, weight_set, st_set;
 
         tag = tags->data;
-        tags = g_slist_delete_link (tags, tags);
 
-        if (ignore_tag (op, tag))
+        if (ignore_tag (buffer, tag))
             continue;
 
         g_object_get (tag,
@@ -1096,6 +1151,90 @@ get_iter_attrs (MooPrintOperation *op,
     return attrs;
 }
 
+/* Moves iter to the end of the run of text which has the same tags,
+ * and returns a string identifying the tags which matter for output.
+ * Highlighted text is made of a handful of distinct styles, so what
+ * is computed from the tags is cached under this key. */
+static char *
+get_style_run (GtkTextBuffer      *buffer,
+               GtkTextIter        *iter,
+               const GtkTextIter  *limit,
+               GSList            **tags_p)
+{
+    GSList *tags, *l;
+    GString *key;
+
+    tags = gtk_text_iter_get_tags (iter);
+    gtk_text_iter_forward_to_tag_toggle (iter, NULL);
+
+    if (gtk_text_iter_compare (iter, limit) > 0)
+        *iter = *limit;
+
+    key = g_string_new (NULL);
+
+    for (l = tags; l; l = l->next)
+        if (!ignore_tag (buffer, l->data))
+            g_string_append_printf (key, "%p;", l->data);
+
+    *tags_p = tags;
+    return g_string_free (key, FALSE);
+}
+
+static void
+attr_list_free (GSList *attrs)
+{
+    g_slist_foreach (attrs, (GFunc) pango_attribute_destroy, NULL);
+    g_slist_free (attrs);
+}
+
+/* Tags may go away or change between runs, so the cache only lives
+ * as long as one print operation or export. */
+static GHashTable *
+attr_cache_new (void)
+{
+    return g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                  (GDestroyNotify) attr_list_free);
+}
+
+static GSList *
+attr_cache_lookup (GHashTable        *cache,
+                   GtkTextBuffer     *buffer,
+                   GtkTextIter       *iter,
+                   const GtkTextIter *limit)
+{
+    GSList *tags;
+    GSList *attrs;
+    char *key;
+
+    key = get_style_run (buffer, iter, limit, &tags);
+
+    if (g_hash_table_lookup_extended (cache, key, NULL, (gpointer*) &attrs))
+    {
+        g_free (key);
+    }
+    else
+    {
+        attrs = get_tags_attrs (buffer, tags);
+        g_hash_table_insert (cache, key, attrs);
+    }
+
+    g_slist_free (tags);
+    return attrs;
+}
+
+static GSList *
+get_iter_attrs (MooPrintOperation *op,
+                GtkTextIter       *iter,
+                const GtkTextIter *limit)
+{
+    GSList *attrs = NULL, *l;
+
+    for (l = attr_cache_lookup (op->priv->attr_cache, op->priv->buffer, iter, limit); l; l = l->next)
+        attrs = g_slist_prepend (attrs, pango_attribute_copy (l->data));
+
+    return attrs;
+}
+
 
 static PangoLayout *
 create_layout (GtkPrintContext *context)
@@ -1477,6 +1616,8 @@ moo_print_operation_end_print (GtkPrintOperation  *operation,
     op->priv->layout = NULL;
     g_array_free (op->priv->pages, TRUE);
     op->priv->pages = NULL;
+    g_hash_table_destroy (op->priv->attr_cache);
+    op->priv->attr_cache = NULL;
 }
 
 
@@ -1844,6 +1985,206 @@ _moo_edit_export_pdf (GtkTextView *view,
 }
 
 
+/*****************************************************************************/
+/* Exporting a buffer without a view
+ */
+
+gboolean
+_moo_text_buffer_export_pdf (GtkTextBuffer *buffer,
+                             const char    *display_name,
+                             const char    *filename,
+                             GError       **error)
+{
+    MooPrintOperation *op;
+    GtkPrintOperationResult res;
+    char *basename;
+
+    g_return_val_if_fail (GTK_IS_TEXT_BUFFER (buffer), FALSE);
+    g_return_val_if_fail (display_name != NULL, FALSE);
+    g_return_val_if_fail (filename != NULL, FALSE);
+
+    op = MOO_PRINT_OPERATION (g_object_new (MOO_TYPE_PRINT_OPERATION,
+                                            "buffer", buffer,
+                                            "export-filename", filename,
+                                            (const char*) NULL));
+
+    basename = g_path_get_basename (display_name);
+    moo_print_operation_set_filename (op, display_name, basename);
+
+    res = gtk_print_operation_run (GTK_PRINT_OPERATION (op),
+                                   GTK_PRINT_OPERATION_ACTION_EXPORT,
+                                   NULL, error);
+
+    g_free (basename);
+    g_object_unref (op);
+    return res != GTK_PRINT_OPERATION_RESULT_ERROR;
+}
+
+
+static void
+append_css_color (GString              *css,
+                  const char           *property,
+                  const PangoAttribute *attr)
+{
+    const PangoColor *color = &((const PangoAttrColor*) attr)->color;
+    g_string_append_printf (css, "%s:#%02x%02x%02x;", property,
+                            color->red >> 8, color->green >> 8, color->blue >> 8);
+}
+
+static char *
+attrs_to_css (GSList *attrs)
+{
+    GString *css;
+    gboolean underline = FALSE, strikethrough = FALSE;
+
+    css = g_string_new (NULL);
+
+    for ( ; attrs; attrs = attrs->next)
+    {
+        const PangoAttribute *attr = attrs->data;
+        int value = ((const PangoAttrInt*) attr)->value;
+
+        switch (attr->klass->type)
+        {
+            case PANGO_ATTR_FOREGROUND:
+                append_css_color (css, "color", attr);
+                break;
+            case PANGO_ATTR_BACKGROUND:
+                append_css_color (css, "background-color", attr);
+                break;
+            case PANGO_ATTR_STYLE:
+                g_string_append (css, value == PANGO_STYLE_NORMAL ? "font-style:normal;" :
+                                      value == PANGO_STYLE_OBLIQUE ? "font-style:oblique;" :
+                                                                     "font-style:italic;");
+                break;
+            case PANGO_ATTR_WEIGHT:
+                g_string_append_printf (css, "font-weight:%d;", CLAMP (value, 100, 900));
+                break;
+            case PANGO_ATTR_UNDERLINE:
+                underline = value != PANGO_UNDERLINE_NONE;
+                break;
+            case PANGO_ATTR_STRIKETHROUGH:
+                strikethrough = value != 0;
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (underline || strikethrough)
+        g_string_append_printf (css, "text-decoration:%s%s%s;",
+                                underline ? "underline" : "",
+                                underline && strikethrough ? " " : "",
+                                strikethrough ? "line-through" : "");
+
+    return g_string_free (css, FALSE);
+}
+
+static const char *
+get_run_css (GHashTable        *cache,
+             GtkTextBuffer     *buffer,
+             GtkTextIter       *iter,
+             const GtkTextIter *limit)
+{
+    GSList *tags;
+    char *key;
+    char *css;
+
+    key = get_style_run (buffer, iter, limit, &tags);
+
+    if ((css = g_hash_table_lookup (cache, key)))
+    {
+        g_free (key);
+    }
+    else
+    {
+        GSList *attrs = get_tags_attrs (buffer, tags);
+        css = attrs_to_css (attrs);
+        attr_list_free (attrs);
+        g_hash_table_insert (cache, key, css);
+    }
+
+    g_slist_free (tags);
+    return css;
+}
+
+/* highlighted and written out this many lines at a time, so that the
+   whole document never needs to be highlighted or kept in memory twice */
+#define EXPORT_CHUNK_LINES 1000
+
+gboolean
+_moo_text_buffer_export_html (GtkTextBuffer *buffer,
+                              const char    *display_name,
+                              const char    *filename,
+                              GError       **error)
+{
+    MooFileWriter *writer;
+    GHashTable *css_cache;
+    GtkTextIter iter, end;
+    GString *chunk;
+
+    g_return_val_if_fail (GTK_IS_TEXT_BUFFER (buffer), FALSE);
+    g_return_val_if_fail (display_name != NULL, FALSE);
+    g_return_val_if_fail (filename != NULL, FALSE);
+
+    if (!(writer = moo_config_writer_new (filename, FALSE, error)))
+        return FALSE;
+
+    moo_file_writer_printf_markup (writer,
+                                   "<!DOCTYPE html>\n"
+                                   "<html>\n"
+                                   "<head>\n"
+                                   "<meta charset=\"utf-8\">\n"
+                                   "<title>%s</title>\n"
+                                   "</head>\n"
+                                   "<body>\n"
+                                   "<pre>", display_name);
+
+    css_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    chunk = g_string_new (NULL);
+    gtk_text_buffer_get_start_iter (buffer, &iter);
+
+    while (!gtk_text_iter_is_end (&iter))
+    {
+        end = iter;
+        gtk_text_iter_forward_lines (&end, EXPORT_CHUNK_LINES);
+
+        if (MOO_IS_TEXT_BUFFER (buffer))
+            _moo_text_buffer_update_highlight (MOO_TEXT_BUFFER (buffer),
+                                               &iter, &end, TRUE);
+
+        while (gtk_text_iter_compare (&iter, &end) < 0)
+        {
+            GtkTextIter run_end = iter;
+            const char *css;
+            char *text, *escaped;
+
+            css = get_run_css (css_cache, buffer, &run_end, &end);
+            text = gtk_text_iter_get_slice (&iter, &run_end);
+            escaped = g_markup_escape_text (text, -1);
+
+            if (*css)
+                g_string_append_printf (chunk, "<span style=\"%s\">%s</span>", css, escaped);
+            else
+                g_string_append (chunk, escaped);
+
+            g_free (escaped);
+            g_free (text);
+            iter = run_end;
+        }
+
+        moo_file_writer_write (writer, chunk->str, chunk->len);
+        g_string_truncate (chunk, 0);
+    }
+
+    moo_file_writer_write (writer, "</pre>\n</body>\n</html>\n", -1);
+
+    g_string_free (chunk, TRUE);
+    g_hash_table_destroy (css_cache);
+    return moo_file_writer_close (writer, error);
+}
+
+
 GtkWindow *
 _moo_print_operation_get_parent (MooPrintOperation *op)
 {
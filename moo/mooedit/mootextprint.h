@@ -54,6 +54,17 @@ void    _moo_edit_print_preview                 (GtkTextView        *view,
 void    _moo_edit_export_pdf                    (GtkTextView        *view,
                                                  const char         *filename);
 
+/* export buffer contents with highlighting, without a view or a window;
+   display_name is used for page headers and the html title */
+gboolean _moo_text_buffer_export_pdf            (GtkTextBuffer      *buffer,
+                                                 const char         *display_name,
+                                                 const char         *filename,
+                                                 GError            **error);
+gboolean _moo_text_buffer_export_html           (GtkTextBuffer      *buffer,
+                                                 const char         *display_name,
+                                                 const char         *filename,
+                                                 GError            **error);
+
 
 G_END_DECLS
 
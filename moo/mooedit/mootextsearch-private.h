@@ -25,6 +25,7 @@ G_BEGIN_DECLS
 typedef struct MooRegex {
     GRegex *re;
     int n_lines;
+    char *literal;  /* text every match contains, or NULL */
     int ref_count_;
 } MooRegex;
 
@@ -70,6 +71,13 @@ gboolean _moo_text_search_regex_backward    (const GtkTextIter      *start,
                                              int                    *match_offset,
                                              int                    *match_len,
                                              GMatchInfo            **match_info);
+gboolean _moo_text_search_find_window       (const char             *text,
+                                             gsize                   len,
+                                             gsize                   line,
+                                             int                     n_lines,
+                                             gsize                  *line_end,
+                                             gsize                  *next_line,
+                                             gsize                  *window_end);
 
 int      _moo_text_replace_regex_all        (GtkTextIter            *start,
                                              GtkTextIter            *end,
@@ -14,6 +14,8 @@
  */
 
 #include "mooedit/mootextsearch-private.h"
+#include "mooedit/mootextbuffer.h"
+#include "mooedit/mootext-private.h"
 #include "gtksourceview/gtksourceview-api.h"
 #include "mooutils/mooutils-misc.h"
 #include <mooglib/moo-glib.h>
@@ -54,6 +56,172 @@ get_n_lines (GRegex *regex)
     return found ? 3 : 1;
 }
 
+static void
+literal_run_end (GString *run,
+                 GString *best)
+{
+    if (run->len > best->len)
+        g_string_assign (best, run->str);
+    g_string_truncate (run, 0);
+}
+
+/* Longest piece of plain text which every match contains, used to skip text
+   without running the regex on it. Gives up on anything not obviously safe:
+   alternatives, inline options, caseless and extended patterns, unknown
+   escapes. */
+static char *
+get_required_literal (GRegex *regex)
+{
+    const char *p;
+    GString *run, *best;
+    int depth = 0;
+
+    if (g_regex_get_compile_flags (regex) & (G_REGEX_CASELESS | G_REGEX_EXTENDED))
+        return NULL;
+
+    p = g_regex_get_pattern (regex);
+
+    if (strchr (p, '|') || strstr (p, "(?") || strstr (p, "\\Q"))
+        return NULL;
+
+    run = g_string_new (NULL);
+    best = g_string_new (NULL);
+
+    while (*p)
+    {
+        const char *c = NULL;
+        gsize c_len = 0;
+
+        switch (*p)
+        {
+            case '\\':
+                if (!p[1])
+                {
+                    p++;
+                }
+                else if (!g_ascii_isalnum (p[1]))
+                {
+                    c = p + 1;
+                    c_len = 1;
+                    p += 2;
+                }
+                else if (strchr ("dDwWsSbBhHvVAzZG", p[1]))
+                {
+                    p += 2;
+                }
+                else
+                {
+                    /* \x, \p, back references, etc. */
+                    g_string_free (run, TRUE);
+                    g_string_free (best, TRUE);
+                    return NULL;
+                }
+                break;
+
+            case '[':
+                p++;
+                if (*p == '^')
+                    p++;
+                if (*p == ']')
+                    p++;
+                while (*p && *p != ']')
+                {
+                    if (p[0] == '[' && p[1] == ':' && strstr (p, ":]"))
+                        p = strstr (p, ":]") + 1;
+                    else if (*p == '\\' && p[1])
+                        p++;
+                    p++;
+                }
+                if (*p)
+                    p++;
+                break;
+
+            case '(':
+                depth++;
+                p++;
+                break;
+
+            case ')':
+                depth--;
+                p++;
+                break;
+
+            case '{':
+                while (*p && *p != '}')
+                    p++;
+                if (*p)
+                    p++;
+                break;
+
+            case '.':
+            case '^':
+            case '$':
+            case '*':
+            case '+':
+            case '?':
+                p++;
+                break;
+
+            default:
+                c = p;
+                c_len = g_utf8_skip[*(const guchar*) p];
+                p += c_len;
+                break;
+        }
+
+        if (!c || depth != 0)
+        {
+            literal_run_end (run, best);
+        }
+        else if (*p == '*' || *p == '?' || *p == '{')
+        {
+            /* the character may be missing */
+            literal_run_end (run, best);
+        }
+        else
+        {
+            g_string_append_len (run, c, c_len);
+            if (*p == '+')
+                literal_run_end (run, best);
+        }
+    }
+
+    literal_run_end (run, best);
+    g_string_free (run, TRUE);
+
+    if (!best->len)
+    {
+        g_string_free (best, TRUE);
+        return NULL;
+    }
+
+    return g_string_free (best, FALSE);
+}
+
+/* memchr() for the first byte and memcmp() for the rest */
+static const char *
+find_literal (const char *text,
+              const char *text_end,
+              const char *literal,
+              gsize       literal_len)
+{
+    const char *p = text;
+
+    while (p + literal_len <= text_end)
+    {
+        if (!(p = memchr (p, literal[0], text_end - literal_len + 1 - p)))
+            return NULL;
+
+        if (!memcmp (p + 1, literal + 1, literal_len - 1))
+            return p;
+
+        p++;
+    }
+
+    return NULL;
+}
+
+
 MooRegex *
 _moo_regex_new (GRegex *re)
 {
@@ -66,6 +234,7 @@ _moo_regex_new (GRegex *re)
     regex->ref_count_ = 1;
 
     regex->n_lines = get_n_lines (re);
+    regex->literal = get_required_literal (re);
 
     return regex;
 }
@@ -106,11 +275,27 @@ _moo_regex_unref (MooRegex *regex)
     if (!--regex->ref_count_)
     {
         g_regex_unref (regex->re);
+        g_free (regex->literal);
         g_slice_free (MooRegex, regex);
     }
 }
 
 
+/* Searching reads chunks of text extended to whole lines, instead of
+   fetching every line separately. The first chunk is small since a match
+   is usually close; every chunk without a match doubles the next one, up
+   to SEARCH_CHUNK_MAX characters */
+#define SEARCH_CHUNK_MIN (1 << 12)
+#define SEARCH_CHUNK_MAX (1 << 18)
+
+static int
+next_chunk_size (int *chunk_size)
+{
+    int size = *chunk_size;
+    *chunk_size = MIN (size * 2, SEARCH_CHUNK_MAX);
+    return size;
+}
+
 gboolean
 _moo_text_search_regex_forward (const GtkTextIter      *search_start,
                                 const GtkTextIter      *search_end,
@@ -122,10 +307,14 @@ _moo_text_search_regex_forward (const GtkTextIter      *search_start,
                                 int                    *match_len,
                                 GMatchInfo            **match_infop)
 {
-    GtkTextIter start, end;
+    GtkTextIter start, end, chunk_end, limit;
     GtkTextBuffer *buffer;
     int start_offset;
-    char *text, *text_start;
+    char *text = NULL;
+    const char *text_end = NULL;
+    const char *line = NULL;
+    gsize literal_len = 0;
+    int chunk_size = SEARCH_CHUNK_MIN;
 
     g_return_val_if_fail (search_start != NULL, FALSE);
     g_return_val_if_fail (match_start != NULL && match_end != NULL, FALSE);
@@ -133,31 +322,105 @@ _moo_text_search_regex_forward (const GtkTextIter      *search_start,
 
     buffer = gtk_text_iter_get_buffer (search_start);
 
+    if (regex->literal)
+        literal_len = strlen (regex->literal);
+
+    /* no need to read text past the last window which may have a match */
+    if (search_end)
+    {
+        limit = *search_end;
+        gtk_text_iter_forward_lines (&limit, regex->n_lines - 1);
+        if (!gtk_text_iter_ends_line (&limit))
+            gtk_text_iter_forward_to_line_end (&limit);
+    }
+    else
+    {
+        gtk_text_buffer_get_end_iter (buffer, &limit);
+    }
+
     start = *search_start;
     start_offset = gtk_text_iter_get_line_offset (&start);
     if (start_offset)
         gtk_text_iter_set_line_offset (&start, 0);
 
-    end = *search_start;
-    gtk_text_iter_forward_lines (&end, regex->n_lines - 1);
-    if (!gtk_text_iter_ends_line (&end))
-        gtk_text_iter_forward_to_line_end (&end);
-
     while (TRUE)
     {
         GMatchInfo *match_info = NULL;
+        const char *window_end, *search_from;
+
+        end = start;
+        gtk_text_iter_forward_lines (&end, regex->n_lines - 1);
+        if (!gtk_text_iter_ends_line (&end))
+            gtk_text_iter_forward_to_line_end (&end);
+
+        if (!text || gtk_text_iter_compare (&end, &chunk_end) > 0)
+        {
+            g_free (text);
+
+            chunk_end = start;
+            gtk_text_iter_forward_chars (&chunk_end, next_chunk_size (&chunk_size));
+            if (!gtk_text_iter_ends_line (&chunk_end))
+                gtk_text_iter_forward_to_line_end (&chunk_end);
+            if (gtk_text_iter_compare (&chunk_end, &limit) > 0)
+                chunk_end = limit;
+            if (gtk_text_iter_compare (&chunk_end, &end) < 0)
+                chunk_end = end;
+
+            text = gtk_text_buffer_get_slice (buffer, &start, &chunk_end, TRUE);
+            text_end = text + strlen (text);
+            line = text;
+        }
+
+        window_end = g_utf8_offset_to_pointer (line, gtk_text_iter_get_offset (&end) -
+                                                     gtk_text_iter_get_offset (&start));
+        search_from = g_utf8_offset_to_pointer (line, start_offset);
+
+        if (literal_len && !find_literal (search_from, window_end, regex->literal, literal_len))
+        {
+            const char *found;
+
+            if (regex->n_lines > 1)
+                goto next_window;
+
+            /* Nothing can match before the line which contains the literal */
+            if (!(found = find_literal (window_end, text_end, regex->literal, literal_len)))
+            {
+                start = chunk_end;
+                start_offset = 0;
+                g_free (text);
+                text = NULL;
+
+                if (!gtk_text_iter_forward_line (&start))
+                    break;
+                if (search_end && gtk_text_iter_compare (&start, search_end) > 0)
+                    break;
 
-        text = gtk_text_buffer_get_slice (buffer, &start, &end, TRUE);
-        text_start = g_utf8_offset_to_pointer (text, start_offset);
+                continue;
+            }
+
+            end = start;
+            gtk_text_iter_forward_chars (&end, g_utf8_pointer_to_offset (line, found));
+            gtk_text_iter_set_line_offset (&end, 0);
+            line = g_utf8_offset_to_pointer (line, gtk_text_iter_get_offset (&end) -
+                                                   gtk_text_iter_get_offset (&start));
+            start = end;
+            start_offset = 0;
 
-        if (g_regex_match_full (regex->re, text, -1, text_start - text, 0, &match_info, NULL))
+            if (search_end && gtk_text_iter_compare (&start, search_end) > 0)
+                break;
+
+            continue;
+        }
+
+        if (g_regex_match_full (regex->re, line, window_end - line, search_from - line,
+                                0, &match_info, NULL))
         {
             int start_pos, end_pos;
 
             g_match_info_fetch_pos (match_info, 0, &start_pos, &end_pos);
 
             *match_start = start;
-            gtk_text_iter_forward_chars (match_start, g_utf8_pointer_to_offset (text, text + start_pos));
+            gtk_text_iter_forward_chars (match_start, g_utf8_pointer_to_offset (line, line + start_pos));
 
             if (search_end && gtk_text_iter_compare (match_start, search_end) > 0)
             {
@@ -167,18 +430,18 @@ _moo_text_search_regex_forward (const GtkTextIter      *search_start,
             }
 
             *match_end = *match_start;
-            gtk_text_iter_forward_chars (match_end, g_utf8_pointer_to_offset (text + start_pos, text + end_pos));
+            gtk_text_iter_forward_chars (match_end, g_utf8_pointer_to_offset (line + start_pos, line + end_pos));
+
+            if (match_offset)
+                *match_offset = (line - text) + start_pos;
+            if (match_len)
+                *match_len = end_pos - start_pos;
 
             if (string)
                 *string = text;
             else
                 g_free (text);
 
-            if (match_offset)
-                *match_offset = start_pos;
-            if (match_len)
-                *match_len = end_pos - start_pos;
-
             if (match_infop)
                 *match_infop = match_info;
             else
@@ -188,8 +451,8 @@ _moo_text_search_regex_forward (const GtkTextIter      *search_start,
         }
 
         g_match_info_free (match_info);
-        g_free (text);
 
+next_window:
         start = end;
         start_offset = 0;
 
@@ -199,12 +462,19 @@ _moo_text_search_regex_forward (const GtkTextIter      *search_start,
         if (search_end && gtk_text_iter_compare (&start, search_end) > 0)
             break;
 
-        end = start;
-        gtk_text_iter_forward_lines (&end, regex->n_lines - 1);
-        if (!gtk_text_iter_ends_line (&end))
-            gtk_text_iter_forward_to_line_end (&end);
+        if (gtk_text_iter_compare (&start, &chunk_end) > 0)
+        {
+            g_free (text);
+            text = NULL;
+        }
+        else
+        {
+            line = g_utf8_offset_to_pointer (window_end, gtk_text_iter_get_offset (&start) -
+                                                         gtk_text_iter_get_offset (&end));
+        }
     }
 
+    g_free (text);
     return FALSE;
 }
 
@@ -212,16 +482,16 @@ _moo_text_search_regex_forward (const GtkTextIter      *search_start,
 static gboolean
 find_last_match (GRegex            *regex,
                  const char        *text,
+                 gssize             len,
                  GRegexMatchFlags   flags,
                  int               *start_pos,
                  int               *end_pos,
                  GMatchInfo       **match_infop)
 {
-    gssize len, start;
+    gssize start;
     GMatchInfo *match_info = NULL;
 
     *start_pos = -1;
-    len = strlen (text);
     start = 0;
 
     while (g_regex_match_full (regex, text, len, start, flags, &match_info, NULL))
@@ -257,10 +527,13 @@ _moo_text_search_regex_backward (const GtkTextIter      *search_start,
                                  int                    *match_len,
                                  GMatchInfo            **match_info)
 {
-    GtkTextIter slice_start, slice_end;
+    GtkTextIter slice_start, slice_end, chunk_start;
     GtkTextBuffer *buffer;
-    char *text;
+    char *text = NULL;
+    const char *window_start = NULL, *window_end = NULL;
     GRegexMatchFlags flags;
+    gsize literal_len = 0;
+    int chunk_size = SEARCH_CHUNK_MIN;
 
     g_return_val_if_fail (search_start != NULL, FALSE);
     g_return_val_if_fail (match_start != NULL && match_end != NULL, FALSE);
@@ -272,6 +545,9 @@ _moo_text_search_regex_backward (const GtkTextIter      *search_start,
     gtk_text_iter_backward_lines (&slice_start, regex->n_lines);
     flags = 0;
 
+    if (regex->literal)
+        literal_len = strlen (regex->literal);
+
     if (!gtk_text_iter_ends_line (&slice_end))
         flags |= G_REGEX_MATCH_NOTEOL;
 
@@ -279,12 +555,34 @@ _moo_text_search_regex_backward (const GtkTextIter      *search_start,
     {
         int start_pos, end_pos;
 
-        text = gtk_text_buffer_get_slice (buffer, &slice_start, &slice_end, TRUE);
+        if (!text || gtk_text_iter_compare (&slice_start, &chunk_start) < 0)
+        {
+            g_free (text);
+
+            chunk_start = slice_end;
+            gtk_text_iter_backward_chars (&chunk_start, next_chunk_size (&chunk_size));
+            gtk_text_iter_set_line_offset (&chunk_start, 0);
+            if (search_end && gtk_text_iter_compare (&chunk_start, search_end) < 0)
+            {
+                chunk_start = *search_end;
+                gtk_text_iter_set_line_offset (&chunk_start, 0);
+            }
+            if (gtk_text_iter_compare (&slice_start, &chunk_start) < 0)
+                chunk_start = slice_start;
+
+            text = gtk_text_buffer_get_slice (buffer, &chunk_start, &slice_end, TRUE);
+            window_end = text + strlen (text);
+        }
 
-        if (find_last_match (regex->re, text, flags, &start_pos, &end_pos, match_info))
+        window_start = g_utf8_offset_to_pointer (window_end, gtk_text_iter_get_offset (&slice_start) -
+                                                             gtk_text_iter_get_offset (&slice_end));
+
+        if ((!literal_len || find_literal (window_start, window_end, regex->literal, literal_len)) &&
+            find_last_match (regex->re, window_start, window_end - window_start, flags,
+                             &start_pos, &end_pos, match_info))
         {
             *match_start = slice_start;
-            gtk_text_iter_forward_chars (match_start, g_utf8_pointer_to_offset (text, text + start_pos));
+            gtk_text_iter_forward_chars (match_start, g_utf8_pointer_to_offset (window_start, window_start + start_pos));
 
             /* XXX how about not last match? */
             if (search_end && gtk_text_iter_compare (match_start, search_end) < 0)
@@ -300,24 +598,23 @@ _moo_text_search_regex_backward (const GtkTextIter      *search_start,
             }
 
             *match_end = *match_start;
-            gtk_text_iter_forward_chars (match_end, g_utf8_pointer_to_offset (text + start_pos, text + end_pos));
+            gtk_text_iter_forward_chars (match_end, g_utf8_pointer_to_offset (window_start + start_pos, window_start + end_pos));
+
+            if (match_offset)
+                *match_offset = (window_start - text) + start_pos;
+            if (match_len)
+                *match_len = end_pos - start_pos;
 
             if (string)
                 *string = text;
             else
                 g_free (text);
 
-            if (match_offset)
-                *match_offset = start_pos;
-            if (match_len)
-                *match_len = end_pos - start_pos;
-
             return TRUE;
         }
 
-        g_free (text);
-
         slice_end = slice_start;
+        window_end = window_start;
         flags = 0;
 
         if (gtk_text_iter_is_start (&slice_end))
@@ -329,6 +626,7 @@ _moo_text_search_regex_backward (const GtkTextIter      *search_start,
         gtk_text_iter_backward_lines (&slice_start, regex->n_lines);
     }
 
+    g_free (text);
     return FALSE;
 }
 
@@ -525,6 +823,362 @@ moo_text_search_backward (const GtkTextIter      *start,
 }
 
 
+/* Finds the end of the line which starts at line, and the start of the next
+   line; returns FALSE if there is no next line */
+static gboolean
+find_line_end (const char *text,
+               gsize       len,
+               gsize       line,
+               gsize      *line_end,
+               gsize      *next_line)
+{
+    int delim, next;
+
+    pango_find_paragraph_boundary (text + line, len - line, &delim, &next);
+
+    *line_end = line + delim;
+    *next_line = line + next;
+
+    return delim != next;
+}
+
+/* Search window which starts at line, same as in _moo_text_search_regex_forward():
+   regex->n_lines lines without the last line delimiter. All positions are byte
+   offsets in text, which must start at a line start; returns FALSE if line is
+   the last line of text. */
+gboolean
+_moo_text_search_find_window (const char *text,
+                              gsize       len,
+                              gsize       line,
+                              int         n_lines,
+                              gsize      *line_end,
+                              gsize      *next_line,
+                              gsize      *window_end)
+{
+    gboolean has_next;
+    gsize next = 0;
+
+    has_next = find_line_end (text, len, line, line_end, next_line);
+    *window_end = *line_end;
+
+    if (has_next)
+        next = *next_line;
+
+    while (--n_lines > 0 && next)
+    {
+        gsize dummy;
+
+        if (!find_line_end (text, len, next, window_end, &dummy))
+            next = 0;
+        else
+            next = dummy;
+    }
+
+    return has_next;
+}
+
+/* Replaces the pieces, moves end along with the text */
+static void
+replace_pieces_in_buffer (GtkTextBuffer *buffer,
+                          MooTextPiece  *pieces,
+                          guint          n_pieces,
+                          GtkTextIter   *end)
+{
+    GtkTextMark *end_mark = NULL;
+    int i;
+
+    if (end)
+        end_mark = gtk_text_buffer_create_mark (buffer, NULL, end, TRUE);
+
+    if (MOO_IS_TEXT_BUFFER (buffer))
+    {
+        _moo_text_buffer_replace_pieces (MOO_TEXT_BUFFER (buffer), pieces, n_pieces);
+    }
+    else
+    {
+        for (i = (int) n_pieces - 1; i >= 0; --i)
+        {
+            GtkTextIter start, piece_end;
+
+            gtk_text_buffer_get_iter_at_offset (buffer, &start, pieces[i].offset);
+            gtk_text_buffer_get_iter_at_offset (buffer, &piece_end, pieces[i].offset + pieces[i].length);
+            gtk_text_buffer_delete (buffer, &start, &piece_end);
+            gtk_text_buffer_insert (buffer, &start, pieces[i].text, -1);
+        }
+    }
+
+    if (end_mark)
+    {
+        gtk_text_buffer_get_iter_at_mark (buffer, end, end_mark);
+        gtk_text_buffer_delete_mark (buffer, end_mark);
+    }
+}
+
+/* Replaces all matches between start and end with one pass of the regex over
+   the text and one undo action, instead of searching the buffer again after
+   each replacement. Matches are the same as with _moo_text_search_regex_forward()
+   in a loop: they must start before end. */
+static int
+replace_regex_all_batch (GtkTextIter    *start,
+                         GtkTextIter    *end,
+                         MooRegex       *regex,
+                         const char     *replacement,
+                         const char     *const_replacement,
+                         gboolean        was_zero_match)
+{
+    GtkTextBuffer *buffer;
+    GtkTextIter slice_start, slice_end;
+    GArray *pieces;
+    char *text;
+    gsize len, limit;
+    gsize pos, line, line_end, next_line, window_end;
+    gsize char_byte;
+    gboolean has_next;
+    int base_offset, char_pos, delta, new_end;
+    int count;
+    guint i;
+    gsize literal_len = regex->literal ? strlen (regex->literal) : 0;
+
+    buffer = gtk_text_iter_get_buffer (start);
+
+    slice_start = *start;
+    gtk_text_iter_set_line_offset (&slice_start, 0);
+
+    if (end)
+    {
+        slice_end = *end;
+        gtk_text_iter_forward_lines (&slice_end, regex->n_lines - 1);
+        if (!gtk_text_iter_ends_line (&slice_end))
+            gtk_text_iter_forward_to_line_end (&slice_end);
+    }
+    else
+    {
+        gtk_text_buffer_get_end_iter (buffer, &slice_end);
+    }
+
+    text = gtk_text_buffer_get_slice (buffer, &slice_start, &slice_end, TRUE);
+    len = strlen (text);
+    base_offset = gtk_text_iter_get_offset (&slice_start);
+
+    pos = g_utf8_offset_to_pointer (text, gtk_text_iter_get_line_offset (start)) - text;
+
+    if (end)
+    {
+        limit = g_utf8_offset_to_pointer (text, gtk_text_iter_get_offset (end) - base_offset) - text;
+        limit = MIN (limit, len);
+    }
+    else
+    {
+        limit = len;
+    }
+
+    pieces = g_array_new (FALSE, FALSE, sizeof (MooTextPiece));
+    char_byte = 0;
+    char_pos = 0;
+    delta = 0;
+    new_end = -1;
+
+    line = 0;
+    has_next = _moo_text_search_find_window (text, len, line, regex->n_lines,
+                                             &line_end, &next_line, &window_end);
+
+    while (TRUE)
+    {
+        GMatchInfo *match_info = NULL;
+        char *freeme_here = NULL;
+        const char *real_replacement;
+        int match_start, match_end;
+        GError *error = NULL;
+
+        if ((literal_len && !find_literal (text + pos, text + window_end, regex->literal, literal_len)) ||
+            !g_regex_match_full (regex->re, text + line, window_end - line,
+                                 pos - line, 0, &match_info, NULL))
+        {
+            g_match_info_free (match_info);
+
+            if (!has_next || next_line > limit)
+                break;
+
+            pos = line = next_line;
+            has_next = _moo_text_search_find_window (text, len, line, regex->n_lines,
+                                                     &line_end, &next_line, &window_end);
+            continue;
+        }
+
+        g_match_info_fetch_pos (match_info, 0, &match_start, &match_end);
+        match_start += line;
+        match_end += line;
+
+        if ((gsize) match_start > limit)
+        {
+            g_match_info_free (match_info);
+            break;
+        }
+
+        if (match_start == match_end)
+        {
+            if (was_zero_match && (gsize) match_start == pos)
+            {
+                g_match_info_free (match_info);
+                was_zero_match = FALSE;
+
+                if (pos >= len)
+                    break;
+
+                pos = g_utf8_next_char (text + pos) - text;
+                goto next;
+            }
+
+            was_zero_match = TRUE;
+        }
+        else
+        {
+            was_zero_match = FALSE;
+        }
+
+        if (const_replacement)
+        {
+            real_replacement = const_replacement;
+        }
+        else
+        {
+            freeme_here = g_match_info_expand_references (match_info, replacement, &error);
+
+            if (!freeme_here)
+            {
+                g_warning ("%s", moo_error_message (error));
+                g_error_free (error);
+                g_match_info_free (match_info);
+                break;
+            }
+
+            real_replacement = freeme_here;
+        }
+
+        if (match_start < match_end || *real_replacement)
+        {
+            MooTextPiece piece;
+            int new_length;
+
+            char_pos += g_utf8_pointer_to_offset (text + char_byte, text + match_start);
+            char_byte = match_start;
+
+            piece.offset = base_offset + char_pos;
+            piece.length = g_utf8_pointer_to_offset (text + match_start, text + match_end);
+            piece.text = freeme_here ? freeme_here : g_strdup (real_replacement);
+            freeme_here = NULL;
+
+            new_length = g_utf8_strlen (piece.text, -1);
+            new_end = piece.offset + delta + new_length;
+            delta += new_length - piece.length;
+
+            g_array_append_val (pieces, piece);
+        }
+
+        pos = match_end;
+
+        if (was_zero_match && !*real_replacement)
+        {
+            if (pos >= len)
+            {
+                g_free (freeme_here);
+                g_match_info_free (match_info);
+                break;
+            }
+
+            pos = g_utf8_next_char (text + pos) - text;
+            was_zero_match = FALSE;
+        }
+
+        g_free (freeme_here);
+        g_match_info_free (match_info);
+
+next:
+        /* move the window to the line containing pos */
+        while (pos > line_end && has_next)
+        {
+            line = next_line;
+            has_next = _moo_text_search_find_window (text, len, line, regex->n_lines,
+                                                     &line_end, &next_line, &window_end);
+        }
+
+        if (pos > line_end)
+            break;
+
+        pos = MAX (pos, line);
+    }
+
+    count = pieces->len;
+
+    if (count)
+    {
+        replace_pieces_in_buffer (buffer, (MooTextPiece*) pieces->data, pieces->len, end);
+        gtk_text_buffer_get_iter_at_offset (buffer, start, new_end);
+    }
+
+    for (i = 0; i < pieces->len; ++i)
+        g_free (g_array_index (pieces, MooTextPiece, i).text);
+
+    g_array_free (pieces, TRUE);
+    g_free (text);
+    return count;
+}
+
+
+/* Same for plain text: matches are found with moo_text_search_forward()
+   as usual, but the buffer is not touched until all of them are found */
+static int
+replace_text_all_batch (GtkTextIter        *start,
+                        GtkTextIter        *end,
+                        const char         *text,
+                        const char         *replacement,
+                        MooTextSearchFlags  flags)
+{
+    GtkTextBuffer *buffer;
+    GArray *pieces;
+    int new_length, delta;
+    int count;
+    guint i;
+
+    buffer = gtk_text_iter_get_buffer (start);
+    pieces = g_array_new (FALSE, FALSE, sizeof (MooTextPiece));
+    new_length = g_utf8_strlen (replacement, -1);
+    delta = 0;
+
+    while (TRUE)
+    {
+        GtkTextIter match_start, match_end;
+        MooTextPiece piece;
+
+        if (!moo_text_search_forward (start, text, flags, &match_start, &match_end, end))
+            break;
+
+        piece.offset = gtk_text_iter_get_offset (&match_start);
+        piece.length = gtk_text_iter_get_offset (&match_end) - piece.offset;
+        piece.text = g_strdup (replacement);
+        delta += new_length - piece.length;
+        g_array_append_val (pieces, piece);
+
+        *start = match_end;
+    }
+
+    count = pieces->len;
+
+    if (count)
+    {
+        int new_end = gtk_text_iter_get_offset (start) + delta;
+        replace_pieces_in_buffer (buffer, (MooTextPiece*) pieces->data, pieces->len, end);
+        gtk_text_buffer_get_iter_at_offset (buffer, start, new_end);
+    }
+
+    for (i = 0; i < pieces->len; ++i)
+        g_free (g_array_index (pieces, MooTextPiece, i).text);
+
+    g_array_free (pieces, TRUE);
+    return count;
+}
+
+
 static int
 moo_text_replace_regex_all_real (GtkTextIter            *start,
                                  GtkTextIter            *end,
@@ -599,6 +1253,10 @@ moo_text_replace_regex_all_real (GtkTextIter            *start,
         gtk_text_buffer_begin_user_action (buffer);
         need_end_user_action = TRUE;
         response = MOO_TEXT_REPLACE_ALL;
+
+        count = replace_regex_all_batch (start, end, regex, replacement, const_replacement,
+                                         FALSE);
+        goto out;
     }
 
     while (TRUE)
@@ -713,6 +1371,14 @@ moo_text_replace_regex_all_real (GtkTextIter            *start,
 
         g_match_info_free (match_info);
         g_free (freeme_here);
+
+        /* "Replace All" was chosen, do the rest in one go */
+        if (response == MOO_TEXT_REPLACE_ALL)
+        {
+            count += replace_regex_all_batch (start, end, regex, replacement, const_replacement,
+                                              was_zero_match);
+            goto out;
+        }
     }
 
 out:
@@ -768,8 +1434,7 @@ moo_text_replace_all (GtkTextIter            *start,
                       const char             *replacement,
                       MooTextSearchFlags      flags)
 {
-    int count = 0;
-    GtkTextMark *end_mark;
+    int count;
     GtkTextBuffer *buffer;
 
     g_return_val_if_fail (start != NULL, 0);
@@ -801,31 +1466,7 @@ moo_text_replace_all (GtkTextIter            *start,
     else
         gtk_text_iter_forward_char (end);
 
-    if (end)
-        end_mark = gtk_text_buffer_create_mark (buffer, NULL, end, TRUE);
-    else
-        end_mark = NULL;
-
-    while (TRUE)
-    {
-        GtkTextIter match_start, match_end;
-
-        if (!moo_text_search_forward (start, text, flags, &match_start, &match_end, end))
-            goto out;
-
-        count++;
-        gtk_text_buffer_delete (buffer, &match_start, &match_end);
-        gtk_text_buffer_insert (buffer, &match_end, replacement, -1);
-
-        *start = match_end;
-
-        if (end)
-            gtk_text_buffer_get_iter_at_mark (buffer, end, end_mark);
-    }
-
-out:
-    if (end_mark)
-        gtk_text_buffer_delete_mark (buffer, end_mark);
+    count = replace_text_all_batch (start, end, text, replacement, flags);
 
     gtk_text_buffer_end_user_action (buffer);
     return count;
@@ -925,6 +1566,13 @@ _moo_text_replace_all_interactive (GtkTextIter            *start,
 
         if (end)
             gtk_text_buffer_get_iter_at_mark (buffer, end, end_mark);
+
+        /* "Replace All" was chosen, do the rest in one go */
+        if (response == MOO_TEXT_REPLACE_ALL)
+        {
+            count += replace_text_all_batch (start, end, text, replacement, flags);
+            goto out;
+        }
     }
 
 out:
@@ -18,6 +18,7 @@
 
 #include "mooedit/mootextview.h"
 #include "mooedit/mootextsearch.h"
+#include "mooedit/mootextmatches.h"
 #include "mooutils/moohistorylist.h"
 #include <gtk/gtk.h>
 
@@ -79,6 +80,7 @@ typedef enum {
 typedef enum {
     MOO_TEXT_VIEW_COLOR_CURRENT_LINE,
     MOO_TEXT_VIEW_COLOR_RIGHT_MARGIN,
+    MOO_TEXT_VIEW_COLOR_SEARCH_MATCH,
     MOO_TEXT_VIEW_N_COLORS
 } MooTextViewColor;
 
@@ -141,6 +143,12 @@ struct MooTextViewPrivate {
     int last_search_stamp;
     GtkTextMark *last_found_start, *last_found_end;
 
+    gboolean highlight_search_matches;
+    MooTextMatches *search_matches;     /* owned by the buffer */
+    GtkWidget *match_scrollbar;         /* where match ticks are drawn */
+    gulong match_scrollbar_handler;
+    int drawn_matches[3];               /* visible matches: first, last, count */
+
     /***********************************************************************/
     /* Indentation
      */
@@ -194,6 +202,7 @@ struct MooTextViewPrivate {
         GtkWidget *entry;
         GtkToggleButton *case_sensitive;
         GtkToggleButton *regex;
+        GtkWidget *matches;
         MooTextSearchFlags flags;
     } qs;
 };
@@ -202,6 +211,12 @@ enum {
     DND_TARGET_TEXT = 1
 };
 
+/* highlights matches of the pattern if highlight-search-matches is on */
+void    _moo_text_view_set_search_pattern   (MooTextView        *view,
+                                             const char         *text,
+                                             MooRegex           *regex,
+                                             MooTextSearchFlags  flags);
+
 
 G_END_DECLS
 
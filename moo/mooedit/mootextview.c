@@ -44,6 +44,7 @@
 #include <string.h>
 
 #define LIGHT_BLUE "#EEF6FF"
+#define LIGHT_YELLOW "#FFEE80"
 #define BOOL_CMP(b1,b2) ((b1 && b2) || (!b1 && !b2))
 #define UPDATE_PRIORITY (GTK_TEXT_VIEW_PRIORITY_VALIDATE - 5)
 
@@ -127,6 +128,12 @@ static void     find_prev_interactive       (MooTextView        *view);
 static void     goto_line_interactive       (MooTextView        *view);
 static gboolean start_quick_search          (MooTextView        *view);
 static void     moo_text_view_stop_quick_search (MooTextView    *view);
+static void     set_highlight_search_matches (MooTextView       *view,
+                                             gboolean            highlight);
+static void     connect_search_matches      (MooTextView        *view);
+static void     disconnect_search_matches   (MooTextView        *view);
+static void     draw_search_matches         (MooTextView        *view,
+                                             GdkEventExpose     *event);
 
 static void     insert_text_cb              (MooTextView        *view,
                                              GtkTextIter        *iter,
@@ -226,6 +233,7 @@ enum {
     PROP_HIGHLIGHT_CURRENT_LINE_UNFOCUSED,
     PROP_HIGHLIGHT_MATCHING_BRACKETS,
     PROP_HIGHLIGHT_MISMATCHING_BRACKETS,
+    PROP_HIGHLIGHT_SEARCH_MATCHES,
     PROP_CURRENT_LINE_COLOR,
     PROP_TAB_WIDTH,
     PROP_DRAW_WHITESPACE,
@@ -363,6 +371,14 @@ static void moo_text_view_class_init (MooTextViewClass *klass)
                                              FALSE,
                                              (GParamFlags) G_PARAM_READWRITE));
 
+    g_object_class_install_property (gobject_class,
+                                     PROP_HIGHLIGHT_SEARCH_MATCHES,
+                                     g_param_spec_boolean ("highlight-search-matches",
+                                             "highlight-search-matches",
+                                             "highlight-search-matches",
+                                             FALSE,
+                                             (GParamFlags) G_PARAM_READWRITE));
+
     g_object_class_install_property (gobject_class,
                                      PROP_CURRENT_LINE_COLOR,
                                      g_param_spec_string ("current-line-color",
@@ -660,6 +676,8 @@ moo_text_view_init (MooTextView *view)
 
     view->priv->colors[MOO_TEXT_VIEW_COLOR_CURRENT_LINE] = g_strdup (LIGHT_BLUE);
     view->priv->colors[MOO_TEXT_VIEW_COLOR_RIGHT_MARGIN] = g_strdup (LIGHT_BLUE);
+    view->priv->colors[MOO_TEXT_VIEW_COLOR_SEARCH_MATCH] = g_strdup (LIGHT_YELLOW);
+    view->priv->color_settings[MOO_TEXT_VIEW_COLOR_SEARCH_MATCH] = TRUE;
     view->priv->right_margin_offset = 80;
 
     view->priv->word_chars = NULL;
@@ -804,6 +822,9 @@ moo_text_view_constructor (GType                  type,
 
     connect_buffer (view);
 
+    if (view->priv->highlight_search_matches)
+        connect_search_matches (view);
+
     target_list = gtk_target_list_new (text_view_target_table, G_N_ELEMENTS (text_view_target_table));
     gtk_target_list_add_text_targets (target_list, 0);
     gtk_drag_dest_set_target_list (GTK_WIDGET (view), target_list);
@@ -818,6 +839,7 @@ moo_text_view_dispose (GObject *object)
 {
     MooTextView *view = MOO_TEXT_VIEW (object);
 
+    disconnect_search_matches (view);
     disconnect_buffer (view);
 
     if (view->priv->buffer)
@@ -1118,6 +1140,9 @@ moo_text_view_set_property (GObject        *object,
         case PROP_HIGHLIGHT_CURRENT_LINE:
             moo_text_view_set_highlight_current_line (view, g_value_get_boolean (value));
             break;
+        case PROP_HIGHLIGHT_SEARCH_MATCHES:
+            set_highlight_search_matches (view, g_value_get_boolean (value));
+            break;
         case PROP_HIGHLIGHT_CURRENT_LINE_UNFOCUSED:
             moo_text_view_set_highlight_current_line_unfocused (view, g_value_get_boolean (value));
             break;
@@ -1223,6 +1248,9 @@ moo_text_view_get_property (GObject        *object,
         case PROP_HIGHLIGHT_CURRENT_LINE:
             g_value_set_boolean (value, view->priv->color_settings[MOO_TEXT_VIEW_COLOR_CURRENT_LINE]);
             break;
+        case PROP_HIGHLIGHT_SEARCH_MATCHES:
+            g_value_set_boolean (value, view->priv->highlight_search_matches);
+            break;
         case PROP_DRAW_RIGHT_MARGIN:
             g_value_set_boolean (value, view->priv->color_settings[MOO_TEXT_VIEW_COLOR_RIGHT_MARGIN]);
             break;
@@ -2224,6 +2252,7 @@ update_gcs (MooTextView *view)
 {
     update_gc (view, MOO_TEXT_VIEW_COLOR_CURRENT_LINE);
     update_gc (view, MOO_TEXT_VIEW_COLOR_RIGHT_MARGIN);
+    update_gc (view, MOO_TEXT_VIEW_COLOR_SEARCH_MATCH);
 }
 
 
@@ -2314,6 +2343,101 @@ moo_text_view_draw_current_line (GtkTextView    *text_view,
 }
 
 
+static void
+draw_search_match (GtkTextView       *text_view,
+                   GdkEventExpose    *event,
+                   GdkGC             *gc,
+                   const GtkTextIter *match_start,
+                   const GtkTextIter *match_end)
+{
+    GtkTextIter start = *match_start;
+    int window_width;
+
+    gdk_drawable_get_size (event->window, &window_width, NULL);
+
+    /* one rectangle per line, or two if the line is wrapped in between */
+    while (TRUE)
+    {
+        GtkTextIter end = start;
+        GdkRectangle start_rect, end_rect;
+        int x1, x2, y1, y2;
+
+        if (!gtk_text_iter_ends_line (&end))
+            gtk_text_iter_forward_to_line_end (&end);
+        if (gtk_text_iter_compare (&end, match_end) > 0)
+            end = *match_end;
+
+        gtk_text_view_get_iter_location (text_view, &start, &start_rect);
+        gtk_text_view_get_iter_location (text_view, &end, &end_rect);
+        gtk_text_view_buffer_to_window_coords (text_view, GTK_TEXT_WINDOW_TEXT,
+                                               start_rect.x, start_rect.y, &x1, &y1);
+        gtk_text_view_buffer_to_window_coords (text_view, GTK_TEXT_WINDOW_TEXT,
+                                               end_rect.x, end_rect.y, &x2, &y2);
+
+        if (y1 == y2)
+        {
+            gdk_draw_rectangle (event->window, gc, TRUE,
+                                x1, y1, MAX (x2 - x1, 1), start_rect.height);
+        }
+        else
+        {
+            gdk_draw_rectangle (event->window, gc, TRUE,
+                                x1, y1, window_width - x1, start_rect.height);
+            gdk_draw_rectangle (event->window, gc, TRUE,
+                                0, y2, x2, end_rect.height);
+        }
+
+        if (gtk_text_iter_compare (&end, match_end) >= 0 ||
+            !gtk_text_iter_forward_line (&end))
+                break;
+
+        start = end;
+    }
+}
+
+static void
+draw_search_matches (MooTextView    *view,
+                     GdkEventExpose *event)
+{
+    GtkTextView *text_view = GTK_TEXT_VIEW (view);
+    GtkTextBuffer *buffer = get_buffer (view);
+    const MooTextMatch *matches;
+    guint n_matches, i;
+    GtkTextIter start, end;
+    int y, end_offset;
+
+    if (!view->priv->highlight_search_matches)
+        return;
+
+    matches = _moo_text_matches_get_all (view->priv->search_matches, &n_matches);
+
+    if (!n_matches)
+        return;
+
+    gtk_text_view_window_to_buffer_coords (text_view, GTK_TEXT_WINDOW_TEXT,
+                                           0, event->area.y, NULL, &y);
+    gtk_text_view_get_line_at_y (text_view, &start, y, NULL);
+    gtk_text_view_get_line_at_y (text_view, &end, y + event->area.height, NULL);
+    if (!gtk_text_iter_ends_line (&end))
+        gtk_text_iter_forward_to_line_end (&end);
+    end_offset = gtk_text_iter_get_offset (&end);
+
+    for (i = _moo_text_matches_bsearch (view->priv->search_matches,
+                                        gtk_text_iter_get_offset (&start));
+         i < n_matches && matches[i].start <= end_offset;
+         ++i)
+    {
+        GtkTextIter match_start, match_end;
+
+        gtk_text_buffer_get_iter_at_offset (buffer, &match_start, matches[i].start);
+        gtk_text_buffer_get_iter_at_offset (buffer, &match_end, matches[i].end);
+        draw_search_match (text_view, event,
+                           view->priv->gcs[MOO_TEXT_VIEW_COLOR_SEARCH_MATCH],
+                           &match_start, &match_end);
+    }
+}
+
+
 static void
 draw_tab_at_iter (GtkTextView    *text_view,
                   GdkEventExpose *event,
@@ -2424,6 +2548,10 @@ moo_text_view_expose (GtkWidget      *widget,
             moo_text_view_draw_current_line (text_view, event);
         }
 
+        if (view->priv->search_matches &&
+            view->priv->gcs[MOO_TEXT_VIEW_COLOR_SEARCH_MATCH])
+                draw_search_matches (view, event);
+
         if (GTK_WIDGET_HAS_FOCUS (view) &&
             view->priv->color_settings[MOO_TEXT_VIEW_COLOR_RIGHT_MARGIN] &&
             view->priv->gcs[MOO_TEXT_VIEW_COLOR_RIGHT_MARGIN])
@@ -3756,6 +3884,7 @@ moo_text_view_remove (GtkContainer *container,
         view->priv->qs.entry = NULL;
         view->priv->qs.case_sensitive = NULL;
         view->priv->qs.regex = NULL;
+        view->priv->qs.matches = NULL;
     }
 
     for (i = 0; i < 4; ++i)
@@ -3799,6 +3928,237 @@ moo_text_view_set_quick_search_flags (MooTextView        *view,
 }
 
 
+static void
+get_visible_matches (MooTextView *view,
+                     int          visible[3])
+{
+    GtkTextView *text_view = GTK_TEXT_VIEW (view);
+    const MooTextMatch *matches;
+    GdkRectangle rect;
+    GtkTextIter start, end;
+    guint n_matches, first, last;
+    int end_offset;
+
+    visible[0] = visible[1] = -1;
+    visible[2] = 0;
+
+    matches = _moo_text_matches_get_all (view->priv->search_matches, &n_matches);
+
+    if (!n_matches || !GTK_WIDGET_DRAWABLE (view))
+        return;
+
+    gtk_text_view_get_visible_rect (text_view, &rect);
+    gtk_text_view_get_line_at_y (text_view, &start, rect.y, NULL);
+    gtk_text_view_get_line_at_y (text_view, &end, rect.y + rect.height, NULL);
+    if (!gtk_text_iter_ends_line (&end))
+        gtk_text_iter_forward_to_line_end (&end);
+    end_offset = gtk_text_iter_get_offset (&end);
+
+    first = _moo_text_matches_bsearch (view->priv->search_matches,
+                                       gtk_text_iter_get_offset (&start));
+    last = _moo_text_matches_bsearch (view->priv->search_matches, end_offset);
+    if (last < n_matches && matches[last].start <= end_offset)
+        last++;
+
+    if (first < last)
+    {
+        visible[0] = matches[first].start;
+        visible[1] = matches[last - 1].end;
+        visible[2] = last - first;
+    }
+}
+
+static void
+quick_search_update_matches (MooTextView *view)
+{
+    GtkTextIter start, end;
+    char *text = NULL;
+    int index = -1;
+    guint n_matches = 0;
+    gboolean complete;
+
+    if (!view->priv->qs.matches)
+        return;
+
+    if (view->priv->search_matches && view->priv->qs.in_search &&
+        !_moo_text_matches_has_pattern (view->priv->search_matches, NULL, NULL, 0))
+    {
+        _moo_text_matches_get_all (view->priv->search_matches, &n_matches);
+        complete = _moo_text_matches_is_complete (view->priv->search_matches);
+
+        if (gtk_text_buffer_get_selection_bounds (get_buffer (view), &start, &end))
+            index = _moo_text_matches_index_of (view->priv->search_matches,
+                                                gtk_text_iter_get_offset (&start),
+                                                gtk_text_iter_get_offset (&end));
+
+        if (index >= 0)
+            text = g_strdup_printf (complete ? _("%d of %u") : _("%d of %u+"),
+                                    index + 1, n_matches);
+        else
+            text = g_strdup_printf (complete ? _("%u matches") : _("%u+ matches"),
+                                    n_matches);
+    }
+
+    gtk_label_set_text (GTK_LABEL (view->priv->qs.matches), text ? text : "");
+    g_free (text);
+}
+
+/* Ticks in the vertical scrollbar, one per pixel row which has matches */
+static gboolean
+match_scrollbar_expose (MooTextView    *view,
+                        GdkEventExpose *event,
+                        GtkWidget      *scrollbar)
+{
+    const MooTextMatch *matches;
+    GdkGC *gc = view->priv->gcs[MOO_TEXT_VIEW_COLOR_SEARCH_MATCH];
+    guint n_matches, i;
+    int char_count, stepper_size, trough_y, trough_height;
+
+    if (!view->priv->search_matches || !gc)
+        return FALSE;
+
+    matches = _moo_text_matches_get_all (view->priv->search_matches, &n_matches);
+    char_count = gtk_text_buffer_get_char_count (get_buffer (view));
+
+    gtk_widget_style_get (scrollbar, "stepper-size", &stepper_size, NULL);
+    trough_y = scrollbar->allocation.y + stepper_size;
+    trough_height = scrollbar->allocation.height - 2 * stepper_size - 2;
+
+    if (!n_matches || !char_count || trough_height <= 0)
+        return FALSE;
+
+    for (i = 0; i < n_matches; )
+    {
+        int row = (int) ((double) matches[i].start / char_count * trough_height);
+        int next_offset = (int) ((double) (row + 1) / trough_height * char_count);
+        guint next;
+
+        gdk_draw_rectangle (event->window, gc, TRUE,
+                            scrollbar->allocation.x + 2, trough_y + row,
+                            scrollbar->allocation.width - 4, 2);
+
+        next = _moo_text_matches_bsearch (view->priv->search_matches, next_offset);
+        i = MAX (next, i + 1);
+    }
+
+    return FALSE;
+}
+
+static void
+search_matches_changed (MooTextView *view)
+{
+    GtkWidget *parent = GTK_WIDGET (view)->parent;
+    int visible[3];
+
+    if (!view->priv->match_scrollbar && GTK_IS_SCROLLED_WINDOW (parent) &&
+        GTK_SCROLLED_WINDOW (parent)->vscrollbar)
+    {
+        view->priv->match_scrollbar = GTK_SCROLLED_WINDOW (parent)->vscrollbar;
+        g_object_add_weak_pointer (G_OBJECT (view->priv->match_scrollbar),
+                                   (gpointer*) &view->priv->match_scrollbar);
+        view->priv->match_scrollbar_handler =
+            g_signal_connect_data (view->priv->match_scrollbar, "expose-event",
+                                   G_CALLBACK (match_scrollbar_expose), view,
+                                   NULL, G_CONNECT_AFTER | G_CONNECT_SWAPPED);
+    }
+
+    if (view->priv->match_scrollbar)
+        gtk_widget_queue_draw (view->priv->match_scrollbar);
+
+    /* the index changes a lot while it's being filled in,
+       don't redraw the text unless the visible matches changed */
+    get_visible_matches (view, visible);
+    if (memcmp (visible, view->priv->drawn_matches, sizeof visible) != 0)
+    {
+        memcpy (view->priv->drawn_matches, visible, sizeof visible);
+        gtk_widget_queue_draw (GTK_WIDGET (view));
+    }
+
+    quick_search_update_matches (view);
+}
+
+static void
+connect_search_matches (MooTextView *view)
+{
+    if (view->priv->search_matches)
+        return;
+
+    view->priv->search_matches = _moo_text_matches_get (get_buffer (view));
+    g_object_add_weak_pointer (G_OBJECT (view->priv->search_matches),
+                               (gpointer*) &view->priv->search_matches);
+    g_signal_connect_swapped (view->priv->search_matches, "changed",
+                              G_CALLBACK (search_matches_changed), view);
+}
+
+static void
+disconnect_search_matches (MooTextView *view)
+{
+    if (view->priv->match_scrollbar)
+    {
+        g_signal_handler_disconnect (view->priv->match_scrollbar,
+                                     view->priv->match_scrollbar_handler);
+        gtk_widget_queue_draw (view->priv->match_scrollbar);
+        g_object_remove_weak_pointer (G_OBJECT (view->priv->match_scrollbar),
+                                      (gpointer*) &view->priv->match_scrollbar);
+        view->priv->match_scrollbar = NULL;
+        view->priv->match_scrollbar_handler = 0;
+    }
+
+    if (view->priv->search_matches)
+    {
+        g_signal_handlers_disconnect_by_func (view->priv->search_matches,
+                                              (gpointer) search_matches_changed,
+                                              view);
+        g_object_remove_weak_pointer (G_OBJECT (view->priv->search_matches),
+                                      (gpointer*) &view->priv->search_matches);
+        view->priv->search_matches = NULL;
+    }
+}
+
+static void
+set_highlight_search_matches (MooTextView *view,
+                              gboolean     highlight)
+{
+    highlight = highlight != 0;
+
+    if (view->priv->highlight_search_matches == highlight)
+        return;
+
+    view->priv->highlight_search_matches = highlight;
+
+    if (view->priv->constructed)
+    {
+        if (highlight)
+        {
+            connect_search_matches (view);
+        }
+        else
+        {
+            /* nobody needs the index anymore, the option is global */
+            if (view->priv->search_matches)
+                _moo_text_matches_set_pattern (view->priv->search_matches, NULL, NULL, 0);
+            disconnect_search_matches (view);
+            quick_search_update_matches (view);
+        }
+    }
+
+    gtk_widget_queue_draw (GTK_WIDGET (view));
+    g_object_notify (G_OBJECT (view), "highlight-search-matches");
+}
+
+void
+_moo_text_view_set_search_pattern (MooTextView        *view,
+                                   const char         *text,
+                                   MooRegex           *regex,
+                                   MooTextSearchFlags  flags)
+{
+    g_return_if_fail (MOO_IS_TEXT_VIEW (view));
+
+    if (view->priv->search_matches)
+        _moo_text_matches_set_pattern (view->priv->search_matches, text, regex, flags);
+}
+
+
 static void
 quick_search_option_toggled (MooTextView *view)
 {
@@ -3894,6 +4254,8 @@ quick_search_find_from (MooTextView *view,
         g_regex_unref (re);
     }
 
+    _moo_text_view_set_search_pattern (view, text, NULL, view->priv->qs.flags);
+
     buffer = get_buffer (view);
     found = moo_text_search_forward (start, text, view->priv->qs.flags,
                                      &match_start, &match_end, NULL);
@@ -3913,6 +4275,7 @@ quick_search_find_from (MooTextView *view,
     {
         gtk_text_buffer_select_range (buffer, &match_end, &match_start);
         scroll_selection_onscreen (GTK_TEXT_VIEW (view));
+        quick_search_update_matches (view);
     }
     else
     {
@@ -3986,7 +4349,14 @@ search_entry_changed (MooTextView *view,
     text = gtk_entry_get_text (entry);
 
     if (text[0])
+    {
         quick_search_find (view, text);
+    }
+    else
+    {
+        _moo_text_view_set_search_pattern (view, NULL, NULL, 0);
+        quick_search_update_matches (view);
+    }
 }
 
 
@@ -4047,6 +4417,7 @@ moo_text_view_start_quick_search (MooTextView *view)
         view->priv->qs.entry = GTK_WIDGET (xml->entry);
         view->priv->qs.case_sensitive = GTK_TOGGLE_BUTTON (xml->case_sensitive);
         view->priv->qs.regex = GTK_TOGGLE_BUTTON (xml->regex);
+        view->priv->qs.matches = GTK_WIDGET (xml->matches);
 
         g_signal_connect_swapped (view->priv->qs.entry, "changed",
                                   G_CALLBACK (search_entry_changed), view);
@@ -4081,6 +4452,10 @@ moo_text_view_start_quick_search (MooTextView *view)
 
     view->priv->qs.in_search = TRUE;
 
+    _moo_text_view_set_search_pattern (view, gtk_entry_get_text (GTK_ENTRY (view->priv->qs.entry)),
+                                       NULL, view->priv->qs.flags);
+    quick_search_update_matches (view);
+
     g_free (text);
 }
 
@@ -4093,6 +4468,7 @@ moo_text_view_stop_quick_search (MooTextView *view)
     if (view->priv->qs.in_search)
     {
         view->priv->qs.in_search = FALSE;
+        _moo_text_view_set_search_pattern (view, NULL, NULL, 0);
         gtk_widget_hide (view->priv->qs.evbox);
         gtk_widget_grab_focus (GTK_WIDGET (view));
     }
@@ -378,6 +378,31 @@ moo_test_get_result (void)
     return registry.tr.asserts_passed == registry.tr.asserts;
 }
 
+/* Benchmarks take a while, so they only run if asked for */
+gboolean
+moo_test_benchmarks_enabled (void)
+{
+    const char *val = g_getenv ("MOO_TEST_BENCHMARKS");
+    return val && val[0] && strcmp (val, "0") != 0;
+}
+
+void
+moo_test_benchmark_report (const char *format,
+                           ...)
+{
+    va_list args;
+    char *text;
+
+    va_start (args, format);
+    text = g_strdup_vprintf (format, args);
+    va_end (args);
+
+    fprintf (stdout, "\n    %s", text);
+    fflush (stdout);
+
+    g_free (text);
+}
+
 
 /**
  * moo_test_assert_impl: (moo.private 1)
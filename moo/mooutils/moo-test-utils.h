@@ -87,6 +87,10 @@ void             moo_test_coverage_record   (const char         *lang,
 
 gboolean         moo_test_set_silent_messages   (gboolean        silent);
 
+gboolean         moo_test_benchmarks_enabled    (void);
+void             moo_test_benchmark_report      (const char     *format,
+                                                 ...) G_GNUC_PRINTF(1, 2);
+
 
 G_END_DECLS
 
@@ -19,6 +19,10 @@
 
 #define WANT_STAT_MONITOR
 
+#if defined(__linux__)
+#define MOO_USE_INOTIFY
+#endif
+
 #ifdef __WIN32__
 #include <windows.h>
 #include <io.h>
@@ -29,6 +33,14 @@
 #include <time.h>
 #endif
 
+#ifdef MOO_USE_INOTIFY
+#include <sys/inotify.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
 #include <mooglib/moo-glib.h>
 #include <mooglib/moo-stat.h>
 #include <sys/types.h>
@@ -66,8 +78,13 @@ typedef struct {
 
     MgwStatBuf statbuf;
 
+#ifdef MOO_USE_INOTIFY
+    int wd;
+#endif
+
     guint isdir : 1;
     guint alive : 1;
+    guint inotify : 1;
 } Monitor;
 
 struct WatchFuncs {
@@ -134,6 +151,18 @@ static void     watch_win32_stop_monitor    (MooFileWatch&   watch,
                                              Monitor&        monitor);
 #endif /* __WIN32__ */
 
+#ifdef MOO_USE_INOTIFY
+static gboolean watch_inotify_start         (MooFileWatch&   watch,
+                                             GError**        error);
+static gboolean watch_inotify_shutdown      (MooFileWatch&   watch,
+                                             GError**        error);
+static gboolean watch_inotify_start_monitor (MooFileWatch&   watch,
+                                             Monitor*        monitor,
+                                             GError**        error);
+static void     watch_inotify_stop_monitor  (MooFileWatch&   watch,
+                                             Monitor&        monitor);
+#endif /* MOO_USE_INOTIFY */
+
 static Monitor *monitor_new                 (MooFileWatch&   watch,
                                              const char*     filename,
                                              MooFileWatchCallback callback,
@@ -148,6 +177,11 @@ static struct WatchFuncs watch_funcs = {
     watch_win32_shutdown,
     watch_win32_start_monitor,
     watch_win32_stop_monitor
+#elif defined(MOO_USE_INOTIFY)
+    watch_inotify_start,
+    watch_inotify_shutdown,
+    watch_inotify_start_monitor,
+    watch_inotify_stop_monitor
 #else
     watch_stat_start,
     watch_stat_shutdown,
@@ -491,6 +525,10 @@ do_stat(MooFileWatch *watch)
         if (!monitor || !monitor->alive)
             continue;
 
+        /* inotify monitors get events without polling */
+        if (monitor->inotify)
+            continue;
+
         old = monitor->statbuf.mtime;
 
         event.monitor_id = monitor->id;
@@ -572,6 +610,489 @@ errno_to_file_error (mgw_errno_t code)
 
 #endif /* WANT_STAT_MONITOR */
 
+/*****************************************************************************/
+/* inotify
+ */
+#ifdef MOO_USE_INOTIFY
+
+#define INOTIFY_FILE_MASK   (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+                             IN_MOVE_SELF | IN_DELETE_SELF)
+#define INOTIFY_DIR_MASK    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                             IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF | IN_ONLYDIR)
+/* events which mean the contents changed even if mtime didn't */
+#define INOTIFY_CHANGE_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                             IN_MOVED_FROM | IN_MOVED_TO)
+/* events after which the watch doesn't watch the path anymore */
+#define INOTIFY_GONE_MASK   (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED | IN_UNMOUNT)
+
+/* After an event the watch thread keeps reading for this long, so that
+   a file written in many small pieces produces a single event; but it
+   does not hold events for longer than INOTIFY_COALESCE_MAX. */
+#define INOTIFY_COALESCE_TIMEOUT    50
+#define INOTIFY_COALESCE_MAX        500
+
+typedef struct {
+    int wd;             /* -1 if the kernel queue overflowed */
+    guint32 mask;
+} INotifyEvent;
+
+typedef struct {
+    int fd;
+    guint event_id;
+    gboolean running;
+    GHashTable *wds;    /* int wd -> GSList of Monitor* */
+    GSList *watches;
+} INotify;
+
+static INotify *ino;
+
+
+/****************************************************************************/
+/* Watch thread
+ */
+
+static gboolean
+inotify_thread_read (int         fd,
+                     GHashTable *pending)
+{
+    union {
+        struct inotify_event event;
+        char buf[16 * (sizeof (struct inotify_event) + NAME_MAX + 1)];
+    } data;
+    ssize_t len;
+    const char *ptr;
+
+    do
+        len = read (fd, data.buf, sizeof data.buf);
+    while (len < 0 && errno == EINTR);
+
+    if (len <= 0)
+    {
+        g_critical ("could not read inotify events: %s",
+                    len < 0 ? g_strerror (errno) : "EOF");
+        return FALSE;
+    }
+
+    for (ptr = data.buf; ptr < data.buf + len; )
+    {
+        const struct inotify_event *event = (const struct inotify_event*) ptr;
+        int wd = (event->mask & IN_Q_OVERFLOW) ? -1 : event->wd;
+        guint32 mask = GPOINTER_TO_UINT (g_hash_table_lookup (pending, GINT_TO_POINTER (wd)));
+
+        g_hash_table_insert (pending, GINT_TO_POINTER (wd),
+                             GUINT_TO_POINTER (mask | event->mask));
+
+        ptr += sizeof (struct inotify_event) + event->len;
+    }
+
+    return TRUE;
+}
+
+static void
+inotify_thread_flush (GHashTable *pending)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init (&iter, pending);
+
+    while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+        INotifyEvent *event = g_new0 (INotifyEvent, 1);
+        event->wd = GPOINTER_TO_INT (key);
+        event->mask = GPOINTER_TO_UINT (value);
+        _moo_event_queue_push (ino->event_id, event, g_free);
+    }
+
+    g_hash_table_remove_all (pending);
+}
+
+static gpointer
+inotify_thread_main (gpointer data)
+{
+    int fd = GPOINTER_TO_INT (data);
+    GHashTable *pending = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    while (inotify_thread_read (fd, pending))
+    {
+        gint64 start = g_get_monotonic_time ();
+
+        while (TRUE)
+        {
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            int elapsed = (int) ((g_get_monotonic_time () - start) / 1000);
+            int ret;
+
+            if (elapsed >= INOTIFY_COALESCE_MAX)
+                break;
+
+            ret = poll (&pfd, 1, MIN (INOTIFY_COALESCE_TIMEOUT,
+                                      INOTIFY_COALESCE_MAX - elapsed));
+
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0 || !inotify_thread_read (fd, pending))
+                break;
+        }
+
+        DEBUG_PRINT ("inotify: %u events", g_hash_table_size (pending));
+        inotify_thread_flush (pending);
+    }
+
+    g_hash_table_destroy (pending);
+    return NULL;
+}
+
+
+/****************************************************************************/
+/* Monitors
+ */
+
+static int
+inotify_add_monitor (Monitor *monitor)
+{
+    GSList *monitors;
+    int wd;
+
+    wd = inotify_add_watch (ino->fd, monitor->filename,
+                            monitor->isdir ? INOTIFY_DIR_MASK : INOTIFY_FILE_MASK);
+
+    if (wd < 0)
+        return errno;
+
+    /* the same inode gives the same watch descriptor */
+    monitors = (GSList*) g_hash_table_lookup (ino->wds, GINT_TO_POINTER (wd));
+    monitors = g_slist_prepend (monitors, monitor);
+    g_hash_table_insert (ino->wds, GINT_TO_POINTER (wd), monitors);
+
+    monitor->wd = wd;
+    monitor->inotify = TRUE;
+
+    return 0;
+}
+
+static void
+inotify_remove_monitor (Monitor *monitor)
+{
+    GSList *monitors;
+
+    if (!monitor->inotify)
+        return;
+
+    monitors = (GSList*) g_hash_table_lookup (ino->wds, GINT_TO_POINTER (monitor->wd));
+    monitors = g_slist_remove (monitors, monitor);
+
+    if (monitors)
+    {
+        g_hash_table_insert (ino->wds, GINT_TO_POINTER (monitor->wd), monitors);
+    }
+    else
+    {
+        g_hash_table_remove (ino->wds, GINT_TO_POINTER (monitor->wd));
+        /* fails harmlessly if the kernel already dropped it */
+        inotify_rm_watch (ino->fd, monitor->wd);
+    }
+
+    monitor->inotify = FALSE;
+    monitor->wd = -1;
+}
+
+static void
+inotify_fall_back_to_stat (MooFileWatch &watch,
+                           Monitor      *monitor,
+                           int           err)
+{
+    if (err == ENOSPC)
+    {
+        static gboolean been_here;
+
+        if (!been_here)
+        {
+            been_here = TRUE;
+            g_message ("inotify watch limit reached, polling files instead");
+        }
+    }
+    else
+    {
+        DEBUG_PRINT ("inotify_add_watch failed for '%s': %s",
+                     monitor->filename, g_strerror (err));
+    }
+
+    if (!watch.impl().stat_timeout)
+        watch_stat_start (watch, NULL);
+}
+
+static void
+inotify_check_monitor (MooFileWatch *watch,
+                       guint         monitor_id,
+                       guint32       mask)
+{
+    gboolean do_emit = FALSE;
+    gboolean do_remove = FALSE;
+    MooFileEvent event;
+    Monitor *monitor;
+    mgw_time_t old;
+    mgw_errno_t err;
+
+    if (!watch->impl().alive)
+        return;
+
+    monitor = (Monitor*) g_hash_table_lookup (watch->impl().requests,
+                                              GUINT_TO_POINTER (monitor_id));
+
+    if (!monitor || !monitor->alive || !monitor->inotify)
+        return;
+
+    old = monitor->statbuf.mtime;
+
+    event.monitor_id = monitor->id;
+    event.filename = monitor->filename;
+    event.error = NULL;
+
+    if (mgw_stat (monitor->filename, &monitor->statbuf, &err) != 0)
+    {
+        if (err.value == MGW_ENOENT)
+        {
+            event.code = MOO_FILE_EVENT_DELETED;
+            do_remove = TRUE;
+        }
+        else
+        {
+            event.code = MOO_FILE_EVENT_ERROR;
+            g_set_error (&event.error, MOO_FILE_WATCH_ERROR,
+                         errno_to_file_error (err),
+                         "stat failed: %s",
+                         mgw_strerror (err));
+            inotify_remove_monitor (monitor);
+            monitor->alive = FALSE;
+        }
+
+        do_emit = TRUE;
+    }
+    else if (mask & INOTIFY_GONE_MASK)
+    {
+        /* the file was replaced, e.g. saved by renaming a new file over it;
+           watch the new one */
+        int add_err;
+
+        inotify_remove_monitor (monitor);
+
+        if ((add_err = inotify_add_monitor (monitor)) != 0)
+            inotify_fall_back_to_stat (*watch, monitor, add_err);
+
+        event.code = MOO_FILE_EVENT_CHANGED;
+        do_emit = TRUE;
+    }
+    else if (monitor->statbuf.mtime.value != old.value ||
+             (mask & INOTIFY_CHANGE_MASK))
+    {
+        event.code = MOO_FILE_EVENT_CHANGED;
+        do_emit = TRUE;
+    }
+
+    if (do_emit)
+        moo_file_watch_emit_event (watch, &event, monitor);
+
+    if (event.error)
+        g_error_free (event.error);
+
+    if (do_remove && watch->impl().alive &&
+        g_hash_table_lookup (watch->impl().requests, GUINT_TO_POINTER (monitor_id)))
+    {
+        watch->cancel_monitor (monitor_id);
+    }
+}
+
+typedef struct {
+    MooFileWatch *watch;
+    guint monitor_id;
+    guint32 mask;
+} INotifyTarget;
+
+static GSList *
+inotify_add_target (GSList  *targets,
+                    Monitor *monitor,
+                    guint32  mask)
+{
+    INotifyTarget *target = g_new0 (INotifyTarget, 1);
+    target->watch = monitor->watch;
+    target->monitor_id = monitor->id;
+    target->mask = mask;
+    target->watch->ref();
+    return g_slist_prepend (targets, target);
+}
+
+static void
+inotify_event_callback (GList *events)
+{
+    GHashTable *masks;
+    GSList *targets = NULL;
+    gboolean overflow = FALSE;
+
+    /* merge everything which arrived since the last time */
+    masks = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    for ( ; events != NULL; events = events->next)
+    {
+        INotifyEvent *event = (INotifyEvent*) events->data;
+
+        if (event->wd < 0)
+        {
+            overflow = TRUE;
+        }
+        else
+        {
+            guint32 mask = GPOINTER_TO_UINT (g_hash_table_lookup (masks, GINT_TO_POINTER (event->wd)));
+            g_hash_table_insert (masks, GINT_TO_POINTER (event->wd),
+                                 GUINT_TO_POINTER (mask | event->mask));
+        }
+    }
+
+    /* Collect the monitors first, callbacks may cancel monitors or
+       close watches. If events were lost, check every monitor. */
+    if (overflow)
+    {
+        g_message ("inotify event queue overflowed");
+
+        for (GSList *lw = ino->watches; lw != NULL; lw = lw->next)
+        {
+            MooFileWatch *watch = (MooFileWatch*) lw->data;
+
+            for (MonitorList *lm = watch->impl().monitors; lm != NULL; lm = lm->next)
+            {
+                Monitor *monitor = lm->data;
+                if (monitor->inotify)
+                    targets = inotify_add_target (targets, monitor,
+                                                  GPOINTER_TO_UINT (g_hash_table_lookup (masks, GINT_TO_POINTER (monitor->wd))));
+            }
+        }
+    }
+    else
+    {
+        GHashTableIter iter;
+        gpointer key, value;
+
+        g_hash_table_iter_init (&iter, masks);
+
+        while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+            GSList *monitors = (GSList*) g_hash_table_lookup (ino->wds, key);
+
+            if (!monitors)
+                DEBUG_PRINT ("got event for dead watch descriptor %d", GPOINTER_TO_INT (key));
+
+            for ( ; monitors != NULL; monitors = monitors->next)
+                targets = inotify_add_target (targets, (Monitor*) monitors->data,
+                                              GPOINTER_TO_UINT (value));
+        }
+    }
+
+    g_hash_table_destroy (masks);
+
+    gdk_threads_enter ();
+
+    while (targets)
+    {
+        INotifyTarget *target = (INotifyTarget*) targets->data;
+        inotify_check_monitor (target->watch, target->monitor_id, target->mask);
+        target->watch->unref();
+        g_free (target);
+        targets = g_slist_delete_link (targets, targets);
+    }
+
+    gdk_threads_leave ();
+}
+
+static gboolean
+inotify_init_once (void)
+{
+    if (!ino)
+    {
+        GError *error = NULL;
+
+        ino = g_new0 (INotify, 1);
+        ino->running = FALSE;
+
+        /* one descriptor per process: instances are limited too */
+        ino->fd = inotify_init1 (IN_CLOEXEC);
+
+        if (ino->fd < 0)
+        {
+            g_warning ("inotify_init failed: %s", g_strerror (errno));
+            return FALSE;
+        }
+
+        ino->wds = g_hash_table_new (g_direct_hash, g_direct_equal);
+        ino->event_id = _moo_event_queue_connect ((MooEventQueueCallback) inotify_event_callback,
+                                                  NULL, NULL);
+
+        if (!g_thread_create (inotify_thread_main, GINT_TO_POINTER (ino->fd), FALSE, &error))
+        {
+            g_critical ("could not start watch thread: %s", moo_error_message (error));
+            g_error_free (error);
+        }
+        else
+        {
+            ino->running = TRUE;
+            DEBUG_PRINT ("initialized inotify");
+        }
+    }
+
+    return ino->running;
+}
+
+static gboolean
+watch_inotify_start (MooFileWatch& watch,
+                     GError**      error)
+{
+    /* without inotify every monitor is polled */
+    if (!inotify_init_once ())
+        return watch_stat_start (watch, error);
+
+    ino->watches = g_slist_prepend (ino->watches, &watch);
+    DEBUG_PRINT ("started watch %d", watch.impl().id);
+
+    return TRUE;
+}
+
+static gboolean
+watch_inotify_shutdown (MooFileWatch& watch,
+                        GError**      error)
+{
+    if (ino)
+        ino->watches = g_slist_remove (ino->watches, &watch);
+
+    return watch_stat_shutdown (watch, error);
+}
+
+static gboolean
+watch_inotify_start_monitor (MooFileWatch& watch,
+                             Monitor*      monitor,
+                             GError**      error)
+{
+    int err;
+
+    if (!watch_stat_start_monitor (watch, monitor, error))
+        return FALSE;
+
+    if (!ino->running)
+        return TRUE;
+
+    if ((err = inotify_add_monitor (monitor)) != 0)
+        inotify_fall_back_to_stat (watch, monitor, err);
+
+    return TRUE;
+}
+
+static void
+watch_inotify_stop_monitor (G_GNUC_UNUSED MooFileWatch& watch,
+                            Monitor&                    monitor)
+{
+    inotify_remove_monitor (&monitor);
+}
+
+#endif /* MOO_USE_INOTIFY */
+
 /*****************************************************************************/
 /* win32
  */
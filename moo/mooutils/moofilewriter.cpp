@@ -26,6 +26,9 @@
 #include <string.h>
 #include <mooglib/moo-glib.h>
 #include <gio/gio.h>
+#ifndef __WIN32__
+#include <gio/gfiledescriptorbased.h>
+#endif
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -370,6 +373,19 @@ bool MooLocalFileWriter::write (const char* data, gssize len)
     return TRUE;
 }
 
+// GIO syncs the data itself before replacing an existing non-empty
+// file; this takes care of new files. The stream writes to the file
+// itself or to a temporary file which replaces it on close, either
+// way its descriptor is the one to sync.
+static void
+sync_stream (GFileOutputStream *stream)
+{
+#ifndef __WIN32__
+    if (G_IS_FILE_DESCRIPTOR_BASED (stream))
+        fsync (g_file_descriptor_based_get_fd (G_FILE_DESCRIPTOR_BASED (stream)));
+#endif
+}
+
 bool MooLocalFileWriter::close (gerrp& out_error)
 {
     g_return_val_if_fail (stream != nullptr, FALSE);
@@ -377,9 +393,14 @@ bool MooLocalFileWriter::close (gerrp& out_error)
     if (!error)
     {
         stream->flush (NULL, error);
+
+        if (!error && (flags & MOO_FILE_WRITER_SYNC))
+            sync_stream (stream->gobj ());
+
         gerrp second;
         stream->close (NULL, error ? second : error);
         stream.reset ();
+
         file.reset ();
     }
 
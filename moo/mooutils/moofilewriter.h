@@ -45,7 +45,8 @@ typedef enum /*< flags >*/
     MOO_FILE_WRITER_FLAGS_NONE  = 0,
     MOO_FILE_WRITER_SAVE_BACKUP = 1 << 0,
     MOO_FILE_WRITER_CONFIG_MODE = 1 << 1,
-    MOO_FILE_WRITER_TEXT_MODE   = 1 << 2
+    MOO_FILE_WRITER_TEXT_MODE   = 1 << 2,
+    MOO_FILE_WRITER_SYNC        = 1 << 3
 } MooFileWriterFlags;
 
 MOO_DEFINE_FLAGS(MooFileWriterFlags);
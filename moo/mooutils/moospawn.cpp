@@ -16,6 +16,7 @@
 #include "mooutils/moospawn.h"
 #include "marshals.h"
 #include "mooutils/mooutils-misc.h"
+#include "mooutils/mooutils-tests.h"
 #include "moocpp/moocpp.h"
 #include <string.h>
 
@@ -30,6 +31,11 @@
 
 using namespace moo;
 
+/* bytes read from a pipe per call */
+#define READ_CHUNK_SIZE     8192
+/* bytes read from a pipe before returning to the main loop */
+#define MAX_READ_SIZE       65536
+
 typedef struct {
     MooCmd *cmd;
 } ChildWatchData;
@@ -49,6 +55,11 @@ struct _MooCmdPrivate {
     guint stderr_watch;
     GString *out_buffer;
     GString *err_buffer;
+    /* what's been read from the pipes; only an incomplete last
+       line is kept between reads */
+    GString *out_pending;
+    GString *err_pending;
+    GArray *lines;
 };
 
 static void     moo_cmd_finalize        (GObject    *object);
@@ -62,6 +73,12 @@ static gboolean moo_cmd_stdout_line     (MooCmd     *cmd,
                                          const char *line);
 static gboolean moo_cmd_stderr_line     (MooCmd     *cmd,
                                          const char *line);
+static gboolean moo_cmd_stdout_lines    (MooCmd     *cmd,
+                                         guint       n_lines,
+                                         const MooCmdLine *lines);
+static gboolean moo_cmd_stderr_lines    (MooCmd     *cmd,
+                                         guint       n_lines,
+                                         const MooCmdLine *lines);
 
 static gboolean moo_cmd_run_command     (MooCmd     *cmd,
                                          const char *working_dir,
@@ -91,6 +108,8 @@ enum {
     CMD_EXIT,
     STDOUT_LINE,
     STDERR_LINE,
+    STDOUT_LINES,
+    STDERR_LINES,
     LAST_SIGNAL
 };
 
@@ -113,6 +132,8 @@ _moo_cmd_class_init (MooCmdClass *klass)
     klass->cmd_exit = NULL;
     klass->stdout_line = moo_cmd_stdout_line;
     klass->stderr_line = moo_cmd_stderr_line;
+    klass->stdout_lines = moo_cmd_stdout_lines;
+    klass->stderr_lines = moo_cmd_stderr_lines;
 
     g_type_class_add_private (klass, sizeof (MooCmdPrivate));
 
@@ -154,6 +175,26 @@ _moo_cmd_class_init (MooCmdClass *klass)
                           _moo_marshal_BOOL__STRING,
                           G_TYPE_BOOLEAN, 1,
                           G_TYPE_STRING);
+
+    signals[STDOUT_LINES] =
+            g_signal_new ("stdout-lines",
+                          G_OBJECT_CLASS_TYPE (klass),
+                          G_SIGNAL_RUN_LAST,
+                          G_STRUCT_OFFSET (MooCmdClass, stdout_lines),
+                          g_signal_accumulator_true_handled, NULL,
+                          _moo_marshal_BOOL__UINT_POINTER,
+                          G_TYPE_BOOLEAN, 2,
+                          G_TYPE_UINT, G_TYPE_POINTER);
+
+    signals[STDERR_LINES] =
+            g_signal_new ("stderr-lines",
+                          G_OBJECT_CLASS_TYPE (klass),
+                          G_SIGNAL_RUN_LAST,
+                          G_STRUCT_OFFSET (MooCmdClass, stderr_lines),
+                          g_signal_accumulator_true_handled, NULL,
+                          _moo_marshal_BOOL__UINT_POINTER,
+                          G_TYPE_BOOLEAN, 2,
+                          G_TYPE_UINT, G_TYPE_POINTER);
 }
 
 
@@ -163,6 +204,9 @@ _moo_cmd_init (MooCmd *cmd)
     cmd->priv = G_TYPE_INSTANCE_GET_PRIVATE (cmd, MOO_TYPE_CMD, MooCmdPrivate);
     cmd->priv->out_buffer = g_string_new (NULL);
     cmd->priv->err_buffer = g_string_new (NULL);
+    cmd->priv->out_pending = g_string_new (NULL);
+    cmd->priv->err_pending = g_string_new (NULL);
+    cmd->priv->lines = g_array_new (FALSE, FALSE, sizeof (MooCmdLine));
 }
 
 
@@ -173,6 +217,9 @@ moo_cmd_finalize (GObject *object)
 
     g_string_free (cmd->priv->out_buffer, TRUE);
     g_string_free (cmd->priv->err_buffer, TRUE);
+    g_string_free (cmd->priv->out_pending, TRUE);
+    g_string_free (cmd->priv->err_pending, TRUE);
+    g_array_free (cmd->priv->lines, TRUE);
 
     G_OBJECT_CLASS (_moo_cmd_parent_class)->finalize (object);
 }
@@ -259,104 +306,221 @@ child_watch_removed (ChildWatchData *data)
 }
 
 
-static void
-process_line (MooCmd      *cmd,
-              gboolean     err,
-              const char  *line,
-              gssize       len)
+static char *
+convert_line (const char *line,
+              gsize       len)
 {
-    gboolean dummy = FALSE;
-    char *real_line = NULL;
+    const char *charset;
     const char *end;
+    char *real_line = NULL;
 
-    g_return_if_fail (line != NULL);
+    g_utf8_validate (line, len, &end);
 
-    if (len < 0)
-        len = strlen (line);
+    if (g_get_charset (&charset))
+    {
+        g_warning ("invalid unicode:\n%.*s", (int) len, line);
 
-    if ((cmd->priv->cmd_flags & MOO_CMD_UTF8_OUTPUT) &&
-        !g_utf8_validate (line, len, &end))
+        if (end > line)
+            real_line = g_strndup (line, end - line);
+    }
+    else
     {
-        const char *charset;
+        GError *error = NULL;
+        gsize bytes_written;
 
-        if (g_get_charset (&charset))
-        {
-            g_warning ("invalid unicode:\n%s", line);
+        real_line = g_convert_with_fallback (line, len, "UTF-8", charset,
+                                             NULL, NULL, &bytes_written,
+                                             &error);
 
-            if (end > line)
-                real_line = g_strndup (line, end - line);
+        if (!real_line)
+        {
+            g_warning ("could not convert text to UTF-8:\n%.*s",
+                       (int) len, line);
+            g_warning ("%s", moo_error_message (error));
+            g_error_free (error);
         }
+    }
+
+    return real_line;
+}
+
+
+static void
+emit_lines (MooCmd           *cmd,
+            gboolean          err,
+            const MooCmdLine *lines,
+            guint             n_lines)
+{
+    gboolean dummy = FALSE;
+
+    if (n_lines)
+        g_signal_emit (cmd, signals[err ? STDERR_LINES : STDOUT_LINES], 0,
+                       n_lines, lines, &dummy);
+}
+
+
+/* Splits complete lines of the buffer, or everything if eof is TRUE, in
+   place and returns the number of bytes they take. If validate is TRUE, the
+   whole block is checked to be UTF-8 before lines are nul-terminated, and
+   the result is put into valid. */
+static gsize
+split_lines (GString  *buffer,
+             GArray   *lines,
+             gboolean  eof,
+             gboolean  validate,
+             gboolean *valid)
+{
+    char *p = buffer->str;
+    char *end = buffer->str + buffer->len;
+    char *nl;
+    gsize done;
+    guint i;
+
+    g_array_set_size (lines, 0);
+
+    while (p < end)
+    {
+        MooCmdLine line;
+        char *line_end;
+
+        if ((nl = (char*) memchr (p, '\n', end - p)))
+            line_end = nl;
+        else if (eof)
+            line_end = end;
         else
-        {
-            GError *error = NULL;
-            gsize bytes_written;
+            break;
 
-            real_line = g_convert_with_fallback (line, len, "UTF-8", charset,
-                                                 NULL, NULL, &bytes_written,
-                                                 &error);
+        if (line_end > p && line_end[-1] == '\r')
+            line_end -= 1;
 
-            if (!real_line)
-            {
-                g_warning ("could not convert text to UTF-8:\n%.*s",
-                           (int) len, line);
-                g_warning ("%s", moo_error_message (error));
-            }
-        }
+        line.text = p;
+        line.len = line_end - p;
+        g_array_append_val (lines, line);
+
+        p = nl ? nl + 1 : end;
     }
-    else
+
+    done = p - buffer->str;
+
+    if (validate)
+        *valid = g_utf8_validate (buffer->str, done, NULL);
+
+    for (i = 0; i < lines->len; ++i)
     {
-        real_line = g_strndup (line, len);
+        MooCmdLine *line = &g_array_index (lines, MooCmdLine, i);
+        ((char*) line->text)[line->len] = 0;
     }
 
-    if (real_line)
+    return done;
+}
+
+/* Emits complete lines from the buffer and removes them from it, or
+   everything if eof is TRUE. Lines are split in place; text is only
+   copied if it needs converting to UTF-8. */
+static void
+process_output (MooCmd   *cmd,
+                GString  *buffer,
+                gboolean  err,
+                gboolean  eof)
+{
+    GArray *lines = cmd->priv->lines;
+    gboolean utf8 = (cmd->priv->cmd_flags & MOO_CMD_UTF8_OUTPUT) != 0;
+    gboolean valid = TRUE;
+    gsize done;
+
+    done = split_lines (buffer, lines, eof, utf8, &valid);
+
+    if (!lines->len)
+        return;
+
+    g_object_ref (cmd);
+
+    if (!utf8 || valid)
     {
-        if (err)
-            g_signal_emit (cmd, signals[STDERR_LINE], 0, real_line, &dummy);
-        else
-            g_signal_emit (cmd, signals[STDOUT_LINE], 0, real_line, &dummy);
+        emit_lines (cmd, err, (MooCmdLine*) lines->data, lines->len);
     }
+    else
+    {
+        /* slow path: convert invalid lines, drop those which can't be */
+        GPtrArray *converted = g_ptr_array_new ();
+        MooCmdLine *data = (MooCmdLine*) lines->data;
+        guint i, n_lines = 0;
+
+        for (i = 0; i < lines->len; ++i)
+        {
+            MooCmdLine line = data[i];
+
+            if (!g_utf8_validate (line.text, line.len, NULL))
+            {
+                char *real_line = convert_line (line.text, line.len);
+
+                if (!real_line)
+                    continue;
+
+                g_ptr_array_add (converted, real_line);
+                line.text = real_line;
+                line.len = strlen (real_line);
+            }
 
-    g_free (real_line);
+            data[n_lines++] = line;
+        }
+
+        emit_lines (cmd, err, data, n_lines);
+
+        g_ptr_array_foreach (converted, (GFunc) g_free, NULL);
+        g_ptr_array_free (converted, TRUE);
+    }
+
+    g_array_set_size (lines, 0);
+    g_string_erase (buffer, 0, done);
+
+    g_object_unref (cmd);
 }
 
 
-static gboolean
-command_out_or_err (MooCmd         *cmd,
-                    GIOChannel     *channel,
-                    GIOCondition    condition,
-                    gboolean        out)
+/* reads at most max_size bytes, or until EOF if max_size is 0 */
+static GIOStatus
+read_output (GIOChannel  *channel,
+             GString     *buffer,
+             gsize        max_size,
+             GError     **error)
 {
-    GSList *lines;
-    GError *error = NULL;
     GIOStatus status = G_IO_STATUS_NORMAL;
-    gsize count;
+    gsize total = 0;
 
-    count = 0;
-    lines = NULL;
-
-    while (count < 4096)
+    while (!max_size || total < max_size)
     {
-        char *line = NULL;
-        gsize line_end;
+        gsize old_len = buffer->len;
+        gsize bytes_read = 0;
 
-        status = g_io_channel_read_line (channel, &line, NULL, &line_end, &error);
+        /* reuses the buffer memory once it's big enough */
+        g_string_set_size (buffer, old_len + READ_CHUNK_SIZE);
+        status = g_io_channel_read_chars (channel, buffer->str + old_len,
+                                          READ_CHUNK_SIZE, &bytes_read, error);
+        g_string_truncate (buffer, old_len + bytes_read);
+        total += bytes_read;
 
-        if (!line)
+        if (status != G_IO_STATUS_NORMAL || !bytes_read)
             break;
-
-        count += line_end;
-        line[line_end] = 0;
-        lines = g_slist_prepend (lines, line);
     }
 
-    lines = g_slist_reverse (lines);
+    return status;
+}
 
-    while (lines)
-    {
-        process_line (cmd, !out, reinterpret_cast<char*> (lines->data), -1);
-        g_free (lines->data);
-        lines = g_slist_delete_link (lines, lines);
-    }
+
+static gboolean
+command_out_or_err (MooCmd         *cmd,
+                    GIOChannel     *channel,
+                    GIOCondition    condition,
+                    gboolean        out)
+{
+    GString *buffer = out ? cmd->priv->out_pending : cmd->priv->err_pending;
+    GError *error = NULL;
+    GIOStatus status;
+
+    status = read_output (channel, buffer, MAX_READ_SIZE, &error);
+
+    process_output (cmd, buffer, !out, FALSE);
 
     if (error)
     {
@@ -398,24 +562,10 @@ try_channel_leftover (MooCmd      *cmd,
                       GIOChannel  *channel,
                       gboolean     out)
 {
-    char *text;
+    GString *buffer = out ? cmd->priv->out_pending : cmd->priv->err_pending;
 
-    g_io_channel_read_to_end (channel, &text, NULL, NULL);
-
-    if (text)
-    {
-        MooLineReader lr;
-        const char *line;
-        gsize line_len;
-
-        for (moo_line_reader_init (&lr, text, -1);
-             (line = moo_line_reader_get_line (&lr, &line_len, NULL)); )
-        {
-            process_line (cmd, !out, line, line_len);
-        }
-
-        g_free (text);
-    }
+    read_output (channel, buffer, 0, NULL);
+    process_output (cmd, buffer, !out, TRUE);
 }
 
 
@@ -594,7 +744,7 @@ moo_cmd_run_command (MooCmd     *cmd,
     {
         cmd->priv->stdout_io = mgw_io_channel_unix_new (cmd->priv->out);
         g_io_channel_set_encoding (cmd->priv->stdout_io, NULL, NULL);
-        g_io_channel_set_buffered (cmd->priv->stdout_io, TRUE);
+        g_io_channel_set_buffered (cmd->priv->stdout_io, FALSE);
         g_io_channel_set_flags (cmd->priv->stdout_io, G_IO_FLAG_NONBLOCK, NULL);
         g_io_channel_set_close_on_unref (cmd->priv->stdout_io, TRUE);
         cmd->priv->stdout_watch =
@@ -609,7 +759,7 @@ moo_cmd_run_command (MooCmd     *cmd,
     {
         cmd->priv->stderr_io = mgw_io_channel_unix_new (cmd->priv->err);
         g_io_channel_set_encoding (cmd->priv->stderr_io, NULL, NULL);
-        g_io_channel_set_buffered (cmd->priv->stderr_io, TRUE);
+        g_io_channel_set_buffered (cmd->priv->stderr_io, FALSE);
         g_io_channel_set_flags (cmd->priv->stderr_io, G_IO_FLAG_NONBLOCK, NULL);
         g_io_channel_set_close_on_unref (cmd->priv->stderr_io, TRUE);
         cmd->priv->stderr_watch =
@@ -749,6 +899,40 @@ moo_cmd_stderr_line (MooCmd     *cmd,
 }
 
 
+static void
+emit_line_signals (MooCmd           *cmd,
+                   guint             signal,
+                   guint             n_lines,
+                   const MooCmdLine *lines)
+{
+    guint i;
+
+    for (i = 0; i < n_lines; ++i)
+    {
+        gboolean dummy = FALSE;
+        g_signal_emit (cmd, signals[signal], 0, lines[i].text, &dummy);
+    }
+}
+
+static gboolean
+moo_cmd_stdout_lines (MooCmd           *cmd,
+                      guint             n_lines,
+                      const MooCmdLine *lines)
+{
+    emit_line_signals (cmd, STDOUT_LINE, n_lines, lines);
+    return FALSE;
+}
+
+static gboolean
+moo_cmd_stderr_lines (MooCmd           *cmd,
+                      guint             n_lines,
+                      const MooCmdLine *lines)
+{
+    emit_line_signals (cmd, STDERR_LINE, n_lines, lines);
+    return FALSE;
+}
+
+
 gboolean
 _moo_unix_spawn_async (char      **argv,
                        GSpawnFlags g_flags,
@@ -785,3 +969,101 @@ moo_spawn_command_line_async_with_flags (const gchar *command_line,
 
   return retval;
 }
+
+
+static void
+test_split_lines (void)
+{
+    const char *text = "caf\xc3\xa9\nline two\r\n\xd0\xbc\xd0\xb8\xd1\x80\nincomplete";
+    GString *buffer = g_string_new (text);
+    GArray *lines = g_array_new (FALSE, FALSE, sizeof (MooCmdLine));
+    MooCmdLine *data;
+    gboolean valid = FALSE;
+    gsize done;
+
+    done = split_lines (buffer, lines, FALSE, TRUE, &valid);
+    data = (MooCmdLine*) lines->data;
+
+    /* the block is checked at once, so none of these lines is converted */
+    TEST_ASSERT (valid);
+    TEST_ASSERT_INT_EQ (lines->len, 3);
+    TEST_ASSERT_INT_EQ (done, strlen (text) - strlen ("incomplete"));
+    TEST_ASSERT_STR_EQ (data[0].text, "caf\xc3\xa9");
+    TEST_ASSERT_INT_EQ (data[0].len, 5);
+    TEST_ASSERT_STR_EQ (data[1].text, "line two");
+    TEST_ASSERT_INT_EQ (data[1].len, 8);
+    TEST_ASSERT_STR_EQ (data[2].text, "\xd0\xbc\xd0\xb8\xd1\x80");
+
+    g_string_erase (buffer, 0, done);
+    done = split_lines (buffer, lines, TRUE, TRUE, &valid);
+    TEST_ASSERT (valid);
+    TEST_ASSERT_INT_EQ (lines->len, 1);
+    TEST_ASSERT_INT_EQ (done, strlen ("incomplete"));
+    TEST_ASSERT_STR_EQ (g_array_index (lines, MooCmdLine, 0).text, "incomplete");
+
+    g_string_assign (buffer, "ok\n\xff\xfe\nok\n");
+    split_lines (buffer, lines, FALSE, TRUE, &valid);
+    TEST_ASSERT (!valid);
+    TEST_ASSERT_INT_EQ (lines->len, 3);
+
+    g_array_free (lines, TRUE);
+    g_string_free (buffer, TRUE);
+}
+
+struct OutputTestData {
+    GString *buffer;
+    guint n_lines;
+    guint n_copied;
+};
+
+static gboolean
+test_output_lines (G_GNUC_UNUSED MooCmd *cmd,
+                   guint                 n_lines,
+                   const MooCmdLine     *lines,
+                   OutputTestData       *data)
+{
+    guint i;
+
+    for (i = 0; i < n_lines; ++i)
+    {
+        data->n_lines++;
+        if (lines[i].text < data->buffer->str ||
+            lines[i].text >= data->buffer->str + data->buffer->len)
+                data->n_copied++;
+    }
+
+    return TRUE;
+}
+
+static void
+test_process_output (void)
+{
+    MooCmd *cmd = new_object<MooCmd>();
+    OutputTestData data;
+
+    cmd->priv->cmd_flags = MOO_CMD_UTF8_OUTPUT;
+    data.buffer = cmd->priv->out_pending;
+    data.n_lines = data.n_copied = 0;
+    g_signal_connect (cmd, "stdout-lines", G_CALLBACK (test_output_lines), &data);
+
+    g_string_assign (data.buffer, "\xce\xb1\xce\xb2\n\xe2\x82\xac 10\r\nascii\npartial");
+    process_output (cmd, data.buffer, FALSE, FALSE);
+    TEST_ASSERT_INT_EQ (data.n_lines, 3);
+    TEST_ASSERT_INT_EQ (data.n_copied, 0);
+    TEST_ASSERT_STR_EQ (data.buffer->str, "partial");
+
+    g_object_unref (cmd);
+}
+
+void
+moo_test_moo_cmd (void)
+{
+    MooTestSuite *suite;
+
+    suite = moo_test_suite_new ("MooCmd", "mooutils/moospawn.cpp", NULL, NULL, NULL);
+
+    moo_test_suite_add_test (suite, "split-lines", "splitting command output into lines",
+                             (MooTestFunc) test_split_lines, NULL);
+    moo_test_suite_add_test (suite, "process-output", "emitting UTF-8 command output",
+                             (MooTestFunc) test_process_output, NULL);
+}
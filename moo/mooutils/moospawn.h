@@ -43,6 +43,13 @@ typedef enum {
     MOO_CMD_OPEN_CONSOLE        = 1 << 5
 } MooCmdFlags;
 
+/* a line of output without line terminator; text is nul-terminated
+   and points into the command's buffer, valid only during emission */
+typedef struct {
+    const char *text;
+    gsize len;
+} MooCmdLine;
+
 struct _MooCmd
 {
     GObject base;
@@ -62,6 +69,15 @@ struct _MooCmdClass
                              const char *line);
     gboolean (*stderr_line) (MooCmd     *cmd,
                              const char *line);
+
+    /* all complete lines read at once; default handlers emit
+       stdout-line and stderr-line for each of them */
+    gboolean (*stdout_lines) (MooCmd           *cmd,
+                              guint             n_lines,
+                              const MooCmdLine *lines);
+    gboolean (*stderr_lines) (MooCmd           *cmd,
+                              guint             n_lines,
+                              const MooCmdLine *lines);
 };
 
 #ifdef MOO_PATCHED_G_SPAWN_WIN32_HIDDEN_CONSOLE
@@ -14,6 +14,7 @@
  */
 
 #include "mooutils/mooundo.h"
+#include "mooutils/mooutils-tests.h"
 #include "marshals.h"
 #include "moocpp/moocpp.h"
 #include <string.h>
@@ -25,8 +26,9 @@ A bit of how and why:
        it keeps two stacks - undo and redo. On Undo, action from undo stack is
        'undoed' and pushed into redo stack, and vice versa. When new action
        is added, redo stack is erased.
-       These stacks are lists now, but they should be queues if we want to limit
-       number of actions in the stack.
+       These stacks are queues, so that the oldest groups can be dropped when
+       actions take more memory or disk space than allowed, see
+       stack_limit_memory().
     2) Those stacks contain ActionGroup's, each ActionGroup is a queue of
        UndoAction instances.
     3) How actions are added:
@@ -51,6 +53,8 @@ A bit of how and why:
 
 typedef struct {
     GQueue *actions;
+    gsize size;
+    gsize disk;
 } ActionGroup;
 
 typedef struct {
@@ -80,8 +84,8 @@ static void     moo_undo_stack_get_property (GObject        *object,
 static void     moo_undo_stack_undo_real    (MooUndoStack   *stack);
 static void     moo_undo_stack_redo_real    (MooUndoStack   *stack);
 
-static void     action_stack_free           (GSList        **stack,
-                                             gpointer        doc);
+static void     action_stack_free           (GQueue         *queue,
+                                             MooUndoStack   *stack);
 
 
 G_DEFINE_TYPE(MooUndoStack, moo_undo_stack, G_TYPE_OBJECT)
@@ -157,8 +161,10 @@ moo_undo_stack_class_init (MooUndoStackClass *klass)
 
 
 static void
-moo_undo_stack_init (G_GNUC_UNUSED MooUndoStack *stack)
+moo_undo_stack_init (MooUndoStack *stack)
 {
+    stack->undo_stack = g_queue_new ();
+    stack->redo_stack = g_queue_new ();
 }
 
 
@@ -176,8 +182,10 @@ moo_undo_stack_finalize (GObject *object)
 {
     MooUndoStack *stack = MOO_UNDO_STACK (object);
 
-    action_stack_free (&stack->undo_stack, stack->document);
-    action_stack_free (&stack->redo_stack, stack->document);
+    action_stack_free (stack->undo_stack, stack);
+    action_stack_free (stack->redo_stack, stack);
+    g_queue_free (stack->undo_stack);
+    g_queue_free (stack->redo_stack);
 
     G_OBJECT_CLASS(moo_undo_stack_parent_class)->finalize (object);
 }
@@ -267,7 +275,7 @@ gboolean
 moo_undo_stack_can_undo (MooUndoStack *stack)
 {
     g_return_val_if_fail (MOO_IS_UNDO_STACK (stack), FALSE);
-    return stack->undo_stack != NULL;
+    return !g_queue_is_empty (stack->undo_stack);
 }
 
 
@@ -275,7 +283,7 @@ gboolean
 moo_undo_stack_can_redo (MooUndoStack *stack)
 {
     g_return_val_if_fail (MOO_IS_UNDO_STACK (stack), FALSE);
-    return stack->redo_stack != NULL;
+    return !g_queue_is_empty (stack->redo_stack);
 }
 
 
@@ -311,18 +319,15 @@ static void
 moo_undo_stack_undo_real (MooUndoStack *stack)
 {
     ActionGroup *group;
-    GSList *link;
     gboolean notify_redo;
 
-    g_return_if_fail (stack->undo_stack != NULL);
+    g_return_if_fail (!g_queue_is_empty (stack->undo_stack));
 
     stack->frozen++;
 
-    link = stack->undo_stack;
-    group = reinterpret_cast<ActionGroup*> (link->data);
-    stack->undo_stack = g_slist_delete_link (stack->undo_stack, link);
-    notify_redo = stack->redo_stack == NULL;
-    stack->redo_stack = g_slist_prepend (stack->redo_stack, group);
+    group = reinterpret_cast<ActionGroup*> (g_queue_pop_head (stack->undo_stack));
+    notify_redo = g_queue_is_empty (stack->redo_stack);
+    g_queue_push_head (stack->redo_stack, group);
     stack->new_group = TRUE;
 
     action_group_undo (group, stack);
@@ -331,7 +336,7 @@ moo_undo_stack_undo_real (MooUndoStack *stack)
 
     g_object_freeze_notify (G_OBJECT (stack));
 
-    if (!stack->undo_stack)
+    if (g_queue_is_empty (stack->undo_stack))
         g_object_notify (G_OBJECT (stack), "can-undo");
     if (notify_redo)
         g_object_notify (G_OBJECT (stack), "can-redo");
@@ -344,18 +349,15 @@ static void
 moo_undo_stack_redo_real (MooUndoStack *stack)
 {
     ActionGroup *group;
-    GSList *link;
     gboolean notify_undo;
 
-    g_return_if_fail (stack->redo_stack != NULL);
+    g_return_if_fail (!g_queue_is_empty (stack->redo_stack));
 
     stack->frozen++;
 
-    link = stack->redo_stack;
-    group = reinterpret_cast<ActionGroup*> (link->data);
-    stack->redo_stack = g_slist_delete_link (stack->redo_stack, link);
-    notify_undo = stack->undo_stack == NULL;
-    stack->undo_stack = g_slist_prepend (stack->undo_stack, group);
+    group = reinterpret_cast<ActionGroup*> (g_queue_pop_head (stack->redo_stack));
+    notify_undo = g_queue_is_empty (stack->undo_stack);
+    g_queue_push_head (stack->undo_stack, group);
     stack->new_group = TRUE;
 
     action_group_redo (group, stack);
@@ -364,7 +366,7 @@ moo_undo_stack_redo_real (MooUndoStack *stack)
 
     g_object_freeze_notify (G_OBJECT (stack));
 
-    if (!stack->redo_stack)
+    if (g_queue_is_empty (stack->redo_stack))
         g_object_notify (G_OBJECT (stack), "can-redo");
     if (notify_undo)
         g_object_notify (G_OBJECT (stack), "can-undo");
@@ -373,11 +375,35 @@ moo_undo_stack_redo_real (MooUndoStack *stack)
 }
 
 
+static gsize
+action_size (guint          type,
+             MooUndoAction *action)
+{
+    gsize size = sizeof (Wrapper);
+
+    if (TYPE_VTABLE(type)->size)
+        size += TYPE_VTABLE(type)->size (action);
+
+    return size;
+}
+
+
+static gsize
+action_disk_size (guint          type,
+                  MooUndoAction *action)
+{
+    if (TYPE_VTABLE(type)->disk_size)
+        return TYPE_VTABLE(type)->disk_size (action);
+    else
+        return 0;
+}
+
+
 static Wrapper *
 wrapper_new (guint          type,
              MooUndoAction *action)
 {
-    Wrapper *w = g_new0 (Wrapper, 1);
+    Wrapper *w = g_slice_new (Wrapper);
     w->type = type;
     w->action = action;
     return w;
@@ -391,20 +417,25 @@ wrapper_free (Wrapper  *wrapper,
     if (wrapper)
     {
         WRAPPER_VTABLE(wrapper)->destroy (wrapper->action, doc);
-        g_free (wrapper);
+        g_slice_free (Wrapper, wrapper);
     }
 }
 
 
 static void
-action_group_free (ActionGroup *group,
-                   gpointer     doc)
+action_group_free (ActionGroup  *group,
+                   MooUndoStack *stack)
 {
     if (group)
     {
-        g_queue_foreach (group->actions, (GFunc) wrapper_free, doc);
+        g_assert (stack->memory >= group->size);
+        stack->memory -= group->size;
+        g_assert (stack->disk >= group->disk);
+        stack->disk -= group->disk;
+
+        g_queue_foreach (group->actions, (GFunc) wrapper_free, stack->document);
         g_queue_free (group->actions);
-        g_free (group);
+        g_slice_free (ActionGroup, group);
     }
 }
 
@@ -412,19 +443,83 @@ action_group_free (ActionGroup *group,
 static ActionGroup*
 action_group_new (void)
 {
-    ActionGroup *group = g_new0 (ActionGroup, 1);
+    ActionGroup *group = g_slice_new0 (ActionGroup);
     group->actions = g_queue_new ();
     return group;
 }
 
 
 static void
-action_stack_free (GSList **stack,
-                   gpointer doc)
+action_stack_free (GQueue       *queue,
+                   MooUndoStack *stack)
 {
-    g_slist_foreach (*stack, (GFunc) action_group_free, doc);
-    g_slist_free (*stack);
-    *stack = NULL;
+    g_queue_foreach (queue, (GFunc) action_group_free, stack);
+    g_queue_clear (queue);
+}
+
+
+static gboolean
+stack_over_limit (MooUndoStack *stack)
+{
+    return (stack->max_memory && stack->memory > stack->max_memory) ||
+           (stack->max_disk && stack->disk > stack->max_disk);
+}
+
+/* Drops oldest groups until actions fit into max_memory and max_disk.
+   The most recent undo group is always kept, so that a single huge
+   action can still be undone. */
+static void
+stack_limit_memory (MooUndoStack *stack)
+{
+    gboolean notify_redo = FALSE;
+
+    while (stack_over_limit (stack) && !g_queue_is_empty (stack->redo_stack))
+    {
+        action_group_free (reinterpret_cast<ActionGroup*> (g_queue_pop_tail (stack->redo_stack)), stack);
+        notify_redo = g_queue_is_empty (stack->redo_stack);
+    }
+
+    while (stack_over_limit (stack) && g_queue_get_length (stack->undo_stack) > 1)
+        action_group_free (reinterpret_cast<ActionGroup*> (g_queue_pop_tail (stack->undo_stack)), stack);
+
+    if (notify_redo)
+        g_object_notify (G_OBJECT (stack), "can-redo");
+}
+
+
+void
+moo_undo_stack_set_max_memory (MooUndoStack *stack,
+                               gsize         max_memory)
+{
+    g_return_if_fail (MOO_IS_UNDO_STACK (stack));
+    stack->max_memory = max_memory;
+    stack_limit_memory (stack);
+}
+
+
+gsize
+moo_undo_stack_get_memory (MooUndoStack *stack)
+{
+    g_return_val_if_fail (MOO_IS_UNDO_STACK (stack), 0);
+    return stack->memory;
+}
+
+
+void
+moo_undo_stack_set_max_disk (MooUndoStack *stack,
+                             gsize         max_disk)
+{
+    g_return_if_fail (MOO_IS_UNDO_STACK (stack));
+    stack->max_disk = max_disk;
+    stack_limit_memory (stack);
+}
+
+
+gsize
+moo_undo_stack_get_disk (MooUndoStack *stack)
+{
+    g_return_val_if_fail (MOO_IS_UNDO_STACK (stack), 0);
+    return stack->disk;
 }
 
 
@@ -435,11 +530,11 @@ moo_undo_stack_clear (MooUndoStack *stack)
 
     g_return_if_fail (MOO_IS_UNDO_STACK (stack));
 
-    notify_undo = stack->undo_stack != NULL;
-    notify_redo = stack->redo_stack != NULL;
+    notify_undo = !g_queue_is_empty (stack->undo_stack);
+    notify_redo = !g_queue_is_empty (stack->redo_stack);
 
-    action_stack_free (&stack->undo_stack, stack->document);
-    action_stack_free (&stack->redo_stack, stack->document);
+    action_stack_free (stack->undo_stack, stack);
+    action_stack_free (stack->redo_stack, stack);
     stack->new_group = FALSE;
 
     g_object_freeze_notify (G_OBJECT (stack));
@@ -457,18 +552,28 @@ static gboolean
 action_group_merge (ActionGroup    *group,
                     guint           type,
                     MooUndoAction  *action,
-                    gpointer        doc)
+                    MooUndoStack   *stack)
 {
     Wrapper *old;
+    gsize old_size, old_disk;
 
     old = group->actions->head ? reinterpret_cast<Wrapper*> (group->actions->head->data) : nullptr;
 
     if (!old || old->type != type)
         return FALSE;
 
-    if (WRAPPER_VTABLE(old)->merge (old->action, action, doc))
+    old_size = action_size (old->type, old->action);
+    old_disk = action_disk_size (old->type, old->action);
+
+    if (WRAPPER_VTABLE(old)->merge (old->action, action, stack->document))
     {
-        TYPE_VTABLE(type)->destroy (action, doc);
+        gsize new_size = action_size (old->type, old->action);
+        gsize new_disk = action_disk_size (old->type, old->action);
+        group->size += new_size - old_size;
+        stack->memory += new_size - old_size;
+        group->disk += new_disk - old_disk;
+        stack->disk += new_disk - old_disk;
+        TYPE_VTABLE(type)->destroy (action, stack->document);
         return TRUE;
     }
     else
@@ -482,12 +587,18 @@ action_group_add (ActionGroup    *group,
                   guint           type,
                   MooUndoAction  *action,
                   gboolean        try_merge,
-                  gpointer        doc)
+                  MooUndoStack   *stack)
 {
-    if (!try_merge || !action_group_merge (group, type, action, doc))
+    if (!try_merge || !action_group_merge (group, type, action, stack))
     {
         Wrapper *wrapper = wrapper_new (type, action);
+        gsize size = action_size (type, action);
+        gsize disk = action_disk_size (type, action);
         g_queue_push_head (group->actions, wrapper);
+        group->size += size;
+        stack->memory += size;
+        group->disk += disk;
+        stack->disk += disk;
     }
 }
 
@@ -510,29 +621,29 @@ moo_undo_stack_add_action (MooUndoStack   *stack,
         return;
     }
 
-    notify_undo = stack->undo_stack == NULL;
-    notify_redo = stack->redo_stack != NULL;
+    notify_undo = g_queue_is_empty (stack->undo_stack);
+    notify_redo = !g_queue_is_empty (stack->redo_stack);
 
-    if (!stack->undo_stack || stack->new_group)
+    if (g_queue_is_empty (stack->undo_stack) || stack->new_group)
     {
         group = action_group_new ();
-        stack->undo_stack = g_slist_prepend (stack->undo_stack, group);
-        action_group_add (group, type, action, FALSE, stack->document);
+        g_queue_push_head (stack->undo_stack, group);
+        action_group_add (group, type, action, FALSE, stack);
     }
     else if (stack->do_continue)
     {
-        group = reinterpret_cast<ActionGroup*> (stack->undo_stack->data);
-        action_group_add (group, type, action, TRUE, stack->document);
+        group = reinterpret_cast<ActionGroup*> (g_queue_peek_head (stack->undo_stack));
+        action_group_add (group, type, action, TRUE, stack);
     }
     else
     {
-        group = reinterpret_cast<ActionGroup*> (stack->undo_stack->data);
+        group = reinterpret_cast<ActionGroup*> (g_queue_peek_head (stack->undo_stack));
 
-        if (!action_group_merge (group, type, action, stack->document))
+        if (!action_group_merge (group, type, action, stack))
         {
             group = action_group_new ();
-            stack->undo_stack = g_slist_prepend (stack->undo_stack, group);
-            action_group_add (group, type, action, TRUE, stack->document);
+            g_queue_push_head (stack->undo_stack, group);
+            action_group_add (group, type, action, TRUE, stack);
         }
     }
 
@@ -540,7 +651,8 @@ moo_undo_stack_add_action (MooUndoStack   *stack,
     if (stack->continue_group)
         stack->do_continue = TRUE;
 
-    action_stack_free (&stack->redo_stack, stack->document);
+    action_stack_free (stack->redo_stack, stack);
+    stack_limit_memory (stack);
 
     g_object_freeze_notify (G_OBJECT (stack));
 
@@ -603,3 +715,167 @@ moo_undo_stack_frozen (MooUndoStack *stack)
 {
     return stack->frozen > 0;
 }
+
+
+/***************************************************************************/
+/* Tests
+ */
+
+typedef struct {
+    gsize size;
+    gsize disk;
+    guint *destroyed;
+} TestAction;
+
+static void
+test_action_undo (G_GNUC_UNUSED TestAction *action,
+                  G_GNUC_UNUSED gpointer    doc)
+{
+}
+
+static gboolean
+test_action_merge (G_GNUC_UNUSED TestAction *action,
+                   G_GNUC_UNUSED TestAction *what,
+                   G_GNUC_UNUSED gpointer    doc)
+{
+    return FALSE;
+}
+
+static void
+test_action_destroy (TestAction *action,
+                     G_GNUC_UNUSED gpointer doc)
+{
+    *action->destroyed += 1;
+    g_free (action);
+}
+
+static gsize
+test_action_size (TestAction *action)
+{
+    return action->size;
+}
+
+static gsize
+test_action_disk_size (TestAction *action)
+{
+    return action->disk;
+}
+
+static guint
+test_action_type (void)
+{
+    static guint type;
+
+    if (!type)
+    {
+        MooUndoActionClass klass = {
+            (MooUndoActionUndo) test_action_undo,
+            (MooUndoActionRedo) test_action_undo,
+            (MooUndoActionMerge) test_action_merge,
+            (MooUndoActionDestroy) test_action_destroy,
+            (MooUndoActionSize) test_action_size,
+            (MooUndoActionSize) test_action_disk_size
+        };
+        type = moo_undo_action_register (&klass);
+    }
+
+    return type;
+}
+
+static void
+test_add_action (MooUndoStack *stack,
+                 gsize         size,
+                 gsize         disk,
+                 guint        *destroyed)
+{
+    TestAction *action = g_new0 (TestAction, 1);
+    action->size = size;
+    action->disk = disk;
+    action->destroyed = destroyed;
+    moo_undo_stack_new_group (stack);
+    moo_undo_stack_add_action (stack, test_action_type (), (MooUndoAction*) action);
+}
+
+static void
+test_max_memory (void)
+{
+    MooUndoStack *stack;
+    guint destroyed = 0;
+    guint i, n_undo;
+
+    stack = moo_undo_stack_new (NULL);
+
+    for (i = 0; i < 10; ++i)
+        test_add_action (stack, 1000, 0, &destroyed);
+    TEST_ASSERT_INT_EQ (destroyed, 0);
+    TEST_ASSERT (moo_undo_stack_get_memory (stack) >= 10000);
+
+    moo_undo_stack_set_max_memory (stack, 5000);
+    TEST_ASSERT (moo_undo_stack_get_memory (stack) <= 5000);
+    TEST_ASSERT (destroyed >= 5);
+
+    for (i = 0; i < 10; ++i)
+        test_add_action (stack, 1000, 0, &destroyed);
+    TEST_ASSERT (moo_undo_stack_get_memory (stack) <= 5000);
+
+    for (n_undo = 0; moo_undo_stack_can_undo (stack); ++n_undo)
+        moo_undo_stack_undo (stack);
+    TEST_ASSERT_INT_EQ (n_undo, 20 - destroyed);
+    TEST_ASSERT (moo_undo_stack_can_redo (stack));
+
+    /* a single action bigger than the limit is still kept */
+    test_add_action (stack, 100000, 0, &destroyed);
+    TEST_ASSERT (moo_undo_stack_can_undo (stack));
+    TEST_ASSERT (!moo_undo_stack_can_redo (stack));
+
+    moo_undo_stack_clear (stack);
+    TEST_ASSERT_INT_EQ (moo_undo_stack_get_memory (stack), 0);
+    TEST_ASSERT_INT_EQ (destroyed, 21);
+
+    g_object_unref (stack);
+}
+
+static void
+test_max_disk (void)
+{
+    MooUndoStack *stack;
+    guint destroyed = 0;
+    guint i;
+
+    stack = moo_undo_stack_new (NULL);
+    moo_undo_stack_set_max_memory (stack, 1 << 20);
+    moo_undo_stack_set_max_disk (stack, 5000);
+
+    /* spilled text is small in memory but still limited */
+    for (i = 0; i < 10; ++i)
+        test_add_action (stack, 10, 1000, &destroyed);
+    TEST_ASSERT (moo_undo_stack_get_memory (stack) < 1 << 20);
+    TEST_ASSERT (moo_undo_stack_get_disk (stack) <= 5000);
+    TEST_ASSERT_INT_EQ (destroyed, 5);
+
+    moo_undo_stack_set_max_disk (stack, 2000);
+    TEST_ASSERT_INT_EQ (moo_undo_stack_get_disk (stack), 2000);
+    TEST_ASSERT_INT_EQ (destroyed, 8);
+
+    /* a single action bigger than the limit is still kept */
+    test_add_action (stack, 10, 100000, &destroyed);
+    TEST_ASSERT (moo_undo_stack_can_undo (stack));
+    TEST_ASSERT_INT_EQ (moo_undo_stack_get_disk (stack), 100000);
+
+    moo_undo_stack_clear (stack);
+    TEST_ASSERT_INT_EQ (moo_undo_stack_get_memory (stack), 0);
+    TEST_ASSERT_INT_EQ (moo_undo_stack_get_disk (stack), 0);
+    TEST_ASSERT_INT_EQ (destroyed, 11);
+
+    g_object_unref (stack);
+}
+
+void
+moo_test_undo (void)
+{
+    MooTestSuite *suite = moo_test_suite_new ("mooundo", "mooutils/mooundo.cpp", NULL, NULL, NULL);
+    moo_test_suite_add_test (suite, "max_memory", "test of moo_undo_stack_set_max_memory()",
+                             (MooTestFunc) test_max_memory, NULL);
+    moo_test_suite_add_test (suite, "max_disk", "test of moo_undo_stack_set_max_disk()",
+                             (MooTestFunc) test_max_disk, NULL);
+}
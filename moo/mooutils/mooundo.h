@@ -44,6 +44,7 @@ typedef gboolean (*MooUndoActionMerge)  (MooUndoAction  *action,
                                          gpointer        document);
 typedef void     (*MooUndoActionDestroy)(MooUndoAction  *action,
                                          gpointer        document);
+typedef gsize    (*MooUndoActionSize)   (MooUndoAction  *action);
 
 struct _MooUndoActionClass
 {
@@ -51,6 +52,10 @@ struct _MooUndoActionClass
     MooUndoActionRedo redo;
     MooUndoActionMerge merge;
     MooUndoActionDestroy destroy;
+    /* optional, how much memory the action holds */
+    MooUndoActionSize size;
+    /* optional, how much disk space the action holds in temporary files */
+    MooUndoActionSize disk_size;
 };
 
 struct _MooUndoStack
@@ -58,8 +63,13 @@ struct _MooUndoStack
     GObject base;
 
     gpointer document;
-    GSList *undo_stack; /* ActionGroup* */
-    GSList *redo_stack; /* ActionGroup* */
+    GQueue *undo_stack; /* ActionGroup*, most recent first */
+    GQueue *redo_stack; /* ActionGroup*, most recent first */
+
+    gsize memory;       /* used by actions in both stacks */
+    gsize max_memory;   /* zero means no limit */
+    gsize disk;         /* used by actions in both stacks in temporary files */
+    gsize max_disk;     /* zero means no limit */
 
     guint frozen;
     guint continue_group;
@@ -91,6 +101,13 @@ void            moo_undo_stack_freeze       (MooUndoStack       *stack);
 void            moo_undo_stack_thaw         (MooUndoStack       *stack);
 gboolean        moo_undo_stack_frozen       (MooUndoStack       *stack);
 
+void            moo_undo_stack_set_max_memory (MooUndoStack     *stack,
+                                             gsize               max_memory);
+gsize           moo_undo_stack_get_memory   (MooUndoStack       *stack);
+void            moo_undo_stack_set_max_disk (MooUndoStack       *stack,
+                                             gsize               max_disk);
+gsize           moo_undo_stack_get_disk     (MooUndoStack       *stack);
+
 void            moo_undo_stack_new_group    (MooUndoStack       *stack);
 void            moo_undo_stack_start_group  (MooUndoStack       *stack);
 void            moo_undo_stack_end_group    (MooUndoStack       *stack);
@@ -1151,22 +1151,37 @@ error:
 }
 
 
+/* Regular expression which matches what the glob pattern matches; it is
+   anchored at the end only, so it must be matched against basenames */
+char *
+_moo_glob_to_regex (const char         *pattern,
+                    GRegexCompileFlags *flags)
+{
+    g_return_val_if_fail (pattern != NULL, NULL);
+    g_return_val_if_fail (flags != NULL, NULL);
+
+#ifdef __WIN32__
+    *flags = G_REGEX_CASELESS;
+#else
+    *flags = GRegexCompileFlags (0);
+#endif
+
+    return glob_to_re (pattern);
+}
+
+
 static MooGlob *
 _moo_glob_new (const char *pattern)
 {
     MooGlob *gl;
     GRegex *re;
     char *re_pattern;
-    GRegexCompileFlags flags = GRegexCompileFlags (0);
+    GRegexCompileFlags flags;
     GError *error = NULL;
 
     g_return_val_if_fail (pattern != NULL, NULL);
 
-#ifdef __WIN32__
-    flags = G_REGEX_CASELESS;
-#endif
-
-    if (!(re_pattern = glob_to_re (pattern)))
+    if (!(re_pattern = _moo_glob_to_regex (pattern, &flags)))
         return NULL;
 
     re = g_regex_new (re_pattern, flags, GRegexMatchFlags (0), &error);
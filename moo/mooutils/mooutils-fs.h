@@ -87,6 +87,8 @@ int             _moo_mkdir                  (const char  *path,
 
 gboolean        _moo_glob_match_simple      (const char *pattern,
                                              const char *filename);
+char           *_moo_glob_to_regex          (const char *pattern,
+                                             GRegexCompileFlags *flags);
 
 
 G_END_DECLS
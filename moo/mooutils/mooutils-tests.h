@@ -24,8 +24,10 @@ void    moo_test_gobject            (void);
 void    moo_test_mooaccel           (void);
 void    moo_test_mooutils_fs        (void);
 void    moo_test_moo_file_writer    (void);
+void    moo_test_moo_cmd            (void);
 void    moo_test_mooutils_misc      (void);
 void    moo_test_i18n               (MooTestOptions opts);
+void    moo_test_undo               (void);
 
 #ifdef __WIN32__
 void    moo_test_mooutils_win32     (void);
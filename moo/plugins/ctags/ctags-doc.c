@@ -20,6 +20,8 @@
 #include "ctags-view.h"
 #include "readtags.h"
 #include <mooutils/mooutils-misc.h>
+#include <mooutils/mooutils-script.h>
+#include <mooutils/mooutils-thread.h>
 #include <mooutils/mootype-macros.h>
 #include <gtk/gtk.h>
 #include <string.h>
@@ -32,10 +34,16 @@
 MOO_DEFINE_BOXED_TYPE_R (MooCtagsEntry, _moo_ctags_entry)
 G_DEFINE_TYPE (MooCtagsDocPlugin, _moo_ctags_doc_plugin, MOO_TYPE_DOC_PLUGIN)
 
+/* number of documents whose tags are kept */
+#define CACHE_SIZE          16
+#define MAX_TAG_FIELDS      32
+
 struct _MooCtagsDocPluginPrivate
 {
     GtkTreeStore *store;
     guint update_idle;
+    guint event_id;
+    guint serial;               /* of the last started job */
 };
 
 typedef struct {
@@ -44,6 +52,23 @@ typedef struct {
     void (*process_list) (GSList *entries, GtkTreeStore *store);
 } MooCtagsLanguage;
 
+/* ctags run in a thread on a copy of the document text */
+typedef struct {
+    guint event_id;
+    guint serial;
+    char *key;
+    char *text;
+    char *basename;
+    MooCtagsLanguage *lang;
+    GSList *entries;
+} CtagsJob;
+
+typedef struct {
+    char *key;
+    GSList *entries;
+    MooCtagsLanguage *lang;
+} CacheItem;
+
 static gboolean moo_ctags_doc_plugin_create         (MooCtagsDocPlugin  *plugin);
 static void     moo_ctags_doc_plugin_destroy        (MooCtagsDocPlugin  *plugin);
 
@@ -52,6 +77,8 @@ static gboolean moo_ctags_doc_plugin_update         (MooCtagsDocPlugin  *plugin)
 
 static GSList  *moo_ctags_parse_file                (const char         *filename,
                                                      const char         *opts);
+static void     moo_ctags_doc_plugin_process_jobs   (GList              *jobs,
+                                                     MooCtagsDocPlugin  *plugin);
 
 
 static void
@@ -94,6 +121,9 @@ static gboolean
 moo_ctags_doc_plugin_create (MooCtagsDocPlugin *plugin)
 {
     ensure_model (plugin);
+    plugin->priv->event_id =
+        _moo_event_queue_connect ((MooEventQueueCallback) moo_ctags_doc_plugin_process_jobs,
+                                  plugin, NULL);
     moo_ctags_doc_plugin_queue_update (plugin);
 
     g_signal_connect_swapped (MOO_DOC_PLUGIN (plugin)->doc, "after-save",
@@ -117,6 +147,11 @@ moo_ctags_doc_plugin_destroy (MooCtagsDocPlugin *plugin)
         g_source_remove (plugin->priv->update_idle);
     plugin->priv->update_idle = 0;
 
+    /* results of running jobs are dropped */
+    if (plugin->priv->event_id)
+        _moo_event_queue_disconnect (plugin->priv->event_id);
+    plugin->priv->event_id = 0;
+
     g_object_unref (plugin->priv->store);
 }
 
@@ -337,57 +372,384 @@ _moo_ctags_language_find_for_name (const char *lang_name)
 
 
 static void
-process_entries (MooCtagsDocPlugin *plugin,
-                 GSList            *list,
-                 MooCtagsLanguage  *lang)
+process_entries (GtkTreeStore     *store,
+                 GSList           *list,
+                 MooCtagsLanguage *lang)
 {
     g_return_if_fail (lang == NULL || lang->process_list != NULL);
 
     if (lang)
-        lang->process_list (list, plugin->priv->store);
+        lang->process_list (list, store);
     else
-        process_list_simple (list, plugin->priv->store);
+        process_list_simple (list, store);
+}
+
+
+static gboolean
+entries_equal (MooCtagsEntry *e1,
+               MooCtagsEntry *e2)
+{
+    if (!e1 || !e2)
+        return e1 == e2;
+
+    /* line numbers are not compared, rows are updated with them */
+    return e1->kind == e2->kind &&
+           e1->file_scope == e2->file_scope &&
+           !strcmp (e1->name, e2->name) &&
+           !g_strcmp0 (e1->klass, e2->klass) &&
+           !g_strcmp0 (e1->signature, e2->signature);
+}
+
+static gboolean
+rows_equal (GtkTreeModel *model1,
+            GtkTreeIter  *iter1,
+            GtkTreeModel *model2,
+            GtkTreeIter  *iter2)
+{
+    MooCtagsEntry *entry1, *entry2;
+    char *label1, *label2;
+    gboolean equal;
+
+    gtk_tree_model_get (model1, iter1,
+                        MOO_CTAGS_VIEW_COLUMN_ENTRY, &entry1,
+                        MOO_CTAGS_VIEW_COLUMN_LABEL, &label1, -1);
+    gtk_tree_model_get (model2, iter2,
+                        MOO_CTAGS_VIEW_COLUMN_ENTRY, &entry2,
+                        MOO_CTAGS_VIEW_COLUMN_LABEL, &label2, -1);
+
+    equal = !g_strcmp0 (label1, label2) && entries_equal (entry1, entry2);
+
+    if (entry1)
+        _moo_ctags_entry_unref (entry1);
+    if (entry2)
+        _moo_ctags_entry_unref (entry2);
+    g_free (label1);
+    g_free (label2);
+
+    return equal;
+}
+
+static void
+copy_row (GtkTreeStore *store,
+          GtkTreeIter  *iter,
+          GtkTreeModel *src,
+          GtkTreeIter  *src_iter)
+{
+    MooCtagsEntry *entry;
+    char *label;
+
+    gtk_tree_model_get (src, src_iter,
+                        MOO_CTAGS_VIEW_COLUMN_ENTRY, &entry,
+                        MOO_CTAGS_VIEW_COLUMN_LABEL, &label, -1);
+    gtk_tree_store_set (store, iter,
+                        MOO_CTAGS_VIEW_COLUMN_ENTRY, entry,
+                        MOO_CTAGS_VIEW_COLUMN_LABEL, label, -1);
+
+    if (entry)
+        _moo_ctags_entry_unref (entry);
+    g_free (label);
+}
+
+/* Makes children of parent in store look like children of src_parent
+   in src. Rows which did not change are kept, so the tree view doesn't
+   lose expanded rows and selection. */
+static void
+merge_store (GtkTreeStore *store,
+             GtkTreeIter  *parent,
+             GtkTreeModel *src,
+             GtkTreeIter  *src_parent)
+{
+    GtkTreeModel *model = GTK_TREE_MODEL (store);
+    GtkTreeIter old_iter, src_iter;
+    gboolean have_old, have_src;
+
+    have_old = gtk_tree_model_iter_children (model, &old_iter, parent);
+    have_src = gtk_tree_model_iter_children (src, &src_iter, src_parent);
+
+    while (have_src)
+    {
+        GtkTreeIter iter;
+
+        if (have_old && rows_equal (model, &old_iter, src, &src_iter))
+        {
+            iter = old_iter;
+            have_old = gtk_tree_model_iter_next (model, &old_iter);
+        }
+        else
+        {
+            GtkTreeIter next = old_iter;
+
+            /* a removed row */
+            if (have_old && gtk_tree_model_iter_next (model, &next) &&
+                rows_equal (model, &next, src, &src_iter))
+            {
+                have_old = gtk_tree_store_remove (store, &old_iter);
+                continue;
+            }
+
+            if (have_old)
+                gtk_tree_store_insert_before (store, &iter, parent, &old_iter);
+            else
+                gtk_tree_store_append (store, &iter, parent);
+        }
+
+        copy_row (store, &iter, src, &src_iter);
+        merge_store (store, &iter, src, &src_iter);
+
+        have_src = gtk_tree_model_iter_next (src, &src_iter);
+    }
+
+    while (have_old)
+        have_old = gtk_tree_store_remove (store, &old_iter);
+}
+
+static void
+update_store (MooCtagsDocPlugin *plugin,
+              GSList            *list,
+              MooCtagsLanguage  *lang)
+{
+    GtkTreeStore *store;
+
+    store = gtk_tree_store_new (2, MOO_TYPE_CTAGS_ENTRY, G_TYPE_STRING);
+
+    if (list)
+        process_entries (store, list, lang);
+
+    merge_store (plugin->priv->store, NULL, GTK_TREE_MODEL (store), NULL);
+
+    g_object_unref (store);
+}
+
+
+static GSList *
+entry_list_copy (GSList *list)
+{
+    list = g_slist_copy (list);
+    g_slist_foreach (list, (GFunc) _moo_ctags_entry_ref, NULL);
+    return list;
+}
+
+static void
+entry_list_free (GSList *list)
+{
+    g_slist_foreach (list, (GFunc) _moo_ctags_entry_unref, NULL);
+    g_slist_free (list);
+}
+
+
+/* tags of recently parsed texts, main thread only; most recent first */
+static GQueue tags_cache = G_QUEUE_INIT;
+
+static void
+cache_item_free (CacheItem *item)
+{
+    g_free (item->key);
+    entry_list_free (item->entries);
+    g_free (item);
+}
+
+static CacheItem *
+cache_lookup (const char *key)
+{
+    GList *l;
+
+    for (l = tags_cache.head; l != NULL; l = l->next)
+    {
+        CacheItem *item = l->data;
+
+        if (!strcmp (item->key, key))
+        {
+            g_queue_unlink (&tags_cache, l);
+            g_queue_push_head_link (&tags_cache, l);
+            return item;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+cache_add (const char       *key,
+           GSList           *entries,
+           MooCtagsLanguage *lang)
+{
+    CacheItem *item;
+
+    item = g_new0 (CacheItem, 1);
+    item->key = g_strdup (key);
+    item->entries = entry_list_copy (entries);
+    item->lang = lang;
+    g_queue_push_head (&tags_cache, item);
+
+    while (g_queue_get_length (&tags_cache) > CACHE_SIZE)
+        cache_item_free (g_queue_pop_tail (&tags_cache));
+}
+
+
+static void
+ctags_job_free (CtagsJob *job)
+{
+    if (job)
+    {
+        g_free (job->key);
+        g_free (job->text);
+        g_free (job->basename);
+        entry_list_free (job->entries);
+        g_free (job);
+    }
+}
+
+/* called in a thread */
+static void
+ctags_job_run (CtagsJob *job)
+{
+    const char *ext = NULL;
+    char *filename;
+    GError *error = NULL;
+
+    if (job->basename)
+        ext = strrchr (job->basename, '.');
+
+    /* ctags can't read source from stdin, so the text goes to a file
+       with the same extension, for language detection */
+    filename = moo_tempnam (ext);
+
+    if (filename && !g_file_set_contents (filename, job->text, -1, &error))
+    {
+        g_critical ("%s: could not write temporary file: %s",
+                    G_STRFUNC, error->message);
+        g_error_free (error);
+        g_free (filename);
+        filename = NULL;
+    }
+
+    if (filename)
+    {
+        if (job->lang)
+            job->entries = moo_ctags_parse_file (filename, job->lang->opts);
+
+        /* process_list_simple() is used if language-specific
+           options did not work */
+        if (!job->entries)
+        {
+            job->lang = NULL;
+            job->entries = moo_ctags_parse_file (filename, NULL);
+        }
+
+        unlink (filename);
+    }
+
+    g_free (filename);
+
+    _moo_event_queue_push (job->event_id, job, (GDestroyNotify) ctags_job_free);
+}
+
+static void
+ctags_job_start (CtagsJob *job)
+{
+    static GThreadPool *pool;
+
+    if (!pool)
+    {
+        GError *error = NULL;
+
+        pool = g_thread_pool_new ((GFunc) ctags_job_run, NULL, 2, FALSE, &error);
+
+        if (!pool)
+        {
+            g_critical ("%s: %s", G_STRFUNC, moo_error_message (error));
+            g_error_free (error);
+            ctags_job_free (job);
+            return;
+        }
+    }
+
+    g_thread_pool_push (pool, job, NULL);
+}
+
+static void
+moo_ctags_doc_plugin_process_jobs (GList             *jobs,
+                                   MooCtagsDocPlugin *plugin)
+{
+    gdk_threads_enter ();
+
+    for ( ; jobs != NULL; jobs = jobs->next)
+    {
+        CtagsJob *job = jobs->data;
+
+        cache_add (job->key, job->entries, job->lang);
+
+        /* a newer job was started meanwhile */
+        if (job->serial == plugin->priv->serial)
+            update_store (plugin, job->entries, job->lang);
+    }
+
+    gdk_threads_leave ();
+}
+
+
+static char *
+get_cache_key (const char       *text,
+               const char       *basename,
+               MooCtagsLanguage *lang)
+{
+    char *checksum, *key;
+
+    checksum = g_compute_checksum_for_string (G_CHECKSUM_MD5, text, -1);
+    key = g_strdup_printf ("%s\n%s\n%s", lang ? lang->name : "",
+                           basename ? basename : "", checksum);
+
+    g_free (checksum);
+    return key;
 }
 
 static gboolean
 moo_ctags_doc_plugin_update (MooCtagsDocPlugin *plugin)
 {
     MooEdit *doc;
-    char *filename;
     GFile *file;
+    GtkTextBuffer *buffer;
+    GtkTextIter start, end;
+    char *lang_id;
+    CtagsJob *job;
+    CacheItem *cached;
 
     plugin->priv->update_idle = 0;
 
-    gtk_tree_store_clear (plugin->priv->store);
-
     doc = MOO_DOC_PLUGIN (plugin)->doc;
 
+    job = g_new0 (CtagsJob, 1);
+    job->event_id = plugin->priv->event_id;
+    job->serial = ++plugin->priv->serial;
+
     file = moo_edit_get_file (doc);
-    filename = file ? g_file_get_path (file) : NULL;
+    job->basename = file ? g_file_get_basename (file) : NULL;
+    lang_id = moo_edit_get_lang_id (doc);
+    job->lang = _moo_ctags_language_find_for_name (lang_id);
 
-    if (filename && !g_file_test (filename, G_FILE_TEST_EXISTS))
+    if (!job->lang && !job->basename)
     {
-        g_free (filename);
-        filename = NULL;
+        update_store (plugin, NULL, NULL);
+        ctags_job_free (job);
+        goto out;
     }
 
-    if (filename)
+    buffer = moo_edit_get_buffer (doc);
+    gtk_text_buffer_get_bounds (buffer, &start, &end);
+    job->text = gtk_text_buffer_get_slice (buffer, &start, &end, TRUE);
+    job->key = get_cache_key (job->text, job->basename, job->lang);
+
+    if ((cached = cache_lookup (job->key)))
     {
-        GSList *list = NULL;
-        char *lang_id = moo_edit_get_lang_id (doc);
-        MooCtagsLanguage *ctags_lang = _moo_ctags_language_find_for_name (lang_id);
-
-        if (ctags_lang && (list = moo_ctags_parse_file (filename, ctags_lang->opts)))
-            process_entries (plugin, list, ctags_lang);
-        else if ((list = moo_ctags_parse_file (filename, NULL)))
-            process_entries (plugin, list, NULL);
-
-        g_slist_foreach (list, (GFunc) _moo_ctags_entry_unref, NULL);
-        g_slist_free (list);
-        g_free (lang_id);
+        update_store (plugin, cached->entries, cached->lang);
+        ctags_job_free (job);
+        goto out;
     }
 
-    g_free (filename);
+    ctags_job_start (job);
+
+out:
+    g_free (lang_id);
     moo_file_free (file);
     return FALSE;
 }
@@ -448,79 +810,89 @@ moo_ctags_entry_new (const tagEntry *te)
 }
 
 
-static GSList *
-_moo_ctags_read_tags (const char *filename)
+/* Parses a line of ctags output, modifying it. Like parseTagLine()
+   in readtags.c, but addresses are always line numbers here. */
+static MooCtagsEntry *
+parse_tag_line (char *line)
 {
-    tagFile *file;
-    tagFileInfo file_info;
-    tagEntry tentry;
-    GSList *list = NULL;
+    tagEntry te;
+    tagExtensionField fields[MAX_TAG_FIELDS];
+    char *p, *tab;
 
-    g_return_val_if_fail (filename != NULL, NULL);
+    /* pseudo-tags */
+    if (line[0] == '!')
+        return NULL;
 
-    file = tagsOpen (filename, &file_info);
+    memset (&te, 0, sizeof te);
+    te.fields.list = fields;
 
-    if (!file_info.status.opened)
-    {
-        char *file_utf8 = g_filename_display_name (filename);
-        g_warning ("could not read file '%s': %s", file_utf8,
-                   g_strerror (file_info.status.error_number));
-        g_free (file_utf8);
+    te.name = line;
+    if (!(tab = strchr (line, '\t')))
         return NULL;
-    }
+    *tab = 0;
 
-    tagsSetSortType (file, TAG_UNSORTED);
+    te.file = tab + 1;
+    if (!(tab = strchr (te.file, '\t')))
+        return NULL;
+    *tab = 0;
 
-    while (tagsNext (file, &tentry) == TagSuccess)
-    {
-        MooCtagsEntry *e = moo_ctags_entry_new (&tentry);
-        if (e)
-            list = g_slist_prepend (list, e);
-    }
+    te.address.lineNumber = strtoul (tab + 1, &p, 10);
 
-    tagsClose (file);
+    if (strncmp (p, ";\"", 2) != 0)
+        return moo_ctags_entry_new (&te);
 
-    return g_slist_reverse (list);
-}
+    for (p += 2; p && *p; )
+    {
+        char *field, *colon;
 
+        while (*p == '\t')
+            *p++ = 0;
+        if (!*p)
+            break;
 
-static char *
-get_tmp_file (void)
-{
-    char *file;
-    int fd;
-    GError *error = NULL;
+        field = p;
+        if ((p = strchr (p, '\t')))
+            *p++ = 0;
 
-    fd = g_file_open_tmp ("moo-ctags-plugin-XXXXXX", &file, &error);
+        if (!(colon = strchr (field, ':')))
+        {
+            te.kind = field;
+            continue;
+        }
 
-    if (fd == -1)
-    {
-        g_critical ("%s: could not open temporary file: %s",
-                    G_STRFUNC, error->message);
-        g_error_free (error);
-        return NULL;
+        *colon = 0;
+
+        if (!strcmp (field, "kind"))
+            te.kind = colon + 1;
+        else if (!strcmp (field, "file"))
+            te.fileScope = 1;
+        else if (te.fields.count < MAX_TAG_FIELDS)
+        {
+            fields[te.fields.count].key = field;
+            fields[te.fields.count].value = colon + 1;
+            te.fields.count++;
+        }
     }
 
-    close (fd);
-    return file;
+    return moo_ctags_entry_new (&te);
 }
 
+
+/* called in a thread */
 static GSList *
 moo_ctags_parse_file (const char *filename,
                       const char *opts)
 {
-    char *tags_file;
     GError *error = NULL;
     int exit_status;
     GSList *list = NULL;
     GString *cmd_line;
-    char *quoted_tags_file, *quoted_filename;
+    char *quoted_filename;
+    char *output = NULL;
+    char *line, *next;
 
     g_return_val_if_fail (filename != NULL, NULL);
 
-    if (!(tags_file = get_tmp_file ()))
-        return NULL;
-
     /* -u unsorted
      * --fields
      *     a access of class members
@@ -539,11 +911,11 @@ moo_ctags_parse_file (const char *filename,
 
     g_string_append (cmd_line, "--excmd=number ");
 
-    quoted_tags_file = g_shell_quote (tags_file);
+    /* tags are read from the pipe */
     quoted_filename = g_shell_quote (filename);
-    g_string_append_printf (cmd_line, "-f %s %s", quoted_tags_file, quoted_filename);
+    g_string_append_printf (cmd_line, "-f - %s", quoted_filename);
 
-    if (!g_spawn_command_line_sync (cmd_line->str, NULL, NULL, &exit_status, &error))
+    if (!g_spawn_command_line_sync (cmd_line->str, &output, NULL, &exit_status, &error))
     {
         g_warning ("%s: could not run ctags command: %s", G_STRFUNC, error->message);
         g_error_free (error);
@@ -556,13 +928,24 @@ moo_ctags_parse_file (const char *filename,
         goto out;
     }
 
-    list = _moo_ctags_read_tags (tags_file);
+    for (line = output; line && *line; line = next)
+    {
+        MooCtagsEntry *entry;
+
+        if ((next = strchr (line, '\n')))
+        {
+            if (next > line && next[-1] == '\r')
+                next[-1] = 0;
+            *next++ = 0;
+        }
+
+        if ((entry = parse_tag_line (line)))
+            list = g_slist_prepend (list, entry);
+    }
 
 out:
+    g_free (output);
     g_free (quoted_filename);
-    g_free (quoted_tags_file);
     g_string_free (cmd_line, TRUE);
-    unlink (tags_file);
-    g_free (tags_file);
-    return list;
+    return g_slist_reverse (list);
 }
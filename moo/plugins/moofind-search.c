@@ -0,0 +1,853 @@
+/*
+ *   moofind-search.c
+ *
+ *   Copyright (C) 2004-2010 by Yevgen Muntyan <emuntyan@users.sourceforge.net>
+ *
+ *   This file is part of medit.  medit is free software; you can
+ *   redistribute it and/or modify it under the terms of the
+ *   GNU Lesser General Public License as published by the
+ *   Free Software Foundation; either version 2.1 of the License,
+ *   or (at your option) any later version.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with medit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "plugins/moofind-search.h"
+#include "mooutils/mooutils-thread.h"
+#include "mooutils/moo-test-macros.h"
+#include <glib/gstdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+/* files searched by one task; directories with many files are split
+   between threads this many files at a time */
+#define FILES_PER_TASK      64
+/* like grep -I, a file with a zero byte in the beginning is binary */
+#define BINARY_CHECK_SIZE   32768
+/* text is matched this many bytes at a time, extended to the end of
+   line, so that cancelling doesn't wait for a regex to scan a big file */
+#define MATCH_WINDOW_SIZE   65536
+#define MAX_THREADS         8
+
+struct MooFindSearch {
+    /* read-only once the search is started */
+    GRegex *regex;
+    char *literal;
+    gsize literal_len;
+    gboolean files_only;
+    GPtrArray *globs;           /* GPatternSpec */
+    GPtrArray *skip_files;
+    GPtrArray *skip_dirs;
+    GHashTable *texts;          /* filename -> text */
+
+    GThreadPool *pool;
+    guint event_id;
+    MooFindResultsFunc results_func;
+    MooFindDoneFunc done_func;
+    gpointer data;
+
+    volatile int pending;       /* tasks queued or running */
+    volatile int cancelled;
+};
+
+typedef struct {
+    char *dir;                  /* directory to read, or NULL */
+    GPtrArray *files;           /* files to search, or NULL */
+} FindTask;
+
+/* a NULL results is pushed when the last task is done */
+typedef struct {
+    GPtrArray *results;
+} FindEvent;
+
+
+static void
+find_result_free (MooFindResult *result)
+{
+    if (result)
+    {
+        if (result->matches)
+        {
+            guint i;
+            for (i = 0; i < result->matches->len; ++i)
+                g_free (g_array_index (result->matches, MooFindMatch, i).text);
+            g_array_free (result->matches, TRUE);
+        }
+
+        g_free (result->filename);
+        g_free (result);
+    }
+}
+
+static void
+find_event_free (FindEvent *event)
+{
+    if (event)
+    {
+        if (event->results)
+            g_ptr_array_free (event->results, TRUE);
+        g_free (event);
+    }
+}
+
+static FindTask *
+find_task_new (char      *dir,
+               GPtrArray *files)
+{
+    FindTask *task = g_new (FindTask, 1);
+    task->dir = dir;
+    task->files = files;
+    return task;
+}
+
+static void
+find_task_free (FindTask *task)
+{
+    if (task)
+    {
+        if (task->files)
+            g_ptr_array_free (task->files, TRUE);
+        g_free (task->dir);
+        g_free (task);
+    }
+}
+
+
+static gboolean
+pattern_is_literal (const char *pattern)
+{
+    return strpbrk (pattern, ".[]()*+?{}|^$\\") == NULL;
+}
+
+MooFindSearch *
+_moo_find_search_new (const char *pattern,
+                      gboolean    case_sensitive,
+                      GError    **error)
+{
+    MooFindSearch *search;
+
+    g_return_val_if_fail (!pattern || *pattern, NULL);
+
+    search = g_new0 (MooFindSearch, 1);
+    search->files_only = pattern == NULL;
+    search->globs = g_ptr_array_new_with_free_func ((GDestroyNotify) g_pattern_spec_free);
+    search->skip_files = g_ptr_array_new_with_free_func ((GDestroyNotify) g_pattern_spec_free);
+    search->skip_dirs = g_ptr_array_new_with_free_func ((GDestroyNotify) g_pattern_spec_free);
+    search->texts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+    if (pattern && case_sensitive && pattern_is_literal (pattern))
+    {
+        search->literal = g_strdup (pattern);
+        search->literal_len = strlen (pattern);
+    }
+    else if (pattern)
+    {
+        /* RAW: files are searched as they are, whatever the encoding */
+        search->regex = g_regex_new (pattern,
+                                     G_REGEX_MULTILINE | G_REGEX_RAW | G_REGEX_OPTIMIZE |
+                                        (case_sensitive ? 0 : G_REGEX_CASELESS),
+                                     0, error);
+
+        if (!search->regex)
+        {
+            _moo_find_search_free (search);
+            return NULL;
+        }
+    }
+
+    return search;
+}
+
+static void
+add_globs (GPtrArray  *globs,
+           GPtrArray  *dir_globs,
+           const char *string)
+{
+    char **pieces, **p;
+
+    if (!string)
+        return;
+
+    pieces = g_strsplit_set (string, ";,", 0);
+
+    for (p = pieces; p && *p; ++p)
+    {
+        char *glob = g_strstrip (*p);
+        gsize len = strlen (glob);
+
+        if (!len)
+            continue;
+
+        if (dir_globs && glob[len-1] == '/')
+        {
+            glob[len-1] = 0;
+            if (*glob)
+                g_ptr_array_add (dir_globs, g_pattern_spec_new (glob));
+        }
+        else
+        {
+            g_ptr_array_add (globs, g_pattern_spec_new (glob));
+            if (dir_globs)
+                g_ptr_array_add (dir_globs, g_pattern_spec_new (glob));
+        }
+    }
+
+    g_strfreev (pieces);
+}
+
+void
+_moo_find_search_set_globs (MooFindSearch *search,
+                            const char    *globs)
+{
+    g_return_if_fail (search != NULL && search->pool == NULL);
+
+    g_ptr_array_set_size (search->globs, 0);
+
+    /* '*' is what the dialog shows by default, it means all files */
+    if (globs && strcmp (globs, "*") != 0)
+        add_globs (search->globs, NULL, globs);
+}
+
+void
+_moo_find_search_set_skip (MooFindSearch *search,
+                           const char    *skip)
+{
+    g_return_if_fail (search != NULL && search->pool == NULL);
+
+    g_ptr_array_set_size (search->skip_files, 0);
+    g_ptr_array_set_size (search->skip_dirs, 0);
+    add_globs (search->skip_files, search->skip_dirs, skip);
+}
+
+void
+_moo_find_search_add_text (MooFindSearch *search,
+                           const char    *filename,
+                           const char    *text)
+{
+    g_return_if_fail (search != NULL && search->pool == NULL);
+    g_return_if_fail (filename != NULL && text != NULL);
+
+    g_hash_table_insert (search->texts, g_strdup (filename), g_strdup (text));
+}
+
+
+static gboolean
+match_any (GPtrArray  *globs,
+           const char *name)
+{
+    guint i;
+
+    for (i = 0; i < globs->len; ++i)
+        if (g_pattern_match_string (globs->pdata[i], name))
+            return TRUE;
+
+    return FALSE;
+}
+
+static gboolean
+is_cancelled (MooFindSearch *search)
+{
+    return g_atomic_int_get (&search->cancelled) != 0;
+}
+
+static const char *
+find_literal (const char *text,
+              gsize       len,
+              const char *literal,
+              gsize       literal_len)
+{
+    const char *p = text;
+    const char *end = text + len;
+
+    while ((gsize) (end - p) >= literal_len)
+    {
+        p = memchr (p, literal[0], end - p - literal_len + 1);
+
+        if (!p)
+            return NULL;
+
+        if (memcmp (p, literal, literal_len) == 0)
+            return p;
+
+        p++;
+    }
+
+    return NULL;
+}
+
+/* looks for a match which starts between start and window_end; the
+   regex sees the text before start but not after window_end */
+static const char *
+find_in_window (MooFindSearch *search,
+                const char    *text,
+                const char    *start,
+                const char    *window_end)
+{
+    GMatchInfo *match_info = NULL;
+    const char *found = NULL;
+
+    if (search->literal)
+        return find_literal (start, window_end - start,
+                             search->literal, search->literal_len);
+
+    if (g_regex_match_full (search->regex, text, window_end - text, start - text,
+                            0, &match_info, NULL))
+    {
+        int match_start;
+        g_match_info_fetch_pos (match_info, 0, &match_start, NULL);
+        found = text + match_start;
+    }
+
+    g_match_info_free (match_info);
+    return found;
+}
+
+/* returns the position of the next match at or after start, or NULL
+   if there is none or the search is cancelled */
+static const char *
+find_next (MooFindSearch *search,
+           const char    *text,
+           gsize          len,
+           const char    *start)
+{
+    const char *end = text + len;
+
+    while (start < end && !is_cancelled (search))
+    {
+        const char *window_end = NULL;
+        const char *found;
+
+        if ((gsize) (end - start) > MATCH_WINDOW_SIZE)
+            window_end = memchr (start + MATCH_WINDOW_SIZE, '\n',
+                                 end - start - MATCH_WINDOW_SIZE);
+        window_end = window_end ? window_end + 1 : end;
+
+        if ((found = find_in_window (search, text, start, window_end)))
+            return found;
+
+        start = window_end;
+    }
+
+    return NULL;
+}
+
+static GArray *
+search_text (MooFindSearch *search,
+             const char    *text,
+             gsize          len)
+{
+    GArray *matches = NULL;
+    const char *end = text + len;
+    const char *line_start = text;
+    const char *p = text;
+    int line = 0;
+
+    if (memchr (text, 0, MIN (len, BINARY_CHECK_SIZE)))
+        return NULL;
+
+    while (p < end && !is_cancelled (search))
+    {
+        const char *match, *line_end;
+        MooFindMatch m;
+
+        if (!(match = find_next (search, text, len, p)))
+            break;
+
+        /* count lines up to the match */
+        while ((p = memchr (line_start, '\n', match - line_start)))
+        {
+            line_start = p + 1;
+            line++;
+        }
+
+        if (!(line_end = memchr (match, '\n', end - match)))
+            line_end = end;
+
+        if (!matches)
+            matches = g_array_new (FALSE, FALSE, sizeof (MooFindMatch));
+
+        m.line = line;
+        m.text = g_strndup (line_start, line_end - line_start -
+                            (line_end > line_start && line_end[-1] == '\r'));
+        g_array_append_val (matches, m);
+
+        if (line_end == end)
+            break;
+
+        /* one result per line, go on from the next one */
+        p = line_start = line_end + 1;
+        line++;
+    }
+
+    return matches;
+}
+
+static MooFindResult *
+search_file (MooFindSearch *search,
+             const char    *filename)
+{
+    MooFindResult *result;
+    GArray *matches = NULL;
+    const char *text;
+
+    if (search->files_only)
+    {
+        result = g_new (MooFindResult, 1);
+        result->filename = g_strdup (filename);
+        result->matches = NULL;
+        return result;
+    }
+
+    if ((text = g_hash_table_lookup (search->texts, filename)))
+    {
+        matches = search_text (search, text, strlen (text));
+    }
+    else
+    {
+        GMappedFile *file;
+
+        /* errors are ignored, like with grep -s */
+        if (!(file = g_mapped_file_new (filename, FALSE, NULL)))
+            return NULL;
+
+        if (g_mapped_file_get_length (file) != 0)
+            matches = search_text (search,
+                                   g_mapped_file_get_contents (file),
+                                   g_mapped_file_get_length (file));
+
+        g_mapped_file_unref (file);
+    }
+
+    if (!matches)
+        return NULL;
+
+    result = g_new (MooFindResult, 1);
+    result->filename = g_strdup (filename);
+    result->matches = matches;
+    return result;
+}
+
+/* Tasks are pushed and searches are cancelled under this lock, so that
+   no task is pushed once _moo_find_search_free() starts freeing the pool */
+G_LOCK_DEFINE_STATIC (push_task);
+
+static void
+push_task (MooFindSearch *search,
+           FindTask      *task)
+{
+    G_LOCK (push_task);
+
+    if (is_cancelled (search))
+    {
+        find_task_free (task);
+    }
+    else
+    {
+        g_atomic_int_inc (&search->pending);
+        g_thread_pool_push (search->pool, task, NULL);
+    }
+
+    G_UNLOCK (push_task);
+}
+
+static GPtrArray *
+read_dir (MooFindSearch *search,
+          const char    *path)
+{
+    GDir *dir;
+    const char *name;
+    GPtrArray *files;
+
+    if (!(dir = g_dir_open (path, 0, NULL)))
+        return NULL;
+
+    files = g_ptr_array_new_with_free_func (g_free);
+
+    while ((name = g_dir_read_name (dir)) && !is_cancelled (search))
+    {
+        char *filename;
+        GStatBuf buf;
+
+        filename = g_build_filename (path, name, NULL);
+
+        /* like grep -r, symlinks are not followed */
+        if (g_lstat (filename, &buf) != 0)
+        {
+            g_free (filename);
+        }
+        else if (S_ISDIR (buf.st_mode))
+        {
+            if (!match_any (search->skip_dirs, name))
+                push_task (search, find_task_new (filename, NULL));
+            else
+                g_free (filename);
+        }
+        else if (S_ISREG (buf.st_mode) &&
+                 (!search->globs->len || match_any (search->globs, name)) &&
+                 !match_any (search->skip_files, name))
+        {
+            g_ptr_array_add (files, filename);
+
+            if (files->len == FILES_PER_TASK)
+            {
+                push_task (search, find_task_new (NULL, files));
+                files = g_ptr_array_new_with_free_func (g_free);
+            }
+        }
+        else
+        {
+            g_free (filename);
+        }
+    }
+
+    g_dir_close (dir);
+    return files;
+}
+
+static void
+push_event (MooFindSearch *search,
+            GPtrArray     *results)
+{
+    FindEvent *event = g_new (FindEvent, 1);
+    event->results = results;
+    _moo_event_queue_push (search->event_id, event, (GDestroyNotify) find_event_free);
+}
+
+static void
+run_task (FindTask      *task,
+          MooFindSearch *search)
+{
+    GPtrArray *results = NULL;
+
+    /* files left over from reading the directory are searched here */
+    if (task->dir && !is_cancelled (search))
+        task->files = read_dir (search, task->dir);
+
+    if (task->files)
+    {
+        guint i;
+
+        for (i = 0; i < task->files->len && !is_cancelled (search); ++i)
+        {
+            MooFindResult *result = search_file (search, task->files->pdata[i]);
+
+            if (result)
+            {
+                if (!results)
+                    results = g_ptr_array_new_with_free_func ((GDestroyNotify) find_result_free);
+                g_ptr_array_add (results, result);
+            }
+        }
+    }
+
+    if (results && !is_cancelled (search))
+        push_event (search, results);
+    else if (results)
+        g_ptr_array_free (results, TRUE);
+
+    find_task_free (task);
+
+    if (g_atomic_int_dec_and_test (&search->pending))
+        push_event (search, NULL);
+}
+
+
+static void
+process_events (GList         *events,
+                MooFindSearch *search)
+{
+    GPtrArray *results = NULL;
+    gboolean done = FALSE;
+
+    for (; events != NULL; events = events->next)
+    {
+        FindEvent *event = events->data;
+        guint i;
+
+        if (!event->results)
+        {
+            done = TRUE;
+            continue;
+        }
+
+        /* everything which arrived since last time goes out in one batch */
+        if (!results)
+        {
+            results = event->results;
+            event->results = NULL;
+            continue;
+        }
+
+        for (i = 0; i < event->results->len; ++i)
+            g_ptr_array_add (results, event->results->pdata[i]);
+
+        /* results are moved, not copied */
+        g_ptr_array_set_free_func (event->results, NULL);
+    }
+
+    if (results && !is_cancelled (search) && search->results_func)
+        search->results_func (results, search->data);
+
+    if (results)
+        g_ptr_array_free (results, TRUE);
+
+    if (done && search->done_func)
+        search->done_func (search->data);
+}
+
+static int
+get_n_threads (void)
+{
+#if GLIB_CHECK_VERSION(2,36,0)
+    return CLAMP ((int) g_get_num_processors (), 2, MAX_THREADS);
+#else
+    return 4;
+#endif
+}
+
+void
+_moo_find_search_start (MooFindSearch      *search,
+                        GSList             *dirs,
+                        MooFindResultsFunc  results_func,
+                        MooFindDoneFunc     done_func,
+                        gpointer            data)
+{
+    g_return_if_fail (search != NULL && search->pool == NULL);
+
+    search->results_func = results_func;
+    search->done_func = done_func;
+    search->data = data;
+    search->event_id = _moo_event_queue_connect ((MooEventQueueCallback) process_events,
+                                                 search, NULL);
+    search->pool = g_thread_pool_new ((GFunc) run_task, search,
+                                      get_n_threads (), FALSE, NULL);
+
+    /* keeps the search from being done until all directories are queued */
+    g_atomic_int_inc (&search->pending);
+
+    for (; dirs != NULL; dirs = dirs->next)
+        if (dirs->data && *(char*) dirs->data)
+            push_task (search, find_task_new (g_strdup (dirs->data), NULL));
+
+    if (g_atomic_int_dec_and_test (&search->pending))
+        push_event (search, NULL);
+}
+
+void
+_moo_find_search_cancel (MooFindSearch *search)
+{
+    g_return_if_fail (search != NULL);
+    G_LOCK (push_task);
+    g_atomic_int_set (&search->cancelled, 1);
+    G_UNLOCK (push_task);
+}
+
+void
+_moo_find_search_free (MooFindSearch *search)
+{
+    if (!search)
+        return;
+
+    _moo_find_search_cancel (search);
+
+    /* queued tasks see the flag and return right away */
+    if (search->pool)
+        g_thread_pool_free (search->pool, FALSE, TRUE);
+
+    if (search->event_id)
+        _moo_event_queue_disconnect (search->event_id);
+
+    if (search->regex)
+        g_regex_unref (search->regex);
+    g_free (search->literal);
+    g_ptr_array_free (search->globs, TRUE);
+    g_ptr_array_free (search->skip_files, TRUE);
+    g_ptr_array_free (search->skip_dirs, TRUE);
+    g_hash_table_destroy (search->texts);
+    g_free (search);
+}
+
+
+/* Tests
+ */
+
+typedef struct {
+    GMainLoop *loop;
+    const char *dir;
+    GHashTable *found;          /* file relative to dir -> "line:text;..." */
+    gboolean done;
+} FindTestData;
+
+static void
+test_results_func (GPtrArray    *results,
+                   FindTestData *data)
+{
+    guint i, j;
+
+    for (i = 0; i < results->len; ++i)
+    {
+        MooFindResult *result = results->pdata[i];
+        GString *str = g_string_new (NULL);
+        const char *name = result->filename + strlen (data->dir) + 1;
+
+        for (j = 0; result->matches && j < result->matches->len; ++j)
+        {
+            MooFindMatch *m = &g_array_index (result->matches, MooFindMatch, j);
+            g_string_append_printf (str, "%d:%s;", m->line, m->text);
+        }
+
+        g_hash_table_insert (data->found, g_strdup (name), g_string_free (str, FALSE));
+    }
+}
+
+static void
+test_done_func (FindTestData *data)
+{
+    data->done = TRUE;
+    g_main_loop_quit (data->loop);
+}
+
+static gboolean
+test_timeout (FindTestData *data)
+{
+    g_main_loop_quit (data->loop);
+    return FALSE;
+}
+
+static void
+test_write_file (const char *dir,
+                 const char *name,
+                 const char *contents,
+                 gssize      len)
+{
+    char *filename = g_build_filename (dir, name, NULL);
+    char *file_dir = g_path_get_dirname (filename);
+
+    g_mkdir_with_parents (file_dir, 0755);
+    TEST_ASSERT (g_file_set_contents (filename, contents, len, NULL));
+
+    g_free (file_dir);
+    g_free (filename);
+}
+
+/* runs the search in dir and returns what it found */
+static GHashTable *
+test_run_search (MooFindSearch *search,
+                 const char    *dir)
+{
+    FindTestData data;
+    GSList dirs = { (gpointer) dir, NULL };
+    guint timeout;
+
+    data.loop = g_main_loop_new (NULL, FALSE);
+    data.dir = dir;
+    data.found = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    data.done = FALSE;
+
+    _moo_find_search_start (search, &dirs,
+                            (MooFindResultsFunc) test_results_func,
+                            (MooFindDoneFunc) test_done_func,
+                            &data);
+
+    timeout = g_timeout_add_seconds (30, (GSourceFunc) test_timeout, &data);
+    g_main_loop_run (data.loop);
+    g_source_remove (timeout);
+    TEST_ASSERT_MSG (data.done, "search in %s did not finish", dir);
+
+    _moo_find_search_free (search);
+    g_main_loop_unref (data.loop);
+    return data.found;
+}
+
+#define TEST_FOUND(found, name, expected)                               \
+    TEST_ASSERT_STR_EQ ((const char*) g_hash_table_lookup (found, name), expected)
+
+static void
+test_find_search (void)
+{
+    MooFindSearch *search;
+    GHashTable *found;
+    GString *big;
+    char *dir, *filename;
+    int i;
+
+    dir = g_build_filename (moo_test_get_working_dir (), "find-search", NULL);
+
+    test_write_file (dir, "a.txt", "foo\nbar\nbar foo\n", -1);
+    test_write_file (dir, "b.c", "foo\n", -1);
+    test_write_file (dir, "bin.txt", "\0foo\n", 5);
+    test_write_file (dir, "sub/c.txt", "xfoo\r\nBAZ\r\n", -1);
+
+    big = g_string_new (NULL);
+    for (i = 0; i < 40000; ++i)
+        g_string_append (big, "x\n");
+    g_string_append (big, "foo at the end");
+    test_write_file (dir, "big.log", big->str, big->len);
+    g_string_free (big, TRUE);
+
+    /* literal pattern, globs, binary files */
+    search = _moo_find_search_new ("foo", TRUE, NULL);
+    TEST_ASSERT (search != NULL && search->literal != NULL);
+    _moo_find_search_set_globs (search, "*.txt; *.log");
+    found = test_run_search (search, dir);
+    TEST_ASSERT_INT_EQ (g_hash_table_size (found), 3);
+    TEST_FOUND (found, "a.txt", "0:foo;2:bar foo;");
+    TEST_FOUND (found, "sub" G_DIR_SEPARATOR_S "c.txt", "0:xfoo;");
+    /* the match is many match windows into the file */
+    TEST_FOUND (found, "big.log", "40000:foo at the end;");
+    g_hash_table_destroy (found);
+
+    /* regex, case insensitive, skipped directories */
+    search = _moo_find_search_new ("^ba[rz]", FALSE, NULL);
+    TEST_ASSERT (search != NULL && search->regex != NULL);
+    found = test_run_search (search, dir);
+    TEST_ASSERT_INT_EQ (g_hash_table_size (found), 2);
+    TEST_FOUND (found, "a.txt", "1:bar;2:bar foo;");
+    TEST_FOUND (found, "sub" G_DIR_SEPARATOR_S "c.txt", "1:BAZ;");
+    g_hash_table_destroy (found);
+
+    search = _moo_find_search_new ("ba[rz]", FALSE, NULL);
+    _moo_find_search_set_skip (search, "sub/");
+    found = test_run_search (search, dir);
+    TEST_ASSERT_INT_EQ (g_hash_table_size (found), 1);
+    TEST_FOUND (found, "a.txt", "1:bar;2:bar foo;");
+    g_hash_table_destroy (found);
+
+    /* text of a modified open document is searched instead of the file */
+    search = _moo_find_search_new ("foo", TRUE, NULL);
+    _moo_find_search_set_globs (search, "*.c");
+    filename = g_build_filename (dir, "b.c", NULL);
+    _moo_find_search_add_text (search, filename, "int x;\nint foo;\n");
+    found = test_run_search (search, dir);
+    TEST_ASSERT_INT_EQ (g_hash_table_size (found), 1);
+    TEST_FOUND (found, "b.c", "1:int foo;");
+    g_hash_table_destroy (found);
+    g_free (filename);
+
+    /* files only */
+    search = _moo_find_search_new (NULL, FALSE, NULL);
+    _moo_find_search_set_globs (search, "*.c");
+    found = test_run_search (search, dir);
+    TEST_ASSERT_INT_EQ (g_hash_table_size (found), 1);
+    TEST_FOUND (found, "b.c", "");
+    g_hash_table_destroy (found);
+
+    g_free (dir);
+}
+
+void
+moo_test_find_search (void)
+{
+    MooTestSuite *suite;
+
+    suite = moo_test_suite_new ("MooFindSearch", "plugins/moofind-search.c", NULL, NULL, NULL);
+
+    moo_test_suite_add_test (suite, "search", "searching files in threads",
+                             (MooTestFunc) test_find_search, NULL);
+}
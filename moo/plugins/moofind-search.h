@@ -0,0 +1,81 @@
+/*
+ *   moofind-search.h
+ *
+ *   Copyright (C) 2004-2010 by Yevgen Muntyan <emuntyan@users.sourceforge.net>
+ *
+ *   This file is part of medit.  medit is free software; you can
+ *   redistribute it and/or modify it under the terms of the
+ *   GNU Lesser General Public License as published by the
+ *   Free Software Foundation; either version 2.1 of the License,
+ *   or (at your option) any later version.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with medit.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOO_FIND_SEARCH_H
+#define MOO_FIND_SEARCH_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Searches directory trees in a pool of threads. Directories are read
+ * and files are searched in parallel; results are delivered in the main
+ * thread, a batch of files at a time. Matches within a file come in
+ * order, but files come in no particular order.
+ */
+
+typedef struct MooFindSearch MooFindSearch;
+
+typedef struct {
+    int line;                   /* zero-based */
+    char *text;                 /* whole line, without line end */
+} MooFindMatch;
+
+typedef struct {
+    char *filename;
+    GArray *matches;            /* MooFindMatch; NULL when looking for files */
+} MooFindResult;
+
+/* results is an array of MooFindResult*, owned by the search */
+typedef void (*MooFindResultsFunc)  (GPtrArray  *results,
+                                     gpointer    data);
+typedef void (*MooFindDoneFunc)     (gpointer    data);
+
+/* pattern is a Perl-compatible regular expression (GRegex), matched
+   against the raw bytes of files; a match is reported for the line it
+   starts on, and a match which spans lines may be missed. With NULL
+   pattern files themselves are looked for, by globs */
+MooFindSearch  *_moo_find_search_new        (const char         *pattern,
+                                             gboolean            case_sensitive,
+                                             GError            **error);
+/* ';' or ',' separated lists of globs matched against file basenames;
+   skip entries ending with '/' only apply to directories */
+void            _moo_find_search_set_globs  (MooFindSearch      *search,
+                                             const char         *globs);
+void            _moo_find_search_set_skip   (MooFindSearch      *search,
+                                             const char         *skip);
+/* text is searched instead of the file on disk, e.g. for a modified
+   open document */
+void            _moo_find_search_add_text   (MooFindSearch      *search,
+                                             const char         *filename,
+                                             const char         *text);
+
+void            _moo_find_search_start      (MooFindSearch      *search,
+                                             GSList             *dirs,
+                                             MooFindResultsFunc  results_func,
+                                             MooFindDoneFunc     done_func,
+                                             gpointer            data);
+void            _moo_find_search_cancel     (MooFindSearch      *search);
+/* cancels the search and waits for the threads; no callbacks are
+   invoked after this */
+void            _moo_find_search_free       (MooFindSearch      *search);
+
+void            moo_test_find_search        (void);
+
+
+G_END_DECLS
+
+#endif /* MOO_FIND_SEARCH_H */
@@ -20,6 +20,7 @@
 #include "mooedit/mooplugin-macro.h"
 #include "mooedit/mooedit-script.h"
 #include "plugins/mooplugin-builtin.h"
+#include "plugins/moofind-search.h"
 #include "moofileview/moofileentry.h"
 #include "support/moocmdview.h"
 #include "mooedit/mooedit-accels.h"
@@ -38,10 +39,6 @@
 #endif
 #include <gtk/gtk.h>
 #include <string.h>
-#ifndef __WIN32__
-#include <sys/wait.h>
-#endif
-#include <signal.h>
 
 #define FIND_PLUGIN_ID "Find"
 
@@ -61,7 +58,6 @@ typedef struct {
 typedef struct {
     MooWinPlugin parent;
 
-    char *current_file;
     GtkWidget *grep_dialog;
     GrepXml *grep_xml;
 
@@ -70,6 +66,7 @@ typedef struct {
 
     MooEditWindow *window;
     MooCmdView *output;
+    MooFindSearch *search;
     GtkTextTag *line_number_tag;
     GtkTextTag *match_tag;
     GtkTextTag *file_tag;
@@ -115,11 +112,9 @@ static void         execute_find            (const char     *pattern,
 
 static gboolean     output_activate         (WindowStuff    *stuff,
                                              int             line);
-static gboolean     command_exit            (MooLineView    *view,
-                                             int             status,
-                                             WindowStuff    *stuff);
-static gboolean     process_line            (MooLineView    *view,
-                                             const char     *line,
+static gboolean     output_abort            (WindowStuff    *stuff);
+static void         search_done             (WindowStuff    *stuff);
+static void         process_results         (GPtrArray      *results,
                                              WindowStuff    *stuff);
 
 
@@ -210,10 +205,8 @@ ensure_output (WindowStuff *stuff)
     stuff->message_tag =
             moo_text_view_lookup_tag (MOO_TEXT_VIEW (stuff->output), "message");
 
-    g_signal_connect (stuff->output, "cmd-exit",
-                      G_CALLBACK (command_exit), stuff);
-    g_signal_connect (stuff->output, "stdout-line",
-                      G_CALLBACK (process_line), stuff);
+    g_signal_connect_swapped (stuff->output, "abort",
+                              G_CALLBACK (output_abort), stuff);
 
     swin = gtk_scrolled_window_new (NULL, NULL);
     gtk_scrolled_window_set_shadow_type (GTK_SCROLLED_WINDOW (swin),
@@ -685,252 +678,171 @@ finish_group(WindowStuff *stuff)
 }
 
 
-static gboolean
-process_grep_line (MooLineView *view,
-                   const char  *line,
-                   WindowStuff *stuff)
+static void
+write_grep_result (MooLineView   *view,
+                   MooFindResult *result,
+                   WindowStuff   *stuff)
 {
-    char *filename = NULL;
-    char *number = NULL;
-    const char *colon, *p;
     int view_line;
-    int line_no;
-    guint64 line_no_64;
-    mgw_errno_t err;
-
-    g_return_val_if_fail (line != NULL, FALSE);
-
-    /* 'Binary file blah matches' */
-    if (g_str_has_prefix (line, "Binary file "))
-        return FALSE;
+    guint i;
 
-    if (!*line)
-        return TRUE;
+    view_line = moo_line_view_write_line (view, result->filename, -1,
+                                          stuff->file_tag);
+    moo_line_view_set_data (view, view_line,
+                            file_line_pair_new (result->filename, -1),
+                            (GDestroyNotify) file_line_pair_free);
 
-    p = line;
-    if (!(colon = strchr (p, ':')))
-        goto parse_error;
+    finish_group (stuff);
+    stuff->group_start_line = view_line;
 
-#ifdef __WIN32__
-    /* Absolute filename 'C:\foobar\blah.txt:100:lalala' */
-    if (g_ascii_isalpha(p[0]) && p[1] == ':')
+    for (i = 0; i < result->matches->len; ++i)
     {
-        if (!(colon = strchr (colon + 1, ':')))
-            goto parse_error;
-    }
-#endif
-
-    if (!colon[1])
-        goto parse_error;
-
-    filename = g_strndup (p, colon - p);
-    p = colon + 1;
+        MooFindMatch *match = &g_array_index (result->matches, MooFindMatch, i);
+        char number[32];
 
-    if (!(colon = strchr (p, ':')) || !colon[1])
-        goto parse_error;
+        g_snprintf (number, sizeof number, "%d", match->line + 1);
 
-    number = g_strndup (p, colon - p);
-    p = colon + 1;
+        view_line = moo_line_view_start_line (view);
+        moo_line_view_write (view, number, -1, stuff->line_number_tag);
+        moo_line_view_write (view, ": ", -1, NULL);
+        moo_line_view_write (view, match->text, -1, stuff->match_tag);
+        moo_line_view_end_line (view);
+        stuff->group_end_line = view_line;
 
-    if (!stuff->current_file || strcmp (stuff->current_file, filename) != 0)
-    {
-        g_free (stuff->current_file);
-        stuff->current_file = filename;
-        view_line = moo_line_view_write_line (view, filename, -1,
-                                              stuff->file_tag);
         moo_line_view_set_data (view, view_line,
-                                file_line_pair_new (filename, -1),
+                                file_line_pair_new (result->filename, match->line),
                                 (GDestroyNotify) file_line_pair_free);
-
-        finish_group(stuff);
-        stuff->group_start_line = view_line;
-    }
-    else
-    {
-        g_free (filename);
-    }
-
-    line_no_64 = mgw_ascii_strtoull (number, NULL, 0, &err);
-
-    if (mgw_errno_is_set (err))
-    {
-        g_warning ("could not parse number '%s'", number);
-        line_no = -1;
-    }
-    else if (line_no_64 > G_MAXINT)
-    {
-        g_warning ("number '%s' is too large", number);
-        line_no = -1;
-    }
-    else if (line_no_64 == 0)
-    {
-        g_warning ("number '%s' is zero", number);
-        line_no = -1;
+        moo_line_view_set_cursor (view, view_line, MOO_TEXT_CURSOR_LINK);
+        stuff->match_count++;
     }
-    else
-    {
-        line_no = (int) (line_no_64 - 1);
-    }
-
-    view_line = moo_line_view_start_line (view);
-    moo_line_view_write (view, number, -1, stuff->line_number_tag);
-    moo_line_view_write (view, ": ", -1, NULL);
-    moo_line_view_write (view, p, -1, stuff->match_tag);
-    moo_line_view_end_line (view);
-    stuff->group_end_line = view_line;
-
-    moo_line_view_set_data (view, view_line,
-                            file_line_pair_new (stuff->current_file, line_no),
-                            (GDestroyNotify) file_line_pair_free);
-    moo_line_view_set_cursor (view, view_line, MOO_TEXT_CURSOR_LINK);
-    stuff->match_count++;
-
-    g_free (number);
-    return TRUE;
-
-parse_error:
-    g_warning ("could not parse line '%s'", line);
-    g_free (filename);
-    g_free (number);
-    return FALSE;
 }
 
 
-static gboolean
-process_find_line (MooLineView *view,
-                   const char  *line,
-                   WindowStuff *stuff)
+static void
+write_find_result (MooLineView   *view,
+                   MooFindResult *result,
+                   WindowStuff   *stuff)
 {
     int view_line;
 
-    view_line = moo_line_view_write_line (view, line, -1, stuff->match_tag);
+    view_line = moo_line_view_write_line (view, result->filename, -1, stuff->match_tag);
     moo_line_view_set_data (view, view_line,
-                            file_line_pair_new (line, -1),
+                            file_line_pair_new (result->filename, -1),
                             (GDestroyNotify) file_line_pair_free);
     stuff->match_count++;
-
-    return TRUE;
 }
 
 
-static gboolean
-process_line (MooLineView *view,
-              const char  *line,
-              WindowStuff *stuff)
+/* called from the event queue, with a batch of files */
+static void
+process_results (GPtrArray   *results,
+                 WindowStuff *stuff)
 {
-    switch (stuff->cmd)
+    MooLineView *view = MOO_LINE_VIEW (stuff->output);
+    guint i;
+
+    gdk_threads_enter ();
+
+    for (i = 0; i < results->len; ++i)
     {
-        case CMD_GREP:
-            return process_grep_line (view, line, stuff);
-        case CMD_FIND:
-            return process_find_line (view, line, stuff);
-        default:
-            g_return_val_if_reached (FALSE);
+        if (stuff->cmd == CMD_GREP)
+            write_grep_result (view, results->pdata[i], stuff);
+        else
+            write_find_result (view, results->pdata[i], stuff);
     }
+
+    gdk_threads_leave ();
 }
 
 
-static char *
-parse_globs (const char *string,
-             gboolean    skip)
+static void
+stop_search (WindowStuff *stuff)
 {
-    char **pieces, **p;
-    GString *command;
-
-    if (!string || !string[0] || !strcmp (string, "*"))
-        return NULL;
-
-    pieces = g_strsplit_set (string, ";,", 0);
-    command = g_string_new (NULL);
-
-    for (p = pieces; p && *p; ++p)
-        if (**p)
-            g_string_append_printf (command, "%s-%s \"%s%s%s\"",
-                                    p == pieces ? "" : " -o ",
-                                    skip ? "wholename" : "name",
-                                    skip ? "*" : "",
-                                    *p,
-                                    skip ? "*" : "");
+    if (!stuff->search)
+        return;
 
-    g_strfreev (pieces);
-    return g_string_free (command, FALSE);
+    _moo_find_search_free (stuff->search);
+    stuff->search = NULL;
+    stuff->cmd = 0;
+    g_signal_emit_by_name (stuff->output, "job-finished");
 }
 
+
 static void
-append_globs (GString    *command,
-              const char *globs_string,
-              const char *skip_string)
+start_search (WindowStuff   *stuff,
+              MooFindSearch *search,
+              GSList        *dirs,
+              int            cmd,
+              const char    *job_name)
 {
-    char *globs, *skip;
+    stop_search (stuff);
 
-    globs = parse_globs (globs_string, FALSE);
-    skip = parse_globs (skip_string, TRUE);
+    stuff->match_count = 0;
+    stuff->group_start_line = -1;
+    stuff->group_end_line = -1;
 
-    if (globs && skip)
-        g_string_append_printf (command, " \\( \\( %s \\) -a ! \\( %s \\) \\) ", globs, skip);
-    else if (globs)
-        g_string_append_printf (command, " \\( %s \\) ", globs);
-    else if (skip)
-        g_string_append_printf (command, " ! \\( %s \\) ", skip);
-    else
-        g_string_append (command, " ");
+    stuff->cmd = cmd;
+    stuff->search = search;
+    g_signal_emit_by_name (stuff->output, "job-started", job_name);
+
+    _moo_find_search_start (search, dirs,
+                            (MooFindResultsFunc) process_results,
+                            (MooFindDoneFunc) search_done,
+                            stuff);
+}
 
-    g_free (globs);
-    g_free (skip);
+
+static void
+search_error (WindowStuff *stuff,
+              GError      *error)
+{
+    moo_line_view_write_line (MOO_LINE_VIEW (stuff->output),
+                              moo_error_message (error), -1,
+                              stuff->error_tag);
+    g_error_free (error);
 }
 
 
+/* Modified documents are searched as they are in the editor,
+   not as they were last saved */
 static void
-append_grep_globs (GString    *command,
-                   const char *string,
-                   gboolean    skip)
+add_open_documents (MooFindSearch *search,
+                    MooEditWindow *window)
 {
-    char **globs, **p;
+    MooEditArray *docs;
+    guint i;
 
-    globs = g_strsplit (string, ";", 0);
+    docs = moo_editor_get_docs (moo_edit_window_get_editor (window));
 
-    for (p = globs; p && *p; ++p)
+    for (i = 0; i < docs->n_elms; ++i)
     {
-        if (!**p)
+        MooEdit *doc = docs->elms[i];
+        GtkTextBuffer *buffer;
+        GtkTextIter start, end;
+        char *filename, *norm_filename, *text;
+
+        if (moo_edit_is_untitled (doc) || !moo_edit_is_modified (doc))
             continue;
 
-        if (!skip)
-        {
-            char *quoted;
+        if (!(filename = moo_edit_get_filename (doc)))
+            continue;
 
-            if (!strcmp (*p, "*"))
-                continue;
+        norm_filename = _moo_normalize_file_path (filename);
+        buffer = moo_edit_get_buffer (doc);
+        gtk_text_buffer_get_bounds (buffer, &start, &end);
+        text = gtk_text_buffer_get_slice (buffer, &start, &end, TRUE);
 
-            quoted = g_shell_quote (*p);
-            g_string_append_printf (command, " --include=%s", quoted);
-            g_free (quoted);
-        }
-        else
-        {
-            gsize len = strlen (*p);
-
-            if ((*p)[len-1] == '/')
-            {
-                char *quoted;
-                (*p)[len-1] = 0;
-                quoted = g_shell_quote (*p);
-                g_string_append_printf (command, " --exclude-dir=%s", quoted);
-                g_free (quoted);
-            }
-            else
-            {
-                char *quoted;
-                quoted = g_shell_quote (*p);
-                g_string_append_printf (command, " --exclude=%s", quoted);
-                g_string_append_printf (command, " --exclude-dir=%s", quoted);
-                g_free (quoted);
-            }
-        }
+        _moo_find_search_add_text (search, norm_filename, text);
+
+        g_free (text);
+        g_free (norm_filename);
+        g_free (filename);
     }
 
-    g_strfreev (globs);
+    moo_edit_array_free (docs);
 }
 
+
 static void
 execute_grep (const char     *pattern,
               const char     *glob,
@@ -939,45 +851,24 @@ execute_grep (const char     *pattern,
               gboolean        case_sensitive,
               WindowStuff    *stuff)
 {
-    GString *command = NULL;
-    char *quoted_pattern;
+    MooFindSearch *search;
+    GError *error = NULL;
 
     g_return_if_fail (stuff->output != NULL);
     g_return_if_fail (pattern && pattern[0]);
     g_return_if_fail (dirs != NULL);
 
-    g_free (stuff->current_file);
-    stuff->current_file = NULL;
-    stuff->match_count = 0;
-    stuff->group_start_line = -1;
-    stuff->group_end_line = -1;
-
-    command = g_string_new ("grep -E -r -I -s -H -n");
-    if (!case_sensitive)
-        g_string_append (command, " -i");
-    append_grep_globs (command, glob, FALSE);
-    append_grep_globs (command, skip_files, TRUE);
-
-    quoted_pattern = g_shell_quote (pattern);
-    g_string_append_printf (command, " -e %s", quoted_pattern);
-
-    while (dirs)
+    if (!(search = _moo_find_search_new (pattern, case_sensitive, &error)))
     {
-        char *dir = dirs->data;
-        if (dir && *dir)
-        {
-            char *quoted_dir = g_shell_quote (dir);
-            g_string_append_printf (command, " %s", quoted_dir);
-            g_free (quoted_dir);
-        }
-        dirs = dirs->next;
+        search_error (stuff, error);
+        return;
     }
 
-    stuff->cmd = CMD_GREP;
-    moo_cmd_view_run_command (stuff->output, command->str, NULL, _("Find in Files"));
+    _moo_find_search_set_globs (search, glob);
+    _moo_find_search_set_skip (search, skip_files);
+    add_open_documents (search, stuff->window);
 
-    g_free (quoted_pattern);
-    g_string_free (command, TRUE);
+    start_search (stuff, search, dirs, CMD_GREP, _("Find in Files"));
 }
 
 
@@ -987,26 +878,17 @@ execute_find (const char     *pattern,
               const char     *skip_files,
               WindowStuff    *stuff)
 {
-    GString *command = NULL;
+    MooFindSearch *search;
+    GSList dirs = { (char*) dir, NULL };
 
-    g_return_if_fail (stuff->cmd == 0);
     g_return_if_fail (pattern && pattern[0]);
     g_return_if_fail (dir && dir[0]);
 
-    g_free (stuff->current_file);
-    stuff->current_file = NULL;
-    stuff->match_count = 0;
-    stuff->group_start_line = -1;
-    stuff->group_end_line = -1;
+    search = _moo_find_search_new (NULL, TRUE, NULL);
+    _moo_find_search_set_globs (search, pattern);
+    _moo_find_search_set_skip (search, skip_files);
 
-    command = g_string_new (NULL);
-    g_string_printf (command, "find '%s' -type f", dir);
-    append_globs (command, pattern, skip_files);
-    g_string_append (command, " -print");
-
-    stuff->cmd = CMD_FIND;
-    moo_cmd_view_run_command (stuff->output, command->str, NULL, _("Find File"));
-    g_string_free (command, TRUE);
+    start_search (stuff, search, &dirs, CMD_FIND, _("Find File"));
 }
 
 
@@ -1017,13 +899,10 @@ find_window_plugin_destroy (WindowStuff *stuff)
 
     if (stuff->output)
     {
+        stop_search (stuff);
         g_signal_handlers_disconnect_by_func (stuff->output,
-                                              (gpointer) command_exit,
-                                              stuff);
-        g_signal_handlers_disconnect_by_func (stuff->output,
-                                              (gpointer) process_line,
+                                              (gpointer) output_abort,
                                               stuff);
-        moo_cmd_view_abort (stuff->output);
         moo_edit_window_remove_pane (window, FIND_PLUGIN_ID);
     }
 
@@ -1031,77 +910,55 @@ find_window_plugin_destroy (WindowStuff *stuff)
         gtk_widget_destroy (stuff->grep_dialog);
     if (stuff->find_dialog)
         gtk_widget_destroy (stuff->find_dialog);
-    g_free (stuff->current_file);
 }
 
 
-static gboolean
-command_exit (MooLineView *view,
-              int          status,
-              WindowStuff *stuff)
+static void
+search_done (WindowStuff *stuff)
 {
     int cmd = stuff->cmd;
+    MooLineView *view = MOO_LINE_VIEW (stuff->output);
+    char *msg = NULL;
 
-    g_return_val_if_fail (cmd != 0, FALSE);
+    g_return_if_fail (cmd != 0);
 
-    stuff->cmd = 0;
+    gdk_threads_enter ();
 
-    finish_group(stuff);
+    finish_group (stuff);
 
-#ifndef __WIN32__
-    if (WIFEXITED (status))
-    {
-        char *msg = NULL;
-        guint8 exit_code = WEXITSTATUS (status);
-
-        /* grep exits with status of 0 if something found, 1 if nothing found */
-        if (cmd == CMD_GREP && (exit_code == 0 || exit_code == 1))
-            msg = g_strdup_printf (dngettext (GETTEXT_PACKAGE,
-                                              "*** %u match found ***",
-                                              "*** %u matches found ***",
-                                              stuff->match_count),
-                                   stuff->match_count);
-        /* xargs exits with code 123 if it's command exited with status 1-125*/
-        else if (cmd == CMD_FIND && !exit_code)
-            msg = g_strdup_printf (dngettext (GETTEXT_PACKAGE,
-                                              "*** %u file found ***",
-                                              "*** %u files found ***",
-                                              stuff->match_count),
-                                   stuff->match_count);
-        else
-            return FALSE;
+    if (cmd == CMD_GREP)
+        msg = g_strdup_printf (dngettext (GETTEXT_PACKAGE,
+                                          "*** %u match found ***",
+                                          "*** %u matches found ***",
+                                          stuff->match_count),
+                               stuff->match_count);
+    else
+        msg = g_strdup_printf (dngettext (GETTEXT_PACKAGE,
+                                          "*** %u file found ***",
+                                          "*** %u files found ***",
+                                          stuff->match_count),
+                               stuff->match_count);
+
+    moo_line_view_write_line (view, msg, -1, stuff->message_tag);
+    g_free (msg);
+
+    stop_search (stuff);
+
+    gdk_threads_leave ();
+}
 
-        moo_line_view_write_line (view, msg, -1,
-                                  stuff->message_tag);
-        g_free (msg);
-        return TRUE;
-    }
-#else
-    if (status == 0 || status == 1)
-    {
-        char *msg = NULL;
-
-        if (cmd == CMD_GREP)
-            msg = g_strdup_printf (dngettext (GETTEXT_PACKAGE,
-                                              "*** %u match found ***",
-                                              "*** %u matches found ***",
-                                              stuff->match_count),
-                                   stuff->match_count);
-        else
-            msg = g_strdup_printf (dngettext (GETTEXT_PACKAGE,
-                                              "*** %u file found ***",
-                                              "*** %u files found ***",
-                                              stuff->match_count),
-                                   stuff->match_count);
-
-        moo_line_view_write_line (view, msg, -1,
-                                  stuff->message_tag);
-        g_free (msg);
-        return TRUE;
-    }
-#endif
 
-    return FALSE;
+static gboolean
+output_abort (WindowStuff *stuff)
+{
+    if (!stuff->search)
+        return FALSE;
+
+    stop_search (stuff);
+    moo_line_view_write_line (MOO_LINE_VIEW (stuff->output),
+                              "*** Stopped ***", -1,
+                              stuff->error_tag);
+    return TRUE;
 }
 
 
@@ -7,6 +7,8 @@ SET(plugins_sources
     plugins/mooplugin-builtin.c
     plugins/moofilelist.c
     plugins/moofind.c
+    plugins/moofind-search.c
+    plugins/moofind-search.h
 )
 
 foreach(input_file
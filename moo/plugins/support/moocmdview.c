@@ -310,27 +310,60 @@ cmd_exit_cb (MooCmd     *cmd,
 }
 
 
+/* Signals are only emitted if someone is connected to them, otherwise
+   the class handler is called directly for each line. */
+static void
+process_lines (MooCmdView       *view,
+               MooCmd           *cmd,
+               guint             signal,
+               guint             n_lines,
+               const MooCmdLine *lines)
+{
+    MooCmdViewClass *klass = MOO_CMD_VIEW_GET_CLASS (view);
+    gboolean (*func) (MooCmdView*, const char*);
+    guint i;
+
+    func = signal == STDOUT_LINE ? klass->stdout_line : klass->stderr_line;
+
+    if (g_signal_has_handler_pending (view, signals[signal], 0, FALSE))
+        func = NULL;
+
+    /* stop if the command is aborted by a handler */
+    for (i = 0; i < n_lines && view->priv->cmd == cmd; ++i)
+    {
+        if (func)
+        {
+            func (view, lines[i].text);
+        }
+        else
+        {
+            gboolean result = FALSE;
+            g_signal_emit (view, signals[signal], 0, lines[i].text, &result);
+        }
+    }
+}
+
 static gboolean
-stdout_line_cb (MooCmd     *cmd,
-                const char *text,
-                MooCmdView *view)
+stdout_lines_cb (MooCmd           *cmd,
+                 guint             n_lines,
+                 const MooCmdLine *lines,
+                 MooCmdView       *view)
 {
-    gboolean result = FALSE;
     g_return_val_if_fail (cmd == view->priv->cmd, FALSE);
-    g_signal_emit (view, signals[STDOUT_LINE], 0, text, &result);
-    return result;
+    process_lines (view, cmd, STDOUT_LINE, n_lines, lines);
+    return TRUE;
 }
 
 
 static gboolean
-stderr_line_cb (MooCmd     *cmd,
-                const char *text,
-                MooCmdView *view)
+stderr_lines_cb (MooCmd           *cmd,
+                 guint             n_lines,
+                 const MooCmdLine *lines,
+                 MooCmdView       *view)
 {
-    gboolean result = FALSE;
     g_return_val_if_fail (cmd == view->priv->cmd, FALSE);
-    g_signal_emit (view, signals[STDERR_LINE], 0, text, &result);
-    return result;
+    process_lines (view, cmd, STDERR_LINE, n_lines, lines);
+    return TRUE;
 }
 
 
@@ -433,8 +466,8 @@ moo_cmd_view_run_command_full (MooCmdView  *view,
     }
 
     g_signal_connect (view->priv->cmd, "cmd-exit", G_CALLBACK (cmd_exit_cb), view);
-    g_signal_connect (view->priv->cmd, "stdout-line", G_CALLBACK (stdout_line_cb), view);
-    g_signal_connect (view->priv->cmd, "stderr-line", G_CALLBACK (stderr_line_cb), view);
+    g_signal_connect (view->priv->cmd, "stdout-lines", G_CALLBACK (stdout_lines_cb), view);
+    g_signal_connect (view->priv->cmd, "stderr-lines", G_CALLBACK (stderr_lines_cb), view);
 
     result = TRUE;
     g_signal_emit (view, signals[JOB_STARTED], 0, job_name);
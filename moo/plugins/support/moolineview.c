@@ -24,11 +24,39 @@
 #include "mooutils/moocompat.h"
 #include <gtk/gtk.h>
 #include <gdk/gdkkeysyms.h>
+#include <string.h>
 
 
+/* output is trimmed in chunks, not a line at a time */
+#define TRIM_SLACK(max_lines)   ((max_lines) / 8)
+/* pending text is inserted right away once there is this much of it */
+#define MAX_PENDING_SIZE        65536
+#define DEFAULT_MAX_LINES       100000
+
+typedef struct {
+    gpointer data;
+    GDestroyNotify destroy;     /* free_value() if data is a GValue */
+    MooTextCursor cursor;
+} LineData;
+
+typedef struct {
+    int start;                  /* character offsets in pending text */
+    int end;
+    GtkTextTag *tag;
+} PendingTag;
+
 struct _MooLineViewPrivate {
-    MooData *line_data;
-    GHashTable *cursors;
+    GArray *lines;              /* LineData, for buffer lines and pending ones */
+    gboolean last_line_empty;
+    int max_lines;
+
+    /* text written since the last flush; it is inserted into the buffer
+       in one go, from an idle or when there's enough of it */
+    GString *pending;
+    int pending_chars;
+    GArray *pending_tags;
+    guint flush_idle;
+
     gboolean busy;
     gboolean scrolled;
     GtkTextMark *end_mark;
@@ -36,6 +64,14 @@ struct _MooLineViewPrivate {
 };
 
 static void      moo_line_view_finalize         (GObject        *object);
+static void      moo_line_view_set_property     (GObject        *object,
+                                                 guint           prop_id,
+                                                 const GValue   *value,
+                                                 GParamSpec     *pspec);
+static void      moo_line_view_get_property     (GObject        *object,
+                                                 guint           prop_id,
+                                                 GValue         *value,
+                                                 GParamSpec     *pspec);
 
 static void      moo_line_view_parent_set       (GtkWidget      *widget,
                                                  GtkWidget      *old_parent);
@@ -60,6 +96,9 @@ static void      activate_current_line          (MooLineView    *view);
 
 
 static GtkTextBuffer *get_buffer                (MooLineView    *view);
+static void      flush_pending                  (MooLineView    *view);
+static void      trim_lines                     (MooLineView    *view);
+static void      discard_pending                (MooLineView    *view);
 
 
 enum {
@@ -68,6 +107,11 @@ enum {
     LAST_SIGNAL
 };
 
+enum {
+    PROP_0,
+    PROP_MAX_LINES
+};
+
 static guint signals[LAST_SIGNAL];
 
 
@@ -75,6 +119,45 @@ static guint signals[LAST_SIGNAL];
 G_DEFINE_TYPE (MooLineView, moo_line_view, MOO_TYPE_TEXT_VIEW)
 
 
+static void
+free_value (GValue *value)
+{
+    g_value_unset (value);
+    g_free (value);
+}
+
+static void
+line_data_clear (LineData *ld)
+{
+    if (ld->data && ld->destroy)
+        ld->destroy (ld->data);
+    ld->data = NULL;
+    ld->destroy = NULL;
+}
+
+static void
+free_lines (MooLineView *view,
+            guint        first,
+            guint        n_lines)
+{
+    guint i;
+
+    for (i = first; i < first + n_lines; ++i)
+        line_data_clear (&g_array_index (view->priv->lines, LineData, i));
+
+    g_array_remove_range (view->priv->lines, first, n_lines);
+}
+
+static LineData *
+get_line (MooLineView *view,
+          int          line)
+{
+    if (line < 0 || line >= (int) view->priv->lines->len)
+        return NULL;
+    return &g_array_index (view->priv->lines, LineData, line);
+}
+
+
 static void
 moo_line_view_class_init (MooLineViewClass *klass)
 {
@@ -85,6 +168,8 @@ moo_line_view_class_init (MooLineViewClass *klass)
     GtkBindingSet *binding_set;
 
     gobject_class->finalize = moo_line_view_finalize;
+    gobject_class->set_property = moo_line_view_set_property;
+    gobject_class->get_property = moo_line_view_get_property;
 
     widget_class->button_release_event = moo_line_view_button_release;
     widget_class->parent_set = moo_line_view_parent_set;
@@ -96,6 +181,16 @@ moo_line_view_class_init (MooLineViewClass *klass)
 
     g_type_class_add_private (klass, sizeof (MooLineViewPrivate));
 
+    /* oldest lines are removed when there are more; zero means no limit */
+    g_object_class_install_property (gobject_class,
+                                     PROP_MAX_LINES,
+                                     g_param_spec_int ("max-lines",
+                                             "max-lines",
+                                             "max-lines",
+                                             0, G_MAXINT,
+                                             DEFAULT_MAX_LINES,
+                                             G_PARAM_READWRITE));
+
     signals[ACTIVATE] =
             g_signal_new ("activate",
                           G_OBJECT_CLASS_TYPE (klass),
@@ -128,10 +223,12 @@ moo_line_view_init (MooLineView *view)
     view->priv = G_TYPE_INSTANCE_GET_PRIVATE (view, MOO_TYPE_LINE_VIEW, MooLineViewPrivate);
 
     view->priv->hscrollbar = NULL;
-    view->priv->line_data = _moo_data_new (g_direct_hash,
-                                           g_direct_equal,
-                                           NULL);
-    view->priv->cursors = g_hash_table_new (g_direct_hash, g_direct_equal);
+    view->priv->lines = g_array_new (FALSE, TRUE, sizeof (LineData));
+    view->priv->last_line_empty = TRUE;
+    view->priv->max_lines = DEFAULT_MAX_LINES;
+    view->priv->pending = g_string_new (NULL);
+    view->priv->pending_chars = 0;
+    view->priv->pending_tags = g_array_new (FALSE, FALSE, sizeof (PendingTag));
 
     g_object_set (view,
                   "editable", FALSE,
@@ -147,13 +244,59 @@ moo_line_view_finalize (GObject *object)
 {
     MooLineView *view = MOO_LINE_VIEW (object);
 
-    _moo_data_destroy (view->priv->line_data);
-    g_hash_table_destroy (view->priv->cursors);
+    discard_pending (view);
+    free_lines (view, 0, view->priv->lines->len);
+    g_array_free (view->priv->lines, TRUE);
+    g_string_free (view->priv->pending, TRUE);
+    g_array_free (view->priv->pending_tags, TRUE);
 
     G_OBJECT_CLASS (moo_line_view_parent_class)->finalize (object);
 }
 
 
+static void
+moo_line_view_set_property (GObject        *object,
+                            guint           prop_id,
+                            const GValue   *value,
+                            GParamSpec     *pspec)
+{
+    MooLineView *view = MOO_LINE_VIEW (object);
+
+    switch (prop_id)
+    {
+        case PROP_MAX_LINES:
+            view->priv->max_lines = g_value_get_int (value);
+            g_object_notify (object, "max-lines");
+            break;
+
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+            break;
+    }
+}
+
+
+static void
+moo_line_view_get_property (GObject        *object,
+                            guint           prop_id,
+                            GValue         *value,
+                            GParamSpec     *pspec)
+{
+    MooLineView *view = MOO_LINE_VIEW (object);
+
+    switch (prop_id)
+    {
+        case PROP_MAX_LINES:
+            g_value_set_int (value, view->priv->max_lines);
+            break;
+
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+            break;
+    }
+}
+
+
 static void
 moo_line_view_parent_set (GtkWidget *widget,
                           GtkWidget *old_parent)
@@ -188,12 +331,14 @@ moo_line_view_clear (MooLineView *view)
 
     g_return_if_fail (MOO_IS_LINE_VIEW (view));
 
+    discard_pending (view);
+
     buffer = get_buffer (view);
     gtk_text_buffer_get_bounds (buffer, &start, &end);
     gtk_text_buffer_delete (buffer, &start, &end);
 
-    _moo_data_clear (view->priv->line_data);
-    g_hash_table_remove_all (view->priv->cursors);
+    free_lines (view, 0, view->priv->lines->len);
+    view->priv->last_line_empty = TRUE;
 }
 
 
@@ -364,6 +509,7 @@ moo_line_view_get_text_cursor (MooTextView    *view,
     int line_y, line_height;
     int line;
     MooTextCursor cursor;
+    LineData *ld;
 
     if (x < 0 || y < 0)
         return MOO_TEXT_CURSOR_ARROW;
@@ -377,7 +523,8 @@ moo_line_view_get_text_cursor (MooTextView    *view,
         return MOO_TEXT_CURSOR_ARROW;
 
     line = gtk_text_iter_get_line (&iter);
-    cursor = GPOINTER_TO_INT (g_hash_table_lookup (MOO_LINE_VIEW (view)->priv->cursors, GINT_TO_POINTER (line)));
+    ld = get_line (MOO_LINE_VIEW (view), line);
+    cursor = ld ? ld->cursor : MOO_TEXT_CURSOR_NONE;
 
     return cursor ? cursor : MOO_TEXT_CURSOR_ARROW;
 }
@@ -387,13 +534,12 @@ moo_line_view_set_cursor (MooLineView    *view,
                           int             line,
                           MooTextCursor   cursor)
 {
+    LineData *ld;
+
     g_return_if_fail (MOO_IS_LINE_VIEW (view));
-    g_return_if_fail (line >= 0 && line < gtk_text_buffer_get_line_count (get_buffer (view)));
+    g_return_if_fail ((ld = get_line (view, line)) != NULL);
 
-    if (cursor)
-        g_hash_table_insert (view->priv->cursors, GINT_TO_POINTER (line), GINT_TO_POINTER (cursor));
-    else
-        g_hash_table_remove (view->priv->cursors, GINT_TO_POINTER (line));
+    ld->cursor = cursor;
 }
 
 
@@ -403,15 +549,14 @@ moo_line_view_set_data (MooLineView    *view,
                         gpointer        data,
                         GDestroyNotify  free_func)
 {
+    LineData *ld;
+
     g_return_if_fail (MOO_IS_LINE_VIEW (view));
-    g_return_if_fail (line >= 0 && line < gtk_text_buffer_get_line_count (get_buffer (view)));
+    g_return_if_fail ((ld = get_line (view, line)) != NULL);
 
-    if (data)
-        _moo_data_insert_ptr (view->priv->line_data,
-                              GINT_TO_POINTER (line),
-                              data, free_func);
-    else
-        _moo_data_remove (view->priv->line_data, GINT_TO_POINTER (line));
+    line_data_clear (ld);
+    ld->data = data;
+    ld->destroy = data ? free_func : NULL;
 }
 
 
@@ -419,10 +564,16 @@ gpointer
 moo_line_view_get_data (MooLineView    *view,
                         int             line)
 {
+    LineData *ld;
+
     g_return_val_if_fail (MOO_IS_LINE_VIEW (view), NULL);
     g_return_val_if_fail (line >= 0, NULL);
-    return _moo_data_get_ptr (view->priv->line_data,
-                              GINT_TO_POINTER (line));
+
+    if (!(ld = get_line (view, line)) || !ld->data)
+        return NULL;
+
+    g_return_val_if_fail (ld->destroy != (GDestroyNotify) free_value, NULL);
+    return ld->data;
 }
 
 
@@ -537,26 +688,84 @@ check_if_scrolled (MooLineView *view)
 #endif
 
 
+static void
+add_line (MooLineView *view)
+{
+    LineData ld = { NULL, NULL, MOO_TEXT_CURSOR_NONE };
+    g_array_append_val (view->priv->lines, ld);
+}
+
+
+/* old lines are only removed here, so that line numbers returned
+   by moo_line_view_start_line() stay valid until the main loop runs */
+static gboolean
+flush_idle (MooLineView *view)
+{
+    view->priv->flush_idle = 0;
+    flush_pending (view);
+    trim_lines (view);
+    return FALSE;
+}
+
+
+static void
+append_pending (MooLineView *view,
+                const char  *text,
+                int          len,
+                GtkTextTag  *tag)
+{
+    int chars;
+    const char *p;
+
+    chars = g_utf8_strlen (text, len);
+
+    if (tag)
+    {
+        GArray *tags = view->priv->pending_tags;
+        PendingTag *last = tags->len ? &g_array_index (tags, PendingTag, tags->len - 1) : NULL;
+
+        if (last && last->tag == tag && last->end == view->priv->pending_chars)
+        {
+            last->end += chars;
+        }
+        else
+        {
+            PendingTag pt = { view->priv->pending_chars, view->priv->pending_chars + chars, tag };
+            g_array_append_val (tags, pt);
+        }
+    }
+
+    g_string_append_len (view->priv->pending, text, len);
+    view->priv->pending_chars += chars;
+
+    for (p = text; (p = memchr (p, '\n', text + len - p)); ++p)
+        add_line (view);
+
+    if (len > 0)
+        view->priv->last_line_empty = text[len-1] == '\n';
+
+    if (!view->priv->flush_idle)
+        view->priv->flush_idle =
+            g_idle_add_full (G_PRIORITY_HIGH_IDLE + 15,
+                             (GSourceFunc) flush_idle,
+                             view, NULL);
+}
+
+
 int
 moo_line_view_start_line (MooLineView *view)
 {
-    GtkTextBuffer *buffer;
-    GtkTextIter iter;
-
     g_return_val_if_fail (MOO_IS_LINE_VIEW (view), -1);
     g_return_val_if_fail (!view->priv->busy, -1);
 
     view->priv->busy = TRUE;
 
-    buffer = get_buffer (view);
-    gtk_text_buffer_get_end_iter (buffer, &iter);
+    if (!view->priv->lines->len)
+        add_line (view);
+    else if (!view->priv->last_line_empty)
+        append_pending (view, "\n", 1, NULL);
 
-    check_if_scrolled (view);
-
-    if (!gtk_text_iter_starts_line (&iter))
-        gtk_text_buffer_insert (buffer, &iter, "\n", 1);
-
-    return gtk_text_iter_get_line (&iter);
+    return view->priv->lines->len - 1;
 }
 
 
@@ -566,26 +775,26 @@ moo_line_view_write (MooLineView    *view,
                      int             len,
                      GtkTextTag     *tag)
 {
-    GtkTextBuffer *buffer;
-    GtkTextIter iter;
-
     g_return_if_fail (MOO_IS_LINE_VIEW (view));
     g_return_if_fail (text != NULL);
     g_return_if_fail (view->priv->busy);
 
-    buffer = get_buffer (view);
-    gtk_text_buffer_get_end_iter (buffer, &iter);
+    if (len < 0)
+        len = strlen (text);
+
+    if (!len)
+        return;
 
     if (g_utf8_validate (text, len, NULL))
     {
-        gtk_text_buffer_insert_with_tags (buffer, &iter, text, len, tag, NULL);
+        append_pending (view, text, len, tag);
     }
     else
     {
         char *text_utf8 = g_locale_to_utf8 (text, len, NULL, NULL, NULL);
 
         if (text_utf8)
-            gtk_text_buffer_insert_with_tags (buffer, &iter, text_utf8, -1, tag, NULL);
+            append_pending (view, text_utf8, strlen (text_utf8), tag);
         else
             g_warning ("could not convert '%s' to utf8", text);
 
@@ -621,6 +830,79 @@ moo_line_view_end_line (MooLineView    *view)
 
     view->priv->busy = FALSE;
 
+    if (view->priv->pending->len >= MAX_PENDING_SIZE)
+        flush_pending (view);
+}
+
+
+static void
+discard_pending (MooLineView *view)
+{
+    if (view->priv->flush_idle)
+        g_source_remove (view->priv->flush_idle);
+    view->priv->flush_idle = 0;
+
+    g_string_truncate (view->priv->pending, 0);
+    g_array_set_size (view->priv->pending_tags, 0);
+    view->priv->pending_chars = 0;
+}
+
+
+/* removes the oldest lines once there are too many */
+static void
+trim_lines (MooLineView *view)
+{
+    GtkTextBuffer *buffer;
+    GtkTextIter start, end;
+    int max_lines = view->priv->max_lines;
+    int n_lines;
+
+    if (max_lines <= 0 || (int) view->priv->lines->len <= max_lines + TRIM_SLACK (max_lines))
+        return;
+
+    n_lines = view->priv->lines->len - max_lines;
+
+    buffer = get_buffer (view);
+    gtk_text_buffer_get_start_iter (buffer, &start);
+    gtk_text_buffer_get_iter_at_line (buffer, &end, n_lines);
+    gtk_text_buffer_delete (buffer, &start, &end);
+
+    free_lines (view, 0, n_lines);
+}
+
+
+static void
+flush_pending (MooLineView *view)
+{
+    GtkTextBuffer *buffer;
+    GtkTextIter iter, end;
+    int offset;
+    guint i;
+
+    if (!view->priv->pending->len)
+        return;
+
+    check_if_scrolled (view);
+
+    buffer = get_buffer (view);
+    gtk_text_buffer_get_end_iter (buffer, &iter);
+    offset = gtk_text_iter_get_offset (&iter);
+    gtk_text_buffer_insert (buffer, &iter,
+                            view->priv->pending->str,
+                            view->priv->pending->len);
+
+    for (i = 0; i < view->priv->pending_tags->len; ++i)
+    {
+        PendingTag *pt = &g_array_index (view->priv->pending_tags, PendingTag, i);
+        gtk_text_buffer_get_iter_at_offset (buffer, &iter, offset + pt->start);
+        gtk_text_buffer_get_iter_at_offset (buffer, &end, offset + pt->end);
+        gtk_text_buffer_apply_tag (buffer, pt->tag, &iter, &end);
+    }
+
+    g_string_truncate (view->priv->pending, 0);
+    g_array_set_size (view->priv->pending_tags, 0);
+    view->priv->pending_chars = 0;
+
     if (!view->priv->scrolled)
         gtk_text_view_scroll_mark_onscreen (GTK_TEXT_VIEW (view),
                                             get_end_mark (view));
@@ -669,17 +951,20 @@ moo_line_view_set_line_data (MooLineView    *view,
                              int             line,
                              const GValue   *data)
 {
+    GValue *copy = NULL;
+
     g_return_if_fail (MOO_IS_LINE_VIEW (view));
     g_return_if_fail (line >= 0);
     g_return_if_fail (!data || G_IS_VALUE (data));
 
     if (data)
-        _moo_data_insert_value (view->priv->line_data,
-                                GINT_TO_POINTER (line),
-                                data);
-    else
-        _moo_data_remove (view->priv->line_data,
-                          GINT_TO_POINTER (line));
+    {
+        copy = g_new0 (GValue, 1);
+        g_value_init (copy, G_VALUE_TYPE (data));
+        g_value_copy (data, copy);
+    }
+
+    moo_line_view_set_data (view, line, copy, (GDestroyNotify) free_value);
 }
 
 
@@ -716,12 +1001,22 @@ moo_line_view_get_line_data (MooLineView    *view,
                              int             line,
                              GValue         *dest)
 {
+    LineData *ld;
+    GValue *value;
+
     g_return_val_if_fail (MOO_IS_LINE_VIEW (view), FALSE);
     g_return_val_if_fail (line >= 0, FALSE);
     g_return_val_if_fail (!G_IS_VALUE (dest), FALSE);
-    return _moo_data_get_value (view->priv->line_data,
-                                GINT_TO_POINTER (line),
-                                dest);
+
+    /* data set with moo_line_view_set_data() is not a GValue */
+    if (!(ld = get_line (view, line)) || !ld->data ||
+        ld->destroy != (GDestroyNotify) free_value)
+            return FALSE;
+
+    value = ld->data;
+    g_value_init (dest, G_VALUE_TYPE (value));
+    g_value_copy (value, dest);
+    return TRUE;
 }
 
 
@@ -64,21 +64,37 @@ typedef enum {
 typedef struct FilterStore FilterStore;
 typedef struct PatternInfo PatternInfo;
 typedef struct ActionInfo ActionInfo;
+typedef struct FilterRegex FilterRegex;
+typedef struct FilterMatch FilterMatch;
 typedef struct FilterState FilterState;
 typedef struct FilterInfo FilterInfo;
 
+/* All patterns for stdout or stderr in one regex, each one in its own
+   group, so that a single match tells which pattern it is. */
+struct FilterRegex {
+    GRegex *re;
+    guint n_patterns;
+    PatternInfo **patterns;
+    int *groups;                /* group of each pattern in re */
+};
+
+struct FilterMatch {
+    GMatchInfo *mi;
+    PatternInfo *pattern;
+    int group;
+};
+
 struct FilterState {
     guint ref_count;
     PatternInfo **patterns;
     guint n_patterns;
-    GRegex *re_out;
-    GRegex *re_err;
+    FilterRegex *re_out;
+    FilterRegex *re_err;
 };
 
 struct PatternInfo {
     OutputType type;
     GRegex *re;
-    GMatchInfo *mi;
     char *style;
     GSList *actions;
     guint span;
@@ -102,6 +118,8 @@ struct _MooOutputFilterRegexPrivate {
     FilterState *state;
     GSList *file_stack;
     GSList *dir_stack;
+    /* paths looked up during current command, existing or not */
+    GHashTable *file_cache;
 
     guint span;
     char *style;
@@ -155,6 +173,10 @@ moo_output_filter_regex_dispose (GObject *object)
     g_slist_free (filter->priv->dir_stack);
     filter->priv->dir_stack = NULL;
 
+    if (filter->priv->file_cache)
+        g_hash_table_destroy (filter->priv->file_cache);
+    filter->priv->file_cache = NULL;
+
     G_OBJECT_CLASS (_moo_output_filter_regex_parent_class)->dispose (object);
 }
 
@@ -175,9 +197,35 @@ moo_output_filter_regex_detach (MooOutputFilter *base)
 }
 
 
+static void
+moo_output_filter_regex_cmd_start (MooOutputFilter *base)
+{
+    MooOutputFilterRegex *filter = MOO_OUTPUT_FILTER_REGEX (base);
+    /* files may have appeared since the last command */
+    g_hash_table_remove_all (filter->priv->file_cache);
+}
+
+
+static gboolean
+file_exists (MooOutputFilterRegex *filter,
+             const char           *path)
+{
+    gpointer value;
+
+    if (!g_hash_table_lookup_extended (filter->priv->file_cache, path, NULL, &value))
+    {
+        gboolean exists = g_file_test (path, G_FILE_TEST_EXISTS);
+        value = GINT_TO_POINTER (exists);
+        g_hash_table_insert (filter->priv->file_cache, g_strdup (path), value);
+    }
+
+    return GPOINTER_TO_INT (value);
+}
+
 static char *
-find_file_in_dir (const char *file,
-                  const char *dir)
+find_file_in_dir (MooOutputFilterRegex *filter,
+                  const char           *file,
+                  const char           *dir)
 {
     char *path;
 
@@ -186,7 +234,7 @@ find_file_in_dir (const char *file,
 
     path = g_build_filename (dir, file, NULL);
 
-    if (g_file_test (path, G_FILE_TEST_EXISTS))
+    if (file_exists (filter, path))
         return path;
 
     g_free (path);
@@ -194,12 +242,13 @@ find_file_in_dir (const char *file,
 }
 
 static char *
-find_file_in_dirs (const char         *file,
-                   const char * const *dirs)
+find_file_in_dirs (MooOutputFilterRegex *filter,
+                   const char           *file,
+                   const char * const   *dirs)
 {
     for ( ; file && dirs && *dirs; ++dirs)
     {
-        char *path = find_file_in_dir (file, *dirs);
+        char *path = find_file_in_dir (filter, file, *dirs);
         if (path)
             return path;
     }
@@ -217,10 +266,10 @@ find_file (const char           *file,
         real_file = g_strdup (file);
 
     if (!real_file && filter->priv->dir_stack)
-        real_file = find_file_in_dir (file, filter->priv->dir_stack->data);
+        real_file = find_file_in_dir (filter, file, filter->priv->dir_stack->data);
 
     if (!real_file)
-        real_file = find_file_in_dirs (file, moo_output_filter_get_active_dirs (MOO_OUTPUT_FILTER (filter)));
+        real_file = find_file_in_dirs (filter, file, moo_output_filter_get_active_dirs (MOO_OUTPUT_FILTER (filter)));
 
     if (!real_file)
         real_file = g_strdup (file);
@@ -265,9 +314,23 @@ parse_file_line (MooOutputFilterRegex *filter,
 }
 
 
+/* fetches a named group of the matched pattern */
+static char *
+match_fetch_named (FilterMatch *match,
+                   const char  *name)
+{
+    int n = g_regex_get_string_number (match->pattern->re, name);
+
+    if (n < 0)
+        return NULL;
+
+    return g_match_info_fetch (match->mi, match->group + n);
+}
+
+
 static MooFileLineData *
 process_location (MooOutputFilterRegex *filter,
-                  PatternInfo          *pattern,
+                  FilterMatch          *match,
                   const char           *text,
                   MooLineView          *view,
                   int                   line_no)
@@ -275,9 +338,9 @@ process_location (MooOutputFilterRegex *filter,
     char *file, *line, *character;
     MooFileLineData *data = NULL;
 
-    file = g_match_info_fetch_named (pattern->mi, "file");
-    line = g_match_info_fetch_named (pattern->mi, "line");
-    character = g_match_info_fetch_named (pattern->mi, "character");
+    file = match_fetch_named (match, "file");
+    line = match_fetch_named (match, "line");
+    character = match_fetch_named (match, "character");
 
     if (file || line)
     {
@@ -300,70 +363,32 @@ process_location (MooOutputFilterRegex *filter,
 }
 
 
+/* Finds which pattern the current match of the combined regex is,
+   without matching anything again. */
 static gboolean
-find_match (const char   *text,
-            int           pos,
-            FilterState  *state,
-            OutputType    type,
-            PatternInfo **pattern_p,
-            int          *start,
-            int          *end)
+get_match_pattern (FilterRegex *fre,
+                   FilterMatch *match,
+                   int         *start,
+                   int         *end)
 {
     guint i;
-    GRegex *re_all;
-    GMatchInfo *match_info = NULL;
 
-    if (type == OUTPUT_STDOUT)
-        re_all = state->re_out;
-    else
-        re_all = state->re_err;
-
-    if (!re_all)
-        return FALSE;
-
-    if (!g_regex_match_full (re_all, text, -1, pos, 0, &match_info, NULL))
-    {
-        g_match_info_free (match_info);
-        return FALSE;
-    }
-
-    g_match_info_fetch_pos (match_info, 0, start, end);
-    g_match_info_free (match_info);
+    g_match_info_fetch_pos (match->mi, 0, start, end);
 
-    for (i = 0; i < state->n_patterns; ++i)
+    for (i = 0; i < fre->n_patterns; ++i)
     {
         int p_start, p_end;
-        PatternInfo *pattern = state->patterns[i];
-
-        if (pattern->type != type && pattern->type != OUTPUT_ALL)
-            continue;
 
-        if (pattern->mi)
+        if (g_match_info_fetch_pos (match->mi, fre->groups[i], &p_start, &p_end) &&
+            p_start >= 0)
         {
-            g_match_info_free (pattern->mi);
-            pattern->mi = NULL;
+            match->pattern = fre->patterns[i];
+            match->group = fre->groups[i];
+            return TRUE;
         }
-
-        if (!g_regex_match_full (pattern->re, text, -1, *start,
-                                 G_REGEX_MATCH_ANCHORED,
-                                 &pattern->mi, NULL))
-            continue;
-
-        g_match_info_fetch_pos (pattern->mi, 0, &p_start, &p_end);
-
-        if (p_start == pos && p_end == pos)
-        {
-            g_warning ("empty match");
-            continue;
-        }
-
-        *pattern_p = pattern;
-        *start = p_start;
-        *end = p_end;
-        return TRUE;
     }
 
-    return FALSE;
+    g_return_val_if_reached (FALSE);
 }
 
 
@@ -410,7 +435,7 @@ get_tag (MooLineView *view,
 
 static void
 process_action (MooOutputFilterRegex *filter,
-                PatternInfo          *pattern,
+                FilterMatch          *match,
                 ActionInfo           *action,
                 const char           *text)
 {
@@ -434,7 +459,7 @@ process_action (MooOutputFilterRegex *filter,
         case ACTION_PUSH:
             data = NULL;
             if (action->data)
-                data = g_match_info_fetch_named (pattern->mi, action->data);
+                data = match_fetch_named (match, action->data);
             if (!data)
             {
                 if (*list)
@@ -469,8 +494,8 @@ process_line (MooOutputFilterRegex  *filter,
     gssize start_pos;
     int match_start, match_end;
     int line_no;
-    PatternInfo *pattern;
-    gboolean found;
+    FilterRegex *fre;
+    FilterMatch match = { NULL, NULL, 0 };
     MooLineView *view;
 
     view = moo_output_filter_get_view (MOO_OUTPUT_FILTER (filter));
@@ -493,34 +518,49 @@ process_line (MooOutputFilterRegex  *filter,
         return TRUE;
     }
 
+    fre = type == OUTPUT_STDOUT ? state->re_out : state->re_err;
+
+    if (!fre || !text[0] || !g_regex_match (fre->re, text, 0, &match.mi))
+    {
+        g_match_info_free (match.mi);
+        return FALSE;
+    }
+
     start_pos = 0;
-    found = FALSE;
-    line_no = 0;
+    line_no = moo_line_view_start_line (view);
 
-    while (text[start_pos] && find_match (text, start_pos, state, type, &pattern, &match_start, &match_end))
+    do
     {
         GSList *l;
         MooFileLineData *line_data;
+        PatternInfo *pattern;
 
-        if (!found)
-            line_no = moo_line_view_start_line (view);
+        if (!get_match_pattern (fre, &match, &match_start, &match_end))
+            break;
+
+        if (match_start == match_end)
+        {
+            g_warning ("empty match");
+            break;
+        }
 
-        found = TRUE;
+        pattern = match.pattern;
 
         if (match_start > start_pos)
             moo_line_view_write (view, text + start_pos,
                                  match_start - start_pos,
                                  get_tag (view, type, NULL));
 
-        if (match_end > match_start)
-            moo_line_view_write (view, text + match_start,
-                                 match_end - match_start,
-                                 get_tag (view, type, pattern->style));
+        moo_line_view_write (view, text + match_start,
+                             match_end - match_start,
+                             get_tag (view, type, pattern->style));
 
-        line_data = process_location (filter, pattern, text, view, line_no);
+        line_data = process_location (filter, &match, text, view, line_no);
 
         for (l = pattern->actions; l != NULL; l = l->next)
-            process_action (filter, pattern, l->data, text);
+            process_action (filter, &match, l->data, text);
+
+        start_pos = match_end;
 
         if (pattern->span)
         {
@@ -535,25 +575,20 @@ process_line (MooOutputFilterRegex  *filter,
             moo_line_view_write (view, text + match_end, -1,
                                  get_tag (view, type, pattern->style));
             start_pos = strlen (text);
-
-        }
-        else
-        {
-            start_pos = match_end;
         }
 
         moo_file_line_data_free (line_data);
     }
+    while (text[start_pos] && g_match_info_next (match.mi, NULL));
 
-    if (found)
-    {
-        if (text[start_pos])
-            moo_line_view_write (view, text + start_pos, -1,
-                                 get_tag (view, type, NULL));
-        moo_line_view_end_line (view);
-    }
+    g_match_info_free (match.mi);
+
+    if (text[start_pos])
+        moo_line_view_write (view, text + start_pos, -1,
+                             get_tag (view, type, NULL));
+    moo_line_view_end_line (view);
 
-    return found;
+    return TRUE;
 }
 
 
@@ -589,6 +624,7 @@ _moo_output_filter_regex_class_init (MooOutputFilterRegexClass *klass)
     filter_class->detach = moo_output_filter_regex_detach;
     filter_class->stdout_line = moo_output_filter_regex_stdout_line;
     filter_class->stderr_line = moo_output_filter_regex_stderr_line;
+    filter_class->cmd_start = moo_output_filter_regex_cmd_start;
 
     g_type_class_add_private (klass, sizeof (MooOutputFilterRegexPrivate));
 }
@@ -598,6 +634,7 @@ static void
 _moo_output_filter_regex_init (MooOutputFilterRegex *filter)
 {
     filter->priv = G_TYPE_INSTANCE_GET_PRIVATE (filter, MOO_TYPE_OUTPUT_FILTER_REGEX, MooOutputFilterRegexPrivate);
+    filter->priv->file_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 }
 
 
@@ -667,7 +704,6 @@ pattern_info_new (OutputType  type,
     info = g_new0 (PatternInfo, 1);
     info->type = type;
     info->re = re;
-    info->mi = NULL;
     info->style = g_strdup (style);
     info->actions = actions;
     info->span = span;
@@ -682,7 +718,6 @@ pattern_info_free (PatternInfo *pattern)
     {
         if (pattern->re)
             g_regex_unref (pattern->re);
-        g_match_info_free (pattern->mi);
         g_slist_foreach (pattern->actions, (GFunc) action_info_free, NULL);
         g_slist_free (pattern->actions);
         g_free (pattern->style);
@@ -691,13 +726,31 @@ pattern_info_free (PatternInfo *pattern)
 }
 
 
-static GRegex *
+static void
+filter_regex_free (FilterRegex *fre)
+{
+    if (fre)
+    {
+        if (fre->re)
+            g_regex_unref (fre->re);
+        g_free (fre->patterns);
+        g_free (fre->groups);
+        g_free (fre);
+    }
+}
+
+static FilterRegex *
 get_re_all (GSList    *patterns,
             OutputType type)
 {
     GString *str = NULL;
-    GRegex *regex;
+    FilterRegex *fre;
     GError *error = NULL;
+    int group = 1;
+
+    fre = g_new0 (FilterRegex, 1);
+    fre->patterns = g_new (PatternInfo*, g_slist_length (patterns));
+    fre->groups = g_new (int, g_slist_length (patterns));
 
     while (patterns)
     {
@@ -714,22 +767,32 @@ get_re_all (GSList    *patterns,
         else
             g_string_append_c (str, '|');
 
-        g_string_append (str, g_regex_get_pattern (pat->re));
+        g_string_append_printf (str, "(%s)", g_regex_get_pattern (pat->re));
+
+        fre->patterns[fre->n_patterns] = pat;
+        fre->groups[fre->n_patterns] = group;
+        fre->n_patterns += 1;
+        group += 1 + g_regex_get_capture_count (pat->re);
     }
 
     if (!str)
+    {
+        filter_regex_free (fre);
         return NULL;
+    }
 
-    regex = g_regex_new (str->str, G_REGEX_DUPNAMES, 0, &error);
+    fre->re = g_regex_new (str->str, G_REGEX_DUPNAMES | G_REGEX_OPTIMIZE, 0, &error);
 
-    if (!regex)
+    if (!fre->re)
     {
         g_warning ("%s", error->message);
         g_error_free (error);
+        filter_regex_free (fre);
+        fre = NULL;
     }
 
     g_string_free (str, TRUE);
-    return regex;
+    return fre;
 }
 
 static FilterState *
@@ -761,10 +824,8 @@ filter_state_unref (FilterState *state)
         for (i = 0; i < state->n_patterns; ++i)
             pattern_info_free (state->patterns[i]);
 
-        if (state->re_out)
-            g_regex_unref (state->re_out);
-        if (state->re_err)
-            g_regex_unref (state->re_err);
+        filter_regex_free (state->re_out);
+        filter_regex_free (state->re_err);
 
         g_free (state->patterns);
         g_free (state);